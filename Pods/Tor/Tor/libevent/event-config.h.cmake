@@ -96,6 +96,9 @@
 /* Define if your system supports the epoll system calls */
 #cmakedefine EVENT__HAVE_EPOLL 1
 
+/* Define if your system supports the io_uring system calls */
+#cmakedefine EVENT__HAVE_IO_URING 1
+
 /* Define to 1 if you have the `epoll_create1' function. */
 #cmakedefine EVENT__HAVE_EPOLL_CREATE1 1
 
@@ -89,6 +89,9 @@ extern const struct eventop pollops;
 #ifdef EVENT__HAVE_EPOLL
 extern const struct eventop epollops;
 #endif
+#ifdef EVENT__HAVE_IO_URING
+extern const struct eventop iouringops;
+#endif
 #ifdef EVENT__HAVE_WORKING_KQUEUE
 extern const struct eventop kqops;
 #endif
@@ -121,6 +124,12 @@ static const struct eventop *eventops[] = {
 #endif
 #ifdef _WIN32
 	&win32ops,
+#endif
+	/* io_uring comes last, so that it is only used when the caller avoids
+	 * or disables every other method; disabling epoll alone still gets
+	 * poll.  EVENT_NOIOURING turns it off like any other method. */
+#ifdef EVENT__HAVE_IO_URING
+	&iouringops,
 #endif
 	NULL
 };
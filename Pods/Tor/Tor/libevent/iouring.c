@@ -0,0 +1,674 @@
+/*
+ * Copyright 2000-2007 Niels Provos <provos@citi.umich.edu>
+ * Copyright 2007-2012 Niels Provos, Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "event2/event-config.h"
+#include "evconfig-private.h"
+
+#ifdef EVENT__HAVE_IO_URING
+
+/*
+ * An io_uring backend.
+ *
+ * We use io_uring as a readiness notifier: every fd that libevent wants to
+ * hear about has one IORING_OP_POLL_ADD request in flight.  Poll requests
+ * are one-shot, so when one completes we submit a fresh one before the next
+ * wait, which keeps the usual level-triggered semantics.  (Multishot polls
+ * would save the re-arm, but they only fire when new data shows up, which
+ * is edge-triggered behavior.)
+ *
+ * The point is batching: all the polls we need to add, re-arm, or cancel
+ * are queued on the submission ring and handed to the kernel by the same
+ * io_uring_enter() call that waits for completions.  With epoll, every
+ * change in interest costs its own epoll_ctl().
+ *
+ * The ring starts out disabled, and we only enable it after restricting it
+ * to POLL_ADD and POLL_REMOVE with no further registration allowed.  That
+ * way a process that installs a syscall filter allowing io_uring_enter()
+ * after creating its event base doesn't also allow every other io_uring
+ * operation.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "event-internal.h"
+#include "evsignal-internal.h"
+#include "event2/thread.h"
+#include "evthread-internal.h"
+#include "log-internal.h"
+#include "evmap-internal.h"
+#include "time-internal.h"
+
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000
+#endif
+
+/* How many submission queue entries to ask for.  The completion queue is
+ * twice as big.  If we ever have more changes than this queued at once, we
+ * submit the full ring early and keep going. */
+#define IOURING_ENTRIES 1024
+
+/* user_data for POLL_REMOVE requests: we don't care how they turn out. */
+#define IOURING_REMOVE_TAG (~(ev_uint64_t)0)
+
+/* Encode an fd and a generation number as the user_data of a poll request.
+ * The generation lets us recognize completions for polls that we have since
+ * cancelled or replaced. */
+#define IOURING_TAG(fd, gen) \
+	((((ev_uint64_t)(gen)) << 32) | (ev_uint32_t)(fd))
+#define IOURING_TAG_FD(tag) ((int)((tag) & 0xffffffffu))
+#define IOURING_TAG_GEN(tag) ((ev_uint32_t)((tag) >> 32))
+
+/* What we know about a single fd. */
+struct iouring_fd {
+	/* Generation of the poll request we have in the kernel, if any. */
+	ev_uint32_t gen;
+	/* Which of EV_READ, EV_WRITE and EV_CLOSED libevent wants. */
+	short want;
+	/* Which events the poll request in the kernel is waiting for, or 0 if
+	 * there is no such request. */
+	short armed;
+	/* True iff this fd is on the list of fds to look at before the next
+	 * wait. */
+	char changed;
+	/* True iff libevent stopped caring about this fd entirely since we
+	 * last looked at it.  The fd may have been closed and reused since
+	 * then, so any poll request we have for it is for the wrong file. */
+	char dropped;
+};
+
+struct iouringop {
+	int ring_fd;
+	unsigned features;
+
+	/* Submission ring. */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	/* Our copy of the submission tail. */
+	unsigned sqe_tail;
+
+	/* Completion ring. */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+
+	/* Per-fd state, indexed by fd. */
+	struct iouring_fd *fds;
+	int nfds;
+
+	/* fds whose poll requests might need to change before the next wait. */
+	int *changed;
+	int n_changed;
+	int changed_alloc;
+
+	ev_uint32_t next_gen;
+};
+
+static void *iouring_init(struct event_base *);
+static int iouring_add(struct event_base *, evutil_socket_t fd, short old,
+    short events, void *p);
+static int iouring_del(struct event_base *, evutil_socket_t fd, short old,
+    short events, void *p);
+static int iouring_dispatch(struct event_base *, struct timeval *);
+static void iouring_dealloc(struct event_base *);
+
+const struct eventop iouringops = {
+	"iouring",
+	iouring_init,
+	iouring_add,
+	iouring_del,
+	iouring_dispatch,
+	iouring_dealloc,
+	1, /* need reinit */
+	EV_FEATURE_O1|EV_FEATURE_EARLY_CLOSE,
+	0
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, const void *arg, size_t argsz)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	    flags, arg, argsz);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+    unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Limit the disabled ring <fd> to the requests we make, then enable it.
+ * Returns 0 on success, -1 on failure. */
+static int
+iouring_restrict(int fd, unsigned features)
+{
+	struct io_uring_restriction res[3];
+	unsigned n = 0;
+
+	memset(res, 0, sizeof(res));
+	res[n].opcode = IORING_RESTRICTION_SQE_OP;
+	res[n++].sqe_op = IORING_OP_POLL_ADD;
+	res[n].opcode = IORING_RESTRICTION_SQE_OP;
+	res[n++].sqe_op = IORING_OP_POLL_REMOVE;
+#ifdef IORING_FEAT_CQE_SKIP
+	if (features & IORING_FEAT_CQE_SKIP) {
+		res[n].opcode = IORING_RESTRICTION_SQE_FLAGS_ALLOWED;
+		res[n++].sqe_flags = IOSQE_CQE_SKIP_SUCCESS;
+	}
+#else
+	(void)features;
+#endif
+	/* We allow no IORING_RESTRICTION_REGISTER_OP at all, so nothing can
+	 * lift these restrictions later. */
+	if (sys_io_uring_register(fd, IORING_REGISTER_RESTRICTIONS, res, n) < 0)
+		return (-1);
+	if (sys_io_uring_register(fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+		return (-1);
+	return (0);
+}
+
+static void
+iouring_unmap(struct iouringop *iop)
+{
+	if (iop->sqes)
+		munmap(iop->sqes, iop->sqes_len);
+	if (iop->cq_ring && iop->cq_ring != iop->sq_ring)
+		munmap(iop->cq_ring, iop->cq_ring_len);
+	if (iop->sq_ring)
+		munmap(iop->sq_ring, iop->sq_ring_len);
+}
+
+static void *
+iouring_init(struct event_base *base)
+{
+	struct io_uring_params p;
+	struct iouringop *iop;
+	unsigned *sq_array;
+	unsigned i;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_R_DISABLED;
+	fd = sys_io_uring_setup(IOURING_ENTRIES, &p);
+	if (fd < 0) {
+		if (errno != ENOSYS && errno != EPERM)
+			event_warn("io_uring_setup");
+		return (NULL);
+	}
+	/* We need a timeout on io_uring_enter(), and we need the kernel not
+	 * to drop completions when the completion ring is full. */
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		close(fd);
+		return (NULL);
+	}
+	/* We won't run an unrestricted ring. */
+	if (iouring_restrict(fd, p.features) < 0) {
+		event_warn("io_uring_register");
+		close(fd);
+		return (NULL);
+	}
+
+	if (!(iop = mm_calloc(1, sizeof(struct iouringop)))) {
+		close(fd);
+		return (NULL);
+	}
+	iop->ring_fd = fd;
+	iop->features = p.features;
+
+	iop->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	iop->cq_ring_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (iop->cq_ring_len > iop->sq_ring_len)
+			iop->sq_ring_len = iop->cq_ring_len;
+		iop->cq_ring_len = iop->sq_ring_len;
+	}
+	iop->sq_ring = mmap(NULL, iop->sq_ring_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (iop->sq_ring == MAP_FAILED) {
+		iop->sq_ring = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		iop->cq_ring = iop->sq_ring;
+	} else {
+		iop->cq_ring = mmap(NULL, iop->cq_ring_len,
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+		    IORING_OFF_CQ_RING);
+		if (iop->cq_ring == MAP_FAILED) {
+			iop->cq_ring = NULL;
+			goto err;
+		}
+	}
+	iop->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	iop->sqes = mmap(NULL, iop->sqes_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (iop->sqes == MAP_FAILED) {
+		iop->sqes = NULL;
+		goto err;
+	}
+
+	iop->sq_head = (unsigned *)((char *)iop->sq_ring + p.sq_off.head);
+	iop->sq_tail = (unsigned *)((char *)iop->sq_ring + p.sq_off.tail);
+	iop->sq_mask = *(unsigned *)((char *)iop->sq_ring + p.sq_off.ring_mask);
+	iop->sq_entries = p.sq_entries;
+	iop->sqe_tail = *iop->sq_tail;
+	/* We always fill in submission entries in order, so the index array
+	 * never changes. */
+	sq_array = (unsigned *)((char *)iop->sq_ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; ++i)
+		sq_array[i] = i;
+
+	iop->cq_head = (unsigned *)((char *)iop->cq_ring + p.cq_off.head);
+	iop->cq_tail = (unsigned *)((char *)iop->cq_ring + p.cq_off.tail);
+	iop->cq_mask = *(unsigned *)((char *)iop->cq_ring + p.cq_off.ring_mask);
+	iop->cqes = (struct io_uring_cqe *)((char *)iop->cq_ring +
+	    p.cq_off.cqes);
+
+	iop->next_gen = 1;
+
+	evsig_init_(base);
+
+	return (iop);
+ err:
+	event_warn("mmap(io_uring)");
+	iouring_unmap(iop);
+	close(fd);
+	mm_free(iop);
+	return (NULL);
+}
+
+/* Return the number of submission entries that we have filled in but the
+ * kernel has not yet consumed. */
+static inline unsigned
+iouring_sq_pending(const struct iouringop *iop)
+{
+	return iop->sqe_tail - __atomic_load_n(iop->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Return a zeroed submission entry for us to fill in, submitting what we
+ * have so far if the ring is full.  Returns NULL on failure. */
+static struct io_uring_sqe *
+iouring_get_sqe(struct iouringop *iop)
+{
+	struct io_uring_sqe *sqe;
+	unsigned pending = iouring_sq_pending(iop);
+
+	if (pending >= iop->sq_entries) {
+		if (sys_io_uring_enter(iop->ring_fd, pending, 0, 0,
+			NULL, 0) < 0) {
+			event_warn("io_uring_enter");
+			return (NULL);
+		}
+		if (iouring_sq_pending(iop) >= iop->sq_entries)
+			return (NULL);
+	}
+
+	sqe = &iop->sqes[iop->sqe_tail & iop->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return (sqe);
+}
+
+/* Make the submission entry we just filled in visible to the kernel. */
+static inline void
+iouring_commit_sqe(struct iouringop *iop)
+{
+	++iop->sqe_tail;
+	__atomic_store_n(iop->sq_tail, iop->sqe_tail, __ATOMIC_RELEASE);
+}
+
+static int
+iouring_queue_poll_add(struct iouringop *iop, int fd, short events,
+    ev_uint32_t gen)
+{
+	struct io_uring_sqe *sqe;
+	ev_uint32_t mask = 0;
+
+	if (!(sqe = iouring_get_sqe(iop)))
+		return (-1);
+	if (events & EV_READ)
+		mask |= POLLIN;
+	if (events & EV_WRITE)
+		mask |= POLLOUT;
+	if (events & EV_CLOSED)
+		mask |= POLLRDHUP;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = mask;
+	sqe->user_data = IOURING_TAG(fd, gen);
+	iouring_commit_sqe(iop);
+	return (0);
+}
+
+static int
+iouring_queue_poll_remove(struct iouringop *iop, int fd, ev_uint32_t gen)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = iouring_get_sqe(iop)))
+		return (-1);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = IOURING_TAG(fd, gen);
+	sqe->user_data = IOURING_REMOVE_TAG;
+#ifdef IORING_FEAT_CQE_SKIP
+	if (iop->features & IORING_FEAT_CQE_SKIP)
+		sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+#endif
+	iouring_commit_sqe(iop);
+	return (0);
+}
+
+/* Remember that the poll request for <fd> may need to change before the
+ * next wait, growing our per-fd state as needed.  Returns the state for
+ * <fd>, or NULL on failure. */
+static struct iouring_fd *
+iouring_note_change(struct iouringop *iop, int fd)
+{
+	struct iouring_fd *st;
+
+	if (fd < 0)
+		return (NULL);
+	if (fd >= iop->nfds) {
+		int new_nfds = iop->nfds ? iop->nfds : 32;
+		struct iouring_fd *new_fds;
+		while (new_nfds <= fd)
+			new_nfds <<= 1;
+		new_fds = mm_realloc(iop->fds,
+		    new_nfds * sizeof(struct iouring_fd));
+		if (new_fds == NULL)
+			return (NULL);
+		memset(new_fds + iop->nfds, 0,
+		    (new_nfds - iop->nfds) * sizeof(struct iouring_fd));
+		iop->fds = new_fds;
+		iop->nfds = new_nfds;
+	}
+	st = &iop->fds[fd];
+	if (!st->changed) {
+		if (iop->n_changed == iop->changed_alloc) {
+			int new_alloc = iop->changed_alloc ?
+			    iop->changed_alloc * 2 : 64;
+			int *new_changed = mm_realloc(iop->changed,
+			    new_alloc * sizeof(int));
+			if (new_changed == NULL)
+				return (NULL);
+			iop->changed = new_changed;
+			iop->changed_alloc = new_alloc;
+		}
+		iop->changed[iop->n_changed++] = fd;
+		st->changed = 1;
+	}
+	return (st);
+}
+
+static int
+iouring_add(struct event_base *base, evutil_socket_t fd, short old,
+    short events, void *p)
+{
+	struct iouringop *iop = base->evbase;
+	struct iouring_fd *st;
+	(void)p;
+
+	if (!(st = iouring_note_change(iop, fd)))
+		return (-1);
+	st->want = (old | events) & (EV_READ|EV_WRITE|EV_CLOSED);
+	return (0);
+}
+
+static int
+iouring_del(struct event_base *base, evutil_socket_t fd, short old,
+    short events, void *p)
+{
+	struct iouringop *iop = base->evbase;
+	struct iouring_fd *st;
+	(void)p;
+
+	if (!(st = iouring_note_change(iop, fd)))
+		return (-1);
+	st->want = (old & ~events) & (EV_READ|EV_WRITE|EV_CLOSED);
+	if (!st->want)
+		st->dropped = 1;
+	return (0);
+}
+
+/* Queue whatever poll requests and cancellations we need to make the kernel
+ * agree with what libevent wants for <fd>.  Returns -1 if we couldn't queue
+ * them; the state in <st> then still says what is left to do. */
+static int
+iouring_apply_change(struct iouringop *iop, int fd, struct iouring_fd *st)
+{
+	/* A poll that is already waiting for everything we want can stay;
+	 * evmap ignores the extra events when it fires. */
+	if (st->armed && st->want && !(st->want & ~st->armed) &&
+	    !st->dropped)
+		return (0);
+	if (st->armed) {
+		if (iouring_queue_poll_remove(iop, fd, st->gen) < 0)
+			return (-1);
+		st->armed = 0;
+	}
+	st->dropped = 0;
+	if (st->want) {
+		if (++iop->next_gen == 0)
+			iop->next_gen = 1;
+		st->gen = iop->next_gen;
+		if (iouring_queue_poll_add(iop, fd, st->want, st->gen) < 0)
+			return (-1);
+		st->armed = st->want;
+	}
+	return (0);
+}
+
+/* Apply every pending change.  Changes we couldn't queue stay on the list,
+ * and we return -1. */
+static int
+iouring_apply_changes(struct iouringop *iop)
+{
+	int i, n_left = 0, r = 0;
+
+	for (i = 0; i < iop->n_changed; ++i) {
+		int fd = iop->changed[i];
+		struct iouring_fd *st = &iop->fds[fd];
+
+		if (iouring_apply_change(iop, fd, st) < 0) {
+			iop->changed[n_left++] = fd;
+			r = -1;
+		} else {
+			st->changed = 0;
+		}
+	}
+	iop->n_changed = n_left;
+
+	return (r);
+}
+
+/* Handle a single completion. */
+static void
+iouring_process_cqe(struct event_base *base, struct iouringop *iop,
+    const struct io_uring_cqe *cqe)
+{
+	struct iouring_fd *st;
+	int fd;
+	short ev = 0;
+
+	if (cqe->user_data == IOURING_REMOVE_TAG)
+		return;
+	fd = IOURING_TAG_FD(cqe->user_data);
+	if (fd < 0 || fd >= iop->nfds)
+		return;
+	st = &iop->fds[fd];
+	if (!st->armed || st->gen != IOURING_TAG_GEN(cqe->user_data)) {
+		/* This is a poll we already cancelled or replaced. */
+		return;
+	}
+
+	/* This poll is done; we'll need a new one if libevent still cares
+	 * about this fd. */
+	st->armed = 0;
+	if (st->want)
+		iouring_note_change(iop, fd);
+
+	if (cqe->res == -ECANCELED) {
+		return;
+	} else if (cqe->res < 0) {
+		ev = EV_READ | EV_WRITE;
+	} else {
+		int what = cqe->res;
+		if (what & POLLERR) {
+			ev = EV_READ | EV_WRITE;
+		} else if ((what & POLLHUP) && !(what & POLLRDHUP)) {
+			ev = EV_READ | EV_WRITE;
+		} else {
+			if (what & POLLIN)
+				ev |= EV_READ;
+			if (what & POLLOUT)
+				ev |= EV_WRITE;
+			if (what & POLLRDHUP)
+				ev |= EV_CLOSED;
+		}
+	}
+	if (!ev)
+		return;
+
+	evmap_io_active_(base, fd, ev);
+}
+
+static int
+iouring_dispatch(struct event_base *base, struct timeval *tv)
+{
+	struct iouringop *iop = base->evbase;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned head, tail, min_complete = 1;
+	int res, retry;
+
+	/* If the submission ring filled up and the kernel wouldn't take it,
+	 * some fds aren't being polled the way libevent wants yet.  Submit what
+	 * we have without sleeping, then try those again. */
+	retry = iouring_apply_changes(iop) < 0;
+
+	memset(&arg, 0, sizeof(arg));
+	if (tv != NULL) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		arg.ts = (ev_uint64_t)(ev_uintptr_t)&ts;
+		if (tv->tv_sec == 0 && tv->tv_usec == 0)
+			min_complete = 0;
+	}
+	/* Don't sleep if there are completions we haven't looked at yet. */
+	if (*iop->cq_head != __atomic_load_n(iop->cq_tail, __ATOMIC_ACQUIRE))
+		min_complete = 0;
+	if (retry)
+		min_complete = 0;
+
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	res = sys_io_uring_enter(iop->ring_fd, iouring_sq_pending(iop),
+	    min_complete, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+	    &arg, sizeof(arg));
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+
+	if (res == -1) {
+		if (errno != EINTR && errno != ETIME && errno != EBUSY &&
+		    errno != EAGAIN) {
+			event_warn("io_uring_enter");
+			return (-1);
+		}
+	}
+
+	head = *iop->cq_head;
+	tail = __atomic_load_n(iop->cq_tail, __ATOMIC_ACQUIRE);
+	event_debug(("%s: io_uring_enter reports %u completions", __func__,
+		tail - head));
+	for (; head != tail; ++head)
+		iouring_process_cqe(base, iop, &iop->cqes[head & iop->cq_mask]);
+	__atomic_store_n(iop->cq_head, head, __ATOMIC_RELEASE);
+
+	if (retry && iouring_apply_changes(iop) < 0) {
+		event_warnx("%s: unable to queue poll requests", __func__);
+		return (-1);
+	}
+
+	return (0);
+}
+
+static void
+iouring_dealloc(struct event_base *base)
+{
+	struct iouringop *iop = base->evbase;
+
+	evsig_dealloc_(base);
+	iouring_unmap(iop);
+	if (iop->ring_fd >= 0)
+		close(iop->ring_fd);
+	if (iop->fds)
+		mm_free(iop->fds);
+	if (iop->changed)
+		mm_free(iop->changed);
+
+	memset(iop, 0, sizeof(struct iouringop));
+	mm_free(iop);
+}
+
+#endif /* EVENT__HAVE_IO_URING */
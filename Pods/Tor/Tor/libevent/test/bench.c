@@ -69,6 +69,8 @@ static ev_ssize_t count, fired;
 static int writes, failures;
 static evutil_socket_t *pipes;
 static int num_pipes, num_active, num_writes;
+static int oneshot, show_stats;
+static int dispatches;
 static struct event *events;
 static struct event_base *base;
 
@@ -85,6 +87,8 @@ read_cb(evutil_socket_t fd, short which, void *arg)
 		count += n;
 	else
 		failures++;
+	if (oneshot)
+		event_add(&events[idx], NULL);
 	if (writes) {
 		if (widx >= num_pipes)
 			widx -= num_pipes;
@@ -106,7 +110,9 @@ run_once(void)
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
 		if (event_initialized(&events[i]))
 			event_del(&events[i]);
-		event_assign(&events[i], base, cp[0], EV_READ | EV_PERSIST, read_cb, (void *)(ev_intptr_t) i);
+		event_assign(&events[i], base, cp[0],
+		    EV_READ | (oneshot ? 0 : EV_PERSIST), read_cb,
+		    (void *)(ev_intptr_t) i);
 		event_add(&events[i], NULL);
 	}
 
@@ -129,9 +135,10 @@ run_once(void)
 		} while (count != fired);
 		evutil_gettimeofday(&te, NULL);
 
-		if (xcount != count)
+		if (xcount != count && !show_stats)
 			fprintf(stderr, "Xcount: %d, Rcount: " EV_SSIZE_FMT "\n",
 				xcount, count);
+		dispatches = xcount;
 	}
 
 	evutil_timersub(&te, &ts, &te);
@@ -159,7 +166,7 @@ main(int argc, char **argv)
 	num_pipes = 100;
 	num_active = 1;
 	num_writes = num_pipes;
-	while ((c = getopt(argc, argv, "n:a:w:m:l")) != -1) {
+	while ((c = getopt(argc, argv, "n:a:w:m:los")) != -1) {
 		switch (c) {
 		case 'n':
 			num_pipes = atoi(optarg);
@@ -173,6 +180,12 @@ main(int argc, char **argv)
 		case 'm':
 			method = optarg;
 			break;
+		case 'o':
+			oneshot = 1;
+			break;
+		case 's':
+			show_stats = 1;
+			break;
 		case 'l':
 			methods = event_get_supported_methods();
 			fprintf(stdout, "Using Libevent %s. Available methods are:\n",
@@ -223,12 +236,26 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (show_stats)
+		fprintf(stdout, "Using %s\n", event_base_get_method(base));
+
 	for (i = 0; i < 25; i++) {
 		tv = run_once();
 		if (tv == NULL)
 			exit(1);
-		fprintf(stdout, "%ld\n",
-			tv->tv_sec * 1000000L + tv->tv_usec);
+		if (show_stats) {
+			/* Every byte is one event, so events per dispatch is
+			 * also bytes per wakeup. */
+			fprintf(stdout, "%ld usec, %d dispatches, "
+			    "%.2f events per dispatch, "
+			    "%.0f dispatches per MB\n",
+			    tv->tv_sec * 1000000L + tv->tv_usec, dispatches,
+			    dispatches ? (double)count / dispatches : 0.0,
+			    count ? dispatches * 1048576.0 / count : 0.0);
+		} else {
+			fprintf(stdout, "%ld\n",
+			    tv->tv_sec * 1000000L + tv->tv_usec);
+		}
 	}
 
 	exit(0);
@@ -66,6 +66,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "app/config/statefile.h"
+#include "app/main/log_writer.h"
 #include "app/main/main.h"
 #include "app/main/subsysmgr.h"
 #include "core/mainloop/connection.h"
@@ -98,6 +99,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -329,6 +331,7 @@ static const config_var_t option_vars_[] = {
   OBSOLETE("AlternateHSAuthority"),
   V(AssumeReachable,             BOOL,     "0"),
   V(AssumeReachableIPv6,         AUTOBOOL, "auto"),
+  V(AsyncLogging,                BOOL,     "0"),
   OBSOLETE("AuthDirBadDir"),
   OBSOLETE("AuthDirBadDirCCs"),
   V(AuthDirBadExit,              LINELIST, NULL),
@@ -479,6 +482,7 @@ static const config_var_t option_vars_[] = {
   V(FetchHidServDescriptors,     BOOL,     "1"),
   V(FetchUselessDescriptors,     BOOL,     "0"),
   OBSOLETE("FetchV2Networkstatus"),
+  V(GeoIPCacheFiles,             BOOL,     "1"),
   V(GeoIPExcludeUnknown,         AUTOBOOL, "auto"),
 #ifdef _WIN32
   V(GeoIPFile,                   FILENAME, "<default>"),
@@ -544,6 +548,7 @@ static const config_var_t option_vars_[] = {
   VAR_D("HSLayer3Nodes",         ROUTERSET,  HSLayer3Nodes,  NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
   V_IMMUTABLE(KeepBindCapabilities,        AUTOBOOL, "auto"),
+  V_IMMUTABLE(LibeventMethod,    STRING,   NULL),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
@@ -579,6 +584,7 @@ static const config_var_t option_vars_[] = {
   V(NumEntryGuards,              POSINT,     "0"),
   V(NumPrimaryGuards,            POSINT,     "0"),
   V(OfflineMasterKey,            BOOL,     "0"),
+  V(OffloadRelayCrypto,          BOOL,     "0"),
   OBSOLETE("ORListenAddress"),
   VPORT(ORPort),
   V(OutboundBindAddress,         LINELIST,   NULL),
@@ -2216,6 +2222,15 @@ options_act,(const or_options_t *old_options))
     finish_daemon(options->DataDirectory);
   }
 
+  /* Now that we won't fork again, we can hand our log writes to a thread. */
+  if (options->AsyncLogging) {
+    if (log_writer_start() < 0)
+      log_warn(LD_CONFIG, "Couldn't start a log writer thread; "
+               "writing logs synchronously.");
+  } else {
+    log_writer_stop();
+  }
+
   if (options_act_relay(old_options) < 0)
     return -1;
 
@@ -2240,6 +2255,8 @@ options_act,(const or_options_t *old_options))
     log_warn(LD_BUG,"Error parsing already-validated policy options.");
     return -1;
   }
+  /* Which nodes we can choose depends on our firewall and bridge options. */
+  node_select_cache_clear();
 
   if (init_control_cookie_authentication(options->CookieAuthentication) < 0) {
     log_warn(LD_CONFIG,"Error creating control cookie authentication file.");
@@ -7097,6 +7114,7 @@ init_libevent(const or_options_t *options)
   memset(&cfg, 0, sizeof(cfg));
   cfg.num_cpus = get_num_cpus(options);
   cfg.msec_per_tick = options->TokenBucketRefillInterval;
+  cfg.method = options->LibeventMethod;
 
   tor_libevent_initialize(&cfg);
 
@@ -7402,8 +7420,14 @@ config_load_geoip_file_(sa_family_t family,
   const or_options_t *options = get_options();
   const char *msg = "";
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
+  char *cache_fname = NULL;
   int r;
 
+  if (options->GeoIPCacheFiles) {
+    cache_fname = get_cachedir_fname(family == AF_INET ? "cached-geoip"
+                                                       : "cached-geoip6");
+  }
+
 #ifdef _WIN32
   char *free_fname = NULL; /* Used to hold any temporary-allocated value */
   /* XXXX Don't use this "<default>" junk; make our filename options
@@ -7413,12 +7437,13 @@ config_load_geoip_file_(sa_family_t family,
     tor_asprintf(&free_fname, "%s\\%s", conf_root, default_fname);
     fname = free_fname;
   }
-  r = geoip_load_file(family, fname, severity);
+  r = geoip_load_file_cached(family, fname, cache_fname, severity);
   tor_free(free_fname);
 #else /* !defined(_WIN32) */
   (void)default_fname;
-  r = geoip_load_file(family, fname, severity);
+  r = geoip_load_file_cached(family, fname, cache_fname, severity);
 #endif /* defined(_WIN32) */
+  tor_free(cache_fname);
 
   if (r < 0 && severity == LOG_WARN) {
     log_warn(LD_GENERAL, "%s", msg);
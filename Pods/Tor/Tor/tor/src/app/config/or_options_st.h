@@ -76,6 +76,8 @@ struct or_options_t {
                           * each log message occurs? */
   int TruncateLogFile; /**< Boolean: Should we truncate the log file
                             before we start writing? */
+  int AsyncLogging; /**< Boolean: Should a separate thread write file and
+                     * stream logs? */
   char *SyslogIdentityTag; /**< Identity tag to add for syslog logging. */
 
   char *DebugLogFile; /**< Where to send verbose log messages. */
@@ -431,6 +433,9 @@ struct or_options_t {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If true, decrypt relay cells heading away from the origin on our
+   * cpuworker threads instead of on the main thread. */
+  int OffloadRelayCrypto;
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   char *ClientOnionAuthDir; /**< Directory to keep client
@@ -575,6 +580,8 @@ struct or_options_t {
                   * log whether it was DNS-leaking or not? */
   /** Token Bucket Refill resolution in milliseconds. */
   int TokenBucketRefillInterval;
+  /** If set, the name of the Libevent backend to use. */
+  char *LibeventMethod;
 
   /** Boolean: Do we try to enter from a smallish number
    * of fixed nodes? */
@@ -858,6 +865,10 @@ struct or_options_t {
   /** Optionally, IPv4 and IPv6 GeoIP data. */
   char *GeoIPFile;
   char *GeoIPv6File;
+  /** If true, keep a binary copy of each GeoIP database in the cache
+   * directory, and load it instead of parsing GeoIPFile or GeoIPv6File when
+   * those haven't changed. */
+  int GeoIPCacheFiles;
 
   /** Autobool: if auto, then any attempt to Exclude{Exit,}Nodes a particular
    * country code will exclude all nodes in ?? and A1.  If true, all nodes in
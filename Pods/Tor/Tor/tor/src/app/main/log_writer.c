@@ -0,0 +1,149 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file log_writer.c
+ * \brief Thread that writes file logs when AsyncLogging is set.
+ *
+ * The log module can't start threads of its own, so when asynchronous
+ * logging is on, it queues messages for file and stream logs in a ring, and
+ * we run a thread here that drains the ring with logs_async_drain().  The
+ * thread sleeps on a condition variable while there is nothing to do; the
+ * log module's wakeup function only takes the lock to signal it when it is
+ * actually asleep, so a busy logger never contends with the writer.
+ **/
+
+#include "orconfig.h"
+#include "app/main/log_writer.h"
+#include "lib/log/log.h"
+#include "lib/thread/threads.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/** How long does the writer thread sleep, at most, before it checks for
+ * messages again?  This is only a backstop: producers wake it up. */
+#define LOG_WRITER_MAX_SLEEP_MSEC 250
+
+/** Lock protecting the writer thread's state below. */
+static tor_mutex_t *writer_lock = NULL;
+/** Condition that wakes the writer thread, and that the thread signals when
+ * it exits. */
+static tor_cond_t *writer_cond = NULL;
+/** True while the writer thread is running.  Protected by writer_lock. */
+static int writer_running = 0;
+/** True if the writer thread should exit.  Protected by writer_lock. */
+static int writer_should_exit = 0;
+/** 1 while the writer thread is waiting on writer_cond, else 0. */
+static atomic_counter_t writer_sleeping;
+
+/** Wake the writer thread if it is asleep.  Called by the log module after
+ * it queues a message, with the log lock held: must not log. */
+static void
+log_writer_wakeup(void)
+{
+  if (atomic_counter_get(&writer_sleeping)) {
+    tor_mutex_acquire(writer_lock);
+    tor_cond_signal_one(writer_cond);
+    tor_mutex_release(writer_lock);
+  }
+}
+
+/** Main function for the writer thread. */
+static void
+log_writer_main(void *arg)
+{
+  const struct timeval max_sleep = { 0, LOG_WRITER_MAX_SLEEP_MSEC * 1000 };
+  (void)arg;
+
+  tor_mutex_acquire(writer_lock);
+  while (!writer_should_exit) {
+    tor_mutex_release(writer_lock);
+    logs_async_drain();
+    tor_mutex_acquire(writer_lock);
+
+    /* Say we're asleep before we look at the ring for the last time: then a
+     * producer either sees us asleep and signals us, or we see its
+     * message. */
+    atomic_counter_exchange(&writer_sleeping, 1);
+    if (logs_async_is_idle() && !writer_should_exit)
+      tor_cond_wait(writer_cond, writer_lock, &max_sleep);
+    atomic_counter_exchange(&writer_sleeping, 0);
+  }
+  writer_running = 0;
+  tor_cond_signal_all(writer_cond);
+  tor_mutex_release(writer_lock);
+
+  spawn_exit();
+}
+
+/** Start writing file logs from a separate thread, if we aren't already.
+ * Only call this once we are done forking.  Return 0 on success, and -1 on
+ * failure, in which case we keep logging synchronously. */
+int
+log_writer_start(void)
+{
+  int running, r = 0;
+
+  if (!writer_lock) {
+    writer_lock = tor_mutex_new_nonrecursive();
+    writer_cond = tor_cond_new();
+    atomic_counter_init(&writer_sleeping);
+  }
+
+  tor_mutex_acquire(writer_lock);
+  running = writer_running;
+  tor_mutex_release(writer_lock);
+  if (running)
+    return 0;
+
+  /* Never hold writer_lock while calling into the log module: the wakeup
+   * function takes them in the other order. */
+  if (logs_set_async(1, log_writer_wakeup) < 0)
+    return -1;
+
+  tor_mutex_acquire(writer_lock);
+  writer_should_exit = 0;
+  writer_running = 1;
+  if (spawn_func(log_writer_main, NULL) < 0) {
+    writer_running = 0;
+    r = -1;
+  }
+  tor_mutex_release(writer_lock);
+
+  if (r < 0)
+    logs_set_async(0, NULL);
+  else
+    log_info(LD_GENERAL, "Writing log files from a separate thread.");
+  return r;
+}
+
+/** Stop the writer thread, if it is running, and go back to writing file
+ * logs synchronously.  Anything still queued gets written first. */
+void
+log_writer_stop(void)
+{
+  if (!writer_lock)
+    return;
+
+  tor_mutex_acquire(writer_lock);
+  if (writer_running) {
+    writer_should_exit = 1;
+    tor_cond_signal_all(writer_cond);
+    while (writer_running)
+      tor_cond_wait(writer_cond, writer_lock, NULL);
+  }
+  tor_mutex_release(writer_lock);
+
+  logs_set_async(0, NULL);
+}
+
+/** Stop the writer thread and release its resources. */
+void
+log_writer_free_all(void)
+{
+  log_writer_stop();
+  tor_cond_free(writer_cond);
+  tor_mutex_free(writer_lock);
+}
@@ -0,0 +1,16 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file log_writer.h
+ * \brief Header for log_writer.c
+ **/
+
+#ifndef TOR_LOG_WRITER_H
+#define TOR_LOG_WRITER_H
+
+int log_writer_start(void);
+void log_writer_stop(void);
+void log_writer_free_all(void);
+
+#endif /* !defined(TOR_LOG_WRITER_H) */
@@ -314,6 +314,7 @@ static void
 dumpmemusage(int severity)
 {
   connection_dump_buffer_mem_stats(severity);
+  buf_dump_freelist_sizes(severity);
   tor_log(severity, LD_GENERAL, "In rephist: %"PRIu64" used by %d Tors.",
       (rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
@@ -901,12 +902,15 @@ sandbox_init_filter(void)
   OPEN_CACHEDIR_SUFFIX("cached-microdesc-consensus", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-microdescs.idx", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
   OPEN_CACHEDIR("cached-descriptors.tmp.tmp");
   OPEN_CACHEDIR_SUFFIX("cached-extrainfo", ".tmp");
   OPEN_CACHEDIR_SUFFIX("cached-extrainfo.new", ".tmp");
   OPEN_CACHEDIR("cached-extrainfo.tmp.tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-geoip", ".tmp");
+  OPEN_CACHEDIR_SUFFIX("cached-geoip6", ".tmp");
 
   OPEN_DATADIR_SUFFIX("state", ".tmp");
   OPEN_DATADIR_SUFFIX("sr-state", ".tmp");
@@ -989,12 +993,15 @@ sandbox_init_filter(void)
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-microdescs.new", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-microdescs.idx", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-descriptors.new", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-extrainfo", ".tmp");
   RENAME_CACHEDIR_SUFFIX("cached-extrainfo", ".new");
   RENAME_CACHEDIR_SUFFIX("cached-extrainfo.new", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-geoip", ".tmp");
+  RENAME_CACHEDIR_SUFFIX("cached-geoip6", ".tmp");
 
   RENAME_SUFFIX("state", ".tmp");
   RENAME_SUFFIX("sr-state", ".tmp");
@@ -14,6 +14,7 @@
 
 #include "app/config/config.h"
 #include "app/config/statefile.h"
+#include "app/main/log_writer.h"
 #include "app/main/main.h"
 #include "app/main/shutdown.h"
 #include "app/main/subsysmgr.h"
@@ -27,6 +28,7 @@
 #include "core/or/conflux_pool.h"
 #include "core/or/connection_edge.h"
 #include "core/or/dos.h"
+#include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -43,6 +45,7 @@
 #include "feature/hs/hs_common.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/relay/ext_orport.h"
@@ -50,6 +53,7 @@
 #include "feature/stats/bwhist.h"
 #include "feature/stats/geoip_stats.h"
 #include "feature/stats/rephist.h"
+#include "lib/buf/buffers.h"
 #include "lib/evloop/compat_libevent.h"
 #include "lib/geoip/geoip.h"
 
@@ -130,8 +134,11 @@ tor_free_all(int postfork)
   channel_tls_free_all();
   channel_free_all();
   connection_free_all();
+  cell_pool_release_idle();
+  buf_clear_freelists();
   connection_edge_free_all();
   scheduler_free_all();
+  node_select_free_all();
   nodelist_free_all();
   microdesc_free_all();
   routerparse_free_all();
@@ -145,6 +152,8 @@ tor_free_all(int postfork)
   circpad_free_all();
 
   if (!postfork) {
+    /* Get our queued log messages onto disk while we still can. */
+    log_writer_free_all();
     config_free_all();
     relay_config_free_all();
     or_state_free_all();
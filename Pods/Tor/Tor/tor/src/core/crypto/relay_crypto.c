@@ -97,6 +97,45 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in)
   crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
 }
 
+/** Apply <b>cipher</b> to the payloads of the <b>n_cells</b> cells in
+ * <b>cells</b> (in place), in order.
+ *
+ * The result is identical to calling relay_crypt_one_payload() on each cell
+ * in turn, but the payloads are gathered into a contiguous buffer so that
+ * the cipher is invoked once per RELAY_CRYPT_BATCH_CHUNK cells rather than
+ * once per cell.
+ */
+void
+relay_crypt_payloads(crypto_cipher_t *cipher, cell_t **cells, size_t n_cells)
+{
+  uint8_t buf[RELAY_CRYPT_BATCH_CHUNK * CELL_PAYLOAD_SIZE];
+  size_t i, j, n_chunk;
+
+  tor_assert(cipher);
+  tor_assert(cells || n_cells == 0);
+
+  if (n_cells == 1) {
+    relay_crypt_one_payload(cipher, cells[0]->payload);
+    return;
+  }
+
+  for (i = 0; i < n_cells; i += n_chunk) {
+    n_chunk = MIN(n_cells - i, RELAY_CRYPT_BATCH_CHUNK);
+    for (j = 0; j < n_chunk; ++j) {
+      memcpy(buf + j*CELL_PAYLOAD_SIZE, cells[i+j]->payload,
+             CELL_PAYLOAD_SIZE);
+    }
+    crypto_cipher_crypt_inplace(cipher, (char*) buf,
+                                n_chunk * CELL_PAYLOAD_SIZE);
+    for (j = 0; j < n_chunk; ++j) {
+      memcpy(cells[i+j]->payload, buf + j*CELL_PAYLOAD_SIZE,
+             CELL_PAYLOAD_SIZE);
+    }
+  }
+
+  memwipe(buf, 0, sizeof(buf));
+}
+
 /** Return the sendme_digest within the <b>crypto</b> object. */
 uint8_t *
 relay_crypto_get_sendme_digest(relay_crypto_t *crypto)
@@ -185,25 +224,80 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
       log_fn(LOG_PROTOCOL_WARN, LD_OR,
              "Incoming cell at client not recognized. Closing.");
       return -1;
-    } else {
-      relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
-      /* We're in the middle. Encrypt one layer. */
-      relay_crypt_one_payload(crypto->b_crypto, cell->payload);
     }
+  }
+
+  /* We're in the middle. Apply our layer, then see if the cell is for us. */
+  if (relay_decrypt_cells(circ, &cell, 1, cell_direction) < 0)
+    return -1;
+  *recognized = relay_cell_is_recognized(circ, cell, cell_direction);
+  return 0;
+}
+
+/** Do the appropriate en/decryption for each of the <b>n_cells</b> cells in
+ * <b>cells</b>, all arriving in order on the non-origin circuit <b>circ</b>
+ * in direction <b>cell_direction</b>.
+ *
+ * This only applies our layer of crypto: the caller must then call
+ * relay_cell_is_recognized() on each cell, in order, and finish handling
+ * each recognized cell before checking the next one, since recognizing a
+ * cell advances the running digest.
+ *
+ * Return -1 if the cells cannot be handled as a batch (that is, if
+ * <b>circ</b> is an origin circuit, which needs layered decrypts), else
+ * return 0.
+ */
+int
+relay_decrypt_cells(circuit_t *circ, cell_t **cells, size_t n_cells,
+                    cell_direction_t cell_direction)
+{
+  relay_crypto_t *crypto;
+
+  tor_assert(circ);
+  tor_assert(cell_direction == CELL_DIRECTION_IN ||
+             cell_direction == CELL_DIRECTION_OUT);
+
+  if (BUG(CIRCUIT_IS_ORIGIN(circ)))
+    return -1;
+
+  crypto = &TO_OR_CIRCUIT(circ)->crypto;
+  if (cell_direction == CELL_DIRECTION_IN) {
+    /* We're in the middle. Encrypt one layer. */
+    relay_crypt_payloads(crypto->b_crypto, cells, n_cells);
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* We're in the middle. Decrypt one layer. */
-    relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
+    relay_crypt_payloads(crypto->f_crypto, cells, n_cells);
+  }
+  return 0;
+}
+
+/** Return 1 if <b>cell</b>, which has already had our layer applied by
+ * relay_decrypt_cells(), is meant for us at the non-origin circuit
+ * <b>circ</b>, else return 0.
+ *
+ * If the cell is recognized, the forward digest has been updated with it.
+ */
+int
+relay_cell_is_recognized(circuit_t *circ, cell_t *cell,
+                         cell_direction_t cell_direction)
+{
+  relay_header_t rh;
+
+  tor_assert(circ);
+  tor_assert(cell);
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
+  if (BUG(CIRCUIT_IS_ORIGIN(circ)))
+    return 0;
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
-    }
+  /* Cells heading towards the origin are never for a middle hop. */
+  if (cell_direction == CELL_DIRECTION_IN)
+    return 0;
+
+  relay_header_unpack(&rh, cell->payload);
+  if (rh.recognized == 0) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_digest_matches(TO_OR_CIRCUIT(circ)->crypto.f_digest, cell))
+      return 1;
   }
   return 0;
 }
@@ -16,9 +16,17 @@ int relay_crypto_init(relay_crypto_t *crypto,
                       const char *key_data, size_t key_data_len,
                       int reverse, int is_hs_v3);
 
+/** How many cell payloads relay_crypt_payloads() hands to the cipher in a
+ * single call. */
+#define RELAY_CRYPT_BATCH_CHUNK 8
+
 int relay_decrypt_cell(circuit_t *circ, cell_t *cell,
                        cell_direction_t cell_direction,
                        crypt_path_t **layer_hint, char *recognized);
+int relay_decrypt_cells(circuit_t *circ, cell_t **cells, size_t n_cells,
+                        cell_direction_t cell_direction);
+int relay_cell_is_recognized(circuit_t *circ, cell_t *cell,
+                             cell_direction_t cell_direction);
 void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
@@ -34,6 +42,8 @@ void relay_crypto_record_sendme_digest(relay_crypto_t *crypto,
 
 void
 relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in);
+void
+relay_crypt_payloads(crypto_cipher_t *cipher, cell_t **cells, size_t n_cells);
 
 void
 relay_set_digest(crypto_digest_t *digest, cell_t *cell);
@@ -13,6 +13,8 @@
  *
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
+ *      <li>for decrypting relay cells in relay.c, if OffloadRelayCrypto is
+ *          set,
  *      <li>for compressing consensuses in consdiffmgr.c,
  *      <li>for calculating diffs and compressing them in consdiffmgr.c.
  *      <li>and for solving onion service PoW challenges in pow.c.
@@ -36,7 +38,11 @@
 #include "feature/nodelist/networkstatus.h"
 #include "lib/evloop/workqueue.h"
 #include "core/crypto/onion_crypto.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/or/relay.h"
+#include "lib/crypt_ops/crypto_cipher.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
 
 static void queue_pending_tasks(void);
@@ -147,8 +153,8 @@ cpuworker_free_all(void)
 }
 
 /** Return the number of threads configured for our CPU worker. */
-unsigned int
-cpuworker_get_n_threads(void)
+MOCK_IMPL(unsigned int,
+cpuworker_get_n_threads,(void))
 {
   if (!threadpool) {
     return 0;
@@ -223,6 +229,26 @@ typedef struct cpuworker_job_u_t {
   } u;
 } cpuworker_job_t;
 
+/** Largest number of onionskins that we hand to a cpuworker at once.  We
+ * only build batches larger than one when onionskins are waiting in the
+ * onion queue, so this only matters when we're busy. */
+#define MAX_ONIONSKINS_PER_BATCH 16
+
+/** A set of onionskins that a cpuworker processes as a single piece of
+ * work.  Every circuit in the batch has its workqueue_entry set to the
+ * batch's entry. */
+typedef struct cpuworker_batch_t {
+  /** Number of elements in jobs. */
+  int n_jobs;
+  /** The handshakes to process. */
+  cpuworker_job_t jobs[FLEXIBLE_ARRAY_MEMBER];
+} cpuworker_batch_t;
+
+/** Return the number of bytes needed for a cpuworker_batch_t holding
+ * <b>n</b> jobs. */
+#define CPUWORKER_BATCH_LEN(n) \
+  (offsetof(cpuworker_batch_t, jobs) + (n)*sizeof(cpuworker_job_t))
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -362,11 +388,10 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Handle a single reply <b>job</b> from the worker threads. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_one(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -460,16 +485,29 @@ cpuworker_onion_handshake_replyfn(void *work_)
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
-  tor_free(job);
+}
+
+/** Handle a reply from the worker threads, for every handshake in the
+ * batch. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
+{
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_onion_handshake_reply_one(&batch->jobs[i]);
+  }
+  tor_free(batch);
   queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Process the single onion handshake request in <b>job</b>, using the
+ * keys in <b>state</b>, and replace it with a reply.  A request we can't
+ * answer gets a failed reply, so that only its own circuit is closed. */
+static void
+cpuworker_onion_handshake_one(worker_state_t *state, cpuworker_job_t *job)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
 
   /* variables for onion processing */
   server_onion_keys_t *onion_keys = state->onion_keys;
@@ -499,15 +537,7 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
                                   rpl.keys, CPATH_KEY_MATERIAL_LEN,
                                   rpl.rend_auth_material,
                                   &rpl.circ_params);
-  if (n < 0) {
-    /* failure */
-    log_debug(LD_OR,"onion_skin_server_handshake failed.");
-    memset(&rpl, 0, sizeof(rpl));
-    rpl.success = 0;
-  } else {
-    /* success */
-    log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
-    cell_out->handshake_len = n;
+  if (n >= 0) {
     switch (cc->cell_type) {
     case CELL_CREATE:
       cell_out->cell_type = CELL_CREATED; break;
@@ -516,9 +546,20 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
     case CELL_CREATE_FAST:
       cell_out->cell_type = CELL_CREATED_FAST; break;
     default:
-      tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
+      tor_assert_nonfatal_unreached();
+      n = -1;
+      break;
     }
+  }
+  if (n < 0) {
+    /* failure */
+    log_debug(LD_OR,"onion_skin_server_handshake failed.");
+    memset(&rpl, 0, sizeof(rpl));
+    rpl.success = 0;
+  } else {
+    /* success */
+    log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+    cell_out->handshake_len = n;
     rpl.success = 1;
   }
 
@@ -539,24 +580,158 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
 
   memwipe(&req, 0, sizeof(req));
   memwipe(&rpl, 0, sizeof(req));
+}
+
+/** Implementation function for onion handshake requests: process every
+ * handshake in a batch.  Failures are reported per handshake, in each
+ * job's reply; they never stop the worker. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_onion_handshake_one(state, &batch->jobs[i]);
+  }
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
+/** Set up <b>job</b> to perform the public key operations necessary to
+ * respond to <b>onionskin</b> for the circuit <b>circ</b>, and count it as
+ * a pending task.  Always frees <b>onionskin</b>.
+ *
+ * Return 0 on success, or -1 if the circuit can't take a handshake.
+ */
+static int
+cpuworker_job_init(cpuworker_job_t *job, or_circuit_t *circ,
+                   create_cell_t *onionskin)
+{
+  cpuworker_request_t req;
+  int should_time;
+
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return -1;
+  }
+
+  if (!channel_is_client(circ->p_chan))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  should_time = should_time_request(onionskin->handshake_type);
+  memset(&req, 0, sizeof(req));
+  req.magic = CPUWORKER_REQUEST_MAGIC;
+  req.timed = should_time;
+
+  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (should_time)
+    tor_gettimeofday(&req.started_at);
+
+  /* Copy the current cached consensus params relevant to
+   * circuit negotiation into the CPU worker context */
+  req.circ_ns_params.cc_enabled = congestion_control_enabled();
+  req.circ_ns_params.sendme_inc_cells = congestion_control_sendme_inc();
+
+  job->circ = circ;
+  memcpy(&job->u.request, &req, sizeof(req));
+  memwipe(&req, 0, sizeof(req));
+
+  ++total_pending_tasks;
+  return 0;
+}
+
+/** Release every job in <b>batch</b>, which never made it onto the work
+ * queue, and free the batch.  If <b>close_circs</b> is true, also close each
+ * of the batch's circuits: there is nobody else left to answer them. */
+static void
+cpuworker_batch_abandon(cpuworker_batch_t *batch, int close_circs)
+{
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    or_circuit_t *circ = batch->jobs[i].circ;
+    circ->workqueue_entry = NULL;
+    tor_assert(total_pending_tasks > 0);
+    --total_pending_tasks;
+    if (close_circs && !TO_CIRCUIT(circ)->marked_for_close)
+      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  }
+  memwipe(batch, 0, CPUWORKER_BATCH_LEN(batch->n_jobs));
+  tor_free(batch);
+}
+
+/** Give <b>batch</b> to the cpuworkers, and point every circuit in it at the
+ * resulting work queue entry.  On failure, return -1 and leave the batch to
+ * the caller; otherwise return 0. */
+static int
+cpuworker_queue_batch(cpuworker_batch_t *batch)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  queue_entry = threadpool_queue_work_priority(threadpool,
+                                      WQ_PRI_HIGH,
+                                      cpuworker_onion_handshake_threadfn,
+                                      cpuworker_onion_handshake_replyfn,
+                                      batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    return -1;
+  }
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
+              &batch->jobs[i], queue_entry, batch->jobs[i].circ);
+    batch->jobs[i].circ->workqueue_entry = queue_entry;
+  }
+
+  return 0;
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers, up to
+ * MAX_ONIONSKINS_PER_BATCH at a time. */
 static void
 queue_pending_tasks(void)
 {
-  or_circuit_t *circ;
-  create_cell_t *onionskin = NULL;
+  or_circuit_t *circs[MAX_ONIONSKINS_PER_BATCH];
+  create_cell_t *onionskins[MAX_ONIONSKINS_PER_BATCH];
+  cpuworker_batch_t *batch;
+  int i, n;
 
   while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
+    for (n = 0; n < MAX_ONIONSKINS_PER_BATCH &&
+           total_pending_tasks + n < max_pending_tasks; ++n) {
+      circs[n] = onion_next_task(&onionskins[n]);
+      if (!circs[n])
+        break;
+    }
 
-    if (!circ)
+    if (n == 0)
       return;
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
-      log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    batch = tor_malloc_zero(CPUWORKER_BATCH_LEN(n));
+    for (i = 0; i < n; ++i) {
+      if (cpuworker_job_init(&batch->jobs[batch->n_jobs],
+                             circs[i], onionskins[i]) < 0) {
+        log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+        continue;
+      }
+      ++batch->n_jobs;
+    }
+
+    if (batch->n_jobs == 0) {
+      tor_free(batch);
+      continue;
+    }
+    if (cpuworker_queue_batch(batch) < 0) {
+      log_info(LD_OR,"assign_to_cpuworker failed. Closing circuits.");
+      cpuworker_batch_abandon(batch, 1);
+    }
   }
 }
 
@@ -585,10 +760,7 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
-  cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
+  cpuworker_batch_t *batch;
 
   tor_assert(threadpool);
 
@@ -607,68 +779,333 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (!channel_is_client(circ->p_chan))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+  batch = tor_malloc_zero(CPUWORKER_BATCH_LEN(1));
+  if (cpuworker_job_init(&batch->jobs[0], circ, onionskin) < 0) {
+    tor_free(batch);
+    return -1;
+  }
+  batch->n_jobs = 1;
 
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
+  if (cpuworker_queue_batch(batch) < 0) {
+    /* Our caller closes the circuit. */
+    cpuworker_batch_abandon(batch, 0);
+    return -1;
+  }
+  return 0;
+}
 
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+/** If <b>circ</b> has a pending handshake that hasn't been processed yet,
+ * remove it from the worker queue.  Any other handshakes that were batched
+ * with it go back on the worker queue. */
+void
+cpuworker_cancel_circ_handshake(or_circuit_t *circ)
+{
+  cpuworker_batch_t *batch;
+  int i;
+  if (circ->workqueue_entry == NULL)
+    return;
 
-  tor_free(onionskin);
+  batch = workqueue_entry_cancel(circ->workqueue_entry);
+  if (batch) {
+    /* It successfully cancelled. */
+    for (i = 0; i < batch->n_jobs; ++i) {
+      if (batch->jobs[i].circ == circ)
+        break;
+    }
+    tor_assert(i < batch->n_jobs);
+    --batch->n_jobs;
+    if (i != batch->n_jobs)
+      memcpy(&batch->jobs[i], &batch->jobs[batch->n_jobs],
+             sizeof(cpuworker_job_t));
+    memwipe(&batch->jobs[batch->n_jobs], 0xe0, sizeof(cpuworker_job_t));
+    tor_assert(total_pending_tasks > 0);
+    --total_pending_tasks;
+    /* if (!batch), this is done in cpuworker_onion_handshake_replyfn. */
+    circ->workqueue_entry = NULL;
 
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
+    if (batch->n_jobs == 0) {
+      tor_free(batch);
+    } else if (cpuworker_queue_batch(batch) < 0) {
+      log_info(LD_OR,"assign_to_cpuworker failed. Closing circuits.");
+      cpuworker_batch_abandon(batch, 1);
+    }
+  }
+}
 
-  /* Copy the current cached consensus params relevant to
-   * circuit negotiation into the CPU worker context */
-  req.circ_ns_params.cc_enabled = congestion_control_enabled();
-  req.circ_ns_params.sendme_inc_cells = congestion_control_sendme_inc();
+/** Largest number of relay cells we're willing to hold for a single circuit
+ * while a cpuworker decrypts the ones before them. */
+#define MAX_PENDING_CRYPT_CELLS_PER_CIRC 1024
 
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
+/** How much memory does one relay cell take up while it waits for, or is on,
+ * a cpuworker? */
+#define CRYPT_CELL_MEM_COST (sizeof(cell_t) + sizeof(cell_t *))
 
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
+/** Number of relay cells that are waiting for, or on, a cpuworker. */
+static size_t n_crypt_cells_allocated = 0;
+
+/** A batch of relay cells, all heading away from the origin on the same
+ * circuit, for a cpuworker to decrypt. */
+typedef struct cpuworker_crypt_job_t {
+  /** The circuit that the cells arrived on, or NULL if that circuit was
+   * freed while this job was on a cpuworker. */
+  or_circuit_t *circ;
+  /** The cipher to apply to the cells. This belongs to circ->crypto, unless
+   * circ is NULL, in which case it belongs to this job. */
+  crypto_cipher_t *cipher;
+  /** The workqueue entry for this job, once it has been queued. */
+  workqueue_entry_t *workqueue_entry;
+  /** The cells to decrypt, in the order they arrived. */
+  cell_t **cells;
+  /** Number of cells in <b>cells</b>. */
+  size_t n_cells;
+  /** Number of slots allocated in <b>cells</b>. */
+  size_t n_allocated;
+  /** Coarse timestamp at which the first cell was added to this job. */
+  uint32_t inserted_timestamp;
+} cpuworker_crypt_job_t;
+
+#define cpuworker_crypt_job_free(job) \
+  FREE_AND_NULL(cpuworker_crypt_job_t, cpuworker_crypt_job_free_, (job))
+
+/** Release all storage held by <b>job</b>, except for its cipher. */
+static void
+cpuworker_crypt_job_free_(cpuworker_crypt_job_t *job)
+{
+  size_t i;
+  if (!job)
+    return;
+  for (i = 0; i < job->n_cells; ++i)
+    tor_free(job->cells[i]);
+  tor_assert(n_crypt_cells_allocated >= job->n_cells);
+  n_crypt_cells_allocated -= job->n_cells;
+  tor_free(job->cells);
+  tor_free(job);
+}
+
+/** Return true iff relay cells heading away from the origin on <b>circ</b>
+ * should be decrypted by a cpuworker rather than on the main thread.
+ *
+ * Once a circuit has cells on a cpuworker, all of its later cells need to
+ * follow them there, so that they stay in order. */
+int
+cpuworker_relay_crypto_wanted(const or_circuit_t *circ)
+{
+  if (circ->crypt_job || circ->crypt_next_job)
+    return 1;
+  return threadpool && get_options()->OffloadRelayCrypto;
+}
+
+/** Implementation function for relay cell crypto requests. */
+static workqueue_reply_t
+cpuworker_relay_crypto_threadfn(void *state_, void *work_)
+{
+  cpuworker_crypt_job_t *job = work_;
+  (void)state_;
+
+  relay_crypt_payloads(job->cipher, job->cells, job->n_cells);
+  return WQ_RPL_REPLY;
+}
+
+static int cpuworker_launch_crypt_job(or_circuit_t *circ);
+
+/** Handle a reply from the worker threads to a relay cell crypto request:
+ * finish receiving the cells, then send the next batch for the same circuit
+ * (if any) to a cpuworker. */
+static void
+cpuworker_relay_crypto_replyfn(void *work_)
+{
+  cpuworker_crypt_job_t *job = work_;
+  or_circuit_t *circ = job->circ;
+  int reason;
+
+  if (!circ) {
+    /* The circuit was freed while the cells were being decrypted, and left
+     * its cipher for us to free. */
+    log_debug(LD_OR, "Circuit died while cells were being decrypted.");
+    crypto_cipher_free(job->cipher);
+    goto done;
+  }
+
+  tor_assert(circ->crypt_job == job);
+  circ->crypt_job = NULL;
+
+  reason = circuit_receive_decrypted_relay_cells(job->cells, job->n_cells,
+                                                 TO_CIRCUIT(circ),
+                                                 CELL_DIRECTION_OUT);
+  if (reason < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Failed to handle relay cells decrypted by a cpuworker. "
+           "Closing.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
+  }
+
+  if (circ->crypt_next_job) {
+    if (TO_CIRCUIT(circ)->marked_for_close) {
+      cpuworker_crypt_job_free(circ->crypt_next_job);
+    } else if ((reason = cpuworker_launch_crypt_job(circ)) < 0) {
+      circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
+    }
+  }
+
+ done:
+  cpuworker_crypt_job_free(job);
+}
+
+/** Send the relay cells waiting in <b>circ</b>'s crypt_next_job to a
+ * cpuworker.  The circuit must not already have a job on a cpuworker.
+ *
+ * Return 0 on success, or -<b>reason</b> on failure.
+ */
+static int
+cpuworker_launch_crypt_job(or_circuit_t *circ)
+{
+  cpuworker_crypt_job_t *job = circ->crypt_next_job;
+
+  tor_assert(job);
+  tor_assert(!circ->crypt_job);
+
+  circ->crypt_next_job = NULL;
+  job->cipher = circ->crypto.f_crypto;
+
+  if (BUG(!threadpool)) {
+    cpuworker_crypt_job_free(job);
+    return -END_CIRC_REASON_INTERNAL;
+  }
+
+  job->workqueue_entry = threadpool_queue_work_priority(threadpool,
                                       WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
+                                      cpuworker_relay_crypto_threadfn,
+                                      cpuworker_relay_crypto_replyfn,
                                       job);
-  if (!queue_entry) {
+  if (!job->workqueue_entry) {
     log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
-    return -1;
+    cpuworker_crypt_job_free(job);
+    return -END_CIRC_REASON_INTERNAL;
   }
 
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
-
-  circ->workqueue_entry = queue_entry;
+  log_debug(LD_OR, "Queued %d relay cells for decryption (circ=%p)",
+            (int)job->n_cells, circ);
 
+  circ->crypt_job = job;
   return 0;
 }
 
-/** If <b>circ</b> has a pending handshake that hasn't been processed yet,
- * remove it from the worker queue. */
+/** Hand a copy of the relay cell <b>cell</b>, which is heading away from
+ * the origin on <b>circ</b>, to a cpuworker for decryption.  If the circuit
+ * already has cells on a cpuworker, hold on to it until they are done, and
+ * then send it along with any other cells that have arrived meanwhile.
+ *
+ * Once the cell is decrypted, it is passed to
+ * circuit_receive_decrypted_relay_cells().
+ *
+ * Return 0 on success, or -<b>reason</b> on failure.
+ */
+int
+cpuworker_queue_relay_cell(or_circuit_t *circ, const cell_t *cell)
+{
+  cpuworker_crypt_job_t *job;
+
+  tor_assert(circ);
+  tor_assert(cell);
+
+  if (!circ->crypt_next_job) {
+    circ->crypt_next_job = tor_malloc_zero(sizeof(cpuworker_crypt_job_t));
+    circ->crypt_next_job->circ = circ;
+    circ->crypt_next_job->inserted_timestamp = monotime_coarse_get_stamp();
+  }
+  job = circ->crypt_next_job;
+
+  if (job->n_cells >= MAX_PENDING_CRYPT_CELLS_PER_CIRC) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Too many relay cells waiting for a cpuworker on one circuit. "
+           "Closing.");
+    return -END_CIRC_REASON_RESOURCELIMIT;
+  }
+
+  if (job->n_cells == job->n_allocated) {
+    job->n_allocated = job->n_allocated ? job->n_allocated * 2 : 16;
+    job->cells = tor_reallocarray(job->cells, job->n_allocated,
+                                  sizeof(cell_t *));
+  }
+  /* The cell is on our caller's stack, so we have to copy it.  The copy
+   * counts towards the cell queue allocation until the job is freed. */
+  job->cells[job->n_cells++] = tor_memdup(cell, sizeof(cell_t));
+  ++n_crypt_cells_allocated;
+
+  if (circ->crypt_job) {
+    /* We'll send this along once the cells before it are back. */
+    return 0;
+  }
+  return cpuworker_launch_crypt_job(circ);
+}
+
+/** Return the number of bytes used by relay cells that are waiting for, or
+ * on, a cpuworker. */
+size_t
+cpuworker_relay_crypto_get_total_allocation(void)
+{
+  return n_crypt_cells_allocated * CRYPT_CELL_MEM_COST;
+}
+
+/** Return how long, in coarse timestamp units before <b>now</b>, the oldest
+ * relay cell on <b>circ</b> has been waiting for a cpuworker, or 0 if there
+ * is none. */
+uint32_t
+cpuworker_circ_relay_crypto_age(const or_circuit_t *circ, uint32_t now)
+{
+  const cpuworker_crypt_job_t *job = circ->crypt_job;
+  if (!job)
+    job = circ->crypt_next_job;
+  return job ? now - job->inserted_timestamp : 0;
+}
+
+/** Discard the relay cells on the marked circuit <b>circ</b> that are
+ * waiting for a cpuworker, including the ones already queued if no cpuworker
+ * has started on them yet.  Return the number of bytes freed. */
+size_t
+cpuworker_circ_free_relay_crypto(or_circuit_t *circ)
+{
+  size_t n_cells = 0;
+
+  if (!TO_CIRCUIT(circ)->marked_for_close) {
+    log_warn(LD_BUG, "Called on non-marked circuit");
+    return 0;
+  }
+
+  if (circ->crypt_next_job) {
+    n_cells += circ->crypt_next_job->n_cells;
+    cpuworker_crypt_job_free(circ->crypt_next_job);
+  }
+  if (circ->crypt_job &&
+      workqueue_entry_cancel(circ->crypt_job->workqueue_entry)) {
+    /* Otherwise a cpuworker has it; the reply handler will free it. */
+    n_cells += circ->crypt_job->n_cells;
+    cpuworker_crypt_job_free(circ->crypt_job);
+  }
+  return n_cells * CRYPT_CELL_MEM_COST;
+}
+
+/** If <b>circ</b> has relay cells waiting for or on a cpuworker, discard
+ * them. Called when <b>circ</b> is about to be freed. */
 void
-cpuworker_cancel_circ_handshake(or_circuit_t *circ)
+cpuworker_cancel_circ_relay_crypto(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
-  if (circ->workqueue_entry == NULL)
+  cpuworker_crypt_job_t *job;
+
+  cpuworker_crypt_job_free(circ->crypt_next_job);
+
+  if (circ->crypt_job == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
+  job = circ->crypt_job;
+  circ->crypt_job = NULL;
+  if (workqueue_entry_cancel(job->workqueue_entry)) {
     /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
-    circ->workqueue_entry = NULL;
+    cpuworker_crypt_job_free(job);
+  } else {
+    /* A cpuworker is using the cipher right now. Hand it over to the job,
+     * so that cpuworker_relay_crypto_replyfn() can free it later. */
+    job->circ = NULL;
+    circ->crypto.f_crypto = NULL;
   }
 }
@@ -37,7 +37,15 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
-unsigned int cpuworker_get_n_threads(void);
+int cpuworker_relay_crypto_wanted(const or_circuit_t *circ);
+int cpuworker_queue_relay_cell(or_circuit_t *circ, const cell_t *cell);
+void cpuworker_cancel_circ_relay_crypto(or_circuit_t *circ);
+size_t cpuworker_relay_crypto_get_total_allocation(void);
+uint32_t cpuworker_circ_relay_crypto_age(const or_circuit_t *circ,
+                                         uint32_t now);
+size_t cpuworker_circ_free_relay_crypto(or_circuit_t *circ);
+
+MOCK_DECL(unsigned int, cpuworker_get_n_threads, (void));
 
 #endif /* !defined(TOR_CPUWORKER_H) */
 
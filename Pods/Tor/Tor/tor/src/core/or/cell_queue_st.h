@@ -21,6 +21,8 @@ struct packed_cell_t {
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_timestamp; /**< Time (in timestamp units) when this cell
                                 * was inserted */
+  /** The slab of the cell pool that holds this cell. */
+  struct cell_slab_t *slab;
 };
 
 /** A queue of cells on a circuit, waiting to be added to the
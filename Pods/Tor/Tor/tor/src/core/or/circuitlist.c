@@ -61,6 +61,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/circuituse.h"
 #include "core/or/circuitstats.h"
+#include "core/or/command.h"
 #include "core/or/circuitpadding.h"
 #include "core/or/conflux.h"
 #include "core/or/conflux_pool.h"
@@ -69,6 +70,7 @@
 #include "core/or/status.h"
 #include "core/or/trace_probes_circuit.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "app/config/config.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
@@ -1163,6 +1165,7 @@ circuit_free_(circuit_t *circ)
   n_circ_id = circ->n_circ_id;
 
   circuit_clear_testing_cell_stats(circ);
+  command_drop_relay_cells(circ);
 
   /* Cleanup circuit from anything HS v3 related. We also do this when the
    * circuit is closed. This is to avoid any code path that free registered
@@ -1229,6 +1232,7 @@ circuit_free_(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
+    cpuworker_cancel_circ_relay_crypto(ocirc);
     relay_crypto_clear(&ocirc->crypto);
 
     if (ocirc->rend_splice) {
@@ -2537,11 +2541,16 @@ circuit_max_queued_cell_age(const circuit_t *c, uint32_t now)
 
   if (! CIRCUIT_IS_ORIGIN(c)) {
     const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(c);
+    uint32_t age2;
     if (NULL != (cell = TOR_SIMPLEQ_FIRST(&orcirc->p_chan_cells.head))) {
-      uint32_t age2 = now - cell->inserted_timestamp;
+      age2 = now - cell->inserted_timestamp;
       if (age2 > age)
-        return age2;
+        age = age2;
     }
+    /* Cells waiting for a cpuworker haven't reached a queue yet. */
+    age2 = cpuworker_circ_relay_crypto_age(orcirc, now);
+    if (age2 > age)
+      age = age2;
   }
   return age;
 }
@@ -2767,6 +2776,8 @@ circuits_handle_oom(size_t current_allocation)
     }
     marked_circuit_free_cells(circ);
     freed = marked_circuit_free_stream_bytes(circ);
+    if (! CIRCUIT_IS_ORIGIN(circ))
+      freed += cpuworker_circ_free_relay_crypto(TO_OR_CIRCUIT(circ));
 
     ++n_circuits_killed;
 
@@ -65,11 +65,11 @@ static int ewma_tick_len = EWMA_TICK_LEN_DEFAULT;
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static int compare_cell_ewma_counts(const void *p1, const void *p2);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
+static void ewma_pqueue_sift_down(ewma_pqueue_t *pq, int idx, double count,
+                                  cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
                                   unsigned cur_tick);
@@ -118,6 +118,8 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
  * has value ewma_scale_factor ** N.)
  */
 static double ewma_scale_factor = 0.1;
+/** The natural logarithm of ewma_scale_factor. */
+static double ewma_log_scale_factor = -2.30258509299404568;
 
 /*** EWMA circuitmux_policy_t method table ***/
 
@@ -168,7 +170,6 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
   pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
 
   return TO_CMUX_POL_DATA(pol);
@@ -189,7 +190,8 @@ ewma_free_cmux_data(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->active_circuit_pqueue.counts);
+  tor_free(pol->active_circuit_pqueue.ents);
   memwipe(pol, 0xda, sizeof(ewma_policy_data_t));
   tor_free(pol);
 }
@@ -326,9 +328,10 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 {
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
+  ewma_pqueue_t *pq;
   unsigned int tick;
   double fractional_tick, ewma_increment;
-  cell_ewma_t *cell_ewma, *tmp;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -346,21 +349,22 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
     scale_active_circuits(pol, tick);
   }
 
-  /* How much do we adjust the cell count in cell_ewma by? */
+  /* How much do we adjust the cell count in cell_ewma by?  This is
+   * ewma_scale_factor ** -fractional_tick. */
   ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
-
-  /* Do the adjustment */
-  cell_ewma = &(cdata->cell_ewma);
-  cell_ewma->cell_count += ewma_increment;
+    ((double)(n_cells)) * exp(-fractional_tick * ewma_log_scale_factor);
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * the queue.  Adjust its count there, and sift it down into place.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  cell_ewma = &(cdata->cell_ewma);
+  pq = &pol->active_circuit_pqueue;
+  tor_assert(cell_ewma->heap_index == 0);
+  cell_ewma->cell_count = pq->counts[0] + ewma_increment;
+  cell_ewma->last_adjusted_tick =
+    pol->active_circuit_pqueue_last_recalibrated;
+  ewma_pqueue_sift_down(pq, 0, cell_ewma->cell_count, cell_ewma);
 }
 
 /**
@@ -382,9 +386,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
+  if (pol->active_circuit_pqueue.n > 0) {
     /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+    cell_ewma = pol->active_circuit_pqueue.ents[0];
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -401,7 +405,6 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
 {
   ewma_policy_data_t *p1 = NULL, *p2 = NULL;
-  cell_ewma_t *ce1 = NULL, *ce2 = NULL;
 
   tor_assert(cmux_1);
   tor_assert(pol_data_1);
@@ -412,24 +415,21 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   p2 = TO_EWMA_POL_DATA(pol_data_2);
 
   if (p1 != p2) {
-    /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
-    }
-
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
-    }
+    /* Look at the head of each queue */
+    const int have1 = p1->active_circuit_pqueue.n > 0;
+    const int have2 = p2->active_circuit_pqueue.n > 0;
 
     /* Got both of them? */
-    if (ce1 != NULL && ce2 != NULL) {
+    if (have1 && have2) {
       /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      const double c1 = p1->active_circuit_pqueue.counts[0];
+      const double c2 = p2->active_circuit_pqueue.counts[0];
+      return (c1 < c2) ? -1 : (c1 > c2) ? 1 : 0;
     } else {
-      if (ce1 != NULL) {
+      if (have1) {
         /* We only have a circuit on cmux_1, so prefer it */
         return -1;
-      } else if (ce2 != NULL) {
+      } else if (have2) {
         /* We only have a circuit on cmux_2, so prefer it */
         return 1;
       } else {
@@ -443,20 +443,6 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   }
 }
 
-/** Helper for sorting cell_ewma_t values in their priority queue. */
-static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
-{
-  const cell_ewma_t *e1 = p1, *e2 = p2;
-
-  if (e1->cell_count < e2->cell_count)
-    return -1;
-  else if (e1->cell_count > e2->cell_count)
-    return 1;
-  else
-    return 0;
-}
-
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -617,7 +603,8 @@ cmux_ewma_set_options(const or_options_t *options,
   /* convert halflife into halflife-per-tick. */
   halflife /= ewma_tick_len;
   /* compute per-tick scale factor. */
-  ewma_scale_factor = exp(LOG_ONEHALF / halflife);
+  ewma_log_scale_factor = LOG_ONEHALF / halflife;
+  ewma_scale_factor = exp(ewma_log_scale_factor);
   log_info(LD_OR,
            "Enabled cell_ewma algorithm because of value in %s; "
            "scale factor is %f per %d seconds",
@@ -651,34 +638,95 @@ static void
 scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 {
   double factor;
+  double *counts;
+  int i, n;
 
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
 
   factor =
     get_scale_factor(
       pol->active_circuit_pqueue_last_recalibrated,
       cur_tick);
-  /** Ordinarily it isn't okay to change the value of an element in a heap,
-   * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
-               pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
+  /* Ordinarily it isn't okay to change the value of an element in a heap,
+   * but it's okay here, since we are preserving the order.  The counts are
+   * contiguous, so this loop is easy for the compiler to vectorize; the
+   * cell_ewma_t themselves are brought up to date when they leave the
+   * queue or send cells. */
+  counts = pol->active_circuit_pqueue.counts;
+  n = pol->active_circuit_pqueue.n;
+  for (i = 0; i < n; ++i)
+    counts[i] *= factor;
   pol->active_circuit_pqueue_last_recalibrated = cur_tick;
 }
 
+/* ==== Functions for the active circuit priority queue ==== */
+
+/** How many children does each node of an ewma_pqueue_t have? */
+#define EWMA_PQUEUE_ARITY 4
+/** Return the index of the parent of the node at <b>idx</b>. */
+#define EWMA_PQUEUE_PARENT(idx) (((idx) - 1) / EWMA_PQUEUE_ARITY)
+/** Return the index of the first child of the node at <b>idx</b>. */
+#define EWMA_PQUEUE_FIRST_CHILD(idx) ((idx) * EWMA_PQUEUE_ARITY + 1)
+
+/** Store <b>ewma</b> with <b>count</b> at position <b>idx</b> of <b>pq</b>.
+ */
+static inline void
+ewma_pqueue_set(ewma_pqueue_t *pq, int idx, double count, cell_ewma_t *ewma)
+{
+  pq->counts[idx] = count;
+  pq->ents[idx] = ewma;
+  ewma->heap_index = idx;
+}
+
+/** Place <b>ewma</b> with <b>count</b> at the free position <b>idx</b> of
+ * <b>pq</b>, or at one of its ancestors, moving larger ancestors down. */
+static void
+ewma_pqueue_sift_up(ewma_pqueue_t *pq, int idx, double count,
+                    cell_ewma_t *ewma)
+{
+  while (idx > 0) {
+    int parent = EWMA_PQUEUE_PARENT(idx);
+    if (pq->counts[parent] <= count)
+      break;
+    ewma_pqueue_set(pq, idx, pq->counts[parent], pq->ents[parent]);
+    idx = parent;
+  }
+  ewma_pqueue_set(pq, idx, count, ewma);
+}
+
+/** Place <b>ewma</b> with <b>count</b> at the free position <b>idx</b> of
+ * <b>pq</b>, or at one of its descendants, moving smaller children up. */
+static void
+ewma_pqueue_sift_down(ewma_pqueue_t *pq, int idx, double count,
+                      cell_ewma_t *ewma)
+{
+  for (;;) {
+    int child = EWMA_PQUEUE_FIRST_CHILD(idx);
+    int end, best, i;
+    if (child >= pq->n)
+      break;
+    end = MIN(child + EWMA_PQUEUE_ARITY, pq->n);
+    best = child;
+    for (i = child + 1; i < end; ++i) {
+      if (pq->counts[i] < pq->counts[best])
+        best = i;
+    }
+    if (pq->counts[best] >= count)
+      break;
+    ewma_pqueue_set(pq, idx, pq->counts[best], pq->ents[best]);
+    idx = best;
+  }
+  ewma_pqueue_set(pq, idx, count, ewma);
+}
+
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
  * <b>pol</b>'s priority queue of active circuits */
 static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_pqueue_t *pq;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
@@ -686,38 +734,46 @@ add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
       ewma,
       pol->active_circuit_pqueue_last_recalibrated);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       offsetof(cell_ewma_t, heap_index),
-                       ewma);
+  pq = &pol->active_circuit_pqueue;
+  if (pq->n == pq->capacity) {
+    pq->capacity = pq->capacity ? pq->capacity * 2 : 16;
+    pq->counts = tor_reallocarray(pq->counts, pq->capacity, sizeof(double));
+    pq->ents = tor_reallocarray(pq->ents, pq->capacity,
+                                sizeof(cell_ewma_t *));
+  }
+  ewma_pqueue_sift_up(pq, pq->n++, ewma->cell_count, ewma);
 }
 
-/** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
+/** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits,
+ * bringing its cell count up to date. */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_pqueue_t *pq;
+  int idx;
+
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          offsetof(cell_ewma_t, heap_index),
-                          ewma);
-}
-
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
-{
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
-
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              offsetof(cell_ewma_t, heap_index));
+  pq = &pol->active_circuit_pqueue;
+  idx = ewma->heap_index;
+  tor_assert(idx < pq->n);
+  tor_assert(pq->ents[idx] == ewma);
+
+  ewma->cell_count = pq->counts[idx];
+  ewma->last_adjusted_tick = pol->active_circuit_pqueue_last_recalibrated;
+  ewma->heap_index = -1;
+
+  /* Move the last entry into the hole, and restore the heap order. */
+  if (--pq->n != idx) {
+    double count = pq->counts[pq->n];
+    cell_ewma_t *last = pq->ents[pq->n];
+    if (idx > 0 && pq->counts[EWMA_PQUEUE_PARENT(idx)] > count)
+      ewma_pqueue_sift_up(pq, idx, count, last);
+    else
+      ewma_pqueue_sift_down(pq, idx, count, last);
+  }
 }
 
 /**
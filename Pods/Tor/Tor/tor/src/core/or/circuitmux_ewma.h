@@ -43,7 +43,10 @@ struct cell_ewma_t {
    * since the start of this tick have weight greater than 1.0; ones sent
    * earlier have less weight. */
   unsigned int last_adjusted_tick;
-  /** The EWMA of the cell count. */
+  /** The EWMA of the cell count.  While the circuit is in an active
+   * circuit queue, its current count lives in the queue's <b>counts</b>
+   * array; this copy is only refreshed when the circuit sends cells or
+   * leaves the queue. */
   double cell_count;
   /** True iff this is the cell count for a circuit's previous
    * channel. */
@@ -53,6 +56,24 @@ struct cell_ewma_t {
   int heap_index;
 };
 
+/**
+ * A priority queue of cell_ewma_t, lowest cell count first.  It is a 4-ary
+ * min-heap stored as a structure of arrays: the cell counts that order the
+ * heap are kept apart from the cell_ewma_t they belong to, so that sifting
+ * compares neighbouring doubles and rescaling is a single pass over one
+ * dense array.
+ */
+typedef struct ewma_pqueue_t {
+  /** The cell count of each entry, in heap order. */
+  double *counts;
+  /** The cell_ewma_t of each entry, in heap order. */
+  cell_ewma_t **ents;
+  /** How many entries are in the queue? */
+  int n;
+  /** How many entries do <b>counts</b> and <b>ents</b> have room for? */
+  int capacity;
+} ewma_pqueue_t;
+
 struct ewma_policy_data_t {
   circuitmux_policy_data_t base_;
 
@@ -62,7 +83,7 @@ struct ewma_policy_data_t {
    * in heap order according to EWMA.  This was formerly in channel_t, and
    * in or_connection_t before that.
    */
-  smartlist_t *active_circuit_pqueue;
+  ewma_pqueue_t active_circuit_pqueue;
 
   /**
    * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
@@ -83,6 +83,24 @@ static void command_process_created_cell(cell_t *cell, channel_t *chan);
 static void command_process_relay_cell(cell_t *cell, channel_t *chan);
 static void command_process_destroy_cell(cell_t *cell, channel_t *chan);
 
+/** Largest number of relay cells that we hold for one circuit before we
+ * hand them to circuit_receive_relay_cells(). */
+#define RELAY_CELL_BATCH_MAX 16
+
+/** Relay cells that arrived back-to-back for one non-origin circuit, in one
+ * direction, and that have passed command_process_relay_cell()'s checks.  We
+ * hold them here so that our layer of crypto can be applied to all of them
+ * at once; they are handled, in order, by command_flush_relay_cells(). */
+static struct {
+  /** The circuit the cells are for, or NULL if there are none. */
+  circuit_t *circ;
+  /** The direction the cells are going on <b>circ</b>. */
+  cell_direction_t direction;
+  /** How many cells are in <b>cells</b>? */
+  size_t n;
+  cell_t cells[RELAY_CELL_BATCH_MAX];
+} pending_relay_cells;
+
 /** Convert the cell <b>command</b> into a lower-case, human-readable
  * string. */
 const char *
@@ -140,6 +158,68 @@ command_time_process_cell(cell_t *cell, channel_t *chan, int *time,
 }
 #endif /* defined(KEEP_TIMING_STATS) */
 
+/** Handle every relay cell that command_process_relay_cell() has been
+ * holding back.  Call this whenever there may be no more cells coming right
+ * away for the same circuit, and before doing anything else that cares about
+ * the order in which cells are handled. */
+void
+command_flush_relay_cells(void)
+{
+  cell_t *cells[RELAY_CELL_BATCH_MAX];
+  circuit_t *circ = pending_relay_cells.circ;
+  const size_t n_cells = pending_relay_cells.n;
+  size_t i;
+  int reason;
+
+  if (!n_cells)
+    return;
+
+  pending_relay_cells.circ = NULL;
+  pending_relay_cells.n = 0;
+  for (i = 0; i < n_cells; ++i)
+    cells[i] = &pending_relay_cells.cells[i];
+
+  if ((reason = circuit_receive_relay_cells(cells, n_cells, circ,
+                                  pending_relay_cells.direction)) < 0) {
+    log_fn(LOG_DEBUG,LD_PROTOCOL,"circuit_receive_relay_cells "
+           "(%s) failed. Closing.",
+           pending_relay_cells.direction==CELL_DIRECTION_OUT?
+           "forward":"backward");
+    circuit_mark_for_close(circ, -reason);
+  }
+}
+
+/** Forget any relay cells that we are holding for <b>circ</b>, which is
+ * about to be freed. */
+void
+command_drop_relay_cells(const circuit_t *circ)
+{
+  if (pending_relay_cells.circ == circ) {
+    pending_relay_cells.circ = NULL;
+    pending_relay_cells.n = 0;
+  }
+}
+
+/** Hold the relay <b>cell</b> for <b>circ</b>, going in <b>direction</b>,
+ * until command_flush_relay_cells(), so that it can be decrypted along with
+ * the cells that arrive after it. */
+static void
+command_hold_relay_cell(cell_t *cell, circuit_t *circ,
+                        cell_direction_t direction)
+{
+  if (pending_relay_cells.n && (pending_relay_cells.circ != circ ||
+                                pending_relay_cells.direction != direction))
+    command_flush_relay_cells();
+
+  pending_relay_cells.circ = circ;
+  pending_relay_cells.direction = direction;
+  memcpy(&pending_relay_cells.cells[pending_relay_cells.n++], cell,
+         sizeof(cell_t));
+
+  if (pending_relay_cells.n == RELAY_CELL_BATCH_MAX)
+    command_flush_relay_cells();
+}
+
 /** Process a <b>cell</b> that was just received on <b>chan</b>. Keep internal
  * statistics about how many of each cell we've processed so far
  * this second, and the total number of microseconds it took to
@@ -187,6 +267,11 @@ command_process_cell(channel_t *chan, cell_t *cell)
 #define PROCESS_CELL(tp, cl, cn) command_process_ ## tp ## _cell(cl, cn)
 #endif /* defined(KEEP_TIMING_STATS) */
 
+  /* Relay cells decide for themselves whether to join the cells we are
+   * holding; everything else must see them handled first. */
+  if (cell->command != CELL_RELAY && cell->command != CELL_RELAY_EARLY)
+    command_flush_relay_cells();
+
   switch (cell->command) {
     case CELL_CREATE:
     case CELL_CREATE_FAST:
@@ -482,6 +567,13 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
 
   circ = circuit_get_by_circid_channel(cell->circ_id, chan);
 
+  /* Anything we do below for a different circuit, or to close this one,
+   * must come after the cells we are holding. */
+  if (!circ || circ != pending_relay_cells.circ ||
+      circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING ||
+      cell->command == CELL_RELAY_EARLY)
+    command_flush_relay_cells();
+
   if (!circ) {
     log_debug(LD_OR,
               "unknown circuit %u on connection from %s. Dropping.",
@@ -566,7 +658,11 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
     }
   }
 
-  if ((reason = circuit_receive_relay_cell(cell, circ, direction)) < 0) {
+  if (!CIRCUIT_IS_ORIGIN(circ)) {
+    /* Our layer of crypto is cheaper per cell on several cells at once. */
+    command_hold_relay_cell(cell, circ, direction);
+  } else if ((reason = circuit_receive_relay_cell(cell, circ,
+                                                  direction)) < 0) {
     log_fn(LOG_DEBUG,LD_PROTOCOL,"circuit_receive_relay_cell "
            "(%s) failed. Closing.",
            direction==CELL_DIRECTION_OUT?"forward":"backward");
@@ -15,6 +15,8 @@
 #include "core/or/channel.h"
 
 void command_process_cell(channel_t *chan, cell_t *cell);
+void command_flush_relay_cells(void);
+void command_drop_relay_cells(const circuit_t *circ);
 void command_setup_channel(channel_t *chan);
 void command_setup_listener(channel_listener_t *chan_l);
 
@@ -2383,6 +2383,10 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
    * those functions may run directly on the cell pointers we pass here, or
    * it may decide to queue them, in which case it will allocate its own
    * buffer and copy the cell.
+   *
+   * The command layer may hold back relay cells so that it can decrypt
+   * several at once: we tell it to finish them whenever we run out of
+   * cells, or get a var cell that must not overtake them.
    */
 
   while (1) {
@@ -2392,6 +2396,7 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               conn->base_.s,(int)connection_get_inbuf_len(TO_CONN(conn)),
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
+      command_flush_relay_cells();
       if (!var_cell)
         return 0; /* not yet. */
 
@@ -2408,8 +2413,10 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       char buf[CELL_MAX_NETWORK_SIZE];
       cell_t cell;
       if (connection_get_inbuf_len(TO_CONN(conn))
-          < cell_network_size) /* whole response available? */
+          < cell_network_size) { /* whole response available? */
+        command_flush_relay_cells();
         return 0; /* not yet */
+      }
 
       /* Touch the channel's active timestamp if there is one */
       if (conn->chan)
@@ -28,6 +28,13 @@ struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_t *workqueue_entry;
+  /** Batch of relay cells heading away from the origin that a cpuworker is
+   * decrypting for us right now, if any. Used only in cpuworker.c. */
+  struct cpuworker_crypt_job_t *crypt_job;
+  /** Relay cells heading away from the origin that arrived while
+   * <b>crypt_job</b> was pending, and which will go to a cpuworker once it
+   * is done. Used only in cpuworker.c. */
+  struct cpuworker_crypt_job_t *crypt_next_job;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -23,6 +23,7 @@ static int
 subsys_or_initialize(void)
 {
   or_register_periodic_events();
+  protover_summary_cache_init();
   return 0;
 }
 
@@ -214,11 +214,15 @@ parse_single_entry(const char *s, const char *end_of_entry)
 
   /* The name must not be longer than MAX_PROTOCOL_NAME_LENGTH. */
   if (equals - s > (int)MAX_PROTOCOL_NAME_LENGTH) {
+    /* Not escaped(): this is reachable from consensus parsing, which may
+     * happen off the main thread. */
+    char *esc = esc_for_log_len(s, equals - s);
     log_warn(LD_NET, "When parsing a protocol entry, I got a very large "
              "protocol name. This is possibly an attack or a bug, unless "
              "the Tor network truly supports protocol names larger than "
              "%ud characters. The offending string was: %s",
-             MAX_PROTOCOL_NAME_LENGTH, escaped(out->name));
+             MAX_PROTOCOL_NAME_LENGTH, esc);
+    tor_free(esc);
     goto error;
   }
 
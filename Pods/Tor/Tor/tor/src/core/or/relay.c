@@ -60,6 +60,7 @@
 #include "lib/compress/compress.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
 #include "feature/control/control_events.h"
@@ -217,41 +218,21 @@ circuit_update_channel_usage(circuit_t *circ, cell_t *cell)
   }
 }
 
-/** Receive a relay cell:
- *  - Crypt it (encrypt if headed toward the origin or if we <b>are</b> the
- *    origin; decrypt if we're headed toward the exit).
- *  - Check if recognized (if exitward).
- *  - If recognized and the digest checks out, then find if there's a stream
- *    that the cell is intended for, and deliver it to the right
- *    connection_edge.
- *  - If not recognized, then we need to relay it: append it to the appropriate
- *    cell_queue on <b>circ</b>.
+/** Handle a relay cell that has already been crypted on arrival at
+ * <b>circ</b>: if <b>recognized</b> is set, deliver it to the right
+ * connection_edge (with <b>layer_hint</b> as the hop that recognized it);
+ * otherwise, append it to the appropriate cell_queue on <b>circ</b>.
  *
  * Return -<b>reason</b> on failure.
  */
-int
-circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
-                           cell_direction_t cell_direction)
+static int
+circuit_handle_crypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                  cell_direction_t cell_direction,
+                                  crypt_path_t *layer_hint, char recognized)
 {
   channel_t *chan = NULL;
-  crypt_path_t *layer_hint=NULL;
-  char recognized=0;
   int reason;
 
-  tor_assert(cell);
-  tor_assert(circ);
-  tor_assert(cell_direction == CELL_DIRECTION_OUT ||
-             cell_direction == CELL_DIRECTION_IN);
-  if (circ->marked_for_close)
-    return 0;
-
-  if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
-      < 0) {
-    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
-           "relay crypt failed. Dropping connection.");
-    return -END_CIRC_REASON_INTERNAL;
-  }
-
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -371,6 +352,131 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   return 0;
 }
 
+/** Receive a relay cell:
+ *  - Crypt it (encrypt if headed toward the origin or if we <b>are</b> the
+ *    origin; decrypt if we're headed toward the exit).
+ *  - Check if recognized (if exitward).
+ *  - If recognized and the digest checks out, then find if there's a stream
+ *    that the cell is intended for, and deliver it to the right
+ *    connection_edge.
+ *  - If not recognized, then we need to relay it: append it to the appropriate
+ *    cell_queue on <b>circ</b>.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
+                           cell_direction_t cell_direction)
+{
+  crypt_path_t *layer_hint=NULL;
+  char recognized=0;
+
+  tor_assert(cell);
+  tor_assert(circ);
+  tor_assert(cell_direction == CELL_DIRECTION_OUT ||
+             cell_direction == CELL_DIRECTION_IN);
+  if (circ->marked_for_close)
+    return 0;
+
+  if (cell_direction == CELL_DIRECTION_OUT && ! CIRCUIT_IS_ORIGIN(circ) &&
+      cpuworker_relay_crypto_wanted(TO_OR_CIRCUIT(circ))) {
+    /* A cpuworker will decrypt this cell; we handle it once it's back. */
+    return cpuworker_queue_relay_cell(TO_OR_CIRCUIT(circ), cell);
+  }
+
+  if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
+      < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "relay crypt failed. Dropping connection.");
+    return -END_CIRC_REASON_INTERNAL;
+  }
+
+  return circuit_handle_crypted_relay_cell(cell, circ, cell_direction,
+                                           layer_hint, recognized);
+}
+
+/** Receive <b>n_cells</b> relay cells, all arriving in order on <b>circ</b>
+ * in direction <b>cell_direction</b>, as if by calling
+ * circuit_receive_relay_cell() on each of them in turn.
+ *
+ * When we are in the middle of the circuit, our layer of crypto is applied
+ * to all of the cells in one batch before any of them are handled.  Cells
+ * are still recognized and handled one at a time, and we stop early if the
+ * circuit gets marked for close along the way.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_relay_cells(cell_t **cells, size_t n_cells, circuit_t *circ,
+                            cell_direction_t cell_direction)
+{
+  size_t i;
+  int reason;
+
+  tor_assert(cells);
+  tor_assert(circ);
+  tor_assert(cell_direction == CELL_DIRECTION_OUT ||
+             cell_direction == CELL_DIRECTION_IN);
+
+  if (n_cells == 1 || CIRCUIT_IS_ORIGIN(circ) ||
+      (cell_direction == CELL_DIRECTION_OUT &&
+       cpuworker_relay_crypto_wanted(TO_OR_CIRCUIT(circ)))) {
+    /* Origin circuits need layered decrypts: do them one at a time.  Cells
+     * going to a cpuworker get batched up over there instead. */
+    for (i = 0; i < n_cells; ++i) {
+      if ((reason = circuit_receive_relay_cell(cells[i], circ,
+                                               cell_direction)) < 0)
+        return reason;
+    }
+    return 0;
+  }
+
+  if (circ->marked_for_close)
+    return 0;
+
+  if (relay_decrypt_cells(circ, cells, n_cells, cell_direction) < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "relay crypt failed. Dropping connection.");
+    return -END_CIRC_REASON_INTERNAL;
+  }
+
+  return circuit_receive_decrypted_relay_cells(cells, n_cells, circ,
+                                               cell_direction);
+}
+
+/** Finish receiving <b>n_cells</b> relay cells that arrived in order on the
+ * non-origin circuit <b>circ</b> in direction <b>cell_direction</b>, and
+ * which have already had our layer of crypto applied by
+ * relay_decrypt_cells(): check whether each one is recognized, then deliver
+ * or relay it.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+int
+circuit_receive_decrypted_relay_cells(cell_t **cells, size_t n_cells,
+                                      circuit_t *circ,
+                                      cell_direction_t cell_direction)
+{
+  size_t i;
+  int reason;
+
+  tor_assert(cells);
+  tor_assert(circ);
+
+  for (i = 0; i < n_cells; ++i) {
+    char recognized;
+    /* A cell we already handled may have closed the circuit. */
+    if (circ->marked_for_close)
+      return 0;
+    recognized = relay_cell_is_recognized(circ, cells[i], cell_direction);
+    if ((reason = circuit_handle_crypted_relay_cell(cells[i], circ,
+                                                    cell_direction, NULL,
+                                                    recognized)) < 0)
+      return reason;
+  }
+  return 0;
+}
+
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
  *  - Append it to the appropriate cell_queue on <b>circ</b>.
@@ -2702,20 +2808,154 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** How many packed cells do we allocate at a time? */
+#define CELLS_PER_SLAB 64
+/** How many completely unused slabs do we keep around for reuse? Beyond
+ * this, slabs are freed as soon as their last cell is freed. */
+#define MAX_IDLE_CELL_SLABS 8
+
+/** A contiguous block of packed cells.  We allocate packed_cell_t objects
+ * from slabs so that queueing a cell doesn't need a trip to the allocator,
+ * and so that the cells of busy circuits stay close together in memory. */
+typedef struct cell_slab_t {
+  /** Links for whichever of the pool's slab lists this slab is on. */
+  TOR_LIST_ENTRY(cell_slab_t) node;
+  /** Unallocated cells in this slab, linked through their next field. */
+  packed_cell_t *free_cells;
+  /** How many cells in this slab are allocated? */
+  int n_allocated;
+  /** Storage for the cells themselves. */
+  packed_cell_t cells[CELLS_PER_SLAB];
+} cell_slab_t;
+
+TOR_LIST_HEAD(cell_slab_list_t, cell_slab_t);
+/** Slabs that have some allocated cells and some free ones. */
+static struct cell_slab_list_t partial_slabs =
+  TOR_LIST_HEAD_INITIALIZER(partial_slabs);
+/** Slabs whose cells are all allocated. */
+static struct cell_slab_list_t full_slabs =
+  TOR_LIST_HEAD_INITIALIZER(full_slabs);
+/** Slabs with no allocated cells, kept around for reuse. */
+static struct cell_slab_list_t idle_slabs =
+  TOR_LIST_HEAD_INITIALIZER(idle_slabs);
+/** How many slabs are on each list? */
+static int n_partial_slabs = 0, n_full_slabs = 0, n_idle_slabs = 0;
+
+/** Allocate and return a new slab of unallocated cells. */
+static cell_slab_t *
+cell_slab_new(void)
+{
+  cell_slab_t *slab = tor_malloc(sizeof(cell_slab_t));
+  int i;
+  slab->free_cells = NULL;
+  slab->n_allocated = 0;
+  for (i = CELLS_PER_SLAB - 1; i >= 0; --i) {
+    slab->cells[i].next.sqe_next = slab->free_cells;
+    slab->free_cells = &slab->cells[i];
+  }
+  return slab;
+}
+
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
+  cell_slab_t *slab = cell->slab;
   --total_cells_allocated;
-  tor_free(cell);
+  tor_assert(slab);
+  tor_assert(slab->n_allocated > 0);
+
+  cell->next.sqe_next = slab->free_cells;
+  slab->free_cells = cell;
+
+  if (slab->n_allocated-- == CELLS_PER_SLAB) {
+    TOR_LIST_REMOVE(slab, node);
+    --n_full_slabs;
+    if (slab->n_allocated > 0) {
+      TOR_LIST_INSERT_HEAD(&partial_slabs, slab, node);
+      ++n_partial_slabs;
+      return;
+    }
+  } else if (slab->n_allocated > 0) {
+    return;
+  } else {
+    TOR_LIST_REMOVE(slab, node);
+    --n_partial_slabs;
+  }
+
+  /* The slab is now empty. */
+  if (n_idle_slabs < MAX_IDLE_CELL_SLABS) {
+    TOR_LIST_INSERT_HEAD(&idle_slabs, slab, node);
+    ++n_idle_slabs;
+  } else {
+    tor_free(slab);
+  }
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
+  cell_slab_t *slab;
+  packed_cell_t *cell;
+
+  if ((slab = TOR_LIST_FIRST(&partial_slabs))) {
+    /* Use the most recently touched slab that has room. */
+  } else {
+    if ((slab = TOR_LIST_FIRST(&idle_slabs))) {
+      TOR_LIST_REMOVE(slab, node);
+      --n_idle_slabs;
+    } else {
+      slab = cell_slab_new();
+    }
+    TOR_LIST_INSERT_HEAD(&partial_slabs, slab, node);
+    ++n_partial_slabs;
+  }
+
+  cell = slab->free_cells;
+  tor_assert(cell);
+  slab->free_cells = cell->next.sqe_next;
+  if (++slab->n_allocated == CELLS_PER_SLAB) {
+    TOR_LIST_REMOVE(slab, node);
+    --n_partial_slabs;
+    TOR_LIST_INSERT_HEAD(&full_slabs, slab, node);
+    ++n_full_slabs;
+  }
+
   ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  memset(cell, 0, sizeof(packed_cell_t));
+  cell->slab = slab;
+  return cell;
+}
+
+/** Return the number of bytes that the cell pool holds but no allocated cell
+ * uses: every unused slab that we're keeping around for reuse, plus the free
+ * cells and bookkeeping of every slab that still has allocated cells in it.
+ * (A single live cell keeps its whole slab alive.)  Together with the cells
+ * counted by cell_queues_get_total_allocation(), this covers every byte of
+ * every slab. */
+size_t
+cell_pool_get_idle_allocation(void)
+{
+  const size_t n_slabs =
+    (size_t)n_full_slabs + n_partial_slabs + n_idle_slabs;
+  return n_slabs * sizeof(cell_slab_t) -
+    total_cells_allocated * sizeof(packed_cell_t);
+}
+
+/** Free every unused cell slab, and return the number of bytes released.
+ * Slabs that still hold allocated cells stay where they are. */
+size_t
+cell_pool_release_idle(void)
+{
+  size_t freed = n_idle_slabs * sizeof(cell_slab_t);
+  cell_slab_t *slab, *next;
+  TOR_LIST_FOREACH_SAFE(slab, &idle_slabs, node, next) {
+    TOR_LIST_REMOVE(slab, node);
+    tor_free(slab);
+  }
+  n_idle_slabs = 0;
+  return freed;
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2744,6 +2984,11 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  tor_log(severity, LD_MM,
+          "Cell pool: %d full, %d partly used, and %d idle slabs of %d cells "
+          "(%"TOR_PRIuSZ" bytes each).",
+          n_full_slabs, n_partial_slabs, n_idle_slabs, CELLS_PER_SLAB,
+          sizeof(cell_slab_t));
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2890,11 +3135,14 @@ packed_cell_mem_cost(void)
   return sizeof(packed_cell_t);
 }
 
-/* DOCDOC */
+/** Return the number of bytes used by allocated packed cells, and by relay
+ * cells waiting for a cpuworker.  The rest of the cell pool's slabs is
+ * counted by cell_pool_get_idle_allocation(). */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return total_cells_allocated * packed_cell_mem_cost() +
+    cpuworker_relay_crypto_get_total_allocation();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2908,6 +3156,7 @@ uint64_t oom_stats_n_bytes_removed_dns = 0;
 uint64_t oom_stats_n_bytes_removed_cell = 0;
 uint64_t oom_stats_n_bytes_removed_geoip = 0;
 uint64_t oom_stats_n_bytes_removed_hsdir = 0;
+uint64_t oom_stats_n_bytes_removed_buf = 0;
 
 /** Check whether we've got too much space used for cells.  If so,
  * call the OOM handler and return 1.  Otherwise, return 0. */
@@ -2919,6 +3168,8 @@ cell_queues_check_size(void)
   size_t alloc = cell_queues_get_total_allocation();
   alloc += half_streams_get_total_allocation();
   alloc += buf_get_total_allocation();
+  alloc += buf_get_freelist_allocation();
+  alloc += cell_pool_get_idle_allocation();
   alloc += tor_compress_get_total_allocation();
   const size_t hs_cache_total = hs_cache_get_total_allocation();
   alloc += hs_cache_total;
@@ -2935,6 +3186,18 @@ cell_queues_check_size(void)
       /* Note this overload down */
       rep_hist_note_overload(OVERLOAD_GENERAL);
 
+      /* Unused buffer chunks and cell slabs are the cheapest things to give
+       * back: release them first, and stop there if that was enough. */
+      removed = buf_clear_freelists();
+      oom_stats_n_bytes_removed_buf += removed;
+      alloc -= removed;
+      removed = cell_pool_release_idle();
+      oom_stats_n_bytes_removed_cell += removed;
+      alloc -= removed;
+      if (alloc < get_options()->MaxMemInQueues) {
+        return 1;
+      }
+
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
@@ -24,6 +24,12 @@ uint32_t relay_get_param_max_circuit_cell_queue_size(
                                      const networkstatus_t *ns);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+int circuit_receive_relay_cells(cell_t **cells, size_t n_cells,
+                                circuit_t *circ,
+                                cell_direction_t cell_direction);
+int circuit_receive_decrypted_relay_cells(cell_t **cells, size_t n_cells,
+                                          circuit_t *circ,
+                                          cell_direction_t cell_direction);
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -58,9 +64,12 @@ extern uint64_t oom_stats_n_bytes_removed_dns;
 extern uint64_t oom_stats_n_bytes_removed_cell;
 extern uint64_t oom_stats_n_bytes_removed_geoip;
 extern uint64_t oom_stats_n_bytes_removed_hsdir;
+extern uint64_t oom_stats_n_bytes_removed_buf;
 
 void dump_cell_pool_usage(int severity);
 size_t packed_cell_mem_cost(void);
+size_t cell_pool_get_idle_allocation(void);
+size_t cell_pool_release_idle(void);
 
 int have_been_under_memory_pressure(void);
 
@@ -405,6 +405,27 @@ static const int MAX_PROTOVER_SUMMARY_MAP_LEN = 1024;
  */
 static strmap_t *protover_summary_map = NULL;
 
+/**
+ * Lock protecting <b>protover_summary_map</b>: routerstatus entries, and
+ * so their protover summaries, may be parsed on cpuworker threads.
+ */
+static tor_mutex_t protover_summary_mutex;
+/** True iff we have initialized protover_summary_mutex. */
+static int protover_summary_mutex_initialized = 0;
+
+/**
+ * Set up the lock for the protover summary cache.  Must be called from the
+ * main thread before any other thread can call summarize_protover_flags().
+ */
+void
+protover_summary_cache_init(void)
+{
+  if (!protover_summary_mutex_initialized) {
+    tor_mutex_init(&protover_summary_mutex);
+    protover_summary_mutex_initialized = 1;
+  }
+}
+
 /**
  * Helper.  Given a non-NULL protover string <b>protocols</b>, set <b>out</b>
  * to its summary, and memoize the result in <b>protover_summary_map</b>.
@@ -412,6 +433,8 @@ static strmap_t *protover_summary_map = NULL;
  * If the protover string does not contain any recognised protocols, sets
  * protocols_known, but does not set any other flags. (Empty strings are also
  * treated this way.)
+ *
+ * Requires that the caller holds protover_summary_mutex.
  */
 static void
 memoize_protover_summary(protover_summary_flags_t *out,
@@ -421,8 +444,7 @@ memoize_protover_summary(protover_summary_flags_t *out,
     protover_summary_map = strmap_new();
 
   if (strmap_size(protover_summary_map) >= MAX_PROTOVER_SUMMARY_MAP_LEN) {
-    protover_summary_cache_free_all();
-    tor_assert(protover_summary_map == NULL);
+    strmap_free(protover_summary_map, tor_free_);
     protover_summary_map = strmap_new();
   }
 
@@ -518,7 +540,11 @@ summarize_protover_flags(protover_summary_flags_t *out,
   tor_assert(out);
   memset(out, 0, sizeof(*out));
   if (protocols && strcmp(protocols, "")) {
+    if (PREDICT_UNLIKELY(!protover_summary_mutex_initialized))
+      protover_summary_cache_init();
+    tor_mutex_acquire(&protover_summary_mutex);
     memoize_protover_summary(out, protocols);
+    tor_mutex_release(&protover_summary_mutex);
   }
   if (version && strcmp(version, "") && !strcmpstart(version, "Tor ")) {
     if (!out->protocols_known) {
@@ -538,11 +564,17 @@ summarize_protover_flags(protover_summary_flags_t *out,
 }
 
 /**
- * Free all space held in the protover_summary_map.
+ * Free all space held in the protover_summary_map, and tear down its lock.
+ * Must be called from the main thread once no other thread can call
+ * summarize_protover_flags().
  */
 void
 protover_summary_cache_free_all(void)
 {
   strmap_free(protover_summary_map, tor_free_);
   protover_summary_map = NULL;
+  if (protover_summary_mutex_initialized) {
+    tor_mutex_uninit(&protover_summary_mutex);
+    protover_summary_mutex_initialized = 0;
+  }
 }
@@ -422,6 +422,36 @@ handle_control_setevents(control_connection_t *conn,
   return 0;
 }
 
+static const control_cmd_syntax_t seteventformat_syntax = {
+  .min_args = 1,
+  .max_args = 1,
+};
+
+/** Called when we get a SETEVENTFORMAT message: choose whether this
+ * controller gets BW, STREAM_BW, CONN_BW and CIRC_BW events as text lines
+ * ("TEXT", the default) or as batches of binary records ("BINARY"), and
+ * reply with DONE or ERROR. */
+static int
+handle_control_seteventformat(control_connection_t *conn,
+                              const control_cmd_args_t *args)
+{
+  const char *format = smartlist_get(args->args, 0);
+
+  if (!strcasecmp(format, "TEXT")) {
+    conn->binary_events = 0;
+  } else if (!strcasecmp(format, "BINARY")) {
+    conn->binary_events = 1;
+  } else {
+    control_printf_endreply(conn, 552, "Unrecognized event format \"%s\"",
+                            format);
+    return 0;
+  }
+
+  control_update_global_event_mask();
+  send_control_done(conn);
+  return 0;
+}
+
 static const control_cmd_syntax_t saveconf_syntax = {
   .max_args = 0,
   .accept_keywords = true,
@@ -2125,6 +2155,7 @@ static const control_cmd_def_t CONTROL_COMMANDS[] =
   ONE_LINE(getconf, 0),
   MULTLINE(loadconf, 0),
   ONE_LINE(setevents, 0),
+  ONE_LINE(seteventformat, 0),
   ONE_LINE(authenticate, CMD_FL_WIPE),
   ONE_LINE(saveconf, 0),
   ONE_LINE(signal, 0),
@@ -28,6 +28,9 @@ struct control_connection_t {
   /** True if we have received a takeownership command on this
    * connection. */
   unsigned int is_owning_control_connection:1;
+  /** True if this controller has asked, with SETEVENTFORMAT BINARY, to get
+   * the events in EVENT_MASK_BINARY_ as batches of binary records. */
+  unsigned int binary_events:1;
 
   /** List of ephemeral onion services belonging to this connection. */
   smartlist_t *ephemeral_onion_services;
@@ -53,6 +53,14 @@ static void control_get_bytes_rw_last_sec(uint64_t *r, uint64_t *w);
  * receiving. */
 static event_mask_t global_event_mask = 0;
 
+/** An event mask of all the events that some controller wants as binary
+ * records. */
+static event_mask_t global_binary_event_mask = 0;
+
+/** An event mask of the events that every interested controller wants as
+ * binary records, so that we don't need to format them as text. */
+static event_mask_t global_binary_only_event_mask = 0;
+
 /** True iff we have disabled log messages from being sent to the controller */
 static int disable_log_messages = 0;
 
@@ -61,6 +69,21 @@ static int disable_log_messages = 0;
 #define EVENT_IS_INTERESTING(e) \
   (!! (global_event_mask & EVENT_MASK_(e)))
 
+/** Macro: true if any control connection wants events of type <b>e</b> as
+ * text lines. */
+#define EVENT_WANTS_TEXT(e) \
+  (!! (global_event_mask & ~global_binary_only_event_mask & EVENT_MASK_(e)))
+
+/** Macro: true if any control connection wants events of type <b>e</b> as
+ * binary records. */
+#define EVENT_WANTS_BINARY(e) \
+  (!! (global_binary_event_mask & EVENT_MASK_(e)))
+
+/** Macro: the events that the control connection <b>conn</b> wants as binary
+ * records. */
+#define CONN_BINARY_EVENT_MASK(conn) \
+  ((conn)->binary_events ? ((conn)->event_mask & EVENT_MASK_BINARY_) : 0)
+
 /** Macro: true if any event from the bitfield 'e' is interesting. */
 #define ANY_EVENT_IS_INTERESTING(e) \
   (!! (global_event_mask & (e)))
@@ -207,19 +230,24 @@ void
 control_update_global_event_mask(void)
 {
   smartlist_t *conns = get_connection_array();
-  event_mask_t old_mask, new_mask;
+  event_mask_t old_mask, new_mask, text_mask = 0;
   old_mask = global_event_mask;
   int any_old_per_sec_events = control_any_per_second_event_enabled();
 
   global_event_mask = 0;
+  global_binary_event_mask = 0;
   SMARTLIST_FOREACH(conns, connection_t *, _conn,
   {
     if (_conn->type == CONN_TYPE_CONTROL &&
         STATE_IS_OPEN(_conn->state)) {
       control_connection_t *conn = TO_CONTROL_CONN(_conn);
+      const event_mask_t binary_mask = CONN_BINARY_EVENT_MASK(conn);
       global_event_mask |= conn->event_mask;
+      global_binary_event_mask |= binary_mask;
+      text_mask |= conn->event_mask & ~binary_mask;
     }
   });
+  global_binary_only_event_mask = global_binary_event_mask & ~text_mask;
 
   new_mask = global_event_mask;
 
@@ -391,6 +419,18 @@ static tor_threadlocal_t block_event_queue_flag;
  * to one or more controllers */
 static smartlist_t *queued_control_events = NULL;
 
+/** Binary event records that may need to be sent to one or more
+ * controllers, in the format described at queue_control_event_record(). */
+static char *queued_control_records = NULL;
+/** Number of bytes used in queued_control_records. */
+static size_t queued_control_records_len = 0;
+/** Number of bytes allocated for queued_control_records. */
+static size_t queued_control_records_alloc = 0;
+/** Number of records in queued_control_records. */
+static int queued_control_records_n = 0;
+/** An event mask of the types of the records in queued_control_records. */
+static event_mask_t queued_control_records_mask = 0;
+
 /** True if the flush_queued_events_event is pending. */
 static int flush_queued_event_pending = 0;
 
@@ -506,6 +546,141 @@ queued_event_free_(queued_event_t *ev)
   tor_free(ev);
 }
 
+/** Helper: add a binary record for <b>event</b>, with the
+ * <b>body_len</b>-byte body at <b>body</b>, to the records queued to be sent
+ * to controllers that use SETEVENTFORMAT BINARY, and schedule the queue to
+ * be flushed if needed.
+ *
+ * Each time we flush the queue, we send every such controller all the
+ * records that it wants in one batch, as a line
+ *
+ *   "650 BINARY_EVENTS" SP Count SP Length CRLF
+ *
+ * followed immediately by Length bytes holding Count records.  Each record
+ * is a two-byte event code (as in control_events.h) and a two-byte body
+ * length, followed by the body.  All integers are in network byte order, and
+ * all bodies are a multiple of four bytes long.  The bodies are:
+ *
+ *   BW:        u32 bytes read, u32 bytes written.
+ *   STREAM_BW: u64 time (microseconds since the epoch), u64 stream ID,
+ *              u32 bytes read, u32 bytes written.
+ *   CONN_BW:   u64 connection ID, u32 bytes read, u32 bytes written,
+ *              u8 type (1 for OR, 2 for DIR, 3 for EXIT), 3 zero bytes.
+ *   CIRC_BW:   u64 time (microseconds since the epoch), u32 circuit ID,
+ *              u32 bytes read, u32 bytes written, u32 delivered read,
+ *              u32 overhead read, u32 delivered written,
+ *              u32 overhead written, 4 zero bytes.
+ *
+ * Controllers must skip records with event codes they don't know, and
+ * ignore any bytes at the end of a body longer than they expect.
+ */
+MOCK_IMPL(STATIC void,
+queue_control_event_record,(uint16_t event, const uint8_t *body,
+                            size_t body_len))
+{
+  const size_t rec_len = CONTROL_RECORD_HEADER_LEN + body_len;
+  tor_assert(body_len <= UINT16_MAX);
+
+  if (PREDICT_UNLIKELY( ! EVENT_WANTS_BINARY(event) )) {
+    return;
+  }
+
+  int *block_event_queue = get_block_event_queue();
+  if (*block_event_queue) {
+    return;
+  }
+
+  ++*block_event_queue;
+
+  tor_mutex_acquire(queued_control_events_lock);
+  if (queued_control_records_len + rec_len > queued_control_records_alloc) {
+    queued_control_records_alloc = MAX(queued_control_records_alloc * 2,
+                                       queued_control_records_len + rec_len);
+    queued_control_records_alloc = MAX(queued_control_records_alloc, 4096);
+    queued_control_records = tor_realloc(queued_control_records,
+                                         queued_control_records_alloc);
+  }
+  char *rec = queued_control_records + queued_control_records_len;
+  set_uint16(rec, htons(event));
+  set_uint16(rec + 2, htons((uint16_t)body_len));
+  memcpy(rec + CONTROL_RECORD_HEADER_LEN, body, body_len);
+  queued_control_records_len += rec_len;
+  ++queued_control_records_n;
+  queued_control_records_mask |= EVENT_MASK_(event);
+
+  int activate_event = 0;
+  if (! flush_queued_event_pending && in_main_thread()) {
+    activate_event = 1;
+    flush_queued_event_pending = 1;
+  }
+
+  tor_mutex_release(queued_control_events_lock);
+
+  --*block_event_queue;
+
+  if (activate_event) {
+    tor_assert(flush_queued_events_event);
+    mainloop_event_activate(flush_queued_events_event);
+  }
+}
+
+/** Return a newly allocated copy of the records among the
+ * <b>records_len</b> bytes of binary event records at <b>records</b> whose
+ * events are in <b>wanted</b>.  Set *<b>len_out</b> to the length of the
+ * copy, and *<b>n_out</b> to the number of records in it. */
+STATIC char *
+control_records_filter(const char *records, size_t records_len,
+                       event_mask_t wanted, size_t *len_out, int *n_out)
+{
+  char *out = tor_malloc(records_len ? records_len : 1);
+  const char *cp = records, *end = records + records_len;
+  size_t len = 0;
+  int n = 0;
+
+  while (cp < end) {
+    const uint16_t event = ntohs(get_uint16(cp));
+    const size_t rec_len = CONTROL_RECORD_HEADER_LEN +
+      ntohs(get_uint16(cp + 2));
+    tor_assert(rec_len <= (size_t)(end - cp));
+    if (event < EVENT_CAPACITY_ && (wanted & EVENT_MASK_(event))) {
+      memcpy(out + len, cp, rec_len);
+      len += rec_len;
+      ++n;
+    }
+    cp += rec_len;
+  }
+
+  *len_out = len;
+  *n_out = n;
+  return out;
+}
+
+/** Send the <b>n</b> binary event records in the <b>len</b> bytes at
+ * <b>records</b>, whose types are in <b>mask</b>, to <b>control_conn</b> as
+ * one batch, leaving out any records that it doesn't want. */
+static void
+send_control_records(control_connection_t *control_conn,
+                     const char *records, size_t len, int n,
+                     event_mask_t mask)
+{
+  const event_mask_t wanted = CONN_BINARY_EVENT_MASK(control_conn);
+  char *filtered = NULL;
+  char hdr[64];
+
+  if (!(mask & wanted))
+    return;
+  if (mask & ~wanted) {
+    records = filtered = control_records_filter(records, len, wanted,
+                                                &len, &n);
+  }
+
+  tor_snprintf(hdr, sizeof(hdr), "650 BINARY_EVENTS %d %"TOR_PRIuSZ"\r\n",
+               n, len);
+  connection_buf_add(hdr, strlen(hdr), TO_CONN(control_conn));
+  connection_buf_add(records, len, TO_CONN(control_conn));
+  tor_free(filtered);
+}
+
 /** Send every queued event to every controller that's interested in it,
  * and remove the events from the queue.  If <b>force</b> is true,
  * then make all controllers send their data out immediately, since we
@@ -522,6 +697,10 @@ queued_events_flush_all(int force)
   smartlist_t *all_conns = get_connection_array();
   smartlist_t *controllers = smartlist_new();
   smartlist_t *queued_events;
+  char *records;
+  size_t records_len;
+  int records_n;
+  event_mask_t records_mask;
 
   int *block_event_queue = get_block_event_queue();
   ++*block_event_queue;
@@ -531,6 +710,14 @@ queued_events_flush_all(int force)
   flush_queued_event_pending = 0;
   queued_events = queued_control_events;
   queued_control_events = smartlist_new();
+  records = queued_control_records;
+  records_len = queued_control_records_len;
+  records_n = queued_control_records_n;
+  records_mask = queued_control_records_mask;
+  queued_control_records = NULL;
+  queued_control_records_len = queued_control_records_alloc = 0;
+  queued_control_records_n = 0;
+  queued_control_records_mask = 0;
   tor_mutex_release(queued_control_events_lock);
 
   /* Gather all the controllers that will care... */
@@ -549,7 +736,8 @@ queued_events_flush_all(int force)
     const size_t msg_len = strlen(ev->msg);
     SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
                             control_conn) {
-      if (control_conn->event_mask & bit) {
+      if (control_conn->event_mask & ~CONN_BINARY_EVENT_MASK(control_conn)
+          & bit) {
         connection_buf_add(ev->msg, msg_len, TO_CONN(control_conn));
       }
     } SMARTLIST_FOREACH_END(control_conn);
@@ -557,6 +745,12 @@ queued_events_flush_all(int force)
     queued_event_free(ev);
   } SMARTLIST_FOREACH_END(ev);
 
+  if (records_n) {
+    SMARTLIST_FOREACH(controllers, control_connection_t *, control_conn,
+                      send_control_records(control_conn, records, records_len,
+                                           records_n, records_mask));
+  }
+
   if (force) {
     SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
                             control_conn) {
@@ -566,6 +760,7 @@ queued_events_flush_all(int force)
 
   smartlist_free(queued_events);
   smartlist_free(controllers);
+  tor_free(records);
 
   --*block_event_queue;
 }
@@ -968,19 +1163,24 @@ control_event_or_conn_status(or_connection_t *conn, or_conn_status_event_t tp,
   return 0;
 }
 
-/**
- * Print out STREAM_BW event for a single conn
- */
-int
-control_event_stream_bandwidth(edge_connection_t *edge_conn)
+/** Return the time <b>tv</b> as a number of microseconds since the epoch,
+ * for a binary event record. */
+static inline uint64_t
+timeval_to_record_usec(const struct timeval *tv)
+{
+  return ((uint64_t)tv->tv_sec) * 1000000 + (uint64_t)tv->tv_usec;
+}
+
+/** Helper: send a STREAM_BW event for <b>edge_conn</b>, in whichever
+ * formats controllers want, and reset its bandwidth counters. */
+static void
+send_stream_bandwidth_event(edge_connection_t *edge_conn)
 {
   struct timeval now;
-  char tbuf[ISO_TIME_USEC_LEN+1];
-  if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
-    if (!edge_conn->n_read && !edge_conn->n_written)
-      return 0;
 
-    tor_gettimeofday(&now);
+  tor_gettimeofday(&now);
+  if (EVENT_WANTS_TEXT(EVENT_STREAM_BANDWIDTH_USED)) {
+    char tbuf[ISO_TIME_USEC_LEN+1];
     format_iso_time_nospace_usec(tbuf, &now);
     send_control_event(EVENT_STREAM_BANDWIDTH_USED,
                        "650 STREAM_BW %"PRIu64" %lu %lu %s\r\n",
@@ -988,8 +1188,31 @@ control_event_stream_bandwidth(edge_connection_t *edge_conn)
                        (unsigned long)edge_conn->n_read,
                        (unsigned long)edge_conn->n_written,
                        tbuf);
+  }
+  if (EVENT_WANTS_BINARY(EVENT_STREAM_BANDWIDTH_USED)) {
+    uint8_t body[STREAM_BW_RECORD_LEN];
+    set_uint64(body, tor_htonll(timeval_to_record_usec(&now)));
+    set_uint64(body+8, tor_htonll(edge_conn->base_.global_identifier));
+    set_uint32(body+16, htonl(edge_conn->n_read));
+    set_uint32(body+20, htonl(edge_conn->n_written));
+    queue_control_event_record(EVENT_STREAM_BANDWIDTH_USED,
+                               body, sizeof(body));
+  }
+
+  edge_conn->n_written = edge_conn->n_read = 0;
+}
 
-    edge_conn->n_written = edge_conn->n_read = 0;
+/**
+ * Print out STREAM_BW event for a single conn
+ */
+int
+control_event_stream_bandwidth(edge_connection_t *edge_conn)
+{
+  if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
+    if (!edge_conn->n_read && !edge_conn->n_written)
+      return 0;
+
+    send_stream_bandwidth_event(edge_conn);
   }
 
   return 0;
@@ -1003,8 +1226,6 @@ control_event_stream_bandwidth_used(void)
   if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
     smartlist_t *conns = get_connection_array();
     edge_connection_t *edge_conn;
-    struct timeval now;
-    char tbuf[ISO_TIME_USEC_LEN+1];
 
     SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn)
     {
@@ -1014,16 +1235,7 @@ control_event_stream_bandwidth_used(void)
         if (!edge_conn->n_read && !edge_conn->n_written)
           continue;
 
-        tor_gettimeofday(&now);
-        format_iso_time_nospace_usec(tbuf, &now);
-        send_control_event(EVENT_STREAM_BANDWIDTH_USED,
-                           "650 STREAM_BW %"PRIu64" %lu %lu %s\r\n",
-                           (edge_conn->base_.global_identifier),
-                           (unsigned long)edge_conn->n_read,
-                           (unsigned long)edge_conn->n_written,
-                           tbuf);
-
-        edge_conn->n_written = edge_conn->n_read = 0;
+        send_stream_bandwidth_event(edge_conn);
     }
     SMARTLIST_FOREACH_END(conn);
   }
@@ -1079,30 +1291,46 @@ control_event_circ_bandwidth_used_for_circ(origin_circuit_t *ocirc)
     return 0;
 
   tor_gettimeofday(&now);
-  format_iso_time_nospace_usec(tbuf, &now);
-
-  char *ccontrol_buf = congestion_control_get_control_port_fields(ocirc);
-  send_control_event(EVENT_CIRC_BANDWIDTH_USED,
-                     "650 CIRC_BW ID=%d READ=%lu WRITTEN=%lu TIME=%s "
-                     "DELIVERED_READ=%lu OVERHEAD_READ=%lu "
-                     "DELIVERED_WRITTEN=%lu OVERHEAD_WRITTEN=%lu%s\r\n",
-                     ocirc->global_identifier,
-                     (unsigned long)ocirc->n_read_circ_bw,
-                     (unsigned long)ocirc->n_written_circ_bw,
-                     tbuf,
-                     (unsigned long)ocirc->n_delivered_read_circ_bw,
-                     (unsigned long)ocirc->n_overhead_read_circ_bw,
-                     (unsigned long)ocirc->n_delivered_written_circ_bw,
-                     (unsigned long)ocirc->n_overhead_written_circ_bw,
-                     ccontrol_buf ? ccontrol_buf : "");
+
+  if (EVENT_WANTS_TEXT(EVENT_CIRC_BANDWIDTH_USED)) {
+    format_iso_time_nospace_usec(tbuf, &now);
+
+    char *ccontrol_buf = congestion_control_get_control_port_fields(ocirc);
+    send_control_event(EVENT_CIRC_BANDWIDTH_USED,
+                       "650 CIRC_BW ID=%d READ=%lu WRITTEN=%lu TIME=%s "
+                       "DELIVERED_READ=%lu OVERHEAD_READ=%lu "
+                       "DELIVERED_WRITTEN=%lu OVERHEAD_WRITTEN=%lu%s\r\n",
+                       ocirc->global_identifier,
+                       (unsigned long)ocirc->n_read_circ_bw,
+                       (unsigned long)ocirc->n_written_circ_bw,
+                       tbuf,
+                       (unsigned long)ocirc->n_delivered_read_circ_bw,
+                       (unsigned long)ocirc->n_overhead_read_circ_bw,
+                       (unsigned long)ocirc->n_delivered_written_circ_bw,
+                       (unsigned long)ocirc->n_overhead_written_circ_bw,
+                       ccontrol_buf ? ccontrol_buf : "");
+
+    if (ccontrol_buf)
+      tor_free(ccontrol_buf);
+  }
+  if (EVENT_WANTS_BINARY(EVENT_CIRC_BANDWIDTH_USED)) {
+    uint8_t body[CIRC_BW_RECORD_LEN];
+    set_uint64(body, tor_htonll(timeval_to_record_usec(&now)));
+    set_uint32(body+8, htonl(ocirc->global_identifier));
+    set_uint32(body+12, htonl(ocirc->n_read_circ_bw));
+    set_uint32(body+16, htonl(ocirc->n_written_circ_bw));
+    set_uint32(body+20, htonl(ocirc->n_delivered_read_circ_bw));
+    set_uint32(body+24, htonl(ocirc->n_overhead_read_circ_bw));
+    set_uint32(body+28, htonl(ocirc->n_delivered_written_circ_bw));
+    set_uint32(body+32, htonl(ocirc->n_overhead_written_circ_bw));
+    set_uint32(body+36, 0);
+    queue_control_event_record(EVENT_CIRC_BANDWIDTH_USED, body, sizeof(body));
+  }
 
   ocirc->n_written_circ_bw = ocirc->n_read_circ_bw = 0;
   ocirc->n_overhead_written_circ_bw = ocirc->n_overhead_read_circ_bw = 0;
   ocirc->n_delivered_written_circ_bw = ocirc->n_delivered_read_circ_bw = 0;
 
-  if (ccontrol_buf)
-    tor_free(ccontrol_buf);
-
   return 0;
 }
 
@@ -1112,6 +1340,7 @@ int
 control_event_conn_bandwidth(connection_t *conn)
 {
   const char *conn_type_str;
+  uint8_t conn_type_code;
   if (!get_options()->TestingEnableConnBwEvent ||
       !EVENT_IS_INTERESTING(EVENT_CONN_BW))
     return 0;
@@ -1120,23 +1349,37 @@ control_event_conn_bandwidth(connection_t *conn)
   switch (conn->type) {
     case CONN_TYPE_OR:
       conn_type_str = "OR";
+      conn_type_code = 1;
       break;
     case CONN_TYPE_DIR:
       conn_type_str = "DIR";
+      conn_type_code = 2;
       break;
     case CONN_TYPE_EXIT:
       conn_type_str = "EXIT";
+      conn_type_code = 3;
       break;
     default:
       return 0;
   }
-  send_control_event(EVENT_CONN_BW,
-                     "650 CONN_BW ID=%"PRIu64" TYPE=%s "
-                     "READ=%lu WRITTEN=%lu\r\n",
-                     (conn->global_identifier),
-                     conn_type_str,
-                     (unsigned long)conn->n_read_conn_bw,
-                     (unsigned long)conn->n_written_conn_bw);
+  if (EVENT_WANTS_TEXT(EVENT_CONN_BW)) {
+    send_control_event(EVENT_CONN_BW,
+                       "650 CONN_BW ID=%"PRIu64" TYPE=%s "
+                       "READ=%lu WRITTEN=%lu\r\n",
+                       (conn->global_identifier),
+                       conn_type_str,
+                       (unsigned long)conn->n_read_conn_bw,
+                       (unsigned long)conn->n_written_conn_bw);
+  }
+  if (EVENT_WANTS_BINARY(EVENT_CONN_BW)) {
+    uint8_t body[CONN_BW_RECORD_LEN];
+    set_uint64(body, tor_htonll(conn->global_identifier));
+    set_uint32(body+8, htonl(conn->n_read_conn_bw));
+    set_uint32(body+12, htonl(conn->n_written_conn_bw));
+    memset(body+16, 0, 4);
+    body[16] = conn_type_code;
+    queue_control_event_record(EVENT_CONN_BW, body, sizeof(body));
+  }
   conn->n_written_conn_bw = conn->n_read_conn_bw = 0;
   return 0;
 }
@@ -1307,12 +1550,18 @@ control_event_bandwidth_used(uint32_t n_read, uint32_t n_written)
   if (n_measurements < N_BW_EVENTS_TO_CACHE)
     ++n_measurements;
 
-  if (EVENT_IS_INTERESTING(EVENT_BANDWIDTH_USED)) {
+  if (EVENT_WANTS_TEXT(EVENT_BANDWIDTH_USED)) {
     send_control_event(EVENT_BANDWIDTH_USED,
                        "650 BW %lu %lu\r\n",
                        (unsigned long)n_read,
                        (unsigned long)n_written);
   }
+  if (EVENT_WANTS_BINARY(EVENT_BANDWIDTH_USED)) {
+    uint8_t body[BW_RECORD_LEN];
+    set_uint32(body, htonl(n_read));
+    set_uint32(body+4, htonl(n_written));
+    queue_control_event_record(EVENT_BANDWIDTH_USED, body, sizeof(body));
+  }
 
   return 0;
 }
@@ -2273,6 +2522,10 @@ control_events_free_all(void)
     flush_queued_event_pending = 0;
     queued_events = queued_control_events;
     queued_control_events = NULL;
+    tor_free(queued_control_records);
+    queued_control_records_len = queued_control_records_alloc = 0;
+    queued_control_records_n = 0;
+    queued_control_records_mask = 0;
     tor_mutex_release(queued_control_events_lock);
   }
   if (queued_events) {
@@ -2285,6 +2538,7 @@ control_events_free_all(void)
     flush_queued_events_event = NULL;
   }
   global_event_mask = 0;
+  global_binary_event_mask = global_binary_only_event_mask = 0;
   disable_log_messages = 0;
 }
 
@@ -2295,4 +2549,13 @@ control_testing_set_global_event_mask(uint64_t mask)
 {
   global_event_mask = mask;
 }
+
+/* For testing: change which events controllers want as binary records */
+void
+control_testing_set_global_binary_event_mask(uint64_t binary_mask,
+                                             uint64_t binary_only_mask)
+{
+  global_binary_event_mask = binary_mask;
+  global_binary_only_event_mask = binary_only_mask;
+}
 #endif /* defined(TOR_UNIT_TESTS) */
@@ -305,6 +305,21 @@ CTASSERT(EVENT_MAX_ < EVENT_CAPACITY_);
 #define EVENT_MASK_ALL_              (EVENT_MASK_ABOVE_MIN_ \
                                       & EVENT_MASK_BELOW_MAX_)
 
+/** The events that a controller can ask to receive as fixed-layout binary
+ * records, with SETEVENTFORMAT BINARY, instead of as text lines. */
+#define EVENT_MASK_BINARY_           (EVENT_MASK_(EVENT_BANDWIDTH_USED) | \
+                                      EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED) \
+                                      | EVENT_MASK_(EVENT_CONN_BW) | \
+                                      EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED))
+
+/** Length of the header in front of every binary event record. */
+#define CONTROL_RECORD_HEADER_LEN    4
+/** Lengths of the bodies of the binary event records. */
+#define BW_RECORD_LEN                8
+#define STREAM_BW_RECORD_LEN         24
+#define CONN_BW_RECORD_LEN           20
+#define CIRC_BW_RECORD_LEN           40
+
 /** Helper structure: temporarily stores cell statistics for a circuit. */
 typedef struct cell_stats_t {
   /** Number of cells added in app-ward direction by command. */
@@ -347,7 +362,16 @@ MOCK_DECL(STATIC void,
 MOCK_DECL(STATIC void,
           queue_control_event_string,(uint16_t event, char *msg));
 
+MOCK_DECL(STATIC void,
+          queue_control_event_record,(uint16_t event, const uint8_t *body,
+                                      size_t body_len));
+
 void control_testing_set_global_event_mask(uint64_t mask);
+void control_testing_set_global_binary_event_mask(uint64_t binary_mask,
+                                                  uint64_t binary_only_mask);
+STATIC char *control_records_filter(const char *records, size_t records_len,
+                                    event_mask_t wanted, size_t *len_out,
+                                    int *n_out);
 
 #endif /* defined(TOR_UNIT_TESTS) */
 
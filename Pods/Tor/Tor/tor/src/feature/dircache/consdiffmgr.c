@@ -1307,7 +1307,8 @@ typedef struct compressed_result_t {
  *
  * For each successful compression, set the fields in the <b>results_out</b>
  * array in the position corresponding to the compression method. Use
- * <b>labels_in</b> as a basis for the labels of the result.
+ * <b>labels_in</b> as a basis for the labels of the result.  Methods that
+ * can split their work may use up to <b>n_threads</b> threads.
  *
  * Return 0 if all compression succeeded; -1 if any failed.
  */
@@ -1315,7 +1316,8 @@ static int
 compress_multiple(compressed_result_t *results_out, int n_methods,
                   const compress_method_t *methods,
                   const uint8_t *input, size_t len,
-                  const config_line_t *labels_in)
+                  const config_line_t *labels_in,
+                  int n_threads)
 {
   int rv = 0;
   int i;
@@ -1324,7 +1326,8 @@ compress_multiple(compressed_result_t *results_out, int n_methods,
     const char *methodname = compression_method_get_name(method);
     char *result;
     size_t sz;
-    if (0 == tor_compress(&result, &sz, (const char*)input, len, method)) {
+    if (0 == tor_compress_parallel(&result, &sz, (const char*)input, len,
+                                   method, n_threads)) {
       results_out[i].body = (uint8_t*)result;
       results_out[i].bodylen = sz;
       results_out[i].labels = config_lines_dup(labels_in);
@@ -1587,7 +1590,8 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
   compress_multiple(job->out+1,
                     n_diff_compression_methods()-1,
                     compress_diffs_with+1,
-                    (const uint8_t*)consensus_diff, difflen, common_labels);
+                    (const uint8_t*)consensus_diff, difflen, common_labels,
+                    1);
 
   config_free_lines(common_labels);
   return WQ_RPL_REPLY;
@@ -1739,14 +1743,31 @@ consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
 }
 
 /**
- * Holds requests and replies for consensus_compress_workers.
+ * A consensus waiting to be compressed, shared by the jobs that compress it
+ * with each of our methods.
  */
-typedef struct consensus_compress_worker_job_t {
+typedef struct consensus_compress_input_t {
   char *consensus;
   size_t consensus_len;
   consensus_flavor_t flavor;
   config_line_t *labels_in;
-  compressed_result_t out[ARRAY_LENGTH(compress_consensus_with)];
+  /** Number of jobs that still refer to this input.  Only modified from the
+   * main thread. */
+  unsigned refcnt;
+} consensus_compress_input_t;
+
+/**
+ * Holds requests and replies for consensus_compress_workers.  There is one
+ * job per compression method, so that the slow methods run alongside the
+ * fast ones rather than after them.
+ */
+typedef struct consensus_compress_worker_job_t {
+  consensus_compress_input_t *input;
+  /** Index into compress_consensus_with of the method for this job. */
+  unsigned method_idx;
+  /** How many threads may this job use, if its method can split work? */
+  int n_threads;
+  compressed_result_t out;
 } consensus_compress_worker_job_t;
 
 #define consensus_compress_worker_job_free(job) \
@@ -1754,20 +1775,22 @@ typedef struct consensus_compress_worker_job_t {
                 consensus_compress_worker_job_free_, (job))
 
 /**
- * Free all resources held in <b>job</b>
+ * Free all resources held in <b>job</b>, and release its reference to its
+ * input.  Only call this from the main thread.
  */
 static void
 consensus_compress_worker_job_free_(consensus_compress_worker_job_t *job)
 {
   if (!job)
     return;
-  tor_free(job->consensus);
-  config_free_lines(job->labels_in);
-  unsigned u;
-  for (u = 0; u < n_consensus_compression_methods(); ++u) {
-    config_free_lines(job->out[u].labels);
-    tor_free(job->out[u].body);
+  consensus_compress_input_t *input = job->input;
+  if (input && --input->refcnt == 0) {
+    tor_free(input->consensus);
+    config_free_lines(input->labels_in);
+    tor_free(input);
   }
+  config_free_lines(job->out.labels);
+  tor_free(job->out.body);
   tor_free(job);
 }
 /**
@@ -1779,11 +1802,12 @@ consensus_compress_worker_threadfn(void *state_, void *work_)
 {
   (void)state_;
   consensus_compress_worker_job_t *job = work_;
-  consensus_flavor_t flavor = job->flavor;
-  const char *consensus = job->consensus;
-  size_t bodylen = job->consensus_len;
+  const consensus_compress_input_t *input = job->input;
+  consensus_flavor_t flavor = input->flavor;
+  const char *consensus = input->consensus;
+  size_t bodylen = input->consensus_len;
 
-  config_line_t *labels = config_lines_dup(job->labels_in);
+  config_line_t *labels = config_lines_dup(input->labels_in);
   const char *flavname = networkstatus_get_flavor_name(flavor);
 
   cdm_labels_prepend_sha3(&labels, LABEL_SHA3_DIGEST_UNCOMPRESSED,
@@ -1802,10 +1826,10 @@ consensus_compress_worker_threadfn(void *state_, void *work_)
   config_line_prepend(&labels, LABEL_FLAVOR, flavname);
   config_line_prepend(&labels, LABEL_DOCTYPE, DOCTYPE_CONSENSUS);
 
-  compress_multiple(job->out,
-                    n_consensus_compression_methods(),
-                    compress_consensus_with,
-                    (const uint8_t*)consensus, bodylen, labels);
+  compress_multiple(&job->out, 1,
+                    &compress_consensus_with[job->method_idx],
+                    (const uint8_t*)consensus, bodylen, labels,
+                    job->n_threads);
   config_free_lines(labels);
   return WQ_RPL_REPLY;
 }
@@ -1819,26 +1843,21 @@ static void
 consensus_compress_worker_replyfn(void *work_)
 {
   consensus_compress_worker_job_t *job = work_;
+  const unsigned u = job->method_idx;
+  consensus_cache_entry_handle_t *handle = NULL;
 
-  consensus_cache_entry_handle_t *handles[
-                               ARRAY_LENGTH(compress_consensus_with)];
-  memset(handles, 0, sizeof(handles));
-
-  store_multiple(handles,
-                 n_consensus_compression_methods(),
-                 compress_consensus_with,
-                 job->out,
+  store_multiple(&handle, 1,
+                 &compress_consensus_with[u],
+                 &job->out,
                  "consensus");
   mark_cdm_cache_dirty();
 
-  unsigned u;
-  consensus_flavor_t f = job->flavor;
+  consensus_flavor_t f = job->input->flavor;
   tor_assert((int)f < N_CONSENSUS_FLAVORS);
-  for (u = 0; u < ARRAY_LENGTH(handles); ++u) {
-    if (handles[u] == NULL)
-      continue;
+  tor_assert(u < n_consensus_compression_methods());
+  if (handle) {
     consensus_cache_entry_handle_free(latest_consensus[f][u]);
-    latest_consensus[f][u] = handles[u];
+    latest_consensus[f][u] = handle;
   }
 
   consensus_compress_worker_job_free(job);
@@ -1849,9 +1868,12 @@ consensus_compress_worker_replyfn(void *work_)
  */
 static int background_compression = 0;
 
+/** Most threads that one consensus compression job will use. */
+#define CONSENSUS_COMPRESS_MAX_THREADS 4
+
 /**
- * Queue a job to compress <b>consensus</b> and store its compressed
- * text in the cache.
+ * Queue jobs to compress <b>consensus</b> with each of our methods and store
+ * its compressed text in the cache.
  */
 static int
 consensus_queue_compression_work(const char *consensus,
@@ -1861,10 +1883,10 @@ consensus_queue_compression_work(const char *consensus,
   tor_assert(consensus);
   tor_assert(as_parsed);
 
-  consensus_compress_worker_job_t *job = tor_malloc_zero(sizeof(*job));
-  job->consensus = tor_memdup_nulterm(consensus, consensus_len);
-  job->consensus_len = strlen(job->consensus);
-  job->flavor = as_parsed->flavor;
+  consensus_compress_input_t *input = tor_malloc_zero(sizeof(*input));
+  input->consensus = tor_memdup_nulterm(consensus, consensus_len);
+  input->consensus_len = strlen(input->consensus);
+  input->flavor = as_parsed->flavor;
 
   char va_str[ISO_TIME_LEN+1];
   char vu_str[ISO_TIME_LEN+1];
@@ -1872,9 +1894,9 @@ consensus_queue_compression_work(const char *consensus,
   format_iso_time_nospace(va_str, as_parsed->valid_after);
   format_iso_time_nospace(fu_str, as_parsed->fresh_until);
   format_iso_time_nospace(vu_str, as_parsed->valid_until);
-  config_line_append(&job->labels_in, LABEL_VALID_AFTER, va_str);
-  config_line_append(&job->labels_in, LABEL_FRESH_UNTIL, fu_str);
-  config_line_append(&job->labels_in, LABEL_VALID_UNTIL, vu_str);
+  config_line_append(&input->labels_in, LABEL_VALID_AFTER, va_str);
+  config_line_append(&input->labels_in, LABEL_FRESH_UNTIL, fu_str);
+  config_line_append(&input->labels_in, LABEL_VALID_UNTIL, vu_str);
   if (as_parsed->voters) {
     smartlist_t *hexvoters = smartlist_new();
     SMARTLIST_FOREACH_BEGIN(as_parsed->voters,
@@ -1886,29 +1908,45 @@ consensus_queue_compression_work(const char *consensus,
       smartlist_add_strdup(hexvoters, d);
     } SMARTLIST_FOREACH_END(vi);
     char *signers = smartlist_join_strings(hexvoters, ",", 0, NULL);
-    config_line_prepend(&job->labels_in, LABEL_SIGNATORIES, signers);
+    config_line_prepend(&input->labels_in, LABEL_SIGNATORIES, signers);
     tor_free(signers);
     SMARTLIST_FOREACH(hexvoters, char *, cp, tor_free(cp));
     smartlist_free(hexvoters);
   }
 
+  /* In the background, each job may also split its input between a few
+   * threads; in the foreground, we already hold up the main thread. */
+  int n_threads = 1;
   if (background_compression) {
-    workqueue_entry_t *work;
-    work = cpuworker_queue_work(WQ_PRI_LOW,
-                                consensus_compress_worker_threadfn,
-                                consensus_compress_worker_replyfn,
-                                job);
-    if (!work) {
-      consensus_compress_worker_job_free(job);
-      return -1;
-    }
+    n_threads = MIN(get_num_cpus(get_options()),
+                    CONSENSUS_COMPRESS_MAX_THREADS);
+  }
 
-    return 0;
-  } else {
-    consensus_compress_worker_threadfn(NULL, job);
-    consensus_compress_worker_replyfn(job);
-    return 0;
+  int rv = 0;
+  unsigned u;
+  input->refcnt = n_consensus_compression_methods();
+  for (u = 0; u < n_consensus_compression_methods(); ++u) {
+    consensus_compress_worker_job_t *job = tor_malloc_zero(sizeof(*job));
+    job->input = input;
+    job->method_idx = u;
+    job->n_threads = n_threads;
+
+    if (background_compression) {
+      workqueue_entry_t *work;
+      work = cpuworker_queue_work(WQ_PRI_LOW,
+                                  consensus_compress_worker_threadfn,
+                                  consensus_compress_worker_replyfn,
+                                  job);
+      if (!work) {
+        consensus_compress_worker_job_free(job); // includes decref.
+        rv = -1;
+      }
+    } else {
+      consensus_compress_worker_threadfn(NULL, job);
+      consensus_compress_worker_replyfn(job);
+    }
   }
+  return rv;
 }
 
 /**
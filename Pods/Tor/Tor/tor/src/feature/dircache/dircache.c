@@ -1140,7 +1140,9 @@ handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
                                compress_method,
                                MICRODESC_CACHE_LIFETIME);
 
-    if (compress_method != NO_METHOD)
+    if (compress_method != NO_METHOD &&
+        !dirserv_spool_use_shared_blob(conn, compress_method,
+                                       choose_compression_level()))
       conn->compress_state = tor_compress_new(1, compress_method,
                                       choose_compression_level());
 
@@ -1235,7 +1237,9 @@ handle_get_descriptor(dir_connection_t *conn, const get_handler_args_t *args)
         goto done;
       }
       write_http_response_header(conn, -1, compress_method, cache_lifetime);
-      if (compress_method != NO_METHOD)
+      if (compress_method != NO_METHOD &&
+          !dirserv_spool_use_shared_blob(conn, compress_method,
+                                         choose_compression_level()))
         conn->compress_state = tor_compress_new(1, compress_method,
                                         choose_compression_level());
       clear_spool = 0;
@@ -3,6 +3,7 @@
  * Copyright (c) 2007-2021, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define DIRSERV_PRIVATE
 #include "core/or/or.h"
 
 #include "app/config/config.h"
@@ -24,7 +25,10 @@
 #include "feature/nodelist/routerinfo_st.h"
 #include "feature/nodelist/routerlist_st.h"
 
+#include "lib/cc/ctassert.h"
 #include "lib/compress/compress.h"
+#include "lib/crypt_ops/crypto_digest.h"
+#include "ext/tor_queue.h"
 
 /**
  * \file dirserv.c
@@ -325,6 +329,7 @@ spooled_resource_new(dir_spool_source_t source,
       spooled->spool_eagerly = 1;
       break;
     case DIR_SPOOL_CONSENSUS_CACHE_ENTRY:
+    case DIR_SPOOL_SHARED_BLOB:
       tor_assert_unreached();
       break;
   }
@@ -590,6 +595,7 @@ spooled_resource_lookup_body(const spooled_resource_t *spooled,
     }
     case DIR_SPOOL_NETWORKSTATUS:
     case DIR_SPOOL_CONSENSUS_CACHE_ENTRY:
+    case DIR_SPOOL_SHARED_BLOB:
     default:
       /* LCOV_EXCL_START */
       tor_assert_nonfatal_unreached();
@@ -701,6 +707,279 @@ dirserv_spool_sort(dir_connection_t *conn)
   smartlist_sort(conn->spool, dirserv_spool_sort_comparison_);
 }
 
+/* ==========
+ * Shared compressed spools.
+ *
+ * Caches answer the same requests for microdescriptors and descriptors (by
+ * digest) over and over: every client that misses the same new
+ * microdescriptors after a consensus asks for the same set.  Rather than
+ * compressing those objects again on each connection, we compress the whole
+ * spool once, and send every later connection the same compressed bytes.
+ * ========== */
+
+/** A compressed copy of every object in a spool, shared between all the
+ * connections that ask for the same objects with the same compression. */
+typedef struct spool_blob_t {
+  /** Digest of the request: see spool_blob_compute_key(). */
+  uint8_t key[DIGEST256_LEN];
+  /** The compressed objects, in dir_compressed.  Holds a reference. */
+  cached_dir_t *blob;
+  /** When did we last hand this blob to a connection? */
+  time_t last_served;
+  /** Links in spool_blob_lru. */
+  TOR_TAILQ_ENTRY(spool_blob_t) lru_next;
+} spool_blob_t;
+
+/** Map from request key to spool_blob_t. */
+static digest256map_t *spool_blob_map = NULL;
+/** Every spool_blob_t, least recently served first. */
+static TOR_TAILQ_HEAD(spool_blob_lru_t, spool_blob_t) spool_blob_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(spool_blob_lru);
+/** Total compressed length of every spool_blob_t. */
+static size_t spool_blob_total_len = 0;
+
+/** Return true iff the objects in <b>spool</b> can be served from a shared
+ * blob: that is, iff each of them is a small object named by the digest of
+ * its contents, so that the answer to a request never changes. */
+static int
+spool_is_shareable(const smartlist_t *spool)
+{
+  if (smartlist_len(spool) == 0)
+    return 0;
+  SMARTLIST_FOREACH_BEGIN(spool, const spooled_resource_t *, spooled) {
+    switch (spooled->spool_source) {
+      case DIR_SPOOL_MICRODESC:
+      case DIR_SPOOL_SERVER_BY_DIGEST:
+      case DIR_SPOOL_EXTRA_BY_DIGEST:
+        break;
+      case DIR_SPOOL_SERVER_BY_FP:
+      case DIR_SPOOL_EXTRA_BY_FP:
+      case DIR_SPOOL_NETWORKSTATUS:
+      case DIR_SPOOL_CONSENSUS_CACHE_ENTRY:
+      case DIR_SPOOL_SHARED_BLOB:
+      default:
+        return 0;
+    }
+  } SMARTLIST_FOREACH_END(spooled);
+  return 1;
+}
+
+/** Return true iff we are willing to compress a whole spool with
+ * <b>method</b> in one go.  LZMA is too slow for that: it is left to the
+ * usual compression as the spool is sent. */
+static int
+spool_blob_method_is_ok(compress_method_t method)
+{
+  switch (method) {
+    case GZIP_METHOD:
+    case ZLIB_METHOD:
+    case ZSTD_METHOD:
+      return 1;
+    case NO_METHOD:
+    case LZMA_METHOD:
+    case UNKNOWN_METHOD:
+    default:
+      return 0;
+  }
+}
+
+/** Set <b>key_out</b> to a digest of everything that affects the answer to
+ * <b>spool</b>: the objects, their order, the compression <b>method</b>,
+ * and whether the connection <b>is_encrypted</b>.  The caller sorts the
+ * spool first, so that the same objects asked for in a different order get
+ * the same key. */
+static void
+spool_blob_compute_key(uint8_t *key_out, const smartlist_t *spool,
+                       compress_method_t method, int is_encrypted)
+{
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  uint8_t hdr[2] = { (uint8_t) method, is_encrypted ? 1 : 0 };
+  crypto_digest_add_bytes(d, (const char *) hdr, sizeof(hdr));
+  SMARTLIST_FOREACH_BEGIN(spool, const spooled_resource_t *, spooled) {
+    uint8_t source = (uint8_t) spooled->spool_source;
+    crypto_digest_add_bytes(d, (const char *) &source, 1);
+    crypto_digest_add_bytes(d, (const char *) spooled->digest,
+                            sizeof(spooled->digest));
+  } SMARTLIST_FOREACH_END(spooled);
+  crypto_digest_get_digest(d, (char *) key_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+}
+
+/** Remove <b>ent</b> from the shared blob cache, and free it.  Connections
+ * still sending the blob keep their own reference. */
+static void
+spool_blob_free(spool_blob_t *ent)
+{
+  digest256map_remove(spool_blob_map, ent->key);
+  TOR_TAILQ_REMOVE(&spool_blob_lru, ent, lru_next);
+  spool_blob_total_len -= ent->blob->dir_compressed_len;
+  cached_dir_decref(ent->blob);
+  tor_free(ent);
+}
+
+/** Remove blobs that nobody has asked for since before <b>cutoff</b>, then
+ * the least recently served ones, until the cache would have room for
+ * <b>extra</b> more bytes. */
+static void
+spool_blob_cache_shrink(time_t cutoff, size_t extra)
+{
+  spool_blob_t *ent;
+  while ((ent = TOR_TAILQ_FIRST(&spool_blob_lru))) {
+    if (ent->last_served >= cutoff &&
+        spool_blob_total_len + extra <= SPOOL_BLOB_CACHE_MAX_BYTES)
+      break;
+    spool_blob_free(ent);
+  }
+}
+
+/* A blob is never bigger than its input by more than a little compression
+ * framing, so a blob we build always fits in the cache. */
+CTASSERT(SPOOL_BLOB_MAX_INPUT_LEN * 2 <= SPOOL_BLOB_CACHE_MAX_BYTES / 4);
+
+/** Compress the body of every object in <b>spool</b>, in order, with
+ * <b>method</b> at <b>level</b>.  Skip objects that have gone missing, or
+ * that we would not send on a connection unless <b>is_encrypted</b>.
+ * Return a new cached_dir_t holding the result, or NULL on failure or if the
+ * spool is too big to share. */
+static cached_dir_t *
+spool_blob_build(const smartlist_t *spool, compress_method_t method,
+                 compression_level_t level, int is_encrypted)
+{
+  tor_compress_state_t *state;
+  buf_t *buf = NULL;
+  cached_dir_t *d = NULL;
+  size_t total = 0;
+
+  SMARTLIST_FOREACH_BEGIN(spool, const spooled_resource_t *, spooled) {
+    const uint8_t *body = NULL;
+    size_t bodylen = 0;
+    if (spooled_resource_lookup_body(spooled, is_encrypted,
+                                     &body, &bodylen, NULL) == 0)
+      total += bodylen;
+  } SMARTLIST_FOREACH_END(spooled);
+  if (total == 0 || total > SPOOL_BLOB_MAX_INPUT_LEN)
+    return NULL;
+
+  state = tor_compress_new(1, method, level);
+  if (!state)
+    return NULL;
+  buf = buf_new();
+  SMARTLIST_FOREACH_BEGIN(spool, const spooled_resource_t *, spooled) {
+    const uint8_t *body = NULL;
+    size_t bodylen = 0;
+    if (spooled_resource_lookup_body(spooled, is_encrypted,
+                                     &body, &bodylen, NULL) < 0 ||
+        bodylen == 0)
+      continue;
+    if (buf_add_compress(buf, state, (const char *) body, bodylen, 0) < 0)
+      goto err;
+  } SMARTLIST_FOREACH_END(spooled);
+  if (buf_add_compress(buf, state, "", 0, 1) < 0)
+    goto err;
+
+  d = tor_malloc_zero(sizeof(cached_dir_t));
+  d->refcnt = 1;
+  d->published = approx_time();
+  d->dir_compressed = buf_extract(buf, &d->dir_compressed_len);
+
+ err:
+  tor_compress_free(state);
+  buf_free(buf);
+  return d;
+}
+
+/** Try to answer the request spooled on <b>conn</b> from a shared
+ * compressed blob, building the blob with <b>method</b> at <b>level</b> if
+ * we do not have one yet.
+ *
+ * The blob holds the objects sorted by digest, whatever order the client
+ * asked for them in.
+ *
+ * On success, replace <b>conn</b>'s spool with the blob and return 1: the
+ * caller must not compress the spool again.  Otherwise, leave the spool
+ * alone and return 0. */
+int
+dirserv_spool_use_shared_blob(dir_connection_t *conn,
+                              compress_method_t method,
+                              compression_level_t level)
+{
+  const time_t now = approx_time();
+  const int is_encrypted = connection_dir_is_encrypted(conn);
+  uint8_t key[DIGEST256_LEN];
+  spool_blob_t *ent;
+  smartlist_t *sorted;
+
+  if (!spool_blob_method_is_ok(method) || !conn->spool ||
+      !spool_is_shareable(conn->spool))
+    return 0;
+
+  if (!spool_blob_map)
+    spool_blob_map = digest256map_new();
+
+  sorted = smartlist_new();
+  smartlist_add_all(sorted, conn->spool);
+  smartlist_sort(sorted, dirserv_spool_sort_comparison_);
+  spool_blob_compute_key(key, sorted, method, is_encrypted);
+  ent = digest256map_get(spool_blob_map, key);
+  if (ent) {
+    TOR_TAILQ_REMOVE(&spool_blob_lru, ent, lru_next);
+  } else {
+    cached_dir_t *blob = spool_blob_build(sorted, method, level,
+                                          is_encrypted);
+    if (!blob) {
+      smartlist_free(sorted);
+      return 0;
+    }
+    spool_blob_cache_shrink(now - SPOOL_BLOB_IDLE_LIFETIME,
+                            blob->dir_compressed_len);
+    ent = tor_malloc_zero(sizeof(spool_blob_t));
+    memcpy(ent->key, key, sizeof(ent->key));
+    ent->blob = blob;
+    digest256map_set(spool_blob_map, ent->key, ent);
+    spool_blob_total_len += blob->dir_compressed_len;
+  }
+  ent->last_served = now;
+  TOR_TAILQ_INSERT_TAIL(&spool_blob_lru, ent, lru_next);
+
+  smartlist_free(sorted);
+  dir_conn_clear_spool(conn);
+  conn->spool = smartlist_new();
+  spooled_resource_t *spooled = tor_malloc_zero(sizeof(spooled_resource_t));
+  spooled->spool_source = DIR_SPOOL_SHARED_BLOB;
+  spooled->spool_eagerly = 0;
+  spooled->cached_dir_ref = ent->blob;
+  ++ent->blob->refcnt;
+  smartlist_add(conn->spool, spooled);
+  return 1;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of shared compressed spools we are holding. */
+STATIC int
+spool_blob_cache_get_n_entries(void)
+{
+  return spool_blob_map ? digest256map_size(spool_blob_map) : 0;
+}
+
+/** Return the total compressed length of the shared spools we hold. */
+STATIC size_t
+spool_blob_cache_get_total_len(void)
+{
+  return spool_blob_total_len;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
+/** Release every shared compressed spool. */
+static void
+spool_blob_cache_free_all(void)
+{
+  spool_blob_t *ent;
+  while ((ent = TOR_TAILQ_FIRST(&spool_blob_lru)))
+    spool_blob_free(ent);
+  digest256map_free(spool_blob_map, NULL);
+  spool_blob_map = NULL;
+}
+
 /** Return the cache-info for identity fingerprint <b>fp</b>, or
  * its extra-info document if <b>extrainfo</b> is true. Return
  * NULL if not found or if the descriptor is older than
@@ -800,4 +1079,5 @@ dirserv_free_all(void)
 {
   strmap_free(cached_consensuses, free_cached_dir_);
   cached_consensuses = NULL;
+  spool_blob_cache_free_all();
 }
@@ -14,6 +14,7 @@
 
 struct ed25519_public_key_t;
 
+#include "lib/compress/compress.h"
 #include "lib/testsupport/testsupport.h"
 
 /** Ways to convert a spoolable_resource_t to a bunch of bytes. */
@@ -23,6 +24,7 @@ typedef enum dir_spool_source_t {
     DIR_SPOOL_MICRODESC,
     DIR_SPOOL_NETWORKSTATUS,
     DIR_SPOOL_CONSENSUS_CACHE_ENTRY,
+    DIR_SPOOL_SHARED_BLOB,
 } dir_spool_source_t;
 #define dir_spool_source_bitfield_t ENUM_BF(dir_spool_source_t)
 
@@ -138,6 +140,27 @@ void dirserv_spool_remove_missing_and_guess_size(dir_connection_t *conn,
                                                  size_t *size_out,
                                                  int *n_expired_out);
 void dirserv_spool_sort(dir_connection_t *conn);
+int dirserv_spool_use_shared_blob(dir_connection_t *conn,
+                                  compress_method_t method,
+                                  compression_level_t level);
 void dir_conn_clear_spool(dir_connection_t *conn);
 
+#ifdef DIRSERV_PRIVATE
+/** Largest number of bytes of shared compressed spools that we keep. */
+#define SPOOL_BLOB_CACHE_MAX_BYTES (16*1024*1024)
+/** Largest uncompressed spool that we compress into a shared blob.  We
+ * build the blob all at once, before the client has read anything, so this
+ * bounds the work one request can make us do up front.  It is enough for the
+ * biggest batches of microdescriptors and descriptors that clients ask for;
+ * bigger spools are compressed as they are sent. */
+#define SPOOL_BLOB_MAX_INPUT_LEN (256*1024)
+/** How long do we keep a shared compressed spool that nobody asks for? */
+#define SPOOL_BLOB_IDLE_LIFETIME (30*60)
+
+#ifdef TOR_UNIT_TESTS
+STATIC int spool_blob_cache_get_n_entries(void);
+STATIC size_t spool_blob_cache_get_total_len(void);
+#endif /* defined(TOR_UNIT_TESTS) */
+#endif /* defined(DIRSERV_PRIVATE) */
+
 #endif /* !defined(TOR_DIRSERV_H) */
@@ -13,6 +13,7 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/protover.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
@@ -29,6 +30,7 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
 
 #include "feature/dirauth/vote_microdesc_hash_st.h"
@@ -236,7 +238,7 @@ find_start_of_next_routerstatus(const char *s, const char *s_eos)
  *  the same semantic as in routerstatus_parse_entry_from_string(). */
 STATIC int
 routerstatus_parse_guardfraction(const char *guardfraction_str,
-                                 networkstatus_t *vote,
+                                 const networkstatus_t *vote,
                                  vote_routerstatus_t *vote_rs,
                                  routerstatus_t *rs)
 {
@@ -261,7 +263,9 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   guardfraction = (uint32_t)tor_parse_ulong(end_of_header+1,
                                             10, 0, 100, &ok, NULL);
   if (!ok) {
-    log_warn(LD_DIR, "Invalid GuardFraction %s", escaped(guardfraction_str));
+    char *esc = esc_for_log(guardfraction_str);
+    log_warn(LD_DIR, "Invalid GuardFraction %s", esc);
+    tor_free(esc);
     return -1;
   }
 
@@ -286,35 +290,31 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   return 0;
 }
 
-/** Given a string at *<b>s</b>, containing a routerstatus object, and an
- * empty smartlist at <b>tokens</b>, parse and return the first router status
- * object in the string, and advance *<b>s</b> to just after the end of the
- * router status.  Return NULL and advance *<b>s</b> on error.
- *
- * If <b>vote</b> and <b>vote_rs</b> are provided, don't allocate a fresh
- * routerstatus but use <b>vote_rs</b> instead.
- *
- * If <b>consensus_method</b> is nonzero, this routerstatus is part of a
- * consensus, and we should parse it according to the method used to
- * make that consensus.
- *
- * Parse according to the syntax used by the consensus flavor <b>flav</b>.
- **/
-STATIC routerstatus_t *
-routerstatus_parse_entry_from_string(memarea_t *area,
-                                     const char **s, const char *s_eos,
-                                     smartlist_t *tokens,
-                                     networkstatus_t *vote,
-                                     vote_routerstatus_t *vote_rs,
-                                     int consensus_method,
-                                     consensus_flavor_t flav)
+/** Escape <b>str</b> for logging into the local <b>esc</b>.  Unlike
+ * escaped(), this is safe to use off the main thread. */
+#define ESC(str) (tor_free(esc), esc = esc_for_log(str))
+
+/** Helper for routerstatus_parse_entry_from_string(): do all the parsing
+ * work, but without touching any state outside the routerstatus itself, so
+ * that it can run on a cpuworker thread.  The caller is responsible for
+ * setting <b>vote</b>-&gt;has_measured_bws, and for dumping the entry on
+ * failure. */
+static routerstatus_t *
+routerstatus_parse_entry_impl(memarea_t *area,
+                              const char **s, const char *s_eos,
+                              smartlist_t *tokens,
+                              const networkstatus_t *vote,
+                              vote_routerstatus_t *vote_rs,
+                              int consensus_method,
+                              consensus_flavor_t flav)
 {
-  const char *eos, *s_dup = *s;
+  const char *eos;
   routerstatus_t *rs = NULL;
   directory_token_t *tok;
   char timebuf[ISO_TIME_LEN+1];
   struct in_addr in;
   int offset = 0;
+  char *esc = NULL;
   tor_assert(tokens);
   tor_assert(bool_eq(vote, vote_rs));
 
@@ -352,21 +352,21 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (!is_legal_nickname(tok->args[0])) {
     log_warn(LD_DIR,
              "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+             ESC(tok->args[0]));
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
     log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+             ESC(tok->args[1]));
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
       log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+               ESC(tok->args[2]));
       goto err;
     }
   }
@@ -385,7 +385,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
     log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+             ESC(tok->args[5+offset]));
     goto err;
   }
   tor_addr_from_in(&rs->ipv4_addr, &in);
@@ -413,7 +413,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
         vote_rs->flags |= (UINT64_C(1)<<p);
       } else {
         log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+                 ESC(tok->args[i]));
         goto err;
       }
     }
@@ -492,7 +492,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                     10, 0, UINT32_MAX,
                                     &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          log_warn(LD_DIR, "Invalid Bandwidth %s", ESC(tok->args[i]));
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -503,11 +503,10 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
           log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+                   ESC(tok->args[i]));
           goto err;
         }
         vote_rs->has_measured_bw = 1;
-        vote->has_measured_bws = 1;
       } else if (!strcmpstart(tok->args[i], "Unmeasured=1")) {
         rs->bw_is_unmeasured = 1;
       } else if (!strcmpstart(tok->args[i], "GuardFraction=")) {
@@ -525,7 +524,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
       log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+               ESC(tok->args[0]));
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -568,14 +567,16 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
         log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+                 ESC(tok->args[0]));
         goto err;
       }
     } else {
+      char id_hex[HEX_DIGEST_LEN+1], addrbuf[TOR_ADDR_BUF_LEN];
+      base16_encode(id_hex, sizeof(id_hex), rs->identity_digest, DIGEST_LEN);
+      tor_addr_to_str(addrbuf, &rs->ipv4_addr, sizeof(addrbuf), 0);
       log_info(LD_BUG, "Found an entry in networkstatus with no "
                "microdescriptor digest. (Router %s ($%s) at %s:%d.)",
-               rs->nickname, hex_str(rs->identity_digest, DIGEST_LEN),
-               fmt_addr(&rs->ipv4_addr), rs->ipv4_orport);
+               rs->nickname, id_hex, addrbuf, rs->ipv4_orport);
     }
   }
 
@@ -584,11 +585,11 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
  done:
+  tor_free(esc);
   SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   smartlist_clear(tokens);
   if (area) {
@@ -600,6 +601,46 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+#undef ESC
+
+#ifdef TOR_UNIT_TESTS
+/** Given a string at *<b>s</b>, containing a routerstatus object, and an
+ * empty smartlist at <b>tokens</b>, parse and return the first router status
+ * object in the string, and advance *<b>s</b> to just after the end of the
+ * router status.  Return NULL and advance *<b>s</b> on error.
+ *
+ * If <b>vote</b> and <b>vote_rs</b> are provided, don't allocate a fresh
+ * routerstatus but use <b>vote_rs</b> instead.
+ *
+ * If <b>consensus_method</b> is nonzero, this routerstatus is part of a
+ * consensus, and we should parse it according to the method used to
+ * make that consensus.
+ *
+ * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ **/
+STATIC routerstatus_t *
+routerstatus_parse_entry_from_string(memarea_t *area,
+                                     const char **s, const char *s_eos,
+                                     smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav)
+{
+  const char *s_dup = *s;
+  routerstatus_t *rs;
+
+  rs = routerstatus_parse_entry_impl(area, s, s_eos, tokens, vote, vote_rs,
+                                     consensus_method, flav);
+  if (!rs)
+    dump_desc(s_dup, "routerstatus entry");
+  else if (vote_rs && vote_rs->has_measured_bw)
+    vote->has_measured_bws = 1;
+
+  return rs;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 int
 compare_vote_routerstatus_entries(const void **_a, const void **_b)
 {
@@ -1088,6 +1129,319 @@ dup_protocols_string(smartlist_t *tokens, bool *error, directory_keyword kw)
   return tor_strdup(tok->args[0]);
 }
 
+/** Don't bother parsing routerstatus entries on the cpuworker threads unless
+ * there are at least this many bytes of them: below this, handing the work
+ * off costs more than it saves. */
+STATIC size_t ns_parse_parallel_min_len = 256*1024;
+/** Never split the routerstatus entries into chunks shorter than this. */
+STATIC size_t ns_parse_min_chunk_len = 32*1024;
+/** Split the routerstatus entries into this many chunks per thread, so that
+ * a thread that gets to the work late doesn't hold everybody up. */
+#define NS_PARSE_CHUNKS_PER_THREAD 4
+
+/** A run of consecutive routerstatus entries in a networkstatus document,
+ * parsed in one go by a single thread. */
+typedef struct rs_chunk_t {
+  /** The first entry in this chunk. */
+  const char *start;
+  /** The start of the next chunk, or the end of the document if this is the
+   * last chunk. */
+  const char *end;
+  /** Where parsing stopped.  For every chunk but the last, this is
+   * <b>end</b> unless we hit something other than a routerstatus. */
+  const char *stopped_at;
+  /** If we found a malformed entry in this chunk, its start. */
+  const char *failed_at;
+  /** The routerstatus_t (or vote_routerstatus_t) entries parsed from this
+   * chunk, in order; NULL if we never parsed it. */
+  smartlist_t *entries;
+} rs_chunk_t;
+
+/** State for parsing the routerstatus entries of a single networkstatus
+ * document, shared between the main thread and any cpuworkers helping it. */
+typedef struct rs_parse_job_t {
+  /** The vote whose entries we're parsing, or NULL for a consensus.  Not
+   * modified while the entries are parsed. */
+  const networkstatus_t *vote;
+  /** The consensus method and flavor to parse entries with. */
+  int consensus_method;
+  consensus_flavor_t flav;
+  /** The end of the document. */
+  const char *eos;
+  /** The chunks to parse, in document order. */
+  rs_chunk_t *chunks;
+  int n_chunks;
+
+  /** Lock protecting the fields below. */
+  tor_mutex_t lock;
+  /** Signalled once every chunk is done. */
+  tor_cond_t cond;
+  /** The index of the next chunk that nobody has claimed yet. */
+  int next_chunk;
+  /** How many chunks have been parsed or skipped? */
+  int n_done;
+  /** True iff some chunk had a malformed entry, so that the chunks after it
+   * don't matter. */
+  bool failed;
+
+  /** One reference for the main thread, plus one for each work entry that
+   * we queued and that hasn't replied yet.  Only used by the main thread. */
+  int refcnt;
+} rs_parse_job_t;
+
+/** Free every entry in <b>entries</b> (routerstatus_t entries if
+ * <b>is_vote</b> is false, vote_routerstatus_t otherwise), and the list. */
+static void
+rs_entries_free(smartlist_t *entries, int is_vote)
+{
+  if (!entries)
+    return;
+  if (is_vote)
+    SMARTLIST_FOREACH(entries, vote_routerstatus_t *, rs,
+                      vote_routerstatus_free(rs));
+  else
+    SMARTLIST_FOREACH(entries, routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_free(entries);
+}
+
+/** Create a new rs_parse_job_t for the routerstatus entries that start at
+ * <b>s</b>, in a document ending at <b>eos</b>.  If <b>n_threads</b> is
+ * nonzero and there are enough entries, split them into chunks at entry
+ * boundaries; otherwise make a single chunk. */
+static rs_parse_job_t *
+rs_parse_job_new(const networkstatus_t *ns, const char *s, const char *eos,
+                 consensus_flavor_t flav, unsigned n_threads)
+{
+  rs_parse_job_t *job = tor_malloc_zero(sizeof(rs_parse_job_t));
+  const char *rs_end;
+  size_t rs_len;
+  int max_chunks = 1;
+
+  if (ns->type != NS_TYPE_CONSENSUS) {
+    job->vote = ns;
+  } else {
+    job->consensus_method = ns->consensus_method;
+    job->flav = flav;
+  }
+  job->eos = eos;
+  tor_mutex_init_nonrecursive(&job->lock);
+  tor_cond_init(&job->cond);
+  job->refcnt = 1;
+
+  /* Only split up to the footer (or the signatures, if there's no footer),
+   * so that we never look at anything the serial parse wouldn't. */
+  if (n_threads && (size_t)(eos - s) >= ns_parse_parallel_min_len) {
+    rs_end = tor_memstr(s, eos - s, "\ndirectory-");
+    if (!rs_end)
+      rs_end = eos;
+    rs_len = rs_end - s;
+    if (rs_len >= ns_parse_parallel_min_len) {
+      max_chunks = (int) MIN(rs_len / MAX(ns_parse_min_chunk_len, 1),
+                             (n_threads + 1) * NS_PARSE_CHUNKS_PER_THREAD);
+    }
+  } else {
+    rs_end = eos;
+    rs_len = 0;
+  }
+
+  job->chunks = tor_calloc(MAX(max_chunks, 1), sizeof(rs_chunk_t));
+  job->chunks[0].start = s;
+  job->n_chunks = 1;
+  for (int i = 1; i < max_chunks; ++i) {
+    const char *prev = job->chunks[job->n_chunks - 1].start;
+    const char *target = MAX(s + rs_len * i / max_chunks, prev);
+    const char *next = tor_memstr(target, rs_end - target, "\nr ");
+    if (!next)
+      break;
+    job->chunks[job->n_chunks - 1].end = next + 1;
+    job->chunks[job->n_chunks++].start = next + 1;
+  }
+  job->chunks[job->n_chunks - 1].end = eos;
+
+  return job;
+}
+
+/** Drop a reference to <b>job</b>, freeing it and anything left in its
+ * chunks once nobody is using it any more. */
+static void
+rs_parse_job_decref(rs_parse_job_t *job)
+{
+  if (--job->refcnt > 0)
+    return;
+
+  for (int i = 0; i < job->n_chunks; ++i)
+    rs_entries_free(job->chunks[i].entries, job->vote != NULL);
+  tor_free(job->chunks);
+  tor_cond_uninit(&job->cond);
+  tor_mutex_uninit(&job->lock);
+  tor_free(job);
+}
+
+/** Parse every routerstatus entry in <b>chunk</b> of <b>job</b>, stopping
+ * at the first malformed one.  Safe to call from any thread. */
+static void
+rs_chunk_parse(const rs_parse_job_t *job, rs_chunk_t *chunk)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  const char *s = chunk->start, *eos = job->eos;
+
+  chunk->entries = smartlist_new();
+  while (s < chunk->end && eos - s >= 2 && fast_memeq(s, "r ", 2)) {
+    const char *entry = s;
+    routerstatus_t *rs;
+    if (job->vote) {
+      vote_routerstatus_t *vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+      rs = routerstatus_parse_entry_impl(area, &s, eos, tokens, job->vote,
+                                         vrs, 0, 0);
+      if (rs)
+        smartlist_add(chunk->entries, vrs);
+      else
+        vote_routerstatus_free(vrs);
+    } else {
+      rs = routerstatus_parse_entry_impl(area, &s, eos, tokens, NULL, NULL,
+                                         job->consensus_method, job->flav);
+      if (rs)
+        smartlist_add(chunk->entries, rs);
+    }
+    if (!rs) {
+      chunk->failed_at = entry;
+      break;
+    }
+  }
+  chunk->stopped_at = s;
+
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+/** Claim and parse chunks from <b>job</b> until there are none left.  Run
+ * by the main thread and by every cpuworker that picks up the job. */
+static void
+rs_parse_job_run(rs_parse_job_t *job)
+{
+  while (1) {
+    rs_chunk_t *chunk;
+    bool skip;
+
+    tor_mutex_acquire(&job->lock);
+    if (job->next_chunk == job->n_chunks) {
+      tor_mutex_release(&job->lock);
+      return;
+    }
+    chunk = &job->chunks[job->next_chunk++];
+    skip = job->failed;
+    tor_mutex_release(&job->lock);
+
+    if (!skip)
+      rs_chunk_parse(job, chunk);
+
+    tor_mutex_acquire(&job->lock);
+    if (chunk->failed_at)
+      job->failed = true;
+    if (++job->n_done == job->n_chunks)
+      tor_cond_signal_all(&job->cond);
+    tor_mutex_release(&job->lock);
+  }
+}
+
+/** Worker function: help parse the chunks of an rs_parse_job_t. */
+static workqueue_reply_t
+rs_parse_job_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  rs_parse_job_run(work_);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: drop the reference held by a finished work entry. */
+static void
+rs_parse_job_replyfn(void *work_)
+{
+  rs_parse_job_decref(work_);
+}
+
+/** Parse the routerstatus entries starting at *<b>s</b>, in a document
+ * ending at <b>eos</b>, into <b>ns</b>-&gt;routerstatus_list, and advance
+ * *<b>s</b> past them.  Return 0 on success and -1 if any entry is
+ * malformed.
+ *
+ * If <b>use_workers</b> is true and the document is big enough, split the
+ * entries into chunks and parse them on the cpuworker threads as well as
+ * this one.  The result is the same either way. */
+static int
+networkstatus_parse_routerstatuses(networkstatus_t *ns, const char **s,
+                                   const char *eos, consensus_flavor_t flav,
+                                   int use_workers)
+{
+  const int is_vote = ns->type != NS_TYPE_CONSENSUS;
+  const char *start = *s;
+  unsigned n_threads = 0;
+  rs_parse_job_t *job;
+  int r = 0, retry_serially = 0;
+
+  if (use_workers) {
+    /* This thread does its share of the work too, so only ask for help from
+     * as many threads as we have other CPUs. */
+    int n_other_cpus = get_num_cpus(get_options()) - 1;
+    n_threads = MIN(cpuworker_get_n_threads(), (unsigned)MAX(n_other_cpus, 0));
+  }
+
+  job = rs_parse_job_new(ns, start, eos, flav, n_threads);
+
+  if (job->n_chunks > 1) {
+    /* The main thread is blocked until we're done, so ask for help at
+     * high priority. */
+    int n_helpers = MIN((int)n_threads, job->n_chunks - 1);
+    for (int i = 0; i < n_helpers; ++i) {
+      ++job->refcnt;
+      if (!cpuworker_queue_work(WQ_PRI_HIGH, rs_parse_job_threadfn,
+                                rs_parse_job_replyfn, job))
+        --job->refcnt;
+    }
+  }
+
+  rs_parse_job_run(job);
+  tor_mutex_acquire(&job->lock);
+  while (job->n_done < job->n_chunks)
+    tor_cond_wait(&job->cond, &job->lock, NULL);
+  tor_mutex_release(&job->lock);
+
+  /* Merge the chunks in document order, so that the result (including
+   * which entry we complain about) is exactly what a serial parse gives. */
+  for (int i = 0; i < job->n_chunks; ++i) {
+    rs_chunk_t *chunk = &job->chunks[i];
+    if (chunk->failed_at) {
+      dump_desc(chunk->failed_at, "routerstatus entry");
+      r = -1;
+      break;
+    }
+    if (is_vote) {
+      SMARTLIST_FOREACH(chunk->entries, vote_routerstatus_t *, vrs,
+                        if (vrs->has_measured_bw) ns->has_measured_bws = 1);
+    }
+    smartlist_add_all(ns->routerstatus_list, chunk->entries);
+    smartlist_free(chunk->entries);
+    *s = chunk->stopped_at;
+    if (i < job->n_chunks - 1 && chunk->stopped_at != chunk->end) {
+      /* Something other than a routerstatus in the middle of the entries:
+       * start over, and let the serial parse decide what to make of it. */
+      retry_serially = 1;
+      break;
+    }
+  }
+  rs_parse_job_decref(job);
+
+  if (retry_serially) {
+    rs_entries_free(ns->routerstatus_list, is_vote);
+    ns->routerstatus_list = smartlist_new();
+    ns->has_measured_bws = 0;
+    *s = start;
+    return networkstatus_parse_routerstatuses(ns, s, eos, flav, 0);
+  }
+  return r;
+}
+
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
  * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
 networkstatus_t *
@@ -1097,7 +1451,7 @@ networkstatus_parse_vote_from_string(const char *s,
                                      networkstatus_type_t ns_type)
 {
   smartlist_t *tokens = smartlist_new();
-  smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
+  smartlist_t *footer_tokens = NULL;
   networkstatus_voter_info_t *voter = NULL;
   networkstatus_t *ns = NULL;
   common_digests_t ns_digests;
@@ -1106,7 +1460,7 @@ networkstatus_parse_vote_from_string(const char *s,
   directory_token_t *tok;
   struct in_addr in;
   int i, inorder, n_signatures = 0;
-  memarea_t *area = NULL, *rs_area = NULL;
+  memarea_t *area = NULL;
   consensus_flavor_t flav = FLAV_NS;
   char *last_kwd=NULL;
   const char *eos = s + s_len;
@@ -1469,35 +1823,12 @@ networkstatus_parse_vote_from_string(const char *s,
   }
 
   /* Parse routerstatus lines. */
-  rs_tokens = smartlist_new();
-  rs_area = memarea_new();
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
-  while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
-      vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, eos, rs_tokens, ns,
-                                               rs, 0, 0)) {
-        smartlist_add(ns->routerstatus_list, rs);
-      } else {
-        vote_routerstatus_free(rs);
-        goto err; // Malformed routerstatus, reject this vote.
-      }
-    } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, eos,
-                                                     rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav))) {
-        /* Use exponential-backoff scheduling when downloading microdescs */
-        smartlist_add(ns->routerstatus_list, rs);
-      } else {
-        goto err; // Malformed routerstatus, reject this vote.
-      }
-    }
-  }
+  if (networkstatus_parse_routerstatuses(ns, &s, eos, flav, 1) < 0)
+    goto err; // Malformed routerstatus, reject this vote.
+
   for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
     routerstatus_t *rs1, *rs2;
     if (ns->type != NS_TYPE_CONSENSUS) {
@@ -1719,10 +2050,6 @@ networkstatus_parse_vote_from_string(const char *s,
     tor_free(voter->contact);
     tor_free(voter);
   }
-  if (rs_tokens) {
-    SMARTLIST_FOREACH(rs_tokens, directory_token_t *, t, token_clear(t));
-    smartlist_free(rs_tokens);
-  }
   if (footer_tokens) {
     SMARTLIST_FOREACH(footer_tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(footer_tokens);
@@ -1731,8 +2058,6 @@ networkstatus_parse_vote_from_string(const char *s,
     DUMP_AREA(area, "v3 networkstatus");
     memarea_drop_all(area);
   }
-  if (rs_area)
-    memarea_drop_all(rs_area);
   tor_free(last_kwd);
 
   return ns;
@@ -30,10 +30,11 @@ networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
 
 #ifdef NS_PARSE_PRIVATE
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
-                                            networkstatus_t *vote,
+                                            const networkstatus_t *vote,
                                             vote_routerstatus_t *vote_rs,
                                             routerstatus_t *rs);
 struct memarea_t;
+#ifdef TOR_UNIT_TESTS
 STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      struct memarea_t *area,
                                      const char **s, const char *eos,
@@ -42,6 +43,9 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+#endif /* defined(TOR_UNIT_TESTS) */
+EXTERN(size_t, ns_parse_parallel_min_len)
+EXTERN(size_t, ns_parse_min_chunk_len)
 #endif /* defined(NS_PARSE_PRIVATE) */
 
 #endif /* !defined(TOR_NS_PARSE_H) */
@@ -19,6 +19,10 @@
 
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define MIN_ANNOTATION A_PURPOSE
 #define MAX_ANNOTATION A_UNKNOWN_
 
@@ -36,6 +40,58 @@
     goto done_tokenizing;                                          \
   STMT_END
 
+#ifdef __SSE2__
+/** Return a bitmask of the 16 bytes at <b>p</b> that would stop
+ * find_whitespace_eos(): whitespace, <b>#</b>, and NUL. */
+static inline unsigned
+token_delim_mask(const char *p)
+{
+  const __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+  return (unsigned)_mm_movemask_epi8(m);
+}
+
+/** Return the index of the lowest set bit in the nonzero mask <b>m</b>. */
+static inline unsigned
+token_mask_first(unsigned m)
+{
+#ifdef __GNUC__
+  return (unsigned)__builtin_ctz(m);
+#else
+  unsigned i = 0;
+  while (!(m & 1)) {
+    m >>= 1;
+    ++i;
+  }
+  return i;
+#endif /* defined(__GNUC__) */
+}
+#endif /* defined(__SSE2__) */
+
+/** As find_whitespace_eos(<b>s</b>, <b>eos</b>), but examine 16 bytes at a
+ * time where we can.  Every byte in [<b>s</b>, <b>eos</b>) must be
+ * readable; callers who want to stop at the end of a line should pass the
+ * end of the document as <b>eos</b>, since the newline stops the scan
+ * anyway. */
+static inline const char *
+find_token_end(const char *s, const char *eos)
+{
+#ifdef __SSE2__
+  while (eos - s >= 16) {
+    unsigned m = token_delim_mask(s);
+    if (m)
+      return s + token_mask_first(m);
+    s += 16;
+  }
+#endif /* defined(__SSE2__) */
+  return find_whitespace_eos(s, eos);
+}
+
 /** Free all resources allocated for <b>tok</b> */
 void
 token_clear(directory_token_t *tok)
@@ -159,26 +215,30 @@ tokenize_string(memarea_t *area,
  * <b>eol</b>, and store them in the args field of <b>tok</b>.  Store the
  * number of parsed elements into the n_args field of <b>tok</b>.  Allocate
  * all storage in <b>area</b>.  Return the number of arguments parsed, or
- * return -1 if there was an insanely high number of arguments. */
+ * return -1 if there was an insanely high number of arguments.
+ *
+ * We find the arguments by scanning the original string, which is readable
+ * up to <b>eos</b>, and split a single copy of the line at the same
+ * offsets. */
 static inline int
 get_token_arguments(memarea_t *area, directory_token_t *tok,
-                    const char *s, const char *eol)
+                    const char *s, const char *eol, const char *eos)
 {
 /** Largest number of arguments we'll accept to any token, ever. */
 #define MAX_ARGS 512
   char *mem = memarea_strndup(area, s, eol-s);
-  char *cp = mem;
+  const char *cp = s;
   int j = 0;
   char *args[MAX_ARGS];
-  while (*cp) {
+  while (cp < eol && *cp) {
     if (j == MAX_ARGS)
       return -1;
-    args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
+    args[j++] = mem + (cp - s);
+    cp = find_token_end(cp, eos);
+    if (cp >= eol || !*cp)
       break; /* End of the line. */
-    *cp++ = '\0';
-    cp = (char*)eat_whitespace(cp);
+    mem[cp - s] = '\0';
+    cp = eat_whitespace_eos(cp + 1, eol);
   }
   tok->n_args = j;
   tok->args = memarea_memdup(area, args, j*sizeof(char*));
@@ -290,20 +350,23 @@ get_next_token(memarea_t *area,
     RET_ERR("Line far too long");
   }
 
-  next = find_whitespace_eos(*s, eol);
+  /* The keyword can't run past eol, since the newline there stops it. */
+  next = find_token_end(*s, eos);
 
   if (mem_eq_token(*s, next-*s, "opt")) {
     /* Skip past an "opt" at the start of the line. */
     *s = eat_whitespace_eos_no_nl(next, eol);
-    next = find_whitespace_eos(*s, eol);
+    next = find_token_end(*s, eos);
   } else if (*s == eos) {  /* If no "opt", and end-of-line, line is invalid */
     RET_ERR("Unexpected EOF");
   }
 
   /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
+   * instead, but it wasn't any faster.)  Checking the first character
+   * before the length spares us a strlen() on most of the table. */
   for (i = 0; table[i].t ; ++i) {
-    if (mem_eq_token(*s, next-*s, table[i].t)) {
+    if (next > *s && table[i].t[0] == **s &&
+        mem_eq_token(*s, next-*s, table[i].t)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
@@ -318,7 +381,7 @@ get_next_token(memarea_t *area,
         tok->n_args = 1;
       } else {
         /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
+        if (get_token_arguments(area, tok, *s, eol, eos)<0) {
           tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
           RET_ERR(ebuf);
         }
@@ -350,8 +413,12 @@ get_next_token(memarea_t *area,
   /* Check whether there's an object present */
   *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
   tor_assert(eos >= *s);
+  /* Most lines aren't followed by an object, so look at the start of the
+   * next line before we scan for its end: the next call will do that. */
+  if (eos-*s < 11 || fast_memneq(*s, "-----BEGIN ", 11)) /* No object. */
+    goto check_object;
   eol = memchr(*s, '\n', eos-*s);
-  if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
+  if (!eol || eol-*s<11) /* No object. */
     goto check_object;
 
   if (eol - *s <= 16 || memchr(*s+11,'\0',eol-*s-16) || /* no short lines, */
@@ -52,20 +52,86 @@ entry_has_decrypted_descriptor(const hs_cache_client_descriptor_t *entry)
 /** Directory descriptor cache. Map indexed by blinded key. */
 static digest256map_t *hs_cache_v3_dir;
 
-/** Remove a given descriptor from our cache. */
+/** Every entry of the directory cache, ordered by expiry_ts, so that expiring
+ * entries doesn't need to look at the ones that haven't expired. */
+static smartlist_t *hs_cache_v3_dir_expiry;
+
+/** Eviction lists of the directory cache, least recently stored or
+ * downloaded first.  When we run out of memory, we evict entries that have
+ * never been downloaded before any that have: that way, someone uploading
+ * lots of descriptors pushes out each other's rather than the popular ones.
+ * Each entry is in exactly one of the two lists. */
+static TOR_TAILQ_HEAD(hs_cache_dir_lru_t, hs_cache_dir_descriptor_t)
+  hs_cache_v3_dir_fresh = TOR_TAILQ_HEAD_INITIALIZER(hs_cache_v3_dir_fresh),
+  hs_cache_v3_dir_downloaded =
+    TOR_TAILQ_HEAD_INITIALIZER(hs_cache_v3_dir_downloaded);
+
+/** Statistics about the directory cache. */
+static hs_cache_dir_stats_t hs_cache_v3_dir_stats;
+
+/** Helper: compare two directory cache entries by expiry time, for the
+ * expiry priority queue. */
+static int
+compare_dir_desc_by_expiry_(const void *a, const void *b)
+{
+  const hs_cache_dir_descriptor_t *da = a, *db = b;
+  if (da->expiry_ts < db->expiry_ts)
+    return -1;
+  else if (da->expiry_ts > db->expiry_ts)
+    return 1;
+  else
+    return 0;
+}
+
+/** Return the eviction list that <b>desc</b> belongs in. */
+static struct hs_cache_dir_lru_t *
+dir_desc_eviction_list(const hs_cache_dir_descriptor_t *desc)
+{
+  return desc->is_downloaded ? &hs_cache_v3_dir_downloaded
+                             : &hs_cache_v3_dir_fresh;
+}
+
+/** Remove a given descriptor from our cache, and update our cache size. */
 static void
-remove_v3_desc_as_dir(const hs_cache_dir_descriptor_t *desc)
+remove_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_remove(hs_cache_v3_dir, desc->key);
+  smartlist_pqueue_remove(hs_cache_v3_dir_expiry, compare_dir_desc_by_expiry_,
+                          offsetof(hs_cache_dir_descriptor_t, expiry_idx),
+                          desc);
+  TOR_TAILQ_REMOVE(dir_desc_eviction_list(desc), desc, eviction_next);
+
+  hs_cache_decrement_allocation(desc->alloc_size);
+  hs_cache_v3_dir_stats.n_bytes -= desc->alloc_size;
+  hs_cache_v3_dir_stats.n_entries--;
 }
 
-/** Store a given descriptor in our cache. */
+/** Store a given descriptor in our cache, and update our cache size. */
 static void
 store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_set(hs_cache_v3_dir, desc->key, desc);
+  smartlist_pqueue_add(hs_cache_v3_dir_expiry, compare_dir_desc_by_expiry_,
+                       offsetof(hs_cache_dir_descriptor_t, expiry_idx), desc);
+  TOR_TAILQ_INSERT_TAIL(dir_desc_eviction_list(desc), desc, eviction_next);
+
+  /* Update our total cache size with this entry for the OOM. This uses the
+   * old HS protocol cache subsystem for which we are tied with. */
+  hs_cache_increment_allocation(desc->alloc_size);
+  hs_cache_v3_dir_stats.n_bytes += desc->alloc_size;
+  hs_cache_v3_dir_stats.n_entries++;
+}
+
+/** Note that <b>desc</b> was just downloaded: move it to the end of the
+ * eviction list of downloaded entries. */
+static void
+touch_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
+{
+  TOR_TAILQ_REMOVE(dir_desc_eviction_list(desc), desc, eviction_next);
+  desc->is_downloaded = 1;
+  TOR_TAILQ_INSERT_TAIL(&hs_cache_v3_dir_downloaded, desc, eviction_next);
 }
 
 /** Query our cache and return the entry or NULL if not found. */
@@ -99,6 +165,14 @@ cache_dir_desc_free_void(void *ptr)
   cache_dir_desc_free_(ptr);
 }
 
+/** Return the size of a cache entry in bytes. */
+static size_t
+cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+{
+  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
+          + strlen(entry->encoded_desc));
+}
+
 /** Create a new directory cache descriptor object from a encoded descriptor.
  * On success, return the heap-allocated cache object, otherwise return NULL if
  * we can't decode the descriptor. */
@@ -122,6 +196,10 @@ cache_dir_desc_new(const char *desc)
   /* The blinded pubkey is the indexed key. */
   dir_desc->key = dir_desc->plaintext_data->blinded_pubkey.pubkey;
   dir_desc->created_ts = time(NULL);
+  dir_desc->expiry_ts =
+    dir_desc->created_ts + dir_desc->plaintext_data->lifetime_sec;
+  dir_desc->expiry_idx = -1;
+  dir_desc->alloc_size = cache_get_dir_entry_size(dir_desc);
   return dir_desc;
 
  err:
@@ -129,12 +207,27 @@ cache_dir_desc_new(const char *desc)
   return NULL;
 }
 
-/** Return the size of a cache entry in bytes. */
+/** Remove <b>entry</b> from the directory cache and free it, logging that we
+ * did so because of <b>reason</b>.  Return the number of bytes freed. */
 static size_t
-cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+cache_dir_desc_evict(hs_cache_dir_descriptor_t *entry, const char *reason)
 {
-  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
-          + strlen(entry->encoded_desc));
+  size_t entry_size = entry->alloc_size;
+
+  /* Logging. */
+  {
+    char key_b64[BASE64_DIGEST256_LEN + 1];
+    digest256_to_base64(key_b64, (const char *) entry->key);
+    log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache (%s). "
+                      "Downloaded %" PRIu64 " times and "
+                      "size of %" TOR_PRIuSZ " bytes",
+             safe_str_client(key_b64), reason, entry->n_downloaded,
+             entry_size);
+  }
+  remove_v3_desc_as_dir(entry);
+  /* Entry is not in the cache anymore, destroy it. */
+  cache_dir_desc_free(entry);
+  return entry_size;
 }
 
 /** Try to store a valid version 3 descriptor in the directory cache. Return 0
@@ -167,18 +260,14 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
      * remove the entry we currently have from our cache so we can then
      * store the new one. */
     remove_v3_desc_as_dir(cache_entry);
-    hs_cache_decrement_allocation(cache_get_dir_entry_size(cache_entry));
     cache_dir_desc_free(cache_entry);
+    hs_cache_v3_dir_stats.n_replaced++;
   }
   /* Store the descriptor we just got. We are sure here that either we
    * don't have the entry or we have a newer descriptor and the old one
    * has been removed from the cache. */
   store_v3_desc_as_dir(desc);
 
-  /* Update our total cache size with this entry for the OOM. This uses the
-   * old HS protocol cache subsystem for which we are tied with. */
-  hs_cache_increment_allocation(cache_get_dir_entry_size(desc));
-
   /* Update HSv3 statistics */
   if (get_options()->HiddenServiceStatistics) {
     rep_hist_hsdir_stored_maybe_new_v3_onion(desc->key);
@@ -214,9 +303,12 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   entry = lookup_v3_desc_as_dir(blinded_key.pubkey);
   if (entry != NULL) {
     found = 1;
+    hs_cache_v3_dir_stats.n_hits++;
     if (desc_out) {
       *desc_out = entry->encoded_desc;
     }
+  } else {
+    hs_cache_v3_dir_stats.n_misses++;
   }
 
   return found;
@@ -225,69 +317,38 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   return -1;
 }
 
-/** Clean the v3 cache by removing entries that are below or equal the
- * downloaded target.
- *
- * Stop when the max_remove_bytes is reached. It is possible that more bytes
- * are removed if max_remove_bytes is not aligned on cache entry size.
- *
- * Return the amount of bytes freed. The next_lowest param is set to the
- * lowest n_downloaded value in the cache that is above target.
+/** Evict entries from the v3 cache until at least <b>min_remove_bytes</b>
+ * bytes are freed or the cache is empty: first the entries that were never
+ * downloaded, then the ones that were, least recently stored or downloaded
+ * first.
  *
- * If both next_lowest and returned value are 0, the cache is empty. */
+ * Return the amount of bytes freed. It is possible that more bytes are
+ * removed if min_remove_bytes is not aligned on cache entry size. */
 STATIC size_t
-cache_clean_v3_by_downloaded_as_dir(const uint64_t target,
-                                    const size_t max_remove_bytes,
-                                    uint64_t *next_lowest)
+cache_evict_v3_as_dir(size_t min_remove_bytes)
 {
   size_t bytes_removed = 0;
-  uint64_t lowest = 0;
 
   if (!hs_cache_v3_dir) { /* No cache to clean. Just return. */
-    goto end;
+    return 0;
   }
 
-  log_info(LD_REND, "Cleaning HS cache for downloaded target of %" PRIu64
-                    ". Maximum bytes to removed: %" TOR_PRIuSZ,
-           target, max_remove_bytes);
+  log_info(LD_REND, "Cleaning HS cache. Minimum bytes to remove: %"
+           TOR_PRIuSZ, min_remove_bytes);
 
-  DIGEST256MAP_FOREACH_MODIFY(hs_cache_v3_dir, key,
-                              hs_cache_dir_descriptor_t *, entry) {
-    /* Downloaded counter is above target, ignore. Record next lowest. */
-    if (entry->n_downloaded > target) {
-      if (lowest == 0 || lowest > entry->n_downloaded) {
-        lowest = entry->n_downloaded;
-      }
-      continue;
-    }
-    /* We have removed enough, avoid cleaning this entry. Reason we continue
-     * the loop is so we can find the next lowest value. Yes, with many
-     * entries, this could be expensive but this is only called during OOM
-     * cleanup which should be fairly rare. */
-    if (bytes_removed >= max_remove_bytes) {
-      continue;
+  while (bytes_removed < min_remove_bytes) {
+    hs_cache_dir_descriptor_t *entry =
+      TOR_TAILQ_FIRST(&hs_cache_v3_dir_fresh);
+    if (!entry) {
+      entry = TOR_TAILQ_FIRST(&hs_cache_v3_dir_downloaded);
     }
-    size_t entry_size = cache_get_dir_entry_size(entry);
-    /* Logging. */
-    {
-      char key_b64[BASE64_DIGEST256_LEN + 1];
-      digest256_to_base64(key_b64, (const char *) key);
-      log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache. "
-                        "Downloaded %" PRIu64 " times and "
-                        "size of %" TOR_PRIuSZ " bytes",
-               safe_str_client(key_b64), entry->n_downloaded, entry_size);
+    if (!entry) {
+      break;
     }
-    /* Remove it from our cache. */
-    MAP_DEL_CURRENT(key);
-    bytes_removed += entry_size;
-    /* Entry is not in the cache anymore, destroy it. */
-    cache_dir_desc_free(entry);
-    /* Update our cache entry allocation size for the OOM. */
-    hs_cache_decrement_allocation(entry_size);
-  } DIGEST256MAP_FOREACH_END;
+    bytes_removed += cache_dir_desc_evict(entry, "out of memory");
+    hs_cache_v3_dir_stats.n_evicted_oom++;
+  }
 
- end:
-  *next_lowest = lowest;
   return bytes_removed;
 }
 
@@ -307,36 +368,36 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
     return 0;
   }
 
-  DIGEST256MAP_FOREACH_MODIFY(hs_cache_v3_dir, key,
-                              hs_cache_dir_descriptor_t *, entry) {
-    size_t entry_size;
-    time_t cutoff = global_cutoff;
-    if (!cutoff) {
-      /* Cutoff is the lifetime of the entry found in the descriptor. */
-      cutoff = now - entry->plaintext_data->lifetime_sec;
+  if (!global_cutoff) {
+    /* Use the lifetimes: the expiry queue has every expired entry first. */
+    while (smartlist_len(hs_cache_v3_dir_expiry)) {
+      hs_cache_dir_descriptor_t *entry =
+        smartlist_get(hs_cache_v3_dir_expiry, 0);
+      /* If the entry expires after now, so does every other one. */
+      if (entry->expiry_ts > now) {
+        break;
+      }
+      bytes_removed += cache_dir_desc_evict(entry, "expired");
+      hs_cache_v3_dir_stats.n_expired++;
     }
+    return bytes_removed;
+  }
 
-    /* If the entry has been created _after_ the cutoff, not expired so
-     * continue to the next entry in our v3 cache. */
-    if (entry->created_ts > cutoff) {
-      continue;
-    }
-    /* Here, our entry has expired, remove and free. */
-    MAP_DEL_CURRENT(key);
-    entry_size = cache_get_dir_entry_size(entry);
-    bytes_removed += entry_size;
-    /* Entry is not in the cache anymore, destroy it. */
-    cache_dir_desc_free(entry);
-    /* Update our cache entry allocation size for the OOM. */
-    hs_cache_decrement_allocation(entry_size);
-    /* Logging. */
-    {
-      char key_b64[BASE64_DIGEST256_LEN + 1];
-      digest256_to_base64(key_b64, (const char *) key);
-      log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
-               safe_str_client(key_b64));
+  /* With a global cutoff, we have to look at every entry. */
+  smartlist_t *expired = smartlist_new();
+  DIGEST256MAP_FOREACH(hs_cache_v3_dir, key,
+                       hs_cache_dir_descriptor_t *, entry) {
+    /* If the entry has been created before or at the cutoff, it has
+     * expired. */
+    if (entry->created_ts <= global_cutoff) {
+      smartlist_add(expired, entry);
     }
   } DIGEST256MAP_FOREACH_END;
+  SMARTLIST_FOREACH_BEGIN(expired, hs_cache_dir_descriptor_t *, entry) {
+    bytes_removed += cache_dir_desc_evict(entry, "expired");
+    hs_cache_v3_dir_stats.n_expired++;
+  } SMARTLIST_FOREACH_END(entry);
+  smartlist_free(expired);
 
   return bytes_removed;
 }
@@ -414,9 +475,18 @@ hs_cache_mark_dowloaded_as_dir(const hs_ident_dir_conn_t *ident)
   entry = lookup_v3_desc_as_dir(ident->blinded_pk.pubkey);
   if (entry) {
     entry->n_downloaded++;
+    touch_v3_desc_as_dir(entry);
   }
 }
 
+/** Fill <b>stats_out</b> with statistics about the directory cache. */
+void
+hs_cache_get_dir_stats(hs_cache_dir_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+  memcpy(stats_out, &hs_cache_v3_dir_stats, sizeof(*stats_out));
+}
+
 /** Clean all directory caches using the current time now. */
 void
 hs_cache_clean_as_dir(time_t now)
@@ -1156,29 +1226,10 @@ hs_cache_client_new_auth_parse(const ed25519_public_key_t *service_pk)
 size_t
 hs_cache_handle_oom(size_t min_remove_bytes)
 {
-  size_t bytes_removed = 0;
-  /* The downloaded counter value to remove. Start at 0 and increment to the
-   * next lowest value in the cache. */
-  uint64_t target = 0;
-
   /* Our OOM handler called with 0 bytes to remove is a code flow error. */
   tor_assert(min_remove_bytes != 0);
 
-  /* Loop until we have an empty cache or we have removed enough bytes. */
-  do {
-    /* This is valid due to the loop condition. At the start, min_remove_bytes
-     * can't be 0. */
-    size_t bytes_to_free = (min_remove_bytes - bytes_removed);
-    size_t bytes_freed =
-      cache_clean_v3_by_downloaded_as_dir(target, bytes_to_free, &target);
-    if (bytes_freed == 0 && target == 0) {
-      /* Indicate that the cache is empty. */
-      break;
-    }
-    bytes_removed += bytes_freed;
-  } while (bytes_removed < min_remove_bytes);
-
-  return bytes_removed;
+  return cache_evict_v3_as_dir(min_remove_bytes);
 }
 
 /** Return the maximum size of a v3 HS descriptor. */
@@ -1197,6 +1248,9 @@ hs_cache_init(void)
   /* Calling this twice is very wrong code flow. */
   tor_assert(!hs_cache_v3_dir);
   hs_cache_v3_dir = digest256map_new();
+  hs_cache_v3_dir_expiry = smartlist_new();
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_fresh);
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_downloaded);
 
   tor_assert(!hs_cache_v3_client);
   hs_cache_v3_client = digest256map_new();
@@ -1211,6 +1265,11 @@ hs_cache_free_all(void)
 {
   digest256map_free(hs_cache_v3_dir, cache_dir_desc_free_void);
   hs_cache_v3_dir = NULL;
+  smartlist_free(hs_cache_v3_dir_expiry);
+  hs_cache_v3_dir_expiry = NULL;
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_fresh);
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_downloaded);
+  memset(&hs_cache_v3_dir_stats, 0, sizeof(hs_cache_v3_dir_stats));
 
   digest256map_free(hs_cache_v3_client, cache_client_desc_free_void);
   hs_cache_v3_client = NULL;
@@ -1270,6 +1329,9 @@ dir_set_downloaded(const ed25519_public_key_t *pk, uint64_t value)
   hs_cache_dir_descriptor_t *entry = lookup_v3_desc_as_dir(pk->pubkey);
   if (entry) {
     entry->n_downloaded = value;
+    if (value > 0) {
+      touch_v3_desc_as_dir(entry);
+    }
   }
 }
 
@@ -16,6 +16,7 @@
 #include "feature/hs/hs_ident.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/torcert.h"
+#include "ext/tor_queue.h"
 
 struct ed25519_public_key_t;
 
@@ -73,8 +74,36 @@ typedef struct hs_cache_dir_descriptor_t {
    * heuristic for the OOM cache cleaning. It is very large so we avoid an kind
    * of possible wrapping. */
   uint64_t n_downloaded;
+
+  /** When does this entry expire? This is created_ts plus the lifetime found
+   * in the plaintext data. */
+  time_t expiry_ts;
+  /** Index of this entry in the expiry priority queue. */
+  int expiry_idx;
+  /** Size of this entry in bytes, as counted in the cache allocation. */
+  size_t alloc_size;
+  /** True iff this entry has been downloaded, and so is in the eviction list
+   * of downloaded entries rather than the one of never downloaded entries. */
+  unsigned int is_downloaded : 1;
+  /** Links in the eviction list that holds this entry. */
+  TOR_TAILQ_ENTRY(hs_cache_dir_descriptor_t) eviction_next;
 } hs_cache_dir_descriptor_t;
 
+/** Statistics about the directory descriptor cache, for the metrics port. */
+typedef struct hs_cache_dir_stats_t {
+  /** How many lookups found a descriptor, and how many didn't? */
+  uint64_t n_hits;
+  uint64_t n_misses;
+  /** How many descriptors were removed because they expired, because we were
+   * low on memory, and because a newer one replaced them? */
+  uint64_t n_expired;
+  uint64_t n_evicted_oom;
+  uint64_t n_replaced;
+  /** How many descriptors, and how many bytes, does the cache hold? */
+  size_t n_entries;
+  size_t n_bytes;
+} hs_cache_dir_stats_t;
+
 /* Public API */
 
 /* Return maximum lifetime in seconds of a cache entry. */
@@ -98,6 +127,7 @@ int hs_cache_store_as_dir(const char *desc);
 int hs_cache_lookup_as_dir(uint32_t version, const char *query,
                            const char **desc_out);
 void hs_cache_mark_dowloaded_as_dir(const hs_ident_dir_conn_t *ident);
+void hs_cache_get_dir_stats(hs_cache_dir_stats_t *stats_out);
 
 const hs_descriptor_t *
 hs_cache_lookup_as_client(const struct ed25519_public_key_t *key);
@@ -150,9 +180,7 @@ typedef struct hs_cache_client_descriptor_t {
 } hs_cache_client_descriptor_t;
 
 STATIC size_t cache_clean_v3_as_dir(time_t now, time_t global_cutoff);
-STATIC size_t cache_clean_v3_by_downloaded_as_dir(const uint64_t target,
-                                           const size_t min_remove_bytes,
-                                           uint64_t *next_lowest);
+STATIC size_t cache_evict_v3_as_dir(size_t min_remove_bytes);
 STATIC hs_cache_dir_descriptor_t *lookup_v3_desc_as_dir(const uint8_t *key);
 
 STATIC hs_cache_client_descriptor_t *
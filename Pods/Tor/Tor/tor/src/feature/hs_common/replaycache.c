@@ -23,6 +23,142 @@
 
 #include "core/or/or.h"
 #include "feature/hs_common/replaycache.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "ext/siphash.h"
+
+/*
+ * The cache is a list of time buckets, each covering bucket_width seconds.
+ * A digest is stored in the bucket that was current when it was last seen,
+ * and each bucket keeps a Bloom filter of its digests, so that a digest we
+ * have never seen -- the common case, and the only case during an
+ * INTRODUCE2 flood -- is rejected without any map lookups.  Scrubbing frees
+ * whole buckets once everything in them has aged out, instead of walking
+ * every entry.
+ */
+
+/** How many buckets cover a cache's horizon. */
+#define REPLAYCACHE_N_BUCKETS 4
+
+/** The smallest number of entries a bucket's Bloom filter is sized for.
+ * Each new bucket's filter is sized for as many entries as the bucket before
+ * it got, and is rebuilt if the bucket ends up with more than twice that. */
+#define REPLAYCACHE_MIN_FILTER_CAPACITY 256
+
+/** Wrap our hash function to have the signature that the bloom filter
+ * needs. */
+static uint64_t
+bloomfilt_digest256_hash(const struct sipkey *key,
+                         const void *item)
+{
+  return siphash24(item, DIGEST256_LEN, key);
+}
+
+/** Free the bucket <b>b</b> and all of its entries. */
+static void
+replaycache_bucket_free(replaycache_bucket_t *b)
+{
+  if (!b)
+    return;
+
+  digest256map_free(b->digests_seen, NULL);
+  bloomfilt_free(b->filter);
+  tor_free(b);
+}
+
+/** Allocate and return a new, empty bucket of <b>r</b> starting at
+ * <b>start</b>, expecting to hold about <b>expected</b> entries. */
+static replaycache_bucket_t *
+replaycache_bucket_new(const replaycache_t *r, time_t start, int expected)
+{
+  replaycache_bucket_t *b = tor_malloc_zero(sizeof(*b));
+
+  b->start = start;
+  b->digests_seen = digest256map_new();
+  b->filter_capacity = MAX(expected, REPLAYCACHE_MIN_FILTER_CAPACITY);
+  b->filter = bloomfilt_new(b->filter_capacity, bloomfilt_digest256_hash,
+                            r->bloom_key);
+  return b;
+}
+
+/** Replace the Bloom filter of <b>b</b> with one sized for its current
+ * entries, since the bucket has outgrown the old one. */
+static void
+replaycache_bucket_grow_filter(const replaycache_t *r, replaycache_bucket_t *b)
+{
+  digest256map_iter_t *itr;
+  const uint8_t *digest;
+  void *valp;
+
+  bloomfilt_free(b->filter);
+  b->filter_capacity = digest256map_size(b->digests_seen);
+  b->filter = bloomfilt_new(b->filter_capacity, bloomfilt_digest256_hash,
+                            r->bloom_key);
+
+  for (itr = digest256map_iter_init(b->digests_seen);
+       !digest256map_iter_done(itr);
+       itr = digest256map_iter_next(b->digests_seen, itr)) {
+    digest256map_iter_get(itr, &digest, &valp);
+    bloomfilt_add(b->filter, digest);
+  }
+}
+
+/** Record in <b>b</b> that <b>digest</b>, whose Bloom filter hashes are
+ * <b>hashes</b>, was seen at <b>when</b>. */
+static void
+replaycache_bucket_set(const replaycache_t *r, replaycache_bucket_t *b,
+                       const uint8_t *digest,
+                       const bloomfilt_hashes_t *hashes, time_t when)
+{
+  /* If the clock went backwards, remember it as seen at the start of the
+   * bucket instead: that only makes its entry live a little longer. */
+  if (when < b->start)
+    when = b->start;
+
+  if (! digest256map_set(b->digests_seen, digest,
+                         (void *)(uintptr_t)(when - b->start + 1))) {
+    /* It's new: growing the filter adds it along with everything else. */
+    if (digest256map_size(b->digests_seen) > 2 * b->filter_capacity)
+      replaycache_bucket_grow_filter(r, b);
+    else
+      bloomfilt_add_hashes(b->filter, hashes);
+  }
+}
+
+/** If <b>b</b> has an entry for <b>digest</b>, whose Bloom filter hashes are
+ * <b>hashes</b>, set *<b>when_out</b> to the time it was last seen and return
+ * true.  Otherwise return false. */
+static int
+replaycache_bucket_get(const replaycache_bucket_t *b, const uint8_t *digest,
+                       const bloomfilt_hashes_t *hashes, time_t *when_out)
+{
+  void *val;
+
+  if (! bloomfilt_probably_contains_hashes(b->filter, hashes))
+    return 0;
+  val = digest256map_get(b->digests_seen, digest);
+  if (! val)
+    return 0;
+  *when_out = b->start + (time_t)((uintptr_t)val - 1);
+  return 1;
+}
+
+/** Free every bucket of <b>r</b> whose entries have all aged out by
+ * <b>present</b>.  This only looks at the buckets it frees, and one more. */
+static void
+replaycache_drop_old_buckets(time_t present, replaycache_t *r)
+{
+  /* if we're never expiring, everything is in one bucket we keep */
+  if (r->horizon == 0)
+    return;
+
+  while (smartlist_len(r->buckets)) {
+    replaycache_bucket_t *b = smartlist_get(r->buckets, 0);
+    if (b->start + r->bucket_width > present - r->horizon)
+      break;
+    smartlist_del_keeporder(r->buckets, 0);
+    replaycache_bucket_free(b);
+  }
+}
 
 /** Free the replaycache r and all of its entries.
  */
@@ -34,7 +170,11 @@ replaycache_free_(replaycache_t *r)
     return;
   }
 
-  if (r->digests_seen) digest256map_free(r->digests_seen, tor_free_);
+  if (r->buckets) {
+    SMARTLIST_FOREACH(r->buckets, replaycache_bucket_t *, b,
+                      replaycache_bucket_free(b));
+    smartlist_free(r->buckets);
+  }
 
   tor_free(r);
 }
@@ -64,12 +204,33 @@ replaycache_new(time_t horizon, time_t interval)
   r->scrub_interval = interval;
   r->scrubbed = 0;
   r->horizon = horizon;
-  r->digests_seen = digest256map_new();
+  if (horizon == 0) {
+    r->bucket_width = 0;
+  } else {
+    r->bucket_width = MAX(horizon / REPLAYCACHE_N_BUCKETS, 1);
+  }
+  r->buckets = smartlist_new();
+  crypto_rand((char *)r->bloom_key, sizeof(r->bloom_key));
 
  err:
   return r;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Return the total number of entries in all the buckets of <b>r</b>.  (A
+ * digest seen again after its bucket stopped being current is counted once
+ * in each bucket that still holds it.) */
+STATIC int
+replaycache_n_entries(const replaycache_t *r)
+{
+  int n = 0;
+
+  SMARTLIST_FOREACH(r->buckets, const replaycache_bucket_t *, b,
+                    n += digest256map_size(b->digests_seen));
+  return n;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** See documentation for replaycache_add_and_test().
  */
 STATIC int
@@ -79,7 +240,10 @@ replaycache_add_and_test_internal(
 {
   int rv = 0;
   uint8_t digest[DIGEST256_LEN];
-  time_t *access_time;
+  bloomfilt_hashes_t hashes;
+  replaycache_bucket_t *current;
+  time_t access_time = 0;
+  int found = 0;
 
   /* sanity check */
   if (present <= 0 || !r || !data || len == 0) {
@@ -91,22 +255,42 @@ replaycache_add_and_test_internal(
   /* compute digest */
   crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
 
-  /* check map */
-  access_time = digest256map_get(r->digests_seen, digest);
+  /* Start a new bucket if the current one is full of time. */
+  current = smartlist_len(r->buckets) ? smartlist_get(r->buckets,
+                                          smartlist_len(r->buckets) - 1)
+                                      : NULL;
+  if (!current ||
+      (r->bucket_width && present >= current->start + r->bucket_width)) {
+    int expected = current ? digest256map_size(current->digests_seen) : 0;
+    current = replaycache_bucket_new(r, present, expected);
+    smartlist_add(r->buckets, current);
+  }
+
+  /* Forget buckets that have aged out, so we don't search them. */
+  replaycache_drop_old_buckets(present, r);
+
+  /* All the buckets share a key, so one set of hashes works for each. */
+  bloomfilt_hash(current->filter, digest, &hashes);
+
+  /* check buckets, newest first: the first entry we find is the latest */
+  SMARTLIST_FOREACH_REVERSE_BEGIN(r->buckets, replaycache_bucket_t *, b) {
+    if ((found = replaycache_bucket_get(b, digest, &hashes, &access_time)))
+      break;
+  } SMARTLIST_FOREACH_END(b);
 
   /* seen before? */
-  if (access_time != NULL) {
+  if (found) {
     /*
      * If it's far enough in the past, no hit.  If the horizon is zero, we
      * never expire.
      */
-    if (*access_time >= present - r->horizon || r->horizon == 0) {
+    if (access_time >= present - r->horizon || r->horizon == 0) {
       /* replay cache hit, return 1 */
       rv = 1;
       /* If we want to output an elapsed time, do so */
       if (elapsed) {
-        if (present >= *access_time) {
-          *elapsed = present - *access_time;
+        if (present >= access_time) {
+          *elapsed = present - access_time;
         } else {
           /* We shouldn't really be seeing hits from the future, but... */
           *elapsed = 0;
@@ -116,14 +300,12 @@ replaycache_add_and_test_internal(
     /*
      * If it's ahead of the cached time, update
      */
-    if (*access_time < present) {
-      *access_time = present;
+    if (access_time < present) {
+      replaycache_bucket_set(r, current, digest, &hashes, present);
     }
   } else {
-    /* No, so no hit and update the digest map with the current time */
-    access_time = tor_malloc(sizeof(*access_time));
-    *access_time = present;
-    digest256map_set(r->digests_seen, digest, access_time);
+    /* No, so no hit and update the current bucket with the current time */
+    replaycache_bucket_set(r, current, digest, &hashes, present);
   }
 
   /* now scrub the cache if it's time */
@@ -138,13 +320,8 @@ replaycache_add_and_test_internal(
 STATIC void
 replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
 {
-  digest256map_iter_t *itr = NULL;
-  const uint8_t *digest;
-  void *valp;
-  time_t *access_time;
-
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r || !(r->buckets)) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
@@ -157,21 +334,7 @@ replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
   if (r->horizon == 0) return;
 
   /* okay, scrub time */
-  itr = digest256map_iter_init(r->digests_seen);
-  while (!digest256map_iter_done(itr)) {
-    digest256map_iter_get(itr, &digest, &valp);
-    access_time = (time_t *)valp;
-    /* aged out yet? */
-    if (*access_time < present - r->horizon) {
-      /* Advance the iterator and remove this one */
-      itr = digest256map_iter_next_rmv(r->digests_seen, itr);
-      /* Free the value removed */
-      tor_free(access_time);
-    } else {
-      /* Just advance the iterator */
-      itr = digest256map_iter_next(r->digests_seen, itr);
-    }
-  }
+  replaycache_drop_old_buckets(present, r);
 
   /* update scrubbed timestamp */
   if (present > r->scrubbed) r->scrubbed = present;
@@ -13,6 +13,24 @@ typedef struct replaycache_t replaycache_t;
 
 #ifdef REPLAYCACHE_PRIVATE
 
+#include "lib/container/bloomfilt.h"
+
+/** One time bucket of a replaycache_t: every digest last seen between
+ * <b>start</b> and <b>start</b> + the cache's bucket_width. */
+typedef struct replaycache_bucket_t {
+  /** Earliest time that any entry in this bucket was seen */
+  time_t start;
+  /**
+   * Digest map: keys are digests, values are the time the digest was last
+   * seen, stored as (uintptr_t)(1 + seconds after <b>start</b>)
+   */
+  digest256map_t *digests_seen;
+  /** Bloom filter holding every key of <b>digests_seen</b> */
+  bloomfilt_t *filter;
+  /** How many entries <b>filter</b> was sized for */
+  int filter_capacity;
+} replaycache_bucket_t;
+
 struct replaycache_t {
   /** Scrub interval */
   time_t scrub_interval;
@@ -24,9 +42,14 @@ struct replaycache_t {
    */
   time_t horizon;
   /**
-   * Digest map: keys are digests, values are times the digest was last seen
+   * How much time each bucket covers; 0 if we never expire, and keep
+   * everything in one bucket.
    */
-  digest256map_t *digests_seen;
+  time_t bucket_width;
+  /** List of replaycache_bucket_t, oldest first */
+  smartlist_t *buckets;
+  /** Key for the siphash functions of every bucket's Bloom filter */
+  uint8_t bloom_key[BLOOMFILT_KEY_LEN];
 };
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
@@ -57,6 +80,9 @@ STATIC int replaycache_add_and_test_internal(
     time_t *elapsed);
 STATIC void replaycache_scrub_if_needed_internal(
     time_t present, replaycache_t *r);
+#ifdef TOR_UNIT_TESTS
+STATIC int replaycache_n_entries(const replaycache_t *r);
+#endif /* defined(TOR_UNIT_TESTS) */
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
 
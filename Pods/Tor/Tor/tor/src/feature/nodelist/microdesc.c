@@ -23,6 +23,7 @@
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/microdesc_index.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
@@ -44,7 +45,9 @@
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
  * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * only the microdescriptors that we want to keep.  Next to the cache file we
+ * keep an index of its parsed contents, so that we can start up without
+ * parsing it (see microdesc_index.c). */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -54,8 +57,15 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
+  /** Index of the microdescriptors in cache_content, if we loaded it from
+   * disk instead of parsing cache_content.  The entries of the index that
+   * are not yet marked as used are in the cache, but not yet in
+   * <b>map</b>. */
+  microdesc_index_t *index;
   /** Number of bytes used in the journal file. */
   size_t journal_len;
   /** Number of bytes in descriptors removed as too old. */
@@ -71,6 +81,8 @@ struct microdesc_cache_t {
 };
 
 static microdesc_cache_t *get_microdesc_cache_noload(void);
+static microdesc_t *microdesc_cache_find(microdesc_cache_t *cache,
+                                         const char *d);
 static void warn_if_nul_found(const char *inp, size_t len, int64_t offset,
                               const char *activity);
 
@@ -267,6 +279,7 @@ get_microdesc_cache_noload(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_cachedir_fname("cached-microdescs");
     cache->journal_fname = get_cachedir_fname("cached-microdescs.new");
+    cache->index_fname = get_cachedir_fname("cached-microdescs.idx");
     the_microdesc_cache = cache;
   }
   return the_microdesc_cache;
@@ -403,7 +416,7 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
   added = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(descriptors, microdesc_t *, md) {
     microdesc_t *md2;
-    md2 = HT_FIND(microdesc_map, &cache->map, md);
+    md2 = microdesc_cache_find(cache, md->digest);
     if (md2) {
       /* We already had this one. */
       if (md2->last_listed < md->last_listed)
@@ -473,6 +486,7 @@ microdesc_cache_clear(microdesc_cache_t *cache)
     microdesc_free(md);
   }
   HT_CLEAR(microdesc_map, &cache->map);
+  microdesc_index_free(cache->index);
   if (cache->cache_content) {
     int res = tor_munmap_file(cache->cache_content);
     if (res != 0) {
@@ -488,6 +502,72 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->bytes_dropped = 0;
 }
 
+/** Build a microdesc_t for record <b>i</b> of the index of <b>cache</b>,
+ * add it to the cache, and return it. */
+static microdesc_t *
+microdesc_cache_take_from_index(microdesc_cache_t *cache, int i)
+{
+  microdesc_t *md = microdesc_index_take(cache->index, i);
+  HT_INSERT(microdesc_map, &cache->map, md);
+  md->held_in_map = 1;
+  return md;
+}
+
+/** Add every microdescriptor in the index of <b>cache</b> to the cache, and
+ * stop using the index. */
+static void
+microdesc_cache_take_all_from_index(microdesc_cache_t *cache)
+{
+  if (!cache->index)
+    return;
+  const int n = microdesc_index_get_n(cache->index);
+  for (int i = 0; i < n; ++i) {
+    if (!microdesc_index_is_used(cache->index, i))
+      microdesc_cache_take_from_index(cache, i);
+  }
+  microdesc_index_free(cache->index);
+}
+
+/** If we have a microdesc consensus, add the microdescriptors that it lists
+ * from the index of <b>cache</b> to the cache and to the nodelist, as
+ * microdescs_add_list_to_cache() would have done if we had parsed them. */
+static void
+microdesc_cache_add_indexed_to_nodelist(microdesc_cache_t *cache)
+{
+  networkstatus_t *ns = networkstatus_get_latest_consensus();
+  int n_added = 0;
+
+  if (!ns || ns->flavor != FLAV_MICRODESC)
+    return;
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, const routerstatus_t *, rs) {
+    int i = microdesc_index_find(cache->index, rs->descriptor_digest);
+    if (i < 0 || microdesc_index_is_used(cache->index, i))
+      continue;
+    nodelist_add_microdesc(microdesc_cache_take_from_index(cache, i));
+    ++n_added;
+  } SMARTLIST_FOREACH_END(rs);
+
+  if (n_added)
+    router_dir_info_changed();
+}
+
+/** Return the microdescriptor in <b>cache</b> whose sha256 digest is
+ * <b>d</b>, building it from the index of the cache if we have not done so
+ * yet.  Return NULL if there is no such microdescriptor. */
+static microdesc_t *
+microdesc_cache_find(microdesc_cache_t *cache, const char *d)
+{
+  microdesc_t *md, search;
+  memcpy(search.digest, d, DIGEST256_LEN);
+  md = HT_FIND(microdesc_map, &cache->map, &search);
+  if (!md && cache->index) {
+    int i = microdesc_index_find(cache->index, d);
+    if (i >= 0 && !microdesc_index_is_used(cache->index, i))
+      md = microdesc_cache_take_from_index(cache, i);
+  }
+  return md;
+}
+
 static void
 warn_if_nul_found(const char *inp, size_t len, int64_t offset,
                   const char *activity)
@@ -526,11 +606,27 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
+    cache->index = microdesc_index_load(cache->index_fname, mm->data,
+                                        mm->size);
+  }
+  if (cache->index) {
+    const int n = microdesc_index_get_n(cache->index);
+    for (int i = 0; i < n; ++i) {
+      ++cache->n_seen;
+      cache->total_len_seen += microdesc_index_get_bodylen(cache->index, i);
+    }
+    total += n;
+    log_info(LD_DIR, "Using index of %d microdescriptors in %s.",
+             n, cache->index_fname);
+    microdesc_cache_add_indexed_to_nodelist(cache);
+  } else if (mm) {
     warn_if_nul_found(mm->data, mm->size, 0, "scanning microdesc cache");
     added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
                                     SAVED_IN_CACHE, 0, -1, NULL);
     if (added) {
       total += smartlist_len(added);
+      /* Save an index, so that next time we can skip the parsing. */
+      microdesc_index_write(cache->index_fname, added, mm->data, mm->size);
       smartlist_free(added);
     }
   }
@@ -652,6 +748,23 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
     }
   }
 
+  /* Microdescriptors that we have only in the index can't be held by any
+   * nodes. */
+  if (cache->index) {
+    const int n = microdesc_index_get_n(cache->index);
+    for (int i = 0; i < n; ++i) {
+      if (microdesc_index_is_used(cache->index, i))
+        continue;
+      if (microdesc_index_get_last_listed(cache->index, i) < cutoff) {
+        ++dropped;
+        bytes_dropped += microdesc_index_get_bodylen(cache->index, i);
+        microdesc_index_drop(cache->index, i);
+      } else {
+        ++kept;
+      }
+    }
+  }
+
   if (dropped) {
     log_info(LD_DIR, "Removed %d/%d microdescriptors as old.",
              dropped,dropped+kept);
@@ -726,6 +839,9 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 
   log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
 
+  /* We're about to unmap the file that the index describes. */
+  microdesc_cache_take_all_from_index(cache);
+
   orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
   orig_size += (int)cache->journal_len;
 
@@ -824,6 +940,11 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     }
   } SMARTLIST_FOREACH_END(md);
 
+  if (cache->cache_content) {
+    microdesc_index_write(cache->index_fname, wrote,
+                          cache->cache_content->data,
+                          cache->cache_content->size);
+  }
   smartlist_free(wrote);
 
   write_str_to_file(cache->journal_fname, "", 1);
@@ -931,6 +1052,7 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 
@@ -945,12 +1067,9 @@ microdesc_free_all(void)
 microdesc_t *
 microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
 {
-  microdesc_t *md, search;
   if (!cache)
     cache = get_microdesc_cache();
-  memcpy(search.digest, d, DIGEST256_LEN);
-  md = HT_FIND(microdesc_map, &cache->map, &search);
-  return md;
+  return microdesc_cache_find(cache, d);
 }
 
 /** Return a smartlist of all the sha256 digest of the microdescriptors that
@@ -0,0 +1,520 @@
+/* Copyright (c) 2009-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file microdesc_index.c
+ *
+ * \brief Binary index of the parsed fields of the microdescriptors in the
+ * microdescriptor cache file.
+ *
+ * Tokenizing every microdescriptor in cached-microdescs is a large part of
+ * the work that a client does at startup.  Whenever we write the cache
+ * file, we therefore also write an index of it: one fixed-size record per
+ * microdescriptor, sorted by SHA256 digest, holding the location of the
+ * body in the cache file and the fields that microdesc_parse_fields() would
+ * extract from it.  Variable-length fields (the onion key, the family and
+ * the policy summaries) live in a blob after the records.
+ *
+ * At startup, the microdescriptor cache mmaps the index along with the
+ * cache file, and only builds a microdesc_t for a record when somebody
+ * asks for it (see microdesc_index_take()).  The index is only used if the
+ * cache file has the length and SHA256 digest recorded in its header.
+ * The index is a host-specific format; we never send it anywhere, and we
+ * ignore it if it was written with a different byte order.
+ */
+
+#include "core/or/or.h"
+
+#include "core/or/policies.h"
+#include "feature/nodelist/microdesc_index.h"
+#include "feature/nodelist/nodefamily.h"
+#include "lib/cc/ctassert.h"
+#include "lib/container/bitarray.h"
+#include "lib/crypt_ops/crypto_curve25519.h"
+#include "lib/crypt_ops/crypto_ed25519.h"
+#include "lib/fs/mmap.h"
+
+#include "feature/nodelist/microdesc_st.h"
+
+/** Magic string at the start of every microdescriptor index file. */
+#define MDINDEX_MAGIC "TorMdIx1"
+/** Value we store to detect an index written with another byte order. */
+#define MDINDEX_BYTE_ORDER 0x01020304u
+/** Blob offset for a field that is not present. */
+#define MDINDEX_NO_OFFSET UINT32_MAX
+
+/** Flags for mdindex_entry_t.flags. @{ */
+#define MDINDEX_HAS_NTOR_KEY   (1u<<0)
+#define MDINDEX_HAS_ED25519_ID (1u<<1)
+#define MDINDEX_HAS_IPV6       (1u<<2)
+#define MDINDEX_HAS_FAMILY     (1u<<3)
+#define MDINDEX_REJECT_STAR    (1u<<4)
+/** @} */
+
+/** Header of a microdescriptor index file. */
+typedef struct mdindex_header_t {
+  /** MDINDEX_MAGIC, without its NUL. */
+  char magic[8];
+  /** MDINDEX_BYTE_ORDER, in the byte order of the host that wrote it. */
+  uint32_t byte_order;
+  /** Number of mdindex_entry_t that follow the header. */
+  uint32_t n_entries;
+  /** Length of the cache file that this index describes. */
+  uint64_t cache_len;
+  /** Length of the blob that follows the entries. */
+  uint64_t blob_len;
+  /** SHA256 digest of the cache file that this index describes. */
+  char cache_digest[DIGEST256_LEN];
+} mdindex_header_t;
+
+/** One record of a microdescriptor index file. */
+typedef struct mdindex_entry_t {
+  /** SHA256 digest of the microdescriptor body. */
+  char digest[DIGEST256_LEN];
+  /** Offset of the body within the cache file. */
+  uint64_t body_off;
+  /** As microdesc_t.last_listed. */
+  int64_t last_listed;
+  /** Length of the body. */
+  uint32_t body_len;
+  /** Bitwise OR of MDINDEX_* flags. */
+  uint32_t flags;
+  /** Offset and length of the ASN.1-encoded TAP onion key in the blob. */
+  uint32_t onion_pkey_off;
+  uint16_t onion_pkey_len;
+  /** As microdesc_t.ipv6_orport. */
+  uint16_t ipv6_orport;
+  /** Offset and length (without its NUL) of the formatted family in the
+   * blob. */
+  uint32_t family_off;
+  uint32_t family_len;
+  /** Offsets of the encoded IPv4 and IPv6 policy summaries in the blob, or
+   * MDINDEX_NO_OFFSET. */
+  uint32_t policy_off;
+  uint32_t ipv6_policy_off;
+  /** As microdesc_t.ipv6_addr, if MDINDEX_HAS_IPV6 is set. */
+  uint8_t ipv6_addr[16];
+  /** As microdesc_t.onion_curve25519_pkey. */
+  uint8_t curve25519_pkey[CURVE25519_PUBKEY_LEN];
+  /** As microdesc_t.ed25519_identity_pkey. */
+  uint8_t ed25519_id[ED25519_PUBKEY_LEN];
+} mdindex_entry_t;
+
+CTASSERT(sizeof(mdindex_header_t) == 64);
+CTASSERT(sizeof(mdindex_entry_t) == 160);
+CTASSERT(sizeof(short_policy_entry_t) == 4);
+
+/** A loaded microdescriptor index. */
+struct microdesc_index_t {
+  /** The mmap'd index file. */
+  tor_mmap_t *mapping;
+  /** The records of the index, sorted by digest. */
+  const mdindex_entry_t *entries;
+  /** Number of records in <b>entries</b>. */
+  int n_entries;
+  /** Variable-length fields of the records. */
+  const char *blob;
+  /** The cache file that the index describes. */
+  const char *cache_body;
+  /** Bit <i>i</i> is set if we have already taken or dropped record
+   * <i>i</i>. */
+  bitarray_t *used;
+};
+
+/** Encoded policy summaries are a 32-bit word holding is_accept in its top
+ * bit and n_entries in the rest, followed by the entries themselves. */
+#define MDINDEX_POLICY_ACCEPT (1u<<31)
+
+/** Return true iff the <b>len</b> bytes at <b>off</b> fit in a blob of
+ * <b>blob_len</b> bytes. */
+static inline int
+mdindex_in_blob(uint64_t off, uint64_t len, uint64_t blob_len)
+{
+  return off <= blob_len && len <= blob_len - off;
+}
+
+/** Return true iff <b>ent</b> makes sense for an index whose blob is
+ * <b>blob</b> (<b>blob_len</b> bytes long), describing the cache file
+ * <b>cache_body</b> (<b>cache_len</b> bytes long). */
+static int
+mdindex_entry_is_valid(const mdindex_entry_t *ent,
+                       const char *blob, uint64_t blob_len,
+                       const char *cache_body, uint64_t cache_len)
+{
+  int i;
+  if (ent->body_off > cache_len || ent->body_len > cache_len - ent->body_off)
+    return 0;
+  if (ent->body_len < 9 ||
+      fast_memneq(cache_body + ent->body_off, "onion-key", 9))
+    return 0;
+  if (ent->onion_pkey_len == 0 ||
+      !mdindex_in_blob(ent->onion_pkey_off, ent->onion_pkey_len, blob_len))
+    return 0;
+  if (ent->flags & MDINDEX_HAS_FAMILY) {
+    if (!mdindex_in_blob(ent->family_off, (uint64_t)ent->family_len + 1,
+                         blob_len) ||
+        blob[ent->family_off + ent->family_len] != '\0' ||
+        memchr(blob + ent->family_off, '\0', ent->family_len))
+      return 0;
+  }
+  for (i = 0; i < 2; ++i) {
+    uint32_t off = i ? ent->ipv6_policy_off : ent->policy_off;
+    uint32_t word, n;
+    if (off == MDINDEX_NO_OFFSET)
+      continue;
+    if ((off & 3) || !mdindex_in_blob(off, 4, blob_len))
+      return 0;
+    memcpy(&word, blob + off, 4);
+    n = word & ~MDINDEX_POLICY_ACCEPT;
+    if (n == 0 || !mdindex_in_blob((uint64_t)off + 4,
+                                   (uint64_t)n * sizeof(short_policy_entry_t),
+                                   blob_len))
+      return 0;
+  }
+  return 1;
+}
+
+/** Load the microdescriptor index from <b>fname</b>, if it exists and
+ * describes the cache file whose <b>cache_len</b> bytes are at
+ * <b>cache_body</b>.  Return the index on success, or NULL if there is no
+ * usable index.  The caller must keep <b>cache_body</b> mapped for as long
+ * as the index exists. */
+microdesc_index_t *
+microdesc_index_load(const char *fname, const char *cache_body,
+                     size_t cache_len)
+{
+  tor_mmap_t *m;
+  const mdindex_header_t *hdr;
+  const mdindex_entry_t *entries;
+  const char *blob;
+  char digest[DIGEST256_LEN];
+  microdesc_index_t *idx;
+  uint32_t i;
+
+  m = tor_mmap_file(fname);
+  if (!m)
+    return NULL;
+  if (m->size < sizeof(mdindex_header_t))
+    goto stale;
+  hdr = (const mdindex_header_t *)m->data;
+  if (fast_memneq(hdr->magic, MDINDEX_MAGIC, sizeof(hdr->magic)) ||
+      hdr->byte_order != MDINDEX_BYTE_ORDER ||
+      hdr->cache_len != (uint64_t)cache_len)
+    goto stale;
+  crypto_digest256(digest, cache_body, cache_len, DIGEST_SHA256);
+  if (fast_memneq(digest, hdr->cache_digest, DIGEST256_LEN))
+    goto stale;
+
+  if (hdr->n_entries > INT_MAX ||
+      hdr->n_entries > (m->size - sizeof(mdindex_header_t)) /
+                       sizeof(mdindex_entry_t) ||
+      hdr->blob_len != m->size - sizeof(mdindex_header_t) -
+                       hdr->n_entries * sizeof(mdindex_entry_t))
+    goto corrupt;
+  entries = (const mdindex_entry_t *)(m->data + sizeof(mdindex_header_t));
+  blob = (const char *)(entries + hdr->n_entries);
+  for (i = 0; i < hdr->n_entries; ++i) {
+    if (i && fast_memcmp(entries[i-1].digest, entries[i].digest,
+                         DIGEST256_LEN) >= 0)
+      goto corrupt;
+    if (!mdindex_entry_is_valid(&entries[i], blob, hdr->blob_len,
+                                cache_body, cache_len))
+      goto corrupt;
+  }
+
+  idx = tor_malloc_zero(sizeof(microdesc_index_t));
+  idx->mapping = m;
+  idx->entries = entries;
+  idx->n_entries = (int)hdr->n_entries;
+  idx->blob = blob;
+  idx->cache_body = cache_body;
+  idx->used = bitarray_init_zero(hdr->n_entries ? hdr->n_entries : 1);
+  return idx;
+
+ corrupt:
+  log_warn(LD_DIR, "Microdescriptor index %s is corrupt; ignoring it.",
+           fname);
+ stale:
+  tor_munmap_file(m);
+  return NULL;
+}
+
+/** Helper: sort microdescriptors by digest. */
+static int
+compare_microdescs_by_digest_(const void **a, const void **b)
+{
+  const microdesc_t *md1 = *a, *md2 = *b;
+  return fast_memcmp(md1->digest, md2->digest, DIGEST256_LEN);
+}
+
+/** A growable buffer for the blob of an index that we are writing. */
+typedef struct mdindex_blob_t {
+  char *mem;
+  size_t len;
+  size_t alloc;
+} mdindex_blob_t;
+
+/** Append <b>len</b> bytes from <b>data</b> to <b>b</b>, after padding it
+ * to a multiple of <b>align</b> bytes.  Return the offset of the new data
+ * in <b>b</b>. */
+static uint32_t
+mdindex_blob_add(mdindex_blob_t *b, const void *data, size_t len,
+                 size_t align)
+{
+  size_t off = (b->len + align - 1) & ~(align - 1);
+  if (off + len > b->alloc) {
+    b->alloc = MAX(b->alloc * 2, off + len + 4096);
+    b->mem = tor_realloc(b->mem, b->alloc);
+  }
+  memset(b->mem + b->len, 0, off - b->len);
+  memcpy(b->mem + off, data, len);
+  b->len = off + len;
+  return (uint32_t)off;
+}
+
+/** Append an encoding of <b>policy</b> to <b>b</b>, and return its offset,
+ * or MDINDEX_NO_OFFSET if <b>policy</b> is NULL. */
+static uint32_t
+mdindex_blob_add_policy(mdindex_blob_t *b, const short_policy_t *policy)
+{
+  uint32_t word, off;
+  if (!policy)
+    return MDINDEX_NO_OFFSET;
+  word = policy->n_entries | (policy->is_accept ? MDINDEX_POLICY_ACCEPT : 0);
+  off = mdindex_blob_add(b, &word, sizeof(word), 4);
+  mdindex_blob_add(b, policy->entries,
+                   policy->n_entries * sizeof(short_policy_entry_t), 4);
+  return off;
+}
+
+/** Write an index to <b>fname</b> for every microdescriptor in <b>mds</b>
+ * that is stored in the cache file whose <b>cache_len</b> bytes are at
+ * <b>cache_body</b>.  Return 0 on success, -1 on failure. */
+int
+microdesc_index_write(const char *fname, const smartlist_t *mds,
+                      const char *cache_body, size_t cache_len)
+{
+  smartlist_t *sorted = smartlist_new();
+  mdindex_blob_t blob = { NULL, 0, 0 };
+  mdindex_header_t *hdr;
+  mdindex_entry_t *entries;
+  char *mem = NULL;
+  size_t len;
+  int r = -1;
+
+  SMARTLIST_FOREACH(mds, microdesc_t *, md, {
+    if (md->saved_location == SAVED_IN_CACHE && md->body)
+      smartlist_add(sorted, md);
+  });
+  smartlist_sort(sorted, compare_microdescs_by_digest_);
+  entries = tor_calloc(MAX(smartlist_len(sorted), 1), sizeof(*entries));
+
+  SMARTLIST_FOREACH_BEGIN(sorted, const microdesc_t *, md) {
+    mdindex_entry_t *ent = &entries[md_sl_idx];
+    if (BUG(md->onion_pkey_len == 0 || md->onion_pkey_len > UINT16_MAX) ||
+        BUG(md->off < 0 || (uint64_t)md->off + md->bodylen > cache_len))
+      goto done;
+    memcpy(ent->digest, md->digest, DIGEST256_LEN);
+    ent->body_off = (uint64_t)md->off;
+    ent->body_len = (uint32_t)md->bodylen;
+    ent->last_listed = (int64_t)md->last_listed;
+    ent->onion_pkey_off = mdindex_blob_add(&blob, md->onion_pkey,
+                                           md->onion_pkey_len, 1);
+    ent->onion_pkey_len = (uint16_t)md->onion_pkey_len;
+    if (md->onion_curve25519_pkey) {
+      ent->flags |= MDINDEX_HAS_NTOR_KEY;
+      memcpy(ent->curve25519_pkey, md->onion_curve25519_pkey->public_key,
+             CURVE25519_PUBKEY_LEN);
+    }
+    if (md->ed25519_identity_pkey) {
+      ent->flags |= MDINDEX_HAS_ED25519_ID;
+      memcpy(ent->ed25519_id, md->ed25519_identity_pkey->pubkey,
+             ED25519_PUBKEY_LEN);
+    }
+    if (tor_addr_family(&md->ipv6_addr) == AF_INET6) {
+      ent->flags |= MDINDEX_HAS_IPV6;
+      memcpy(ent->ipv6_addr, tor_addr_to_in6_addr8(&md->ipv6_addr), 16);
+      ent->ipv6_orport = md->ipv6_orport;
+    }
+    if (md->family) {
+      char *family = nodefamily_format(md->family);
+      ent->flags |= MDINDEX_HAS_FAMILY;
+      ent->family_len = (uint32_t)strlen(family);
+      ent->family_off = mdindex_blob_add(&blob, family,
+                                         ent->family_len + 1, 1);
+      tor_free(family);
+    }
+    ent->policy_off = mdindex_blob_add_policy(&blob, md->exit_policy);
+    ent->ipv6_policy_off = mdindex_blob_add_policy(&blob,
+                                                   md->ipv6_exit_policy);
+    if (md->policy_is_reject_star)
+      ent->flags |= MDINDEX_REJECT_STAR;
+  } SMARTLIST_FOREACH_END(md);
+
+  len = sizeof(mdindex_header_t) +
+    smartlist_len(sorted) * sizeof(mdindex_entry_t) + blob.len;
+  mem = tor_malloc_zero(len);
+  hdr = (mdindex_header_t *)mem;
+  memcpy(hdr->magic, MDINDEX_MAGIC, sizeof(hdr->magic));
+  hdr->byte_order = MDINDEX_BYTE_ORDER;
+  hdr->n_entries = (uint32_t)smartlist_len(sorted);
+  hdr->cache_len = (uint64_t)cache_len;
+  hdr->blob_len = (uint64_t)blob.len;
+  crypto_digest256(hdr->cache_digest, cache_body, cache_len, DIGEST_SHA256);
+  memcpy(mem + sizeof(mdindex_header_t), entries,
+         smartlist_len(sorted) * sizeof(mdindex_entry_t));
+  if (blob.len)
+    memcpy(mem + len - blob.len, blob.mem, blob.len);
+
+  if (write_bytes_to_file(fname, mem, len, 1) < 0) {
+    log_info(LD_DIR, "Unable to write microdescriptor index %s.", fname);
+    goto done;
+  }
+  r = 0;
+
+ done:
+  smartlist_free(sorted);
+  tor_free(entries);
+  tor_free(blob.mem);
+  tor_free(mem);
+  return r;
+}
+
+/** Return the number of records in <b>idx</b>. */
+int
+microdesc_index_get_n(const microdesc_index_t *idx)
+{
+  return idx->n_entries;
+}
+
+/** Return the position of the record in <b>idx</b> for the microdescriptor
+ * whose SHA256 digest is <b>digest</b>, or -1 if there is none. */
+int
+microdesc_index_find(const microdesc_index_t *idx, const char *digest)
+{
+  int lo = 0, hi = idx->n_entries - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    int c = fast_memcmp(digest, idx->entries[mid].digest, DIGEST256_LEN);
+    if (c == 0)
+      return mid;
+    else if (c < 0)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+  return -1;
+}
+
+/** Return true iff record <b>i</b> of <b>idx</b> has been taken or
+ * dropped. */
+int
+microdesc_index_is_used(const microdesc_index_t *idx, int i)
+{
+  tor_assert(i >= 0 && i < idx->n_entries);
+  return bitarray_is_set(idx->used, i) != 0;
+}
+
+/** Return the last_listed time of record <b>i</b> of <b>idx</b>. */
+time_t
+microdesc_index_get_last_listed(const microdesc_index_t *idx, int i)
+{
+  tor_assert(i >= 0 && i < idx->n_entries);
+  return (time_t)idx->entries[i].last_listed;
+}
+
+/** Return the body length of record <b>i</b> of <b>idx</b>. */
+size_t
+microdesc_index_get_bodylen(const microdesc_index_t *idx, int i)
+{
+  tor_assert(i >= 0 && i < idx->n_entries);
+  return idx->entries[i].body_len;
+}
+
+/** Decode the policy summary at <b>off</b> in the blob of <b>idx</b>. */
+static short_policy_t *
+mdindex_decode_policy(const microdesc_index_t *idx, uint32_t off)
+{
+  short_policy_t *policy;
+  uint32_t word, n;
+  if (off == MDINDEX_NO_OFFSET)
+    return NULL;
+  memcpy(&word, idx->blob + off, sizeof(word));
+  n = word & ~MDINDEX_POLICY_ACCEPT;
+  policy = tor_malloc_zero(offsetof(short_policy_t, entries) +
+                           n * sizeof(short_policy_entry_t));
+  policy->is_accept = (word & MDINDEX_POLICY_ACCEPT) ? 1 : 0;
+  policy->n_entries = n;
+  memcpy(policy->entries, idx->blob + off + sizeof(word),
+         n * sizeof(short_policy_entry_t));
+  return policy;
+}
+
+/** Build and return a new microdesc_t from record <b>i</b> of <b>idx</b>,
+ * and mark the record as used.  The microdesc's body points into the cache
+ * file, as if we had parsed it from there with SAVED_IN_CACHE. */
+microdesc_t *
+microdesc_index_take(microdesc_index_t *idx, int i)
+{
+  const mdindex_entry_t *ent;
+  microdesc_t *md;
+
+  tor_assert(!microdesc_index_is_used(idx, i));
+  bitarray_set(idx->used, i);
+  ent = &idx->entries[i];
+
+  md = tor_malloc_zero(sizeof(microdesc_t));
+  memcpy(md->digest, ent->digest, DIGEST256_LEN);
+  md->last_listed = (time_t)ent->last_listed;
+  md->saved_location = SAVED_IN_CACHE;
+  md->off = (off_t)ent->body_off;
+  md->body = (char *)idx->cache_body + ent->body_off;
+  md->bodylen = ent->body_len;
+
+  md->onion_pkey = tor_memdup(idx->blob + ent->onion_pkey_off,
+                              ent->onion_pkey_len);
+  md->onion_pkey_len = ent->onion_pkey_len;
+  if (ent->flags & MDINDEX_HAS_NTOR_KEY) {
+    md->onion_curve25519_pkey = tor_memdup(ent->curve25519_pkey,
+                                           sizeof(curve25519_public_key_t));
+  }
+  if (ent->flags & MDINDEX_HAS_ED25519_ID) {
+    md->ed25519_identity_pkey = tor_memdup(ent->ed25519_id,
+                                           sizeof(ed25519_public_key_t));
+  }
+  if (ent->flags & MDINDEX_HAS_IPV6) {
+    tor_addr_from_ipv6_bytes(&md->ipv6_addr, ent->ipv6_addr);
+    md->ipv6_orport = ent->ipv6_orport;
+  }
+  if (ent->flags & MDINDEX_HAS_FAMILY) {
+    md->family = nodefamily_parse(idx->blob + ent->family_off, NULL,
+                                  NF_WARN_MALFORMED);
+  }
+  md->exit_policy = mdindex_decode_policy(idx, ent->policy_off);
+  md->ipv6_exit_policy = mdindex_decode_policy(idx, ent->ipv6_policy_off);
+  md->policy_is_reject_star = (ent->flags & MDINDEX_REJECT_STAR) ? 1 : 0;
+
+  return md;
+}
+
+/** Mark record <b>i</b> of <b>idx</b> as used, without building a
+ * microdesc_t for it. */
+void
+microdesc_index_drop(microdesc_index_t *idx, int i)
+{
+  tor_assert(!microdesc_index_is_used(idx, i));
+  bitarray_set(idx->used, i);
+}
+
+/** Release all storage held by <b>idx</b>. */
+void
+microdesc_index_free_(microdesc_index_t *idx)
+{
+  if (!idx)
+    return;
+  if (tor_munmap_file(idx->mapping) < 0) {
+    log_warn(LD_FS, "Failed to unmap microdescriptor index.");
+  }
+  bitarray_free(idx->used);
+  tor_free(idx);
+}
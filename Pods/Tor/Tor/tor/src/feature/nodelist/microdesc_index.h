@@ -0,0 +1,32 @@
+/* Copyright (c) 2009-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file microdesc_index.h
+ * \brief Header file for microdesc_index.c.
+ **/
+
+#ifndef TOR_MICRODESC_INDEX_H
+#define TOR_MICRODESC_INDEX_H
+
+typedef struct microdesc_index_t microdesc_index_t;
+
+microdesc_index_t *microdesc_index_load(const char *fname,
+                                        const char *cache_body,
+                                        size_t cache_len);
+int microdesc_index_write(const char *fname, const smartlist_t *mds,
+                          const char *cache_body, size_t cache_len);
+
+int microdesc_index_get_n(const microdesc_index_t *idx);
+int microdesc_index_find(const microdesc_index_t *idx, const char *digest);
+int microdesc_index_is_used(const microdesc_index_t *idx, int i);
+time_t microdesc_index_get_last_listed(const microdesc_index_t *idx, int i);
+size_t microdesc_index_get_bodylen(const microdesc_index_t *idx, int i);
+microdesc_t *microdesc_index_take(microdesc_index_t *idx, int i);
+void microdesc_index_drop(microdesc_index_t *idx, int i);
+
+void microdesc_index_free_(microdesc_index_t *idx);
+#define microdesc_index_free(idx) \
+  FREE_AND_NULL(microdesc_index_t, microdesc_index_free_, (idx))
+
+#endif /* !defined(TOR_MICRODESC_INDEX_H) */
@@ -480,6 +480,107 @@ choose_array_element_by_weight(const uint64_t *entries, int n_entries)
                            entries, n_entries, total, rand_val);
 }
 
+/** Build and return a table for choosing among the <b>n</b> elements of
+ * <b>weights</b>, each with a probability proportional to its weight, in
+ * constant time.  If all weights are 0, every element is equally likely.
+ *
+ * This is Vose's variant of Walker's alias method: the table has one column
+ * per element, each column holds at most two elements (itself, and an
+ * "alias" that owns the rest of the column), and every column is equally
+ * likely. */
+weighted_alias_table_t *
+weighted_alias_table_new(const double *weights, int n)
+{
+  weighted_alias_table_t *table;
+  double total = 0.0;
+  double *scaled;
+  int *small, *large;
+  int n_small = 0, n_large = 0;
+  int i;
+
+  tor_assert(weights);
+  tor_assert(n > 0);
+
+  for (i = 0; i < n; ++i)
+    total += weights[i];
+
+  table = tor_malloc_zero(sizeof(weighted_alias_table_t));
+  table->n = n;
+  table->prob = tor_calloc(n, sizeof(uint64_t));
+  table->alias = tor_calloc(n, sizeof(int));
+
+  if (!(total > 0.0)) {
+    for (i = 0; i < n; ++i) {
+      table->prob[i] = ALIAS_TABLE_PROB_ONE;
+      table->alias[i] = i;
+    }
+    return table;
+  }
+
+  /* Scale the weights so that a column holds exactly 1.0, then pair each
+   * element that doesn't fill its own column with one that overfills its
+   * own, until every column is full. */
+  scaled = tor_calloc(n, sizeof(double));
+  small = tor_calloc(n, sizeof(int));
+  large = tor_calloc(n, sizeof(int));
+  for (i = 0; i < n; ++i) {
+    scaled[i] = weights[i] * n / total;
+    if (scaled[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large - 1];
+    table->prob[s] = (uint64_t) (scaled[s] * ALIAS_TABLE_PROB_ONE);
+    table->alias[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+  /* Whatever is left fills its own column, up to rounding error. */
+  while (n_large) {
+    const int l = large[--n_large];
+    table->prob[l] = ALIAS_TABLE_PROB_ONE;
+    table->alias[l] = l;
+  }
+  while (n_small) {
+    const int s = small[--n_small];
+    table->prob[s] = ALIAS_TABLE_PROB_ONE;
+    table->alias[s] = s;
+  }
+
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+  return table;
+}
+
+/** Pick a random element from <b>table</b>, and return its index. */
+int
+weighted_alias_table_choose(const weighted_alias_table_t *table)
+{
+  const int col = crypto_rand_int(table->n);
+
+  if (crypto_rand_uint64(ALIAS_TABLE_PROB_ONE) < table->prob[col])
+    return col;
+  return table->alias[col];
+}
+
+/** Release all storage held by <b>table</b>. */
+void
+weighted_alias_table_free_(weighted_alias_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->prob);
+  tor_free(table->alias);
+  tor_free(table);
+}
+
 /** Return bw*1000, unless bw*1000 would overflow, in which case return
  * INT32_MAX. */
 static inline int32_t
@@ -932,20 +1033,162 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** Every node that router_choose_random_node() could pick for a given set
+ * of flags, and an alias table for choosing among them by bandwidth with a
+ * given rule.  Building these means looking at every node in the nodelist,
+ * so we keep them until our directory info or our options change. */
+typedef struct node_choice_cache_t {
+  router_crn_flags_t flags;
+  bandwidth_weight_rule_t rule;
+  /** The nodes that match <b>flags</b>, in nodelist order. */
+  smartlist_t *nodes;
+  /** A table for choosing among <b>nodes</b>, or NULL if there are none. */
+  weighted_alias_table_t *table;
+} node_choice_cache_t;
+
+/** How many different flags and rule combinations do we keep tables for?
+ * In practice we only ever see a handful. */
+#define MAX_NODE_CHOICE_CACHES 16
+/** How many times do we pick from a cached table before giving up on it,
+ * because the nodes we keep picking are excluded for this choice? */
+#define NODE_CHOICE_CACHE_MAX_TRIES 16
+
+/** List of node_choice_cache_t. */
+static smartlist_t *node_choice_caches = NULL;
+/** True iff the nodelist or our options changed since we built the entries
+ * of <b>node_choice_caches</b>.  Their node pointers may be dangling. */
+static int node_choice_caches_stale = 0;
+
+/** Release all storage held by <b>cache</b>. */
+static void
+node_choice_cache_free_(node_choice_cache_t *cache)
+{
+  if (!cache)
+    return;
+  smartlist_free(cache->nodes);
+  weighted_alias_table_free(cache->table);
+  tor_free(cache);
+}
+#define node_choice_cache_free(cache) \
+  FREE_AND_NULL(node_choice_cache_t, node_choice_cache_free_, (cache))
+
+/** Tell the node selection code that the set of nodes we could choose, or
+ * their weights, may have changed. */
+void
+node_select_cache_clear(void)
+{
+  node_choice_caches_stale = 1;
+}
+
+/** Return the node choice cache for <b>flags</b> and <b>rule</b>, building
+ * it if needed. */
+static const node_choice_cache_t *
+node_choice_cache_get(router_crn_flags_t flags, bandwidth_weight_rule_t rule)
+{
+  node_choice_cache_t *cache;
+  double *bandwidths = NULL;
+
+  if (!node_choice_caches)
+    node_choice_caches = smartlist_new();
+
+  if (node_choice_caches_stale ||
+      smartlist_len(node_choice_caches) >= MAX_NODE_CHOICE_CACHES) {
+    SMARTLIST_FOREACH(node_choice_caches, node_choice_cache_t *, c,
+                      node_choice_cache_free(c));
+    smartlist_clear(node_choice_caches);
+    node_choice_caches_stale = 0;
+  }
+
+  SMARTLIST_FOREACH(node_choice_caches, node_choice_cache_t *, c, {
+    if (c->flags == flags && c->rule == rule)
+      return c;
+  });
+
+  cache = tor_malloc_zero(sizeof(node_choice_cache_t));
+  cache->flags = flags;
+  cache->rule = rule;
+  cache->nodes = smartlist_new();
+  router_add_running_nodes_to_smartlist(cache->nodes, flags);
+  if (smartlist_len(cache->nodes) &&
+      compute_weighted_bandwidths(cache->nodes, rule, &bandwidths, NULL) == 0)
+    cache->table = weighted_alias_table_new(bandwidths,
+                                            smartlist_len(cache->nodes));
+  tor_free(bandwidths);
+  log_debug(LD_CIRC, "Built a node choice table over %d nodes for rule %s.",
+            smartlist_len(cache->nodes),
+            bandwidth_weight_rule_to_string(rule));
+
+  smartlist_add(node_choice_caches, cache);
+  return cache;
+}
+
+/** Try to choose a node as router_choose_random_node_helper() would, from
+ * the cached table for <b>flags</b> and <b>rule</b>: pick nodes from the
+ * table until we get one that is not excluded.  Since a node's weight does
+ * not depend on which other nodes are candidates, this gives each remaining
+ * node the same chance it would have had if we had built a table just for
+ * them.  Return NULL if we keep picking excluded nodes, so the caller can
+ * fall back to building the list. */
+static const node_t *
+node_choice_cache_choose(const smartlist_t *excludednodes,
+                         const routerset_t *excludedset,
+                         router_crn_flags_t flags,
+                         bandwidth_weight_rule_t rule)
+{
+  const node_choice_cache_t *cache = node_choice_cache_get(flags, rule);
+  int i;
+
+  if (!cache->table)
+    return NULL;
+
+  for (i = 0; i < NODE_CHOICE_CACHE_MAX_TRIES; ++i) {
+    const node_t *node =
+      smartlist_get(cache->nodes, weighted_alias_table_choose(cache->table));
+    if (smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    /* Losing a descriptor doesn't always clear the cache, so make sure the
+     * node is still one we can use. */
+    if (!router_can_choose_node(node, flags))
+      continue;
+    return node;
+  }
+  return NULL;
+}
+
+/** Release all storage held by the node selection caches. */
+void
+node_select_free_all(void)
+{
+  if (node_choice_caches) {
+    SMARTLIST_FOREACH(node_choice_caches, node_choice_cache_t *, c,
+                      node_choice_cache_free(c));
+    smartlist_free(node_choice_caches);
+  }
+  node_choice_caches_stale = 0;
+}
+
 /* Node selection helper for router_choose_random_node().
  *
- * Populates a node list based on <b>flags</b>, ignoring nodes in
- * <b>excludednodes</b> and <b>excludedset</b>. Chooses the node based on
- * <b>rule</b>. */
+ * Chooses a node matching <b>flags</b>, ignoring nodes in
+ * <b>excludednodes</b> and <b>excludedset</b>, based on <b>rule</b>.  Uses
+ * the cached table for <b>flags</b> and <b>rule</b> when it can, and
+ * otherwise populates a node list and chooses from that. */
 static const node_t *
 router_choose_random_node_helper(smartlist_t *excludednodes,
                                  routerset_t *excludedset,
                                  router_crn_flags_t flags,
                                  bandwidth_weight_rule_t rule)
 {
-  smartlist_t *sl=smartlist_new();
+  smartlist_t *sl;
   const node_t *choice = NULL;
 
+  choice = node_choice_cache_choose(excludednodes, excludedset, flags, rule);
+  if (choice)
+    return choice;
+
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, flags);
   log_debug(LD_CIRC,
            "We found %d running nodes.",
@@ -93,7 +93,33 @@ const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
                                                      int flags);
 
+typedef struct weighted_alias_table_t weighted_alias_table_t;
+weighted_alias_table_t *weighted_alias_table_new(const double *weights,
+                                                 int n);
+int weighted_alias_table_choose(const weighted_alias_table_t *table);
+void weighted_alias_table_free_(weighted_alias_table_t *table);
+#define weighted_alias_table_free(table) \
+  FREE_AND_NULL(weighted_alias_table_t, weighted_alias_table_free_, (table))
+
+void node_select_cache_clear(void);
+void node_select_free_all(void);
+
 #ifdef NODE_SELECT_PRIVATE
+/** A table for choosing an element at random, with probability proportional
+ * to its weight, in constant time.  See weighted_alias_table_new(). */
+struct weighted_alias_table_t {
+  /** How many elements (and columns) does this table have? */
+  int n;
+  /** For each column, the chance out of ALIAS_TABLE_PROB_ONE that choosing
+   * that column gives its own element rather than its alias. */
+  uint64_t *prob;
+  /** For each column, the element that owns the rest of the column. */
+  int *alias;
+};
+
+/** The value in weighted_alias_table_t.prob that means "always". */
+#define ALIAS_TABLE_PROB_ONE (UINT64_C(1) << 53)
+
 STATIC int choose_array_element_by_weight(const uint64_t *entries,
                                           int n_entries);
 STATIC void scale_array_elements_to_u64(uint64_t *entries_out,
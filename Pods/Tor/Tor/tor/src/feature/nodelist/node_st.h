@@ -92,6 +92,8 @@ struct node_t {
   /** According to the geoip db what country is this router in? */
   /* IPv6: what is this supposed to mean with multiple OR ports? */
   country_t country;
+  /** The IPv4 address that <b>country</b> was looked up for. */
+  tor_addr_t country_addr;
 
   /* The below items are used only by authdirservers for
    * reachability testing. */
@@ -104,6 +106,11 @@ struct node_t {
    * in order to know what's the hs directory index for this node at the time
    * the consensus is set. */
   struct hsdir_index_t hsdir_index;
+  /** The ed25519 identity that <b>hsdir_index</b> was built for. */
+  ed25519_public_key_t hsdir_index_id;
+  /** The generation of the nodelist's hsdir index parameters that
+   * <b>hsdir_index</b> was built from, or 0 if it was never built. */
+  unsigned int hsdir_index_gen;
 };
 
 #endif /* !defined(NODE_ST_H) */
@@ -113,6 +113,20 @@ static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
 static void node_add_to_address_set(const node_t *node);
 
+/** The time periods and shared random values that the hsdir indexes of every
+ * node are built from.  They are the same for every node in a given
+ * consensus, and usually stay the same from one consensus to the next. */
+typedef struct hsdir_index_params_t {
+  uint64_t fetch_tp;
+  uint64_t store_first_tp;
+  uint64_t store_second_tp;
+  uint8_t fetch_srv[DIGEST256_LEN];
+  uint8_t store_first_srv[DIGEST256_LEN];
+  uint8_t store_second_srv[DIGEST256_LEN];
+  /** True iff we were between TP#N and SRV#N+1 when we computed these. */
+  int in_period_between_tp_and_srv;
+} hsdir_index_params_t;
+
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
  * is currently in the routerlist, or currently in the consensus we're using.
@@ -142,6 +156,13 @@ typedef struct nodelist_t {
    * nodelist.  We use this to detect outdated nodelists that need to be
    * rebuilt using a newer consensus. */
   time_t live_consensus_valid_after;
+
+  /* The parameters that the hsdir indexes of our nodes were last built from,
+   * and a counter that we bump every time they change.  A node whose
+   * hsdir_index_gen matches hsdir_params_gen doesn't need its indexes
+   * rebuilt. */
+  hsdir_index_params_t hsdir_params;
+  unsigned int hsdir_params_gen;
 } nodelist_t;
 
 static inline unsigned int
@@ -350,90 +371,148 @@ node_add_to_ed25519_map(node_t *node)
   return 1;
 }
 
-/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
- * for the node, both current and next if possible. This can only fails if the
- * node_t ed25519 identity key can't be found which would be a bug. */
-STATIC void
-node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+/** Compute into <b>params_out</b> the time periods and shared random values
+ * that the hsdir indexes of every node are built from, for the consensus
+ * <b>ns</b> at time <b>now</b>. */
+static void
+hsdir_index_params_compute(hsdir_index_params_t *params_out,
+                           const networkstatus_t *ns, time_t now)
 {
-  time_t now = approx_time();
-  const ed25519_public_key_t *node_identity_pk;
   uint8_t *fetch_srv = NULL, *store_first_srv = NULL, *store_second_srv = NULL;
   uint64_t next_time_period_num, current_time_period_num;
-  uint64_t fetch_tp, store_first_tp, store_second_tp;
 
-  tor_assert(node);
-  tor_assert(ns);
-
-  if (!networkstatus_consensus_reasonably_live(ns, now)) {
-    static struct ratelim_t live_consensus_ratelim = RATELIM_INIT(30 * 60);
-    log_fn_ratelim(&live_consensus_ratelim, LOG_INFO, LD_GENERAL,
-                   "Not setting hsdir index with a non-live consensus.");
-    goto done;
-  }
-
-  node_identity_pk = node_get_ed25519_id(node);
-  if (node_identity_pk == NULL) {
-    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
-                          "trying to build the hsdir indexes for node %s",
-              node_describe(node));
-    goto done;
-  }
+  /* Clear the padding too: we compare these with tor_memneq(). */
+  memset(params_out, 0, sizeof(*params_out));
 
   /* Get the current and next time period number. */
   current_time_period_num = hs_get_time_period_num(0);
   next_time_period_num = hs_get_next_time_period_num(0);
 
   /* We always use the current time period for fetching descs */
-  fetch_tp = current_time_period_num;
+  params_out->fetch_tp = current_time_period_num;
+  params_out->in_period_between_tp_and_srv =
+    hs_in_period_between_tp_and_srv(ns, now);
 
   /* Now extract the needed SRVs and time periods for building hsdir indices */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
-    fetch_srv = hs_get_current_srv(fetch_tp, ns);
+  if (params_out->in_period_between_tp_and_srv) {
+    fetch_srv = hs_get_current_srv(params_out->fetch_tp, ns);
 
-    store_first_tp = hs_get_previous_time_period_num(0);
-    store_second_tp = current_time_period_num;
+    params_out->store_first_tp = hs_get_previous_time_period_num(0);
+    params_out->store_second_tp = current_time_period_num;
   } else {
-    fetch_srv = hs_get_previous_srv(fetch_tp, ns);
+    fetch_srv = hs_get_previous_srv(params_out->fetch_tp, ns);
 
-    store_first_tp = current_time_period_num;
-    store_second_tp = next_time_period_num;
+    params_out->store_first_tp = current_time_period_num;
+    params_out->store_second_tp = next_time_period_num;
   }
 
   /* We always use the old SRV for storing the first descriptor and the latest
    * SRV for storing the second descriptor */
-  store_first_srv = hs_get_previous_srv(store_first_tp, ns);
-  store_second_srv = hs_get_current_srv(store_second_tp, ns);
+  store_first_srv = hs_get_previous_srv(params_out->store_first_tp, ns);
+  store_second_srv = hs_get_current_srv(params_out->store_second_tp, ns);
+
+  memcpy(params_out->fetch_srv, fetch_srv, DIGEST256_LEN);
+  memcpy(params_out->store_first_srv, store_first_srv, DIGEST256_LEN);
+  memcpy(params_out->store_second_srv, store_second_srv, DIGEST256_LEN);
+
+  tor_free(fetch_srv);
+  tor_free(store_first_srv);
+  tor_free(store_second_srv);
+}
+
+/** Make the nodelist's hsdir index parameters match the consensus <b>ns</b>,
+ * starting a new generation of them if they changed.  Return 0 on success,
+ * or -1 if <b>ns</b> isn't live enough to build hsdir indexes from. */
+static int
+nodelist_update_hsdir_index_params(const networkstatus_t *ns)
+{
+  time_t now = approx_time();
+  hsdir_index_params_t params;
+
+  if (!networkstatus_consensus_reasonably_live(ns, now)) {
+    static struct ratelim_t live_consensus_ratelim = RATELIM_INIT(30 * 60);
+    log_fn_ratelim(&live_consensus_ratelim, LOG_INFO, LD_GENERAL,
+                   "Not setting hsdir index with a non-live consensus.");
+    return -1;
+  }
+
+  hsdir_index_params_compute(&params, ns, now);
+  if (the_nodelist->hsdir_params_gen == 0 ||
+      tor_memneq(&params, &the_nodelist->hsdir_params, sizeof(params))) {
+    memcpy(&the_nodelist->hsdir_params, &params, sizeof(params));
+    /* Zero means "never built", so skip it if we ever wrap around. */
+    if (++the_nodelist->hsdir_params_gen == 0)
+      the_nodelist->hsdir_params_gen = 1;
+  }
+  return 0;
+}
+
+/** Build the hsdir indexes of <b>node</b> from the nodelist's current hsdir
+ * index parameters, unless they were already built from those parameters
+ * and the same ed25519 identity.  Return 1 if we rebuilt them, else 0. */
+static int
+node_build_hsdir_index(node_t *node)
+{
+  const hsdir_index_params_t *params = &the_nodelist->hsdir_params;
+  const ed25519_public_key_t *node_identity_pk;
+
+  node_identity_pk = node_get_ed25519_id(node);
+  if (node_identity_pk == NULL) {
+    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
+                          "trying to build the hsdir indexes for node %s",
+              node_describe(node));
+    return 0;
+  }
+
+  if (node->hsdir_index_gen == the_nodelist->hsdir_params_gen &&
+      ed25519_pubkey_eq(&node->hsdir_index_id, node_identity_pk)) {
+    return 0;
+  }
 
   /* Build the fetch index. */
-  hs_build_hsdir_index(node_identity_pk, fetch_srv, fetch_tp,
+  hs_build_hsdir_index(node_identity_pk, params->fetch_srv, params->fetch_tp,
                        node->hsdir_index.fetch);
 
   /* If we are in the time segment between SRV#N and TP#N, the fetch index is
      the same as the first store index */
-  if (!hs_in_period_between_tp_and_srv(ns, now)) {
+  if (!params->in_period_between_tp_and_srv) {
     memcpy(node->hsdir_index.store_first, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_first));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_first_srv, store_first_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_first_srv,
+                         params->store_first_tp,
                          node->hsdir_index.store_first);
   }
 
   /* If we are in the time segment between TP#N and SRV#N+1, the fetch index is
      the same as the second store index */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
+  if (params->in_period_between_tp_and_srv) {
     memcpy(node->hsdir_index.store_second, node->hsdir_index.fetch,
            sizeof(node->hsdir_index.store_second));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_second_srv, store_second_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_second_srv,
+                         params->store_second_tp,
                          node->hsdir_index.store_second);
   }
 
- done:
-  tor_free(fetch_srv);
-  tor_free(store_first_srv);
-  tor_free(store_second_srv);
-  return;
+  memcpy(&node->hsdir_index_id, node_identity_pk, sizeof(*node_identity_pk));
+  node->hsdir_index_gen = the_nodelist->hsdir_params_gen;
+  return 1;
+}
+
+/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
+ * for the node, both current and next if possible. This can only fails if the
+ * node_t ed25519 identity key can't be found which would be a bug. */
+STATIC void
+node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+{
+  tor_assert(node);
+  tor_assert(ns);
+
+  init_nodelist();
+  if (nodelist_update_hsdir_index_params(ns) < 0)
+    return;
+  node_build_hsdir_index(node);
 }
 
 /** Called when a node's address changes. */
@@ -442,6 +521,7 @@ node_addrs_changed(node_t *node)
 {
   node->last_reachable = node->last_reachable6 = 0;
   node->country = -1;
+  tor_addr_make_unspec(&node->country_addr);
 }
 
 /** Add all address information about <b>node</b> to the current address
@@ -680,16 +760,31 @@ get_estimated_address_per_node, (void))
   return ESTIMATED_ADDRESS_PER_NODE;
 }
 
+/** What did the last call to nodelist_set_consensus() have to do? */
+STATIC nodelist_update_stats_t nodelist_last_update_stats;
+
 /** Tell the nodelist that the current usable consensus is <b>ns</b>.
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
  * and grab microdescriptors into nodes as appropriate.
+ *
+ * Most relays look the same from one consensus to the next, so the derived
+ * state that is expensive to compute (microdescriptor, hsdir indexes and
+ * country) is only recomputed for nodes whose inputs to it have changed.
  */
 void
 nodelist_set_consensus(const networkstatus_t *ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
+  nodelist_update_stats_t *stats = &nodelist_last_update_stats;
+  /* Whether we have hsdir index parameters for <b>ns</b>: 0 if we haven't
+   * looked yet, 1 if we do, -1 if we can't build indexes from it. */
+  int have_hsdir_params = 0;
+  monotime_t start, end;
+
+  monotime_get(&start);
+  memset(stats, 0, sizeof(*stats));
 
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
@@ -713,6 +808,7 @@ nodelist_set_consensus(const networkstatus_t *ns)
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
+    int touched = 0;
     node->rs = rs;
     if (ns->flavor == FLAV_MICRODESC) {
       if (node->md == NULL ||
@@ -725,13 +821,26 @@ nodelist_set_consensus(const networkstatus_t *ns)
         if (node->md)
           node->md->held_by_nodes++;
         node_add_to_ed25519_map(node);
+        ++stats->n_md_changed;
+        touched = 1;
       }
     }
 
     if (rs->pv.supports_v3_hsdir) {
-      node_set_hsdir_index(node, ns);
+      if (!have_hsdir_params)
+        have_hsdir_params =
+          nodelist_update_hsdir_index_params(ns) == 0 ? 1 : -1;
+      if (have_hsdir_params > 0 && node_build_hsdir_index(node)) {
+        ++stats->n_hsdir_index_built;
+        touched = 1;
+      }
     }
-    node_set_country(node);
+    if (!tor_addr_eq(&node->country_addr, &rs->ipv4_addr)) {
+      node_set_country(node);
+      ++stats->n_country_set;
+      touched = 1;
+    }
+    stats->n_touched += touched;
 
     /* If we're not an authdir, believe others. */
     if (!authdir) {
@@ -785,6 +894,19 @@ nodelist_set_consensus(const networkstatus_t *ns)
   if (networkstatus_is_live(ns, approx_time())) {
     the_nodelist->live_consensus_valid_after = ns->valid_after;
   }
+
+  /* Our nodes have new flags and bandwidths. */
+  node_select_cache_clear();
+
+  monotime_get(&end);
+  stats->n_listed = smartlist_len(ns->routerstatus_list);
+  stats->usec = monotime_diff_usec(&start, &end);
+  log_info(LD_DIR, "Updated the nodelist from a %s consensus in %"PRId64
+           " usec: %d of %d listed nodes changed (%d microdescriptors, "
+           "%d hsdir indexes and %d countries recomputed).",
+           networkstatus_get_flavor_name(ns->flavor), stats->usec,
+           stats->n_touched, stats->n_listed, stats->n_md_changed,
+           stats->n_hsdir_index_built, stats->n_country_set);
 }
 
 /** Return 1 iff <b>node</b> has Exit flag and no BadExit flag.
@@ -885,6 +1007,8 @@ node_free_(node_t *node)
   if (node->md)
     node->md->held_by_nodes--;
   tor_assert(node->nodelist_idx == -1);
+  /* Don't leave a dangling pointer in the node selection tables. */
+  node_select_cache_clear();
   tor_free(node);
 }
 
@@ -2085,6 +2209,7 @@ node_set_country(node_t *node)
     return;
   }
   node->country = geoip_get_country_by_addr(ipv4_addr);
+  tor_addr_copy(&node->country_addr, ipv4_addr);
 }
 
 /** Set the country code of all routers in the routerlist. */
@@ -2479,6 +2604,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_select_cache_clear();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
 }
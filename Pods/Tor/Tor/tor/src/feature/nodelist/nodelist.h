@@ -175,6 +175,26 @@ STATIC int node_family_contains(const node_t *n1, const node_t *n2);
 STATIC bool node_has_declared_family(const node_t *node);
 STATIC void node_lookup_declared_family(smartlist_t *out, const node_t *node);
 
+/** What nodelist_set_consensus() had to recompute for the nodes of the last
+ * consensus it was given, and how long that took. */
+typedef struct nodelist_update_stats_t {
+  /** How many routerstatus entries did the consensus have? */
+  int n_listed;
+  /** How many of their nodes needed anything more than their routerstatus
+   * and flags updated? */
+  int n_touched;
+  /** How many nodes got a different microdescriptor? */
+  int n_md_changed;
+  /** How many nodes had their hsdir indexes rebuilt? */
+  int n_hsdir_index_built;
+  /** How many nodes had their country looked up again? */
+  int n_country_set;
+  /** How long did the whole update take, in microseconds? */
+  int64_t usec;
+} nodelist_update_stats_t;
+
+EXTERN(nodelist_update_stats_t, nodelist_last_update_stats)
+
 #ifdef TOR_UNIT_TESTS
 
 STATIC void node_set_hsdir_index(node_t *node, const networkstatus_t *ns);
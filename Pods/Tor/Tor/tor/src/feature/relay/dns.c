@@ -74,6 +74,7 @@
 #include "core/or/conflux_util.h"
 
 #include "ht.h"
+#include "ext/tor_queue.h"
 
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
@@ -101,7 +102,7 @@ static char *resolv_conf_fname = NULL;
 static time_t resolv_conf_mtime = 0;
 
 static void purge_expired_resolves(time_t now);
-static void dns_found_answer(const char *address, uint8_t query_type,
+STATIC void dns_found_answer(const char *address, uint8_t query_type,
                              int dns_answer,
                              const tor_addr_t *addr,
                              const char *hostname,
@@ -112,6 +113,7 @@ static int answer_is_wildcarded(const char *ip);
 static int evdns_err_is_transient(int err);
 static void inform_pending_connections(cached_resolve_t *resolve);
 static void make_pending_resolve_cached(cached_resolve_t *cached);
+static void cached_resolve_apply_refresh(cached_resolve_t *resolve);
 static void configure_libevent_options(void);
 
 #ifdef DEBUG_DNS_CACHE
@@ -125,6 +127,26 @@ static void assert_resolve_ok(cached_resolve_t *resolve);
 /** Hash table of cached_resolve objects. */
 static HT_HEAD(cache_map, cached_resolve_t) cache_root;
 
+/** List of the cached answers in cache_root, from least to most recently
+ * used. When the cache is full, we drop answers from its head. */
+static TOR_TAILQ_HEAD(cached_resolve_lru_t, cached_resolve_t)
+  cached_resolve_lru = TOR_TAILQ_HEAD_INITIALIZER(cached_resolve_lru);
+/** How many cached answers are in cached_resolve_lru? */
+static int n_cached_resolves = 0;
+/** How many refreshes of hot cached answers are in flight? */
+static int n_refreshes_inflight = 0;
+
+/** Default, minimum and maximum number of answers in our cache. */
+#define DNS_CACHE_MAX_ENTRIES_DEFAULT (65536)
+#define DNS_CACHE_MAX_ENTRIES_MIN (128)
+#define DNS_CACHE_MAX_ENTRIES_MAX (INT32_MAX)
+/** Most answers we keep in our cache. From the exit_dns_cache_max_entries
+ * consensus parameter. */
+static int32_t dns_cache_max_entries = DNS_CACHE_MAX_ENTRIES_DEFAULT;
+
+/** Statistics about our cache, for the metrics port. */
+static dns_cache_stats_t dns_cache_stats;
+
 /** Global: how many IPv6 requests have we made in all? */
 static uint64_t n_ipv6_requests_made = 0;
 /** Global: how many IPv6 requests have timed out? */
@@ -219,7 +241,11 @@ evdns_log_cb(int warn, const char *msg)
 void
 dns_new_consensus_params(const networkstatus_t *ns)
 {
-  (void) ns;
+  dns_cache_max_entries =
+    networkstatus_get_param(ns, "exit_dns_cache_max_entries",
+                            DNS_CACHE_MAX_ENTRIES_DEFAULT,
+                            DNS_CACHE_MAX_ENTRIES_MIN,
+                            DNS_CACHE_MAX_ENTRIES_MAX);
 
   /* Consensus has parameters for the Exit relay DNS side and so we only reset
    * the DNS nameservers if we are in server mode. */
@@ -289,6 +315,7 @@ free_cached_resolve_(cached_resolve_t *r)
   }
   if (r->res_status_hostname == RES_STATUS_DONE_OK)
     tor_free(r->result_ptr.hostname);
+  free_cached_resolve_(r->refresh);
   r->magic = 0xFF00FF00;
   tor_free(r);
 }
@@ -387,6 +414,150 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** Remove <b>resolve</b> from the expiry priority queue, if it is there. */
+static void
+clear_expiry(cached_resolve_t *resolve)
+{
+  if (resolve->minheap_idx >= 0) {
+    smartlist_pqueue_remove(cached_resolve_pqueue,
+                            compare_cached_resolves_by_expiry_,
+                            offsetof(cached_resolve_t, minheap_idx),
+                            resolve);
+  }
+  resolve->expire = 0;
+}
+
+/** Add the cached answer <b>resolve</b> to the most recently used end of
+ * the LRU list. */
+static void
+cached_resolve_lru_add(cached_resolve_t *resolve)
+{
+  TOR_TAILQ_INSERT_TAIL(&cached_resolve_lru, resolve, lru_next);
+  ++n_cached_resolves;
+}
+
+/** Remove the cached answer <b>resolve</b> from the LRU list. */
+static void
+cached_resolve_lru_remove(cached_resolve_t *resolve)
+{
+  TOR_TAILQ_REMOVE(&cached_resolve_lru, resolve, lru_next);
+  --n_cached_resolves;
+}
+
+/** Forget about the refresh in flight for <b>resolve</b>, if any. Its
+ * answers, if they ever come, will be ignored. */
+static void
+cached_resolve_drop_refresh(cached_resolve_t *resolve)
+{
+  if (!resolve->refresh)
+    return;
+  free_cached_resolve_(resolve->refresh);
+  resolve->refresh = NULL;
+  --n_refreshes_inflight;
+}
+
+/** Return true iff at least one of the lookups for <b>resolve</b> gave us
+ * an answer. */
+static int
+cached_resolve_has_ok_answer(const cached_resolve_t *resolve)
+{
+  return (resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+          resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+          resolve->res_status_hostname == RES_STATUS_DONE_OK);
+}
+
+/** Return true iff none of the lookups for <b>resolve</b> gave us an answer,
+ * and at least one of them failed with a transient error. */
+static int
+cached_resolve_is_transient_failure(const cached_resolve_t *resolve)
+{
+  if (cached_resolve_has_ok_answer(resolve))
+    return 0;
+  return ((resolve->res_status_ipv4 == RES_STATUS_DONE_ERR &&
+           evdns_err_is_transient(resolve->result_ipv4.err_ipv4)) ||
+          (resolve->res_status_ipv6 == RES_STATUS_DONE_ERR &&
+           evdns_err_is_transient(resolve->result_ipv6.err_ipv6)) ||
+          (resolve->res_status_hostname == RES_STATUS_DONE_ERR &&
+           evdns_err_is_transient(resolve->result_ptr.err_hostname)));
+}
+
+/** Decide for how long to cache the answers in <b>resolve</b>, which just
+ * got all of them, and (re)schedule its expiry accordingly. */
+static void
+cached_resolve_set_lifetime(cached_resolve_t *resolve, time_t now)
+{
+  uint32_t ttl = UINT32_MAX;
+
+  if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv4 < ttl)
+    ttl = resolve->ttl_ipv4;
+
+  if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
+       resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_ipv6 < ttl)
+    ttl = resolve->ttl_ipv6;
+
+  if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
+       resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
+      resolve->ttl_hostname < ttl)
+    ttl = resolve->ttl_hostname;
+
+  /* A timeout or a server failure says nothing about the name itself: cache
+   * it just long enough to absorb a burst of requests for it, rather than
+   * failing every client for the whole clipped TTL. */
+  if (cached_resolve_is_transient_failure(resolve) &&
+      ttl > DNS_TRANSIENT_ERROR_TTL)
+    ttl = DNS_TRANSIENT_ERROR_TTL;
+
+  clear_expiry(resolve);
+  resolve->lifetime = ttl;
+  set_expiry(resolve, now + ttl);
+}
+
+/** Drop the least recently used cached answers until we hold no more than
+ * <b>max_entries</b> of them. Pending resolves are never dropped here.
+ * Return the number of answers dropped. */
+static int
+dns_cache_evict_lru(int max_entries)
+{
+  int n_removed = 0;
+
+  while (n_cached_resolves > max_entries) {
+    cached_resolve_t *victim = TOR_TAILQ_FIRST(&cached_resolve_lru);
+    cached_resolve_t *removed;
+    tor_assert(victim);
+    tor_assert(victim->state == CACHE_STATE_CACHED);
+
+    log_debug(LD_EXIT, "Dropping least recently used cached resolve for %s",
+              escaped_safe_str(victim->address));
+    cached_resolve_lru_remove(victim);
+    clear_expiry(victim);
+    removed = HT_REMOVE(cache_map, &cache_root, victim);
+    tor_assert(removed == victim);
+    cached_resolve_drop_refresh(victim);
+    free_cached_resolve_(victim);
+    ++n_removed;
+  }
+  dns_cache_stats.n_evictions += n_removed;
+  return n_removed;
+}
+
+/** Note that <b>resolve</b> just got all its answers, for our statistics on
+ * how long our nameservers take. */
+static void
+note_resolve_answered(const cached_resolve_t *resolve)
+{
+  monotime_t now;
+  int64_t usec;
+
+  monotime_get(&now);
+  usec = monotime_diff_usec(&resolve->launched, &now);
+  ++dns_cache_stats.n_answers;
+  if (usec > 0)
+    dns_cache_stats.answer_usec_total += usec;
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
@@ -406,6 +577,9 @@ dns_free_all(void)
     free_cached_resolve_(item);
   }
   HT_CLEAR(cache_map, &cache_root);
+  TOR_TAILQ_INIT(&cached_resolve_lru);
+  n_cached_resolves = 0;
+  n_refreshes_inflight = 0;
   smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
   tor_free(resolv_conf_fname);
@@ -443,6 +617,8 @@ purge_expired_resolves(time_t now)
                 escaped_safe_str(resolve->address),
                 (unsigned long)resolve->expire);
       tor_assert(!resolve->pending_connections);
+      cached_resolve_lru_remove(resolve);
+      cached_resolve_drop_refresh(resolve);
     } else {
       tor_assert(resolve->state == CACHE_STATE_DONE);
       tor_assert(!resolve->pending_connections);
@@ -691,6 +867,43 @@ dns_resolve(edge_connection_t *exitconn)
   return r;
 }
 
+/** If the cached answer <b>resolve</b> is hot and close to its expiry,
+ * launch a refresh of it, so that its clients keep getting answers from the
+ * cache rather than all waiting on a new lookup once it expires. */
+static void
+cached_resolve_maybe_prefetch(cached_resolve_t *resolve, time_t now)
+{
+  cached_resolve_t *refresh;
+
+  if (resolve->refresh ||
+      resolve->n_hits < DNS_PREFETCH_MIN_HITS ||
+      n_refreshes_inflight >= DNS_PREFETCH_MAX_INFLIGHT)
+    return;
+  if (resolve->expire - now >
+      resolve->lifetime / DNS_PREFETCH_LIFETIME_FRACTION)
+    return;
+  /* Errors aren't worth keeping around; let them expire. */
+  if (!cached_resolve_has_ok_answer(resolve))
+    return;
+
+  refresh = tor_malloc_zero(sizeof(cached_resolve_t));
+  refresh->magic = CACHED_RESOLVE_MAGIC;
+  refresh->state = CACHE_STATE_PENDING;
+  refresh->minheap_idx = -1;
+  strlcpy(refresh->address, resolve->address, sizeof(refresh->address));
+  monotime_get(&refresh->launched);
+  resolve->refresh = refresh;
+  ++n_refreshes_inflight;
+
+  log_debug(LD_EXIT, "Refreshing cached answer for %s before it expires.",
+            escaped_safe_str(resolve->address));
+  if (launch_resolve(refresh) < 0) {
+    cached_resolve_drop_refresh(resolve);
+    return;
+  }
+  ++dns_cache_stats.n_prefetches;
+}
+
 /** Helper function for dns_resolve: same functionality, but does not handle:
  *     - marking connections on error and clearing their on_circuit
  *     - linking connections to n_streams/resolving_streams,
@@ -799,6 +1012,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
         pending_connection->next = resolve->pending_connections;
         resolve->pending_connections = pending_connection;
         *made_connection_pending_out = 1;
+        ++dns_cache_stats.n_pending;
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") waiting "
                   "for pending DNS resolve of %s", exitconn->base_.s,
                   escaped_safe_str(exitconn->base_.address));
@@ -811,7 +1025,17 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
 
         *resolve_out = resolve;
 
-        return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
+        TOR_TAILQ_REMOVE(&cached_resolve_lru, resolve, lru_next);
+        TOR_TAILQ_INSERT_TAIL(&cached_resolve_lru, resolve, lru_next);
+        ++resolve->n_hits;
+        cached_resolve_maybe_prefetch(resolve, now);
+
+        r = set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
+        if (r < 0)
+          ++dns_cache_stats.n_negative_hits;
+        else
+          ++dns_cache_stats.n_hits;
+        return r;
       case CACHE_STATE_DONE:
         log_err(LD_BUG, "Found a 'DONE' dns resolve still in the cache.");
         tor_fragile_assert();
@@ -835,11 +1059,14 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   /* Add this resolve to the cache and priority queue. */
   HT_INSERT(cache_map, &cache_root, resolve);
   set_expiry(resolve, now + RESOLVE_MAX_TIMEOUT);
+  ++dns_cache_stats.n_misses;
 
   log_debug(LD_EXIT,"Launching %s.",
             escaped_safe_str(exitconn->base_.address));
   assert_cache_ok();
 
+  monotime_get(&resolve->launched);
+
   return launch_resolve(resolve);
 }
 
@@ -1128,7 +1355,7 @@ is_test_address(const char *address)
  * got one; <b>hostname</b> is a hostname fora PTR request if we got one, and
  * <b>ttl</b> is the time-to-live of this answer, in seconds.)
  */
-static void
+STATIC void
 dns_found_answer(const char *address, uint8_t query_type,
                  int dns_answer,
                  const tor_addr_t *addr,
@@ -1151,6 +1378,14 @@ dns_found_answer(const char *address, uint8_t query_type,
   }
   assert_resolve_ok(resolve);
 
+  if (resolve->state == CACHE_STATE_CACHED && resolve->refresh) {
+    cached_resolve_add_answer(resolve->refresh, query_type, dns_answer,
+                              addr, hostname, ttl);
+    if (cached_resolve_have_all_answers(resolve->refresh))
+      cached_resolve_apply_refresh(resolve);
+    return;
+  }
+
   if (resolve->state != CACHE_STATE_PENDING) {
     /* XXXX Maybe update addr? or check addr for consistency? Or let
      * VALID replace FAILED? */
@@ -1167,6 +1402,7 @@ dns_found_answer(const char *address, uint8_t query_type,
                             addr, hostname, ttl);
 
   if (cached_resolve_have_all_answers(resolve)) {
+    note_resolve_answered(resolve);
     inform_pending_connections(resolve);
 
     make_pending_resolve_cached(resolve);
@@ -1260,63 +1496,53 @@ inform_pending_connections(cached_resolve_t *resolve)
   }
 }
 
-/** Remove a pending cached_resolve_t from the hashtable, and add a
- * corresponding cached cached_resolve_t.
- *
- * This function is only necessary because of the perversity of our
- * cache timeout code; see inline comment for ideas on eliminating it.
+/** Turn the pending cached_resolve_t <b>resolve</b>, which just got all its
+ * answers, into a cached answer, and make room for it in the cache.
  **/
 static void
 make_pending_resolve_cached(cached_resolve_t *resolve)
 {
-  cached_resolve_t *removed;
-
-  resolve->state = CACHE_STATE_DONE;
-  removed = HT_REMOVE(cache_map, &cache_root, resolve);
-  if (removed != resolve) {
-    log_err(LD_BUG, "The pending resolve we found wasn't removable from"
-            " the cache. Tried to purge %s (%p); instead got %s (%p).",
-            resolve->address, (void*)resolve,
-            removed ? removed->address : "NULL", (void*)removed);
-  }
   assert_resolve_ok(resolve);
-  assert_cache_ok();
-  /* The resolve will eventually just hit the time-out in the expiry queue and
-  * expire. See fd0bafb0dedc7e2 for a brief explanation of how this got that
-  * way.  XXXXX we could do better!*/
-
-  {
-    cached_resolve_t *new_resolve = tor_memdup(resolve,
-                                               sizeof(cached_resolve_t));
-    uint32_t ttl = UINT32_MAX;
-    new_resolve->expire = 0; /* So that set_expiry won't croak. */
-    if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
-      new_resolve->result_ptr.hostname =
-        tor_strdup(resolve->result_ptr.hostname);
-
-    new_resolve->state = CACHE_STATE_CACHED;
-
-    assert_resolve_ok(new_resolve);
-    HT_INSERT(cache_map, &cache_root, new_resolve);
 
-    if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv4 < ttl)
-      ttl = resolve->ttl_ipv4;
+  resolve->state = CACHE_STATE_CACHED;
+  cached_resolve_set_lifetime(resolve, time(NULL));
+  cached_resolve_lru_add(resolve);
+  dns_cache_evict_lru(dns_cache_max_entries);
 
-    if ((resolve->res_status_ipv6 == RES_STATUS_DONE_OK ||
-         resolve->res_status_ipv6 == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_ipv6 < ttl)
-      ttl = resolve->ttl_ipv6;
+  assert_cache_ok();
+}
 
-    if ((resolve->res_status_hostname == RES_STATUS_DONE_OK ||
-         resolve->res_status_hostname == RES_STATUS_DONE_ERR) &&
-        resolve->ttl_hostname < ttl)
-      ttl = resolve->ttl_hostname;
+/** The refresh of the cached answer <b>resolve</b> got all its answers. If
+ * they are better than transient errors, serve them from now on; otherwise
+ * keep serving the answers we have until they expire. */
+static void
+cached_resolve_apply_refresh(cached_resolve_t *resolve)
+{
+  cached_resolve_t *refresh = resolve->refresh;
 
-    set_expiry(new_resolve, time(NULL) + ttl);
+  note_resolve_answered(refresh);
+  if (cached_resolve_is_transient_failure(refresh)) {
+    cached_resolve_drop_refresh(resolve);
+    return;
   }
 
+  if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
+    tor_free(resolve->result_ptr.hostname);
+  resolve->result_ipv4 = refresh->result_ipv4;
+  resolve->result_ipv6 = refresh->result_ipv6;
+  resolve->result_ptr = refresh->result_ptr;
+  resolve->res_status_ipv4 = refresh->res_status_ipv4;
+  resolve->res_status_ipv6 = refresh->res_status_ipv6;
+  resolve->res_status_hostname = refresh->res_status_hostname;
+  resolve->ttl_ipv4 = refresh->ttl_ipv4;
+  resolve->ttl_ipv6 = refresh->ttl_ipv6;
+  resolve->ttl_hostname = refresh->ttl_hostname;
+  /* The hostname, if we got one, belongs to resolve now. */
+  refresh->res_status_hostname = 0;
+  cached_resolve_drop_refresh(resolve);
+
+  resolve->n_hits = 0;
+  cached_resolve_set_lifetime(resolve, time(NULL));
   assert_cache_ok();
 }
 
@@ -2230,6 +2456,15 @@ dump_dns_mem_usage(int severity)
       (unsigned)hash_mem);
 }
 
+/** Fill <b>stats_out</b> with statistics about our DNS cache. */
+void
+dns_get_cache_stats(dns_cache_stats_t *stats_out)
+{
+  tor_assert(stats_out);
+  *stats_out = dns_cache_stats;
+  stats_out->n_entries = dns_cache_entry_count();
+}
+
 /* Do a round of OOM cleanup on all DNS entries. Return the amount of removed
  * bytes. It is possible that the returned value is lower than min_remove_bytes
  * if the caches get emptied out so the caller should be aware of this. */
@@ -2239,8 +2474,19 @@ dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
   time_t time_inc = 0;
   size_t total_bytes_removed = 0;
   size_t current_size = dns_cache_total_allocation();
-
-  do {
+  size_t n_to_evict;
+
+  /* Drop the least recently used answers first: they're cheap to get back.
+   * Only then start dropping resolves by expiry time, since that also fails
+   * the connections pending on them. */
+  n_to_evict = CEIL_DIV(min_remove_bytes, sizeof(cached_resolve_t));
+  if (n_to_evict >= (size_t) n_cached_resolves)
+    n_to_evict = n_cached_resolves;
+  dns_cache_evict_lru(n_cached_resolves - (int) n_to_evict);
+  total_bytes_removed = current_size - dns_cache_total_allocation();
+  current_size -= total_bytes_removed;
+
+  while (total_bytes_removed < min_remove_bytes) {
     /* If no DNS entries left, break loop. */
     if (!dns_cache_entry_count())
       break;
@@ -2256,7 +2502,7 @@ dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
 
     /* Increase time_inc by a reasonable fraction. */
     time_inc += (MAX_DNS_TTL / 4);
-  } while (total_bytes_removed < min_remove_bytes);
+  }
 
   return total_bytes_removed;
 }
@@ -2273,10 +2519,16 @@ assert_cache_ok_(void)
     tor_assert(!bad_rep);
   }
 
+  int n_cached = 0;
   HT_FOREACH(resolve, cache_map, &cache_root) {
     assert_resolve_ok(*resolve);
     tor_assert((*resolve)->state != CACHE_STATE_DONE);
+    if ((*resolve)->state == CACHE_STATE_CACHED)
+      ++n_cached;
+    else
+      tor_assert(!(*resolve)->refresh);
   }
+  tor_assert(n_cached == n_cached_resolves);
   if (!cached_resolve_pqueue)
     return;
 
@@ -2308,4 +2560,6 @@ void
 dns_insert_cache_entry(cached_resolve_t *new_entry)
 {
   HT_INSERT(cache_map, &cache_root, new_entry);
+  if (new_entry->state == CACHE_STATE_CACHED)
+    cached_resolve_lru_add(new_entry);
 }
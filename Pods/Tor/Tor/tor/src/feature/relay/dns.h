@@ -14,6 +14,27 @@
 
 #ifdef HAVE_MODULE_RELAY
 
+/** Statistics about the exit DNS cache, for the metrics port. */
+typedef struct dns_cache_stats_t {
+  /** How many lookups were answered from a cached address, how many from a
+   * cached error, how many joined a resolve already in flight, and how many
+   * had to launch a new one? */
+  uint64_t n_hits;
+  uint64_t n_negative_hits;
+  uint64_t n_pending;
+  uint64_t n_misses;
+  /** How many hot answers did we refresh ahead of their expiry, and how many
+   * answers did we drop because the cache was full? */
+  uint64_t n_prefetches;
+  uint64_t n_evictions;
+  /** How many resolves got all their answers, and how long did our
+   * nameservers take in total to give them, in microseconds? */
+  uint64_t n_answers;
+  uint64_t answer_usec_total;
+  /** How many answers does the cache hold? */
+  size_t n_entries;
+} dns_cache_stats_t;
+
 int dns_init(void);
 int has_dns_init_failed(void);
 int dns_reset(void);
@@ -32,6 +53,7 @@ void dns_new_consensus_params(const networkstatus_t *ns);
  * need stubs. */
 void dns_free_all(void);
 void dns_launch_correctness_checks(void);
+void dns_get_cache_stats(dns_cache_stats_t *stats_out);
 
 #else /* !defined(HAVE_MODULE_RELAY) */
 
@@ -94,6 +116,25 @@ const char *hostname));
 cached_resolve_t *dns_get_cache_entry(cached_resolve_t *query);
 void dns_insert_cache_entry(cached_resolve_t *new_entry);
 
+/** How many times must a cached answer be used before we refresh it ahead
+ * of its expiry? */
+#define DNS_PREFETCH_MIN_HITS 8
+/** We refresh a hot answer once it is within this fraction of its lifetime
+ * from expiring. */
+#define DNS_PREFETCH_LIFETIME_FRACTION 8
+/** How many refreshes may be in flight at once? */
+#define DNS_PREFETCH_MAX_INFLIGHT 64
+/** For how long do we cache an answer made only of transient errors? */
+#define DNS_TRANSIENT_ERROR_TTL 10
+
+#ifdef TOR_UNIT_TESTS
+STATIC void dns_found_answer(const char *address, uint8_t query_type,
+                             int dns_answer,
+                             const tor_addr_t *addr,
+                             const char *hostname,
+                             uint32_t ttl);
+#endif /* defined(TOR_UNIT_TESTS) */
+
 MOCK_DECL(STATIC int,
 set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
                                 const cached_resolve_t *resolve,
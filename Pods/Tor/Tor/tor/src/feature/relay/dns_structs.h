@@ -14,6 +14,8 @@
 #define TOR_DNS_STRUCTS_H
 
 #include "ext/ht.h"
+#include "ext/tor_queue.h"
+#include "lib/time/compat_time.h"
 
 /** Longest hostname we're willing to resolve. */
 #define MAX_ADDRESSLEN 256
@@ -30,18 +32,17 @@ typedef struct pending_connection_t {
 
 /* Possible states for a cached resolve_t */
 /** We are waiting for the resolver system to tell us an answer here.
- * When we get one, or when we time out, the state of this cached_resolve_t
- * will become "DONE" and we'll possibly add a CACHED
- * entry. This cached_resolve_t will be in the hash table so that we will
+ * When we get one, the state of this cached_resolve_t will become "CACHED".
+ * This cached_resolve_t will be in the hash table so that we will
  * know not to launch more requests for this addr, but rather to add more
  * connections to the pending list for the addr. */
 #define CACHE_STATE_PENDING 0
-/** This used to be a pending cached_resolve_t, and we got an answer for it.
+/** This used to be a pending cached_resolve_t, but we cancelled it.
  * Now we're waiting for this cached_resolve_t to expire.  This should
  * have no pending connections, and should not appear in the hash table. */
 #define CACHE_STATE_DONE 1
 /** We are caching an answer for this address. This should have no pending
- * connections, and should appear in the hash table. */
+ * connections, and should appear in the hash table and in the LRU list. */
 #define CACHE_STATE_CACHED 2
 
 /** @name status values for a single DNS request.
@@ -98,6 +99,19 @@ typedef struct cached_resolve_t {
   pending_connection_t *pending_connections;
   /** Position of this element in the heap*/
   int minheap_idx;
+  /** When did we launch the lookups for this resolve? Used to measure how
+   * long our nameservers take to answer. */
+  monotime_t launched;
+  /** For how many seconds did we decide to cache this answer? */
+  uint32_t lifetime;
+  /** How many times has this cached answer been used since we cached it? */
+  uint32_t n_hits;
+  /** If this is a cached answer that we are refreshing ahead of its expiry,
+   * the pending resolve that will replace its results. The refresh is not in
+   * the hash table nor in the expiry queue. */
+  struct cached_resolve_t *refresh;
+  /** Links in the least-recently-used list of cached answers. */
+  TOR_TAILQ_ENTRY(cached_resolve_t) lru_next;
 } cached_resolve_t;
 
 #endif /* !defined(TOR_DNS_STRUCTS_H) */
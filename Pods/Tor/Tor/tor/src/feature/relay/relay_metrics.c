@@ -27,12 +27,15 @@
 #include "lib/malloc/malloc.h"
 #include "lib/math/fp.h"
 #include "lib/metrics/metrics_store.h"
+#include "lib/net/buffers_net.h"
 
+#include "feature/hs/hs_cache.h"
 #include "feature/hs/hs_dos.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/node_st.h"
 #include "feature/nodelist/routerstatus_st.h"
 #include "feature/nodelist/torcert.h"
+#include "feature/relay/dns.h"
 #include "feature/relay/relay_metrics.h"
 #include "feature/relay/router.h"
 #include "feature/relay/routerkeys.h"
@@ -63,6 +66,16 @@ static void fill_est_intro_cells(void);
 static void fill_est_rend_cells(void);
 static void fill_intro1_cells(void);
 static void fill_rend1_cells(void);
+static void fill_buf_syscalls_values(void);
+static void fill_buf_syscalls_per_mb_values(void);
+static void fill_hsdir_cache_lookups_values(void);
+static void fill_hsdir_cache_evictions_values(void);
+static void fill_hsdir_cache_size_values(void);
+static void fill_dns_cache_lookups_values(void);
+static void fill_dns_cache_actions_values(void);
+static void fill_dns_cache_size_values(void);
+static void fill_dns_answers_values(void);
+static void fill_dns_answer_time_values(void);
 
 /** The base metrics that is a static array of metrics added to the metrics
  * store.
@@ -217,6 +230,76 @@ static const relay_metrics_entry_t base_metrics[] =
     .help = "Total number of REND1 cells we received",
     .fill_fn = fill_rend1_cells,
   },
+  {
+    .key = RELAY_METRICS_NUM_BUF_SYSCALLS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_load_buf_syscalls_total),
+    .help = "Total number of read and write system calls on buffers",
+    .fill_fn = fill_buf_syscalls_values,
+  },
+  {
+    .key = RELAY_METRICS_BUF_SYSCALLS_PER_MB,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_load_buf_syscalls_per_mb),
+    .help = "Read and write system calls on buffers per megabyte moved",
+    .fill_fn = fill_buf_syscalls_per_mb_values,
+  },
+  {
+    .key = RELAY_METRICS_HSDIR_CACHE_LOOKUPS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_hsdir_cache_lookups_total),
+    .help = "Total number of onion service descriptor lookups in our cache",
+    .fill_fn = fill_hsdir_cache_lookups_values,
+  },
+  {
+    .key = RELAY_METRICS_HSDIR_CACHE_EVICTIONS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_hsdir_cache_evictions_total),
+    .help = "Total number of onion service descriptors removed from our cache",
+    .fill_fn = fill_hsdir_cache_evictions_values,
+  },
+  {
+    .key = RELAY_METRICS_HSDIR_CACHE_SIZE,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_hsdir_cache_size),
+    .help = "Onion service descriptors held in our cache",
+    .fill_fn = fill_hsdir_cache_size_values,
+  },
+  {
+    .key = RELAY_METRICS_DNS_CACHE_LOOKUPS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_exit_dns_cache_lookups_total),
+    .help = "Total number of exit DNS lookups, by how our cache answered",
+    .fill_fn = fill_dns_cache_lookups_values,
+  },
+  {
+    .key = RELAY_METRICS_DNS_CACHE_ACTIONS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_exit_dns_cache_actions_total),
+    .help = "Total number of answers refreshed or dropped by our DNS cache",
+    .fill_fn = fill_dns_cache_actions_values,
+  },
+  {
+    .key = RELAY_METRICS_DNS_CACHE_SIZE,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_exit_dns_cache_entries),
+    .help = "Resolves held in our exit DNS cache",
+    .fill_fn = fill_dns_cache_size_values,
+  },
+  {
+    .key = RELAY_METRICS_DNS_ANSWERS,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_exit_dns_answers_total),
+    .help = "Total number of exit DNS resolves that got all their answers",
+    .fill_fn = fill_dns_answers_values,
+  },
+  {
+    .key = RELAY_METRICS_DNS_ANSWER_TIME,
+    .type = METRICS_TYPE_COUNTER,
+    .name = METRICS_NAME(relay_exit_dns_answer_usec_total),
+    .help = "Total time spent waiting on exit DNS answers, in microseconds",
+    .fill_fn = fill_dns_answer_time_values,
+  },
 };
 static const size_t num_base_metrics = ARRAY_LENGTH(base_metrics);
 
@@ -1032,6 +1115,12 @@ fill_oom_values(void)
   metrics_store_entry_add_label(sentry,
                                 metrics_format_label("subsys", "hsdir"));
   metrics_store_entry_update(sentry, oom_stats_n_bytes_removed_hsdir);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+                                metrics_format_label("subsys", "buf"));
+  metrics_store_entry_update(sentry, oom_stats_n_bytes_removed_buf);
 }
 
 /** Fill function for the RELAY_METRICS_SIGNING_CERT_EXPIRY metrics. */
@@ -1200,6 +1289,193 @@ fill_rend1_cells(void)
   }
 }
 
+/** Fill function for the RELAY_METRICS_NUM_BUF_SYSCALLS metric. */
+static void
+fill_buf_syscalls_values(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_NUM_BUF_SYSCALLS];
+  uint64_t n_reads, n_read_bytes, n_writes, n_written_bytes;
+
+  buf_net_get_syscall_stats(&n_reads, &n_read_bytes,
+                            &n_writes, &n_written_bytes);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("direction", "read"));
+  metrics_store_entry_update(sentry, n_reads);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("direction", "written"));
+  metrics_store_entry_update(sentry, n_writes);
+}
+
+/** Return the number of system calls per megabyte, given <b>n_calls</b>
+ * calls that moved <b>n_bytes</b> bytes. */
+static inline int64_t
+syscalls_per_mb(uint64_t n_calls, uint64_t n_bytes)
+{
+  if (n_bytes == 0)
+    return 0;
+  return (int64_t) (((double) n_calls) * (1024 * 1024) / n_bytes);
+}
+
+/** Fill function for the RELAY_METRICS_BUF_SYSCALLS_PER_MB metric. */
+static void
+fill_buf_syscalls_per_mb_values(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_BUF_SYSCALLS_PER_MB];
+  uint64_t n_reads, n_read_bytes, n_writes, n_written_bytes;
+
+  buf_net_get_syscall_stats(&n_reads, &n_read_bytes,
+                            &n_writes, &n_written_bytes);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("direction", "read"));
+  metrics_store_entry_update(sentry, syscalls_per_mb(n_reads, n_read_bytes));
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry,
+          metrics_format_label("direction", "written"));
+  metrics_store_entry_update(sentry,
+                             syscalls_per_mb(n_writes, n_written_bytes));
+}
+
+/** Add one <b>rentry</b> sample labelled <b>name</b>=<b>value</b> with
+ * <b>count</b> to the store. */
+static void
+add_labelled_value(const relay_metrics_entry_t *rentry, const char *name,
+                   const char *value, int64_t count)
+{
+  metrics_store_entry_t *sentry =
+    metrics_store_add(the_store, rentry->type, rentry->name,
+                      rentry->help, 0, NULL);
+  metrics_store_entry_add_label(sentry, metrics_format_label(name, value));
+  metrics_store_entry_update(sentry, count);
+}
+
+/** Fill function for the RELAY_METRICS_HSDIR_CACHE_LOOKUPS metric. */
+static void
+fill_hsdir_cache_lookups_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_HSDIR_CACHE_LOOKUPS];
+  hs_cache_dir_stats_t stats;
+
+  hs_cache_get_dir_stats(&stats);
+  add_labelled_value(rentry, "result", "hit", stats.n_hits);
+  add_labelled_value(rentry, "result", "miss", stats.n_misses);
+}
+
+/** Fill function for the RELAY_METRICS_HSDIR_CACHE_EVICTIONS metric. */
+static void
+fill_hsdir_cache_evictions_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_HSDIR_CACHE_EVICTIONS];
+  hs_cache_dir_stats_t stats;
+
+  hs_cache_get_dir_stats(&stats);
+  add_labelled_value(rentry, "reason", "expired", stats.n_expired);
+  add_labelled_value(rentry, "reason", "oom", stats.n_evicted_oom);
+  add_labelled_value(rentry, "reason", "replaced", stats.n_replaced);
+}
+
+/** Fill function for the RELAY_METRICS_HSDIR_CACHE_SIZE metric. */
+static void
+fill_hsdir_cache_size_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_HSDIR_CACHE_SIZE];
+  hs_cache_dir_stats_t stats;
+
+  hs_cache_get_dir_stats(&stats);
+  add_labelled_value(rentry, "unit", "entries", stats.n_entries);
+  add_labelled_value(rentry, "unit", "bytes", stats.n_bytes);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_CACHE_LOOKUPS metric. */
+static void
+fill_dns_cache_lookups_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DNS_CACHE_LOOKUPS];
+  dns_cache_stats_t stats;
+
+  dns_get_cache_stats(&stats);
+  add_labelled_value(rentry, "result", "hit", stats.n_hits);
+  add_labelled_value(rentry, "result", "negative_hit", stats.n_negative_hits);
+  add_labelled_value(rentry, "result", "pending", stats.n_pending);
+  add_labelled_value(rentry, "result", "miss", stats.n_misses);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_CACHE_ACTIONS metric. */
+static void
+fill_dns_cache_actions_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DNS_CACHE_ACTIONS];
+  dns_cache_stats_t stats;
+
+  dns_get_cache_stats(&stats);
+  add_labelled_value(rentry, "action", "prefetch", stats.n_prefetches);
+  add_labelled_value(rentry, "action", "evict", stats.n_evictions);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_CACHE_SIZE metric. */
+static void
+fill_dns_cache_size_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DNS_CACHE_SIZE];
+  dns_cache_stats_t stats;
+  metrics_store_entry_t *sentry;
+
+  dns_get_cache_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry, stats.n_entries);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_ANSWERS metric. */
+static void
+fill_dns_answers_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DNS_ANSWERS];
+  dns_cache_stats_t stats;
+  metrics_store_entry_t *sentry;
+
+  dns_get_cache_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry, stats.n_answers);
+}
+
+/** Fill function for the RELAY_METRICS_DNS_ANSWER_TIME metric. */
+static void
+fill_dns_answer_time_values(void)
+{
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_DNS_ANSWER_TIME];
+  dns_cache_stats_t stats;
+  metrics_store_entry_t *sentry;
+
+  dns_get_cache_stats(&stats);
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry, stats.answer_usec_total);
+}
+
 /** Reset the global store and fill it with all the metrics from base_metrics
  * and their associated values.
  *
@@ -57,6 +57,26 @@ typedef enum {
   RELAY_METRICS_NUM_INTRO1_CELLS,
   /** Number of times we received a REND1 cell */
   RELAY_METRICS_NUM_REND1_CELLS,
+  /** Number of read and write system calls on buffers. */
+  RELAY_METRICS_NUM_BUF_SYSCALLS,
+  /** Number of read and write system calls on buffers per megabyte. */
+  RELAY_METRICS_BUF_SYSCALLS_PER_MB,
+  /** Number of HSDir descriptor cache lookups. */
+  RELAY_METRICS_HSDIR_CACHE_LOOKUPS,
+  /** Number of HSDir descriptor cache evictions. */
+  RELAY_METRICS_HSDIR_CACHE_EVICTIONS,
+  /** Size of the HSDir descriptor cache. */
+  RELAY_METRICS_HSDIR_CACHE_SIZE,
+  /** Number of exit DNS cache lookups. */
+  RELAY_METRICS_DNS_CACHE_LOOKUPS,
+  /** Number of exit DNS cache refreshes and evictions. */
+  RELAY_METRICS_DNS_CACHE_ACTIONS,
+  /** Number of answers in the exit DNS cache. */
+  RELAY_METRICS_DNS_CACHE_SIZE,
+  /** Number of exit DNS resolves that got all their answers. */
+  RELAY_METRICS_DNS_ANSWERS,
+  /** Time spent waiting on exit DNS answers. */
+  RELAY_METRICS_DNS_ANSWER_TIME,
 } relay_metrics_key_t;
 
 /** The metadata of a relay metric. */
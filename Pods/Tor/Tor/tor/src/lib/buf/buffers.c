@@ -123,26 +123,107 @@ chunk_repack(chunk_t *chunk)
   chunk->data = &chunk->mem[0];
 }
 
+/** Every chunk should take up at least this many bytes. */
+#define MIN_CHUNK_ALLOC 256
+/** No chunk should take up more than this many bytes. */
+#define MAX_CHUNK_ALLOC 65536
+
+/** A list of unused chunks of a single allocation size, which we keep around
+ * so that we don't have to go back to the allocator every time a buffer
+ * grows or shrinks. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks do we hold? */
+  int len; /**< How many chunks are on this list? */
+  chunk_t *head; /**< First chunk on the list, linked through chunk->next. */
+  uint64_t n_alloc; /**< How many chunks of this size have we allocated? */
+  uint64_t n_hit; /**< How many allocations came from this freelist? */
+  uint64_t n_free; /**< How many chunks have we put on this freelist? */
+} chunk_freelist_t;
+
+/** Number of freelists: one for each power of two from MIN_CHUNK_ALLOC up
+ * to MAX_CHUNK_ALLOC. */
+#define N_CHUNK_FREELISTS 9
+/** Never keep more than this many bytes of unused chunks on the freelists.
+ * The OOM handler can release all of them with buf_clear_freelists(). */
+#define MAX_FREELIST_BYTES (8*1024*1024)
+
+/** Static array of freelists, indexed by log2(alloc_size) - 8. */
+static chunk_freelist_t freelists[N_CHUNK_FREELISTS] = {
+  { 256, 0, NULL, 0, 0, 0 },
+  { 512, 0, NULL, 0, 0, 0 },
+  { 1024, 0, NULL, 0, 0, 0 },
+  { 2048, 0, NULL, 0, 0, 0 },
+  { 4096, 0, NULL, 0, 0, 0 },
+  { 8192, 0, NULL, 0, 0, 0 },
+  { 16384, 0, NULL, 0, 0, 0 },
+  { 32768, 0, NULL, 0, 0, 0 },
+  { 65536, 0, NULL, 0, 0, 0 },
+};
+/** How many bytes of unused chunks are on the freelists? */
+static size_t total_bytes_in_freelists = 0;
+/** How many chunks have we allocated that weren't a freelist size? */
+static uint64_t n_freelist_misses = 0;
+
+/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
+ * no freelist exists for that size. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  int i;
+  for (i = 0; i < N_CHUNK_FREELISTS &&
+         freelists[i].alloc_size <= alloc; ++i) {
+    if (freelists[i].alloc_size == alloc) {
+      return &freelists[i];
+    }
+  }
+  return NULL;
+}
+
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
 static void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  size_t alloc;
+  chunk_freelist_t *freelist;
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
-  tor_free(chunk);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+  freelist = get_freelist(alloc);
+  if (freelist && total_bytes_in_freelists + alloc <= MAX_FREELIST_BYTES) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->len;
+    ++freelist->n_free;
+    total_bytes_in_freelists += alloc;
+  } else {
+    tor_free(chunk);
+  }
 }
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
+  chunk_freelist_t *freelist = get_freelist(alloc);
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    --freelist->len;
+    ++freelist->n_hit;
+    tor_assert(total_bytes_in_freelists >= alloc);
+    total_bytes_in_freelists -= alloc;
+  } else {
+    ch = tor_malloc(alloc);
+  }
+  if (freelist)
+    ++freelist->n_alloc;
+  else
+    ++n_freelist_misses;
   ch->next = NULL;
   ch->datalen = 0;
 #ifdef DEBUG_CHUNK_ALLOC
@@ -178,11 +259,6 @@ chunk_grow(chunk_t *chunk, size_t sz)
   return chunk;
 }
 
-/** Every chunk should take up at least this many bytes. */
-#define MIN_CHUNK_ALLOC 256
-/** No chunk should take up more than this many bytes. */
-#define MAX_CHUNK_ALLOC 65536
-
 /** Return the allocation size we'd like to use to hold <b>target</b>
  * bytes. */
 size_t
@@ -498,6 +574,22 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   return chunk;
 }
 
+/** Remove the tail chunk of <b>buf</b>, which must be empty and must come
+ * right after <b>prev</b>, and free it.  This undoes
+ * buf_add_chunk_with_capacity() when we turn out not to need the chunk. */
+void
+buf_free_empty_tail_chunk(buf_t *buf, chunk_t *prev)
+{
+  chunk_t *victim = buf->tail;
+  tor_assert(victim);
+  tor_assert(victim->datalen == 0);
+  tor_assert(prev->next == victim);
+  prev->next = NULL;
+  buf->tail = prev;
+  buf_chunk_free_unchecked(victim);
+  check();
+}
+
 /** Return the age of the oldest chunk in the buffer <b>buf</b>, in
  * timestamp units.  Requires the current monotonic timestamp as its
  * input <b>now</b>.
@@ -512,12 +604,68 @@ buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now)
   }
 }
 
+/** Return the total number of bytes allocated in chunks that are on
+ * buffers.  Chunks waiting on the freelists are counted by
+ * buf_get_freelist_allocation() instead. */
 size_t
 buf_get_total_allocation(void)
 {
   return total_bytes_allocated_in_chunks;
 }
 
+/** Return the total number of bytes held in unused chunks on the
+ * freelists. */
+size_t
+buf_get_freelist_allocation(void)
+{
+  return total_bytes_in_freelists;
+}
+
+/** Free every chunk on the freelists, and return the number of bytes that we
+ * released. */
+size_t
+buf_clear_freelists(void)
+{
+  size_t freed = total_bytes_in_freelists;
+  int i;
+  for (i = 0; i < N_CHUNK_FREELISTS; ++i) {
+    chunk_t *chunk = freelists[i].head;
+    while (chunk) {
+      chunk_t *next = chunk->next;
+      tor_free(chunk);
+      chunk = next;
+    }
+    freelists[i].head = NULL;
+    freelists[i].len = 0;
+  }
+  total_bytes_in_freelists = 0;
+  return freed;
+}
+
+/** Log the current size of each chunk freelist, and how well it has been
+ * working, at log level <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; i < N_CHUNK_FREELISTS; ++i) {
+    const chunk_freelist_t *fl = &freelists[i];
+    tor_log(severity, LD_MM,
+            "  %d bytes: %d chunks on freelist (%"TOR_PRIuSZ" bytes); "
+            "%"PRIu64" allocated, %"PRIu64" from freelist, "
+            "%"PRIu64" returned to freelist.",
+            (int)fl->alloc_size, fl->len, fl->alloc_size * fl->len,
+            fl->n_alloc, fl->n_hit, fl->n_free);
+  }
+  tor_log(severity, LD_MM,
+          "  %"PRIu64" allocations in sizes without a freelist.",
+          n_freelist_misses);
+  tor_log(severity, LD_MM,
+          "  %"TOR_PRIuSZ" bytes on freelists in total, out of a maximum of "
+          "%d.", total_bytes_in_freelists, MAX_FREELIST_BYTES);
+}
+
 /** Append <b>string_len</b> bytes from <b>string</b> to the end of
  * <b>buf</b>.
  *
@@ -38,6 +38,9 @@ size_t buf_slack(const buf_t *buf);
 
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
+size_t buf_get_freelist_allocation(void);
+size_t buf_clear_freelists(void);
+void buf_dump_freelist_sizes(int severity);
 
 int buf_add(buf_t *buf, const char *string, size_t string_len);
 void buf_add_string(buf_t *buf, const char *string);
@@ -100,6 +103,7 @@ struct buf_t {
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
+void buf_free_empty_tail_chunk(buf_t *buf, chunk_t *prev);
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
 #define MIN_READ_LEN 8
@@ -620,6 +620,9 @@
 /* Define to 1 if you have the <sys/ucontext.h> header file. */
 #define HAVE_SYS_UCONTEXT_H 1
 
+/* Define to 1 if you have the <sys/uio.h> header file. */
+#define HAVE_SYS_UIO_H 1
+
 /* Define to 1 if you have the <sys/un.h> header file. */
 #define HAVE_SYS_UN_H 1
 
@@ -256,6 +256,43 @@ tor_compress(char **out, size_t *out_len,
                            1, LOG_WARN);
 }
 
+/** Inputs shorter than this aren't worth splitting between threads. */
+#define COMPRESS_PARALLEL_MIN_INPUT (1024*1024)
+
+/** As tor_compress(), but if <b>method</b> supports it and the input is
+ * large enough, let up to <b>n_threads</b> threads share the work.  The
+ * result decompresses with tor_uncompress() exactly as the output of
+ * tor_compress() does.
+ *
+ * Only Zstandard can do this: its multithreaded encoder still emits a single
+ * standard frame.  Our LZMA method is the legacy .lzma format, which has no
+ * multithreaded encoder (liblzma's only parallel encoder writes .xz), so it
+ * and zlib always compress on the calling thread.
+ */
+int
+tor_compress_parallel(char **out, size_t *out_len,
+                      const char *in, size_t in_len,
+                      compress_method_t method,
+                      int n_threads)
+{
+  if (n_threads > 1 && in_len >= COMPRESS_PARALLEL_MIN_INPUT &&
+      method == ZSTD_METHOD &&
+      tor_zstd_compress_parallel(out, out_len, in, in_len,
+                                 BEST_COMPRESSION, n_threads) == 0) {
+    if (tor_compress_is_compression_bomb(*out_len, in_len)) {
+      log_warn(LD_BUG, "We compressed something and got an insanely high "
+               "compression factor; other Tors would think this was a "
+               "compression bomb.");
+      tor_free(*out);
+      *out_len = 0;
+      return -1;
+    }
+    return 0;
+  }
+
+  return tor_compress(out, out_len, in, in_len, method);
+}
+
 /** Given zero or more compressed strings of total length <b>in_len</b> bytes
  * at <b>in</b>, uncompress them into a newly allocated buffer, using the
  * method described in <b>method</b>.  Store the uncompressed string in
@@ -40,6 +40,11 @@ int tor_compress(char **out, size_t *out_len,
                  const char *in, size_t in_len,
                  compress_method_t method);
 
+int tor_compress_parallel(char **out, size_t *out_len,
+                          const char *in, size_t in_len,
+                          compress_method_t method,
+                          int n_threads);
+
 int tor_uncompress(char **out, size_t *out_len,
                    const char *in, size_t in_len,
                    compress_method_t method,
@@ -17,6 +17,8 @@
 #include "lib/log/util_bug.h"
 #include "lib/compress/compress.h"
 #include "lib/compress/compress_zstd.h"
+#include "lib/intmath/cmp.h"
+#include "lib/intmath/muldiv.h"
 #include "lib/string/printf.h"
 #include "lib/thread/threads.h"
 
@@ -486,6 +488,107 @@ tor_zstd_compress_free_(tor_zstd_compress_state_t *state)
   tor_free(state);
 }
 
+/** Smallest amount of input that we give to one zstd worker thread: smaller
+ * jobs cost more in compression ratio than they win back in time. */
+#define ZSTD_PARALLEL_MIN_JOB_SIZE (512*1024)
+/** Largest job size that zstd accepts on every platform. */
+#define ZSTD_PARALLEL_MAX_JOB_SIZE (512*1024*1024)
+
+/** Compress the <b>in_len</b> bytes at <b>in</b> into a single Zstandard
+ * frame at <b>level</b>, letting up to <b>n_threads</b> zstd worker threads
+ * each compress a slice of the input.  The output is an ordinary frame that
+ * any Zstandard decoder can read.  On success, store a newly allocated
+ * buffer in *<b>out</b> and its length in *<b>out_len</b>, and return 0.
+ *
+ * Return -1 if we couldn't compress, including when our libzstd was built
+ * without multithreading support; callers should then fall back to
+ * tor_compress().
+ *
+ * Unlike tor_zstd_compress_process(), this never flushes in the middle of
+ * the input, since each flush would make the workers wait for one another.
+ */
+int
+tor_zstd_compress_parallel(char **out, size_t *out_len,
+                           const char *in, size_t in_len,
+                           compression_level_t level,
+                           int n_threads)
+{
+  tor_assert(out);
+  tor_assert(out_len);
+  tor_assert(in || in_len == 0);
+
+  *out = NULL;
+  *out_len = 0;
+
+#if defined(HAVE_ZSTD) && ZSTD_VERSION_NUMBER >= 10400
+  ZSTD_CCtx *cctx;
+  ZSTD_inBuffer input = { in, in_len, 0 };
+  ZSTD_outBuffer output;
+  size_t retval, job_size, out_alloc;
+
+  if (n_threads < 1)
+    return -1;
+
+  cctx = ZSTD_createCCtx();
+  if (cctx == NULL)
+    return -1;
+
+  retval = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                  memory_level(level));
+  if (ZSTD_isError(retval))
+    goto err;
+
+  retval = ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, n_threads);
+  if (ZSTD_isError(retval)) {
+    /* libzstd was built without ZSTD_MULTITHREAD. */
+    log_info(LD_GENERAL, "Zstandard can't use worker threads: %s",
+             ZSTD_getErrorName(retval));
+    goto err;
+  }
+
+  /* zstd's default job size is a multiple of its window size, which is
+   * larger than a whole consensus: split the input between the workers
+   * instead. */
+  job_size = CEIL_DIV(in_len, (size_t)n_threads);
+  job_size = MAX(job_size, ZSTD_PARALLEL_MIN_JOB_SIZE);
+  job_size = MIN(job_size, ZSTD_PARALLEL_MAX_JOB_SIZE);
+  retval = ZSTD_CCtx_setParameter(cctx, ZSTD_c_jobSize, (int)job_size);
+  if (ZSTD_isError(retval))
+    goto err;
+
+  out_alloc = ZSTD_compressBound(in_len);
+  *out = tor_malloc(out_alloc);
+  output.dst = *out;
+  output.size = out_alloc;
+  output.pos = 0;
+
+  /* With an output buffer of compressBound() bytes this only loops while
+   * worker jobs are still running. */
+  do {
+    retval = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+    if (ZSTD_isError(retval)) {
+      log_warn(LD_GENERAL, "Zstandard compression error: %s",
+               ZSTD_getErrorName(retval));
+      goto err;
+    }
+  } while (retval != 0);
+
+  ZSTD_freeCCtx(cctx);
+  *out_len = output.pos;
+  *out = tor_realloc(*out, MAX(*out_len, 1));
+  return 0;
+
+ err:
+  ZSTD_freeCCtx(cctx);
+  tor_free(*out);
+  return -1;
+#else /* !(defined(HAVE_ZSTD) && ZSTD_VERSION_NUMBER >= 10400) */
+  (void)level;
+  (void)n_threads;
+  return -1;
+#endif /* defined(HAVE_ZSTD) && ZSTD_VERSION_NUMBER >= 10400 */
+}
+
 /** Return the approximate number of bytes allocated for <b>state</b>. */
 size_t
 tor_zstd_compress_state_size(const tor_zstd_compress_state_t *state)
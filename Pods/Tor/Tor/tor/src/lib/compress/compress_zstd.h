@@ -38,6 +38,11 @@ void tor_zstd_compress_free_(tor_zstd_compress_state_t *state);
   FREE_AND_NULL(tor_zstd_compress_state_t,   \
                            tor_zstd_compress_free_, (st))
 
+int tor_zstd_compress_parallel(char **out, size_t *out_len,
+                               const char *in, size_t in_len,
+                               compression_level_t level,
+                               int n_threads);
+
 size_t tor_zstd_compress_state_size(const tor_zstd_compress_state_t *state);
 
 size_t tor_zstd_get_total_allocation(void);
@@ -16,11 +16,6 @@
 #include "lib/log/util_bug.h"
 #include "ext/siphash.h"
 
-/** How many bloom-filter bits we set per address. This is twice the
- * BLOOMFILT_N_HASHES value, since we split the siphash output into two 32-bit
- * values. */
-#define N_BITS_PER_ITEM (BLOOMFILT_N_HASHES * 2)
-
 struct bloomfilt_t {
   /** siphash keys to make BLOOMFILT_N_HASHES independent hashes for each
    * items. */
@@ -33,14 +28,24 @@ struct bloomfilt_t {
 
 #define BIT(set, n) ((n) & (set)->mask)
 
-/** Add the element <b>item</b> to <b>set</b>. */
+/** Set <b>out</b> to the hash values of <b>item</b> for <b>set</b>. */
 void
-bloomfilt_add(bloomfilt_t *set,
-              const void *item)
+bloomfilt_hash(const bloomfilt_t *set, const void *item,
+               bloomfilt_hashes_t *out)
+{
+  int i;
+  for (i = 0; i < BLOOMFILT_N_HASHES; ++i) {
+    out->h[i] = set->hashfn(&set->key[i], item);
+  }
+}
+
+/** Add the element whose hash values are <b>hashes</b> to <b>set</b>. */
+void
+bloomfilt_add_hashes(bloomfilt_t *set, const bloomfilt_hashes_t *hashes)
 {
   int i;
   for (i = 0; i < BLOOMFILT_N_HASHES; ++i) {
-    uint64_t h = set->hashfn(&set->key[i], item);
+    uint64_t h = hashes->h[i];
     uint32_t high_bits = (uint32_t)(h >> 32);
     uint32_t low_bits = (uint32_t)(h);
     bitarray_set(set->ba, BIT(set, high_bits));
@@ -48,23 +53,46 @@ bloomfilt_add(bloomfilt_t *set,
   }
 }
 
-/** If <b>item</b> is in <b>set</b>, return nonzero.  Otherwise,
- * <em>probably</em> return zero. */
+/** If the element whose hash values are <b>hashes</b> is in <b>set</b>,
+ * return nonzero.  Otherwise, <em>probably</em> return zero.
+ *
+ * We stop at the first bit that isn't set, since for most callers most
+ * queries are for elements that aren't there. */
 int
-bloomfilt_probably_contains(const bloomfilt_t *set,
-                            const void *item)
+bloomfilt_probably_contains_hashes(const bloomfilt_t *set,
+                                   const bloomfilt_hashes_t *hashes)
 {
-  int i, matches = 0;
+  int i;
   for (i = 0; i < BLOOMFILT_N_HASHES; ++i) {
-    uint64_t h = set->hashfn(&set->key[i], item);
+    uint64_t h = hashes->h[i];
     uint32_t high_bits = (uint32_t)(h >> 32);
     uint32_t low_bits = (uint32_t)(h);
-    // Note that !! is necessary here, since bitarray_is_set does not
-    // necessarily return 1 on true.
-    matches += !! bitarray_is_set(set->ba, BIT(set, high_bits));
-    matches += !! bitarray_is_set(set->ba, BIT(set, low_bits));
+    if (! bitarray_is_set(set->ba, BIT(set, high_bits)) ||
+        ! bitarray_is_set(set->ba, BIT(set, low_bits)))
+      return 0;
   }
-  return matches == N_BITS_PER_ITEM;
+  return 1;
+}
+
+/** Add the element <b>item</b> to <b>set</b>. */
+void
+bloomfilt_add(bloomfilt_t *set,
+              const void *item)
+{
+  bloomfilt_hashes_t hashes;
+  bloomfilt_hash(set, item, &hashes);
+  bloomfilt_add_hashes(set, &hashes);
+}
+
+/** If <b>item</b> is in <b>set</b>, return nonzero.  Otherwise,
+ * <em>probably</em> return zero. */
+int
+bloomfilt_probably_contains(const bloomfilt_t *set,
+                            const void *item)
+{
+  bloomfilt_hashes_t hashes;
+  bloomfilt_hash(set, item, &hashes);
+  return bloomfilt_probably_contains_hashes(set, &hashes);
 }
 
 /** Return a newly allocated bloomfilt_t, optimized to hold a total of
@@ -32,6 +32,19 @@ typedef uint64_t (*bloomfilt_hash_fn)(const struct sipkey *key,
 void bloomfilt_add(bloomfilt_t *set, const void *item);
 int bloomfilt_probably_contains(const bloomfilt_t *set, const void *item);
 
+/** The hash values of a single item, as computed by bloomfilt_hash().  These
+ * can be used with any bloomfilt_t that has the same key and hash function,
+ * so that a caller probing several filters only hashes the item once. */
+typedef struct bloomfilt_hashes_t {
+  uint64_t h[BLOOMFILT_N_HASHES];
+} bloomfilt_hashes_t;
+
+void bloomfilt_hash(const bloomfilt_t *set, const void *item,
+                    bloomfilt_hashes_t *out);
+void bloomfilt_add_hashes(bloomfilt_t *set, const bloomfilt_hashes_t *hashes);
+int bloomfilt_probably_contains_hashes(const bloomfilt_t *set,
+                                       const bloomfilt_hashes_t *hashes);
+
 bloomfilt_t *bloomfilt_new(int max_elements,
                            bloomfilt_hash_fn hashfn,
                            const uint8_t *random_key);
@@ -8,6 +8,20 @@
  *
  * \brief Hash-table implementations of a string-to-void* map, and of
  * a digest-to-void* map.
+ *
+ * The tables use open addressing: entries live inline in one flat array of
+ * slots, alongside a parallel array of one-byte "control" values.  A control
+ * byte says whether its slot is empty, holds a removed entry (a
+ * "tombstone"), or holds a live entry, in which case it also holds seven
+ * bits of that entry's hash.  Lookups examine the control bytes a group of
+ * MAP_GROUP_WIDTH at a time (with SSE2 where we have it), and only compare
+ * keys for the slots whose hash bits match, so a typical lookup touches one
+ * line of control bytes and one slot.
+ *
+ * Removing an entry leaves a tombstone, so that iterating while removing
+ * (as with *_iter_next_rmv() and MAP_FOREACH_MODIFY()) never moves the
+ * entries that are still to be visited.  Tombstones are cleared when the
+ * table is rebuilt on insertion.
  **/
 
 #include "lib/container/map.h"
@@ -18,161 +32,370 @@
 
 #include "lib/log/util_bug.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "ext/ht.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-/** Helper: Declare an entry type and a map type to implement a mapping using
- * ht.h.  The map type will be called <b>maptype</b>.  The key part of each
- * entry is declared using the C declaration <b>keydecl</b>.  All functions
- * and types associated with the map get prefixed with <b>prefix</b> */
+/** Helper: Declare an entry type and a map type to implement a mapping with
+ * an open-addressed table.  The map type will be called <b>maptype</b>.  The
+ * key part of each entry is declared using the C declaration
+ * <b>keydecl</b>.  All functions and types associated with the map get
+ * prefixed with <b>prefix</b> */
 #define DEFINE_MAP_STRUCTS(maptype, keydecl, prefix)      \
   typedef struct prefix ## entry_t {                      \
-    HT_ENTRY(prefix ## entry_t) node;                     \
-    void *val;                                            \
     keydecl;                                              \
+    void *val;                                            \
   } prefix ## entry_t;                                    \
   struct maptype {                                        \
-    HT_HEAD(prefix ## impl, prefix ## entry_t) head;      \
+    /** Array of <b>capacity</b> entries. */              \
+    prefix ## entry_t *slots;                             \
+    /** Array of <b>capacity</b> control bytes; shares */ \
+    /** an allocation with <b>slots</b>. */               \
+    uint8_t *ctrl;                                        \
+    /** Number of slots; 0 or a power of two that is */   \
+    /** at least MAP_GROUP_WIDTH. */                      \
+    unsigned capacity;                                    \
+    /** Number of live entries. */                        \
+    unsigned size;                                        \
+    /** Number of tombstones. */                          \
+    unsigned n_deleted;                                   \
   }
 
 DEFINE_MAP_STRUCTS(strmap_t, char *key, strmap_);
-DEFINE_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN], digestmap_);
+/* A digestmap entry has room to cache its key's hash in what would otherwise
+ * be padding, which saves rehashing every key when the table grows. */
+DEFINE_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN]; uint32_t hash,
+                   digestmap_);
 DEFINE_MAP_STRUCTS(digest256map_t, uint8_t key[DIGEST256_LEN], digest256map_);
 
-/** Helper: compare strmap_entry_t objects by key value. */
-static inline int
-strmap_entries_eq(const strmap_entry_t *a, const strmap_entry_t *b)
+/** How many control bytes do we examine at once when probing? */
+#define MAP_GROUP_WIDTH 16
+/** Control byte for a slot that has never held an entry since the table was
+ * last rebuilt. */
+#define MAP_CTRL_EMPTY ((uint8_t)0x80)
+/** Control byte for a slot whose entry was removed. */
+#define MAP_CTRL_DELETED ((uint8_t)0xfe)
+/** True iff <b>c</b> is the control byte of a live entry. */
+#define MAP_CTRL_IS_FULL(c) (((c) & 0x80) == 0)
+
+/** The part of a hash that picks the group where probing starts. */
+#define MAP_HASH_GROUP(h) ((h) >> 7)
+/** The part of a hash that is kept in the control byte. */
+#define MAP_HASH_CTRL(h) ((uint8_t)((h) & 0x7f))
+
+/** How many entries and tombstones can a table with <b>cap</b> slots hold
+ * before we rebuild it?  Every table keeps some empty slots, so that probing
+ * for a missing key always terminates. */
+#define MAP_GROWTH_LIMIT(cap) ((cap) - (cap) / 8)
+
+#ifdef __SSE2__
+/** Return a bitmask of the control bytes in the group at <b>grp</b> that are
+ * equal to <b>c</b>. */
+static inline unsigned
+map_group_match(const uint8_t *grp, uint8_t c)
 {
-  return !strcmp(a->key, b->key);
+  __m128i g = _mm_loadu_si128((const __m128i *)grp);
+  return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
 }
 
-/** Helper: return a hash value for a strmap_entry_t. */
-static inline unsigned int
-strmap_entry_hash(const strmap_entry_t *a)
+/** Return a bitmask of the control bytes in the group at <b>grp</b> that are
+ * empty or deleted. */
+static inline unsigned
+map_group_match_free(const uint8_t *grp)
 {
-  return (unsigned) siphash24g(a->key, strlen(a->key));
+  return (unsigned)_mm_movemask_epi8(
+                              _mm_loadu_si128((const __m128i *)grp));
+}
+#else /* !defined(__SSE2__) */
+static inline unsigned
+map_group_match(const uint8_t *grp, uint8_t c)
+{
+  unsigned i, m = 0;
+  for (i = 0; i < MAP_GROUP_WIDTH; ++i)
+    m |= (unsigned)(grp[i] == c) << i;
+  return m;
 }
 
-/** Helper: compare digestmap_entry_t objects by key value. */
-static inline int
-digestmap_entries_eq(const digestmap_entry_t *a, const digestmap_entry_t *b)
+static inline unsigned
+map_group_match_free(const uint8_t *grp)
 {
-  return tor_memeq(a->key, b->key, DIGEST_LEN);
+  unsigned i, m = 0;
+  for (i = 0; i < MAP_GROUP_WIDTH; ++i)
+    m |= (unsigned)(grp[i] >> 7) << i;
+  return m;
 }
+#endif /* defined(__SSE2__) */
 
-/** Helper: return a hash value for a digest_map_t. */
-static inline unsigned int
-digestmap_entry_hash(const digestmap_entry_t *a)
+/** Return the index of the lowest set bit in the nonzero mask <b>m</b>. */
+static inline unsigned
+map_mask_first(unsigned m)
 {
-  return (unsigned) siphash24g(a->key, DIGEST_LEN);
+#ifdef __GNUC__
+  return (unsigned)__builtin_ctz(m);
+#else
+  unsigned i = 0;
+  while (!(m & 1)) {
+    m >>= 1;
+    ++i;
+  }
+  return i;
+#endif /* defined(__GNUC__) */
 }
 
-/** Helper: compare digestmap_entry_t objects by key value. */
+/** Return the index of the first slot at or after <b>idx</b> that holds a
+ * live entry, or -1 if there is none. */
 static inline int
-digest256map_entries_eq(const digest256map_entry_t *a,
-                        const digest256map_entry_t *b)
+map_next_full(const uint8_t *ctrl, unsigned capacity, unsigned idx)
 {
-  return tor_memeq(a->key, b->key, DIGEST256_LEN);
+  for ( ; idx < capacity; ++idx) {
+    if (MAP_CTRL_IS_FULL(ctrl[idx]))
+      return (int)idx;
+  }
+  return -1;
 }
 
-/** Helper: return a hash value for a digest_map_t. */
-static inline unsigned int
-digest256map_entry_hash(const digest256map_entry_t *a)
+/** Return the index of the first empty or deleted slot on the probe sequence
+ * for <b>hash</b> in a table of <b>capacity</b> slots. */
+static inline unsigned
+map_find_free_slot(const uint8_t *ctrl, unsigned capacity, uint32_t hash)
 {
-  return (unsigned) siphash24g(a->key, DIGEST256_LEN);
+  const unsigned mask = capacity / MAP_GROUP_WIDTH - 1;
+  unsigned g = MAP_HASH_GROUP(hash) & mask, step;
+  for (step = 1; ; ++step) {
+    unsigned m = map_group_match_free(ctrl + g * MAP_GROUP_WIDTH);
+    if (m)
+      return g * MAP_GROUP_WIDTH + map_mask_first(m);
+    /* Triangular steps visit every group of a power-of-two table. */
+    g = (g + step) & mask;
+  }
 }
 
-HT_PROTOTYPE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
-             strmap_entries_eq);
-HT_GENERATE2(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
-             strmap_entries_eq, 0.6, tor_reallocarray_, tor_free_);
-
-HT_PROTOTYPE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq);
-HT_GENERATE2(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq, 0.6, tor_reallocarray_, tor_free_);
-
-HT_PROTOTYPE(digest256map_impl, digest256map_entry_t, node,
-             digest256map_entry_hash,
-             digest256map_entries_eq);
-HT_GENERATE2(digest256map_impl, digest256map_entry_t, node,
-             digest256map_entry_hash,
-             digest256map_entries_eq, 0.6, tor_reallocarray_, tor_free_);
-
-#define strmap_entry_free(ent) \
-  FREE_AND_NULL(strmap_entry_t, strmap_entry_free_, (ent))
-#define digestmap_entry_free(ent) \
-  FREE_AND_NULL(digestmap_entry_t, digestmap_entry_free_, (ent))
-#define digest256map_entry_free(ent) \
-  FREE_AND_NULL(digest256map_entry_t, digest256map_entry_free_, (ent))
+/** Return the capacity to rebuild a table of <b>capacity</b> slots into, so
+ * that it has room for one more than <b>size</b> entries. */
+static unsigned
+map_new_capacity(unsigned capacity, unsigned size)
+{
+  if (capacity == 0)
+    return MAP_GROUP_WIDTH;
+  /* If clearing the tombstones would leave at least an eighth of the
+   * slots free for new entries, that is enough. */
+  if (size < capacity - capacity / 4)
+    return capacity;
+  tor_assert(capacity <= INT_MAX / 2);
+  return capacity * 2;
+}
 
-static inline void
-strmap_entry_free_(strmap_entry_t *ent)
+/** Helper: return a hash value for a strmap key. */
+static inline uint32_t
+strmap_key_hash(const char *key)
 {
-  tor_free(ent->key);
-  tor_free(ent);
+  return (uint32_t) siphash24g(key, strlen(key));
 }
-static inline void
-digestmap_entry_free_(digestmap_entry_t *ent)
+
+/** Helper: return a hash value for a digestmap key. */
+static inline uint32_t
+digestmap_key_hash(const char *key)
 {
-  tor_free(ent);
+  return (uint32_t) siphash24g(key, DIGEST_LEN);
 }
-static inline void
-digest256map_entry_free_(digest256map_entry_t *ent)
+
+/** Helper: return a hash value for a digest256map key. */
+static inline uint32_t
+digest256map_key_hash(const uint8_t *key)
 {
-  tor_free(ent);
+  return (uint32_t) siphash24g(key, DIGEST256_LEN);
+}
+
+/** Helper: return true iff <b>ent</b> has the key <b>key</b>. */
+static inline int
+strmap_key_eq(const strmap_entry_t *ent, const char *key)
+{
+  return !strcmp(ent->key, key);
+}
+
+/** Helper: return true iff <b>ent</b> has the key <b>key</b>. */
+static inline int
+digestmap_key_eq(const digestmap_entry_t *ent, const char *key)
+{
+  return tor_memeq(ent->key, key, DIGEST_LEN);
+}
+
+/** Helper: return true iff <b>ent</b> has the key <b>key</b>. */
+static inline int
+digest256map_key_eq(const digest256map_entry_t *ent, const uint8_t *key)
+{
+  return tor_memeq(ent->key, key, DIGEST256_LEN);
 }
 
 static inline void
-strmap_assign_tmp_key(strmap_entry_t *ent, const char *key)
+strmap_assign_key(strmap_entry_t *ent, const char *key, uint32_t hash)
 {
-  ent->key = (char*)key;
+  (void)hash;
+  ent->key = tor_strdup(key);
 }
 static inline void
-digestmap_assign_tmp_key(digestmap_entry_t *ent, const char *key)
+digestmap_assign_key(digestmap_entry_t *ent, const char *key, uint32_t hash)
 {
   memcpy(ent->key, key, DIGEST_LEN);
+  ent->hash = hash;
 }
 static inline void
-digest256map_assign_tmp_key(digest256map_entry_t *ent, const uint8_t *key)
+digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key,
+                        uint32_t hash)
 {
+  (void)hash;
   memcpy(ent->key, key, DIGEST256_LEN);
 }
+
+/** Helper: return the hash of the key of <b>ent</b>. */
+static inline uint32_t
+strmap_entry_hash(const strmap_entry_t *ent)
+{
+  return strmap_key_hash(ent->key);
+}
+static inline uint32_t
+digestmap_entry_hash(const digestmap_entry_t *ent)
+{
+  return ent->hash;
+}
+static inline uint32_t
+digest256map_entry_hash(const digest256map_entry_t *ent)
+{
+  return digest256map_key_hash(ent->key);
+}
+
 static inline void
-strmap_assign_key(strmap_entry_t *ent, const char *key)
+strmap_entry_clear(strmap_entry_t *ent)
 {
-  ent->key = tor_strdup(key);
+  tor_free(ent->key);
 }
 static inline void
-digestmap_assign_key(digestmap_entry_t *ent, const char *key)
+digestmap_entry_clear(digestmap_entry_t *ent)
 {
-  memcpy(ent->key, key, DIGEST_LEN);
+  (void)ent;
 }
 static inline void
-digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
+digest256map_entry_clear(digest256map_entry_t *ent)
 {
-  memcpy(ent->key, key, DIGEST256_LEN);
+  (void)ent;
+}
+
+/** Helper: return the number of bytes the entry <b>ent</b> owns outside of
+ * its slot. */
+static inline size_t
+strmap_entry_extra_mem(const strmap_entry_t *ent)
+{
+  return strlen(ent->key) + 1;
+}
+static inline size_t
+digestmap_entry_extra_mem(const digestmap_entry_t *ent)
+{
+  (void)ent;
+  return 0;
+}
+static inline size_t
+digest256map_entry_extra_mem(const digest256map_entry_t *ent)
+{
+  (void)ent;
+  return 0;
 }
 
 /**
  * Macro: implement all the functions for a map that are declared in
- * map.h by the DECLARE_MAP_FNS() macro.  You must additionally define a
- * prefix_entry_free_() function to free entries (and their keys), a
- * prefix_assign_tmp_key() function to temporarily set a stack-allocated
- * entry to hold a key, and a prefix_assign_key() function to set a
- * heap-allocated entry to hold a key.
+ * map.h by the DECLARE_MAP_FNS() macro.  You must additionally define
+ * a prefix_key_hash() function to hash a key, a prefix_entry_hash()
+ * function to return the hash of an entry's key, a prefix_key_eq()
+ * function to compare an entry's key with a key, a prefix_assign_key()
+ * function to set an entry to hold a copy of a key, a
+ * prefix_entry_clear() function to free any storage that copy owns,
+ * and a prefix_entry_extra_mem() function to report the size of that
+ * storage.
  */
 #define IMPLEMENT_MAP_FNS(maptype, keytype, prefix)                     \
+  /** Return the index of the slot in <b>map</b> holding <b>key</b>,    \
+   * whose hash is <b>hash</b>, or -1 if there is no such slot. */      \
+  static inline int                                                     \
+  prefix##_find_slot(const maptype *map, const keytype key,             \
+                     uint32_t hash)                                     \
+  {                                                                     \
+    const uint8_t c = MAP_HASH_CTRL(hash);                              \
+    unsigned mask, g, step;                                             \
+    if (map->capacity == 0)                                             \
+      return -1;                                                        \
+    mask = map->capacity / MAP_GROUP_WIDTH - 1;                         \
+    g = MAP_HASH_GROUP(hash) & mask;                                    \
+    for (step = 1; ; ++step) {                                          \
+      const uint8_t *grp = map->ctrl + g * MAP_GROUP_WIDTH;             \
+      unsigned m = map_group_match(grp, c);                             \
+      while (m) {                                                       \
+        unsigned idx = g * MAP_GROUP_WIDTH + map_mask_first(m);         \
+        if (prefix##_key_eq(&map->slots[idx], key))                     \
+          return (int)idx;                                              \
+        m &= m - 1;                                                     \
+      }                                                                 \
+      /* No key is stored past a group that has an empty slot. */       \
+      if (map_group_match(grp, MAP_CTRL_EMPTY))                         \
+        return -1;                                                      \
+      g = (g + step) & mask;                                            \
+    }                                                                   \
+  }                                                                     \
+                                                                        \
+  /** Rebuild the table of <b>map</b> with <b>capacity</b> slots,       \
+   * moving every live entry and dropping every tombstone. */           \
+  static void                                                           \
+  prefix##_rebuild(maptype *map, unsigned capacity)                     \
+  {                                                                     \
+    prefix##_entry_t *old_slots = map->slots;                           \
+    const uint8_t *old_ctrl = map->ctrl;                                \
+    unsigned i, old_capacity = map->capacity;                           \
+    tor_assert(capacity >= MAP_GROUP_WIDTH);                            \
+    tor_assert(map->size < MAP_GROWTH_LIMIT(capacity));                 \
+    map->slots = tor_malloc(capacity *                                  \
+                            (sizeof(prefix##_entry_t) + 1));            \
+    map->ctrl = (uint8_t *)(map->slots + capacity);                     \
+    memset(map->ctrl, MAP_CTRL_EMPTY, capacity);                        \
+    map->capacity = capacity;                                           \
+    map->n_deleted = 0;                                                 \
+    for (i = 0; i < old_capacity; ++i) {                                \
+      uint32_t hash;                                                    \
+      unsigned idx;                                                     \
+      if (!MAP_CTRL_IS_FULL(old_ctrl[i]))                               \
+        continue;                                                       \
+      hash = prefix##_entry_hash(&old_slots[i]);                        \
+      idx = map_find_free_slot(map->ctrl, capacity, hash);              \
+      map->ctrl[idx] = MAP_HASH_CTRL(hash);                             \
+      map->slots[idx] = old_slots[i];                                   \
+    }                                                                   \
+    tor_free(old_slots);                                                \
+  }                                                                     \
+                                                                        \
+  /** Mark the slot at <b>idx</b> in <b>map</b> as no longer holding    \
+   * an entry.  The caller must already have cleared the entry. */      \
+  static inline void                                                    \
+  prefix##_vacate_slot(maptype *map, unsigned idx)                      \
+  {                                                                     \
+    const uint8_t *grp = map->ctrl + (idx & ~(MAP_GROUP_WIDTH - 1));    \
+    /* If this slot's group still has an empty slot, the group has      \
+     * never been full since the last rebuild, so no probe has ever     \
+     * continued past it and the slot can become empty again. */        \
+    if (map_group_match(grp, MAP_CTRL_EMPTY)) {                         \
+      map->ctrl[idx] = MAP_CTRL_EMPTY;                                  \
+    } else {                                                            \
+      map->ctrl[idx] = MAP_CTRL_DELETED;                                \
+      ++map->n_deleted;                                                 \
+    }                                                                   \
+    --map->size;                                                        \
+  }                                                                     \
+                                                                        \
   /** Create and return a new empty map. */                             \
   MOCK_IMPL(maptype *,                                                  \
   prefix##_new,(void))                                                  \
   {                                                                     \
-    maptype *result;                                                    \
-    result = tor_malloc(sizeof(maptype));                               \
-    HT_INIT(prefix##_impl, &result->head);                              \
-    return result;                                                      \
+    return tor_malloc_zero(sizeof(maptype));                            \
   }                                                                     \
                                                                         \
   /** Return the item from <b>map</b> whose key matches <b>key</b>, or  \
@@ -180,121 +403,156 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   void *                                                                \
   prefix##_get(const maptype *map, const keytype key)                   \
   {                                                                     \
-    prefix ##_entry_t *resolve;                                         \
-    prefix ##_entry_t search;                                           \
+    int idx;                                                            \
     tor_assert(map);                                                    \
     tor_assert(key);                                                    \
-    prefix ##_assign_tmp_key(&search, key);                             \
-    resolve = HT_FIND(prefix ##_impl, &map->head, &search);             \
-    if (resolve) {                                                      \
-      return resolve->val;                                              \
-    } else {                                                            \
-      return NULL;                                                      \
-    }                                                                   \
+    idx = prefix##_find_slot(map, key, prefix##_key_hash(key));         \
+    return idx < 0 ? NULL : map->slots[idx].val;                        \
   }                                                                     \
                                                                         \
   /** Add an entry to <b>map</b> mapping <b>key</b> to <b>val</b>;      \
-   * return the previous value, or NULL if no such value existed. */     \
+   * return the previous value, or NULL if no such value existed. */    \
   void *                                                                \
   prefix##_set(maptype *map, const keytype key, void *val)              \
   {                                                                     \
-    prefix##_entry_t search;                                            \
-    void *oldval;                                                       \
+    uint32_t hash;                                                      \
+    unsigned idx = 0;                                                   \
+    int found, need_rebuild = 1;                                        \
     tor_assert(map);                                                    \
     tor_assert(key);                                                    \
     tor_assert(val);                                                    \
-    prefix##_assign_tmp_key(&search, key);                              \
-    /* We a lot of our time in this function, so the code below is */   \
-    /* meant to optimize the check/alloc/set cycle by avoiding the two */\
-    /* trips to the hash table that we would do in the unoptimized */   \
-    /* version of this code. (Each of HT_INSERT and HT_FIND calls */     \
-    /* HT_SET_HASH and HT_FIND_P.) */                                   \
-    HT_FIND_OR_INSERT_(prefix##_impl, node, prefix##_entry_hash,        \
-                       &(map->head),                                    \
-                       prefix##_entry_t, &search, ptr,                  \
-                       {                                                \
-                         /* we found an entry. */                       \
-                         oldval = (*ptr)->val;                          \
-                         (*ptr)->val = val;                             \
-                         return oldval;                                 \
-                       },                                               \
-                       {                                                \
-                         /* We didn't find the entry. */                \
-                         prefix##_entry_t *newent =                     \
-                           tor_malloc_zero(sizeof(prefix##_entry_t));   \
-                         prefix##_assign_key(newent, key);              \
-                         newent->val = val;                             \
-                         HT_FOI_INSERT_(node, &(map->head),             \
-                            &search, newent, ptr);                      \
-                         return NULL;                                   \
-    });                                                                 \
+    hash = prefix##_key_hash(key);                                      \
+    found = prefix##_find_slot(map, key, hash);                         \
+    if (found >= 0) {                                                   \
+      void *oldval = map->slots[found].val;                             \
+      map->slots[found].val = val;                                      \
+      return oldval;                                                    \
+    }                                                                   \
+    if (map->capacity) {                                                \
+      idx = map_find_free_slot(map->ctrl, map->capacity, hash);         \
+      /* Reusing a tombstone never needs a rebuild; filling an empty    \
+       * slot might. */                                                 \
+      need_rebuild = map->ctrl[idx] == MAP_CTRL_EMPTY &&                \
+        map->size + map->n_deleted >= MAP_GROWTH_LIMIT(map->capacity);  \
+    }                                                                   \
+    if (need_rebuild) {                                                 \
+      prefix##_rebuild(map,                                             \
+                       map_new_capacity(map->capacity, map->size));     \
+      idx = map_find_free_slot(map->ctrl, map->capacity, hash);         \
+    }                                                                   \
+    if (map->ctrl[idx] == MAP_CTRL_DELETED)                             \
+      --map->n_deleted;                                                 \
+    map->ctrl[idx] = MAP_HASH_CTRL(hash);                               \
+    prefix##_assign_key(&map->slots[idx], key, hash);                   \
+    map->slots[idx].val = val;                                          \
+    ++map->size;                                                        \
+    return NULL;                                                        \
   }                                                                     \
                                                                         \
-  /** Remove the value currently associated with <b>key</b> from the map. \
-   * Return the value if one was set, or NULL if there was no entry for \
-   * <b>key</b>.                                                        \
+  /** Remove the value currently associated with <b>key</b> from the    \
+   * map.  Return the value if one was set, or NULL if there was no     \
+   * entry for <b>key</b>.                                              \
    *                                                                    \
-   * Note: you must free any storage associated with the returned value. \
+   * Note: you must free any storage associated with the returned       \
+   * value.                                                             \
    */                                                                   \
   void *                                                                \
   prefix##_remove(maptype *map, const keytype key)                      \
   {                                                                     \
-    prefix##_entry_t *resolve;                                          \
-    prefix##_entry_t search;                                            \
     void *oldval;                                                       \
+    int idx;                                                            \
     tor_assert(map);                                                    \
     tor_assert(key);                                                    \
-    prefix##_assign_tmp_key(&search, key);                              \
-    resolve = HT_REMOVE(prefix##_impl, &map->head, &search);            \
-    if (resolve) {                                                      \
-      oldval = resolve->val;                                            \
-      prefix##_entry_free(resolve);                                     \
-      return oldval;                                                    \
-    } else {                                                            \
+    idx = prefix##_find_slot(map, key, prefix##_key_hash(key));         \
+    if (idx < 0)                                                        \
       return NULL;                                                      \
-    }                                                                   \
+    oldval = map->slots[idx].val;                                       \
+    prefix##_entry_clear(&map->slots[idx]);                             \
+    prefix##_vacate_slot(map, (unsigned)idx);                           \
+    return oldval;                                                      \
   }                                                                     \
                                                                         \
   /** Return the number of elements in <b>map</b>. */                   \
   int                                                                   \
   prefix##_size(const maptype *map)                                     \
   {                                                                     \
-    return HT_SIZE(&map->head);                                         \
+    return (int)map->size;                                              \
   }                                                                     \
                                                                         \
   /** Return true iff <b>map</b> has no entries. */                     \
   int                                                                   \
   prefix##_isempty(const maptype *map)                                  \
   {                                                                     \
-    return HT_EMPTY(&map->head);                                        \
+    return map->size == 0;                                              \
+  }                                                                     \
+                                                                        \
+  /** Return the number of bytes of heap memory that <b>map</b> uses    \
+   * for itself and its entries, not counting the values. */            \
+  size_t                                                                \
+  prefix##_mem_usage(const maptype *map)                                \
+  {                                                                     \
+    size_t n = sizeof(maptype) +                                        \
+      (size_t)map->capacity * (sizeof(prefix##_entry_t) + 1);           \
+    unsigned i;                                                         \
+    for (i = 0; i < map->capacity; ++i) {                               \
+      if (MAP_CTRL_IS_FULL(map->ctrl[i]))                               \
+        n += prefix##_entry_extra_mem(&map->slots[i]);                  \
+    }                                                                   \
+    return n;                                                           \
   }                                                                     \
                                                                         \
   /** Assert that <b>map</b> is not corrupt. */                         \
   void                                                                  \
   prefix##_assert_ok(const maptype *map)                                \
   {                                                                     \
-    tor_assert(!prefix##_impl_HT_REP_IS_BAD_(&map->head));              \
+    unsigned i, n_full = 0, n_deleted = 0;                              \
+    tor_assert(map);                                                    \
+    if (map->capacity == 0) {                                           \
+      tor_assert(map->size == 0);                                       \
+      tor_assert(map->n_deleted == 0);                                  \
+      return;                                                           \
+    }                                                                   \
+    tor_assert(map->capacity >= MAP_GROUP_WIDTH);                       \
+    tor_assert((map->capacity & (map->capacity - 1)) == 0);             \
+    tor_assert(map->size + map->n_deleted <=                            \
+               MAP_GROWTH_LIMIT(map->capacity));                        \
+    for (i = 0; i < map->capacity; ++i) {                               \
+      uint32_t hash;                                                    \
+      if (map->ctrl[i] == MAP_CTRL_DELETED) {                           \
+        ++n_deleted;                                                    \
+        continue;                                                       \
+      } else if (map->ctrl[i] == MAP_CTRL_EMPTY) {                      \
+        continue;                                                       \
+      }                                                                 \
+      tor_assert(MAP_CTRL_IS_FULL(map->ctrl[i]));                       \
+      hash = prefix##_key_hash(map->slots[i].key);                      \
+      tor_assert(hash == prefix##_entry_hash(&map->slots[i]));          \
+      tor_assert(map->ctrl[i] == MAP_HASH_CTRL(hash));                  \
+      tor_assert(prefix##_find_slot(map, map->slots[i].key, hash) ==    \
+                 (int)i);                                               \
+      ++n_full;                                                         \
+    }                                                                   \
+    tor_assert(n_full == map->size);                                    \
+    tor_assert(n_deleted == map->n_deleted);                            \
   }                                                                     \
                                                                         \
   /** Remove all entries from <b>map</b>, and deallocate storage for    \
-   * those entries.  If free_val is provided, invoked it every value in \
-   * <b>map</b>. */                                                     \
+   * those entries.  If free_val is provided, invoked it every value    \
+   * in <b>map</b>. */                                                  \
   MOCK_IMPL(void,                                                       \
   prefix##_free_, (maptype *map, void (*free_val)(void*)))              \
   {                                                                     \
-    prefix##_entry_t **ent, **next, *this;                              \
+    unsigned i;                                                         \
     if (!map)                                                           \
       return;                                                           \
-    for (ent = HT_START(prefix##_impl, &map->head); ent != NULL;        \
-         ent = next) {                                                  \
-      this = *ent;                                                      \
-      next = HT_NEXT_RMV(prefix##_impl, &map->head, ent);               \
+    for (i = 0; i < map->capacity; ++i) {                               \
+      if (!MAP_CTRL_IS_FULL(map->ctrl[i]))                              \
+        continue;                                                       \
       if (free_val)                                                     \
-        free_val(this->val);                                            \
-      prefix##_entry_free(this);                                        \
+        free_val(map->slots[i].val);                                    \
+      prefix##_entry_clear(&map->slots[i]);                             \
     }                                                                   \
-    tor_assert(HT_EMPTY(&map->head));                                   \
-    HT_CLEAR(prefix##_impl, &map->head);                                \
+    tor_free(map->slots);                                               \
     tor_free(map);                                                      \
   }                                                                     \
                                                                         \
@@ -322,8 +580,10 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   prefix##_iter_t *                                                     \
   prefix##_iter_init(maptype *map)                                      \
   {                                                                     \
+    int idx;                                                            \
     tor_assert(map);                                                    \
-    return HT_START(prefix##_impl, &map->head);                         \
+    idx = map_next_full(map->ctrl, map->capacity, 0);                   \
+    return idx < 0 ? NULL : &map->slots[idx];                           \
   }                                                                     \
                                                                         \
   /** Advance <b>iter</b> a single step to the next entry, and return   \
@@ -331,23 +591,27 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   prefix##_iter_t *                                                     \
   prefix##_iter_next(maptype *map, prefix##_iter_t *iter)               \
   {                                                                     \
+    int idx;                                                            \
     tor_assert(map);                                                    \
     tor_assert(iter);                                                   \
-    return HT_NEXT(prefix##_impl, &map->head, iter);                    \
+    idx = map_next_full(map->ctrl, map->capacity,                       \
+                        (unsigned)(iter - map->slots) + 1);             \
+    return idx < 0 ? NULL : &map->slots[idx];                           \
   }                                                                     \
-  /** Advance <b>iter</b> a single step to the next entry, removing the \
-   * current entry, and return its new value. */                        \
+  /** Advance <b>iter</b> a single step to the next entry, removing     \
+   * the current entry, and return its new value. */                    \
   prefix##_iter_t *                                                     \
   prefix##_iter_next_rmv(maptype *map, prefix##_iter_t *iter)           \
   {                                                                     \
-    prefix##_entry_t *rmv;                                              \
+    unsigned cur;                                                       \
     tor_assert(map);                                                    \
     tor_assert(iter);                                                   \
-    tor_assert(*iter);                                                  \
-    rmv = *iter;                                                        \
-    iter = HT_NEXT_RMV(prefix##_impl, &map->head, iter);                \
-    prefix##_entry_free(rmv);                                           \
-    return iter;                                                        \
+    cur = (unsigned)(iter - map->slots);                                \
+    tor_assert(cur < map->capacity);                                    \
+    tor_assert(MAP_CTRL_IS_FULL(map->ctrl[cur]));                       \
+    prefix##_entry_clear(iter);                                         \
+    prefix##_vacate_slot(map, cur);                                     \
+    return prefix##_iter_next(map, iter);                               \
   }                                                                     \
   /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed    \
    * to by iter. */                                                     \
@@ -356,11 +620,10 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
                     void **valp)                                        \
   {                                                                     \
     tor_assert(iter);                                                   \
-    tor_assert(*iter);                                                  \
     tor_assert(keyp);                                                   \
     tor_assert(valp);                                                   \
-    *keyp = (*iter)->key;                                               \
-    *valp = (*iter)->val;                                               \
+    *keyp = iter->key;                                                  \
+    *valp = iter->val;                                                  \
   }                                                                     \
   /** Return true iff <b>iter</b> has advanced past the last entry of   \
    * <b>map</b>. */                                                     \
@@ -19,7 +19,7 @@
 
 #define DECLARE_MAP_FNS(mapname_t, keytype, prefix)                     \
   typedef struct mapname_t mapname_t;                                   \
-  typedef struct prefix##_entry_t *prefix##_iter_t;                       \
+  typedef struct prefix##_entry_t prefix##_iter_t;                        \
   MOCK_DECL(mapname_t*, prefix##_new, (void));                           \
   void* prefix##_set(mapname_t *map, keytype key, void *val);            \
   void* prefix##_get(const mapname_t *map, keytype key);                 \
@@ -33,8 +33,15 @@
                                         prefix##_iter_t *iter);          \
   void prefix##_iter_get(prefix##_iter_t *iter, keytype *keyp, void **valp); \
   int prefix##_iter_done(prefix##_iter_t *iter);                          \
+  size_t prefix##_mem_usage(const mapname_t *map);                       \
   void prefix##_assert_ok(const mapname_t *map)
 
+/* The maps below are open-addressed hash tables that keep their entries
+ * inline, so inserting into a map may move its entries: a key pointer
+ * obtained from *_iter_get() on a digestmap or digest256map is only valid
+ * until the next insertion into that map.  Removing entries never moves the
+ * others. */
+
 /* Map from const char * to void *. Implemented with a hash table. */
 DECLARE_MAP_FNS(strmap_t, const char *, strmap);
 /* Map from const char[DIGEST_LEN] to void *. Implemented with a hash table. */
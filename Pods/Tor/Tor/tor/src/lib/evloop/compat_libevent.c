@@ -128,33 +128,61 @@ rescan_mainloop_cb(evutil_socket_t fd, short events, void *arg)
 #endif /* defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__) */
 #endif /* defined(__APPLE__) */
 
+/** Return a new event_config for an event base as described by
+ * <b>torcfg</b>.  If <b>use_method</b> is true and torcfg names a Libevent
+ * method, tell Libevent to avoid every other method. */
+static struct event_config *
+tor_libevent_new_config(const tor_libevent_cfg_t *torcfg, int use_method)
+{
+  struct event_config *cfg;
+
+  cfg = event_config_new();
+  tor_assert(cfg);
+
+  /* Telling Libevent not to try to turn locking on can avoid a needless
+   * socketpair() attempt. */
+  event_config_set_flag(cfg, EVENT_BASE_FLAG_NOLOCK);
+
+  if (torcfg->num_cpus > 0)
+    event_config_set_num_cpus_hint(cfg, torcfg->num_cpus);
+
+  /* We can enable changelist support with epoll, since we don't give
+   * Libevent any dup'd fds.  This lets us avoid some syscalls. */
+  event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+
+  if (use_method && torcfg->method) {
+    /* Libevent has no way to ask for a method by name, so we avoid all the
+     * others. */
+    const char **methods = event_get_supported_methods();
+    int i;
+    for (i = 0; methods && methods[i]; ++i) {
+      if (strcasecmp(methods[i], torcfg->method))
+        event_config_avoid_method(cfg, methods[i]);
+    }
+  }
+
+  return cfg;
+}
+
 /** Initialize the Libevent library and set up the event base. */
 void
 tor_libevent_initialize(tor_libevent_cfg_t *torcfg)
 {
-  tor_assert(the_event_base == NULL);
-  /* some paths below don't use torcfg, so avoid unused variable warnings */
-  (void)torcfg;
+  struct event_config *cfg;
 
-  {
-    struct event_config *cfg;
-
-    cfg = event_config_new();
-    tor_assert(cfg);
-
-    /* Telling Libevent not to try to turn locking on can avoid a needless
-     * socketpair() attempt. */
-    event_config_set_flag(cfg, EVENT_BASE_FLAG_NOLOCK);
-
-    if (torcfg->num_cpus > 0)
-      event_config_set_num_cpus_hint(cfg, torcfg->num_cpus);
+  tor_assert(the_event_base == NULL);
 
-    /* We can enable changelist support with epoll, since we don't give
-     * Libevent any dup'd fds.  This lets us avoid some syscalls. */
-    event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+  cfg = tor_libevent_new_config(torcfg, 1);
+  the_event_base = event_base_new_with_config(cfg);
+  event_config_free(cfg);
 
+  if (!the_event_base && torcfg->method) {
+    /* Either Libevent doesn't know the method we asked for, or it couldn't
+     * start it (maybe the kernel doesn't allow it).  Use the default. */
+    log_warn(LD_GENERAL, "Unable to initialize Libevent method \"%s\"; "
+             "using the default method instead.", torcfg->method);
+    cfg = tor_libevent_new_config(torcfg, 0);
     the_event_base = event_base_new_with_config(cfg);
-
     event_config_free(cfg);
   }
 
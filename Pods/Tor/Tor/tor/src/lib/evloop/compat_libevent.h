@@ -68,6 +68,9 @@ typedef struct tor_libevent_cfg_t {
   /** How many milliseconds should we allow between updating bandwidth limits?
    * (Not currently useful). */
   int msec_per_tick;
+  /** If set, the name of the Libevent backend we should use, if it's
+   * available. */
+  const char *method;
 } tor_libevent_cfg_t;
 
 void tor_libevent_initialize(tor_libevent_cfg_t *cfg);
@@ -9,13 +9,17 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
- * process it with.
+ * threads, each with its own queues of pending work, and a reply queue.
+ * Every piece of work is a workqueue_entry_t, containing data to process and
+ * a function to process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * The main thread hands each piece of work to a single worker thread,
+ * preferring one that is waiting for work, and informs it by using that
+ * thread's condition variable.  A worker thread that runs out of work of its
+ * own steals work from the other threads' queues before going to sleep, so
+ * that the worker threads never contend on a single pool-wide lock. The
+ * workers inform the main process of completed work by using an
+ * alert_sockets_t object, as implemented in net/alertsock.c.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -52,18 +56,21 @@ typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_t {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.  This array does not change once the threads are launched. */
   struct workerthread_t **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Index of the thread that should get the next piece of work, if none of
+   * the threads is waiting for work.  Used only from the main thread. */
+  int next_thread;
+  /** Number of threads that are waiting for work. */
+  atomic_counter_t n_waiting;
+  /** Number of pending work entries of each priority, summed over every
+   * thread's queues.  n_pending[p] counts the entries in work[p]. */
+  atomic_counter_t n_pending[WORKQUEUE_N_PRIORITIES];
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
+   * at an earlier generation needs to run the update function.  Only the
+   * main thread changes this field. */
   unsigned generation;
 
   /** Function that should be run for updates on each thread. */
@@ -78,7 +85,7 @@ struct threadpool_t {
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect the update fields above. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -103,6 +110,12 @@ struct workqueue_entry_t {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_t *on_pool;
+  /** The worker thread on whose queue this entry was placed. It may still be
+   * run by another thread that steals it. */
+  struct workerthread_t *on_thread;
+  /** The update generation of the pool when this entry was queued.  No
+   * thread may run this entry before it has caught up to that generation. */
+  unsigned generation;
   /** True iff this entry is waiting for a worker to start processing it. */
   uint8_t pending;
   /** Priority of this entry. */
@@ -140,6 +153,22 @@ typedef struct workerthread_t {
   unsigned generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+
+  /** Mutex to protect the fields below. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when we are given work or an update. */
+  tor_cond_t condition;
+  /** Queues of pending work given to this thread. The queue with priority
+   * <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** True iff this thread has counted itself in the pool's n_waiting. */
+  unsigned int waiting : 1;
+  /** True iff work has been given to another thread that we should try to
+   * steal. */
+  unsigned int kicked : 1;
+  /** True iff the pool has queued an update that we might not have run. */
+  unsigned int update_pending : 1;
 } workerthread_t;
 
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
@@ -201,14 +230,16 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&ent->on_pool->n_pending[prio], 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -216,54 +247,158 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
+/** Return true iff <b>thread</b> has work in its own queues, or an update
+ * to run.
+ *
+ * The caller must hold thread->lock. */
 static int
 worker_thread_has_work(workerthread_t *thread)
 {
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
+    if (!TOR_TAILQ_EMPTY(&thread->work[i]))
         return 1;
   }
-  return thread->generation != thread->in_pool->generation;
+  return thread->update_pending;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Extract the next workqueue_entry_t of priority <b>prio</b> that
+ * <b>thread</b> may run from the queues of <b>victim</b> (which may be
+ * <b>thread</b> itself), removing it from the queue and marking it as
+ * non-pending.  Return NULL if there is no such work.
  *
- * The caller must hold the lock. */
+ * The caller must hold victim->lock. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_extract_work_from(workerthread_t *thread,
+                                workerthread_t *victim,
+                                workqueue_priority_t prio)
+{
+  work_tailq_t *queue = &victim->work[prio];
+  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
+
+  if (work == NULL)
+    return NULL;
+  if ((int)(work->generation - thread->generation) > 0) {
+    /* This work was queued after an update that we haven't run yet. */
+    return NULL;
+  }
+  TOR_TAILQ_REMOVE(queue, work, next_work);
+  work->pending = 0;
+  atomic_counter_sub(&thread->in_pool->n_pending[prio], 1);
+  return work;
+}
+
+/** Extract the next workqueue_entry_t of priority <b>prio</b> for
+ * <b>thread</b> to run: from its own queue if possible, or else from another
+ * thread's queue.  Return NULL if there is no such work we can run right
+ * now.
+ *
+ * The caller must not hold any locks. */
+static workqueue_entry_t *
+worker_thread_extract_work_at(workerthread_t *thread,
+                              workqueue_priority_t prio)
 {
   threadpool_t *pool = thread->in_pool;
-  work_tailq_t *queue = NULL, *this_queue;
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
-    if (!TOR_TAILQ_EMPTY(this_queue)) {
-      queue = this_queue;
-      if (! crypto_fast_rng_one_in_n(get_thread_fast_rng(),
-                                     thread->lower_priority_chance)) {
-        /* Usually we'll just break now, so that we can get out of the loop
-         * and use the queue where we found work. But with a small
-         * probability, we'll keep looking for lower priority work, so that
-         * we don't ignore our low-priority queues entirely. */
-        break;
-      }
-    }
+  workqueue_entry_t *work;
+  int i;
+
+  for (i = 0; i < pool->n_threads; ++i) {
+    workerthread_t *victim =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    if (atomic_counter_get(&pool->n_pending[prio]) == 0)
+      break;
+    tor_mutex_acquire(&victim->lock);
+    work = worker_thread_extract_work_from(thread, victim, prio);
+    tor_mutex_release(&victim->lock);
+    if (work)
+      return work;
   }
+  return NULL;
+}
 
-  if (queue == NULL)
+/** Extract the next workqueue_entry_t for <b>thread</b> to run.  Return
+ * NULL if there is no work we can run right now.
+ *
+ * We take the highest-priority work queued anywhere in the pool, preferring
+ * our own queue within a priority, so that high-priority work given to a busy
+ * thread never waits behind lower-priority work on an idle one.
+ *
+ * The caller must not hold any locks. */
+static workqueue_entry_t *
+worker_thread_extract_next_work(workerthread_t *thread)
+{
+  workqueue_entry_t *work = NULL;
+  unsigned start, i;
+
+  tor_mutex_acquire(&thread->lock);
+  if (thread->update_pending) {
+    tor_mutex_release(&thread->lock);
     return NULL;
+  }
+  tor_mutex_release(&thread->lock);
+
+  /* Usually we start looking at the highest priority. But with a small
+   * probability, we'll start at a lower priority instead, so that we don't
+   * ignore our low-priority queues entirely. */
+  start = WORKQUEUE_PRIORITY_FIRST;
+  while (start < WORKQUEUE_PRIORITY_LAST &&
+         crypto_fast_rng_one_in_n(get_thread_fast_rng(),
+                                  thread->lower_priority_chance)) {
+    ++start;
+  }
 
-  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
-  TOR_TAILQ_REMOVE(queue, work, next_work);
-  work->pending = 0;
+  for (i = 0; i < (unsigned)WORKQUEUE_N_PRIORITIES && !work; ++i) {
+    unsigned prio = WORKQUEUE_PRIORITY_FIRST +
+      (start - WORKQUEUE_PRIORITY_FIRST + i) % WORKQUEUE_N_PRIORITIES;
+    work = worker_thread_extract_work_at(thread, (workqueue_priority_t)prio);
+  }
   return work;
 }
 
+/** If <b>thread</b> is counted in its pool's n_waiting, stop counting it.
+ *
+ * The caller must hold thread->lock. */
+static void
+worker_thread_clear_waiting(workerthread_t *thread)
+{
+  if (thread->waiting) {
+    thread->waiting = 0;
+    atomic_counter_sub(&thread->in_pool->n_waiting, 1);
+  }
+}
+
+/** If the pool has queued an update for <b>thread</b>, run it.  Return 1 if
+ * we ran an update function that told the thread to exit, else 0. */
+static int
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  int run_update = 0;
+  void *arg = NULL;
+  workqueue_reply_t (*update_fn)(void*,void*) = NULL;
+
+  tor_mutex_acquire(&thread->lock);
+  run_update = thread->update_pending;
+  thread->update_pending = 0;
+  tor_mutex_release(&thread->lock);
+  if (!run_update)
+    return 0;
+
+  tor_mutex_acquire(&pool->lock);
+  run_update = (pool->generation != thread->generation);
+  if (run_update) {
+    arg = pool->update_args[thread->index];
+    pool->update_args[thread->index] = NULL;
+    update_fn = pool->update_fn;
+    thread->generation = pool->generation;
+  }
+  tor_mutex_release(&pool->lock);
+
+  if (run_update && update_fn(thread->state, arg) != WQ_RPL_REPLY)
+    return 1;
+  return 0;
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -275,54 +410,55 @@ worker_thread_main(void *thread_)
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
+    if (worker_thread_run_update(thread))
+      return;
+
+    work = worker_thread_extract_next_work(thread);
+    if (work == NULL) {
+      /* Tell the main thread that we're about to wait for work, then look
+       * once more in case somebody queued work before they could see that.
+       */
+      tor_mutex_acquire(&thread->lock);
+      if (! thread->waiting) {
+        thread->waiting = 1;
+        atomic_counter_add(&pool->n_waiting, 1);
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
-
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
+      tor_mutex_release(&thread->lock);
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+      work = worker_thread_extract_next_work(thread);
+    }
 
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
-        return;
+    if (work == NULL) {
+      /* Okay. Now, wait till somebody has work for us. */
+      tor_mutex_acquire(&thread->lock);
+      while (thread->waiting && !thread->kicked &&
+             !worker_thread_has_work(thread)) {
+        /* TODO: support an idle-function */
+        if (tor_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
+          log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+        }
       }
-      tor_mutex_acquire(&pool->lock);
+      thread->kicked = 0;
+      worker_thread_clear_waiting(thread);
+      tor_mutex_release(&thread->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
-    /* TODO: support an idle-function */
+    tor_mutex_acquire(&thread->lock);
+    worker_thread_clear_waiting(thread);
+    tor_mutex_release(&thread->lock);
+
+    /* We run the work function without holding any lock. This is the main
+     * thread's first opportunity to give us more work. */
+    result = work->fn(thread->state, work->arg);
+
+    /* Queue the reply for the main thread. */
+    queue_reply(thread->reply_queue, work);
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      return;
     }
   }
 }
@@ -345,28 +481,42 @@ queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and send
+ * responses to <b>replyqueue</b>.  The thread is not started until
+ * workerthread_start() is called. */
 static workerthread_t *
 workerthread_new(int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
+  tor_mutex_init_nonrecursive(&thr->lock);
+  tor_cond_init(&thr->condition);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
+  }
 
+  return thr;
+}
+
+/** Launch the thread for the worker <b>thr</b>.  Return 0 on success, -1 on
+ * failure. */
+static int
+workerthread_start(workerthread_t *thr)
+{
   if (spawn_func(worker_thread_main, thr) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
     log_err(LD_GENERAL, "Can't launch worker thread.");
-    workerthread_free(thr);
-    return NULL;
+    return -1;
     //LCOV_EXCL_STOP
   }
 
-  return thr;
+  return 0;
 }
 
 /**
@@ -394,8 +544,9 @@ workerthread_free_(workerthread_t *thread)
  * currently possible, but callers should check anyway.)
  *
  * Items are executed in a loose priority order -- each thread will usually
- * take from the queued work with the highest prioirity, but will occasionally
- * visit lower-priority queues to keep them from starving completely.
+ * take the queued work with the highest prioirity, from any thread's queue,
+ * but will occasionally visit lower-priority queues to keep them from
+ * starving completely.
  *
  * Note that because of priorities and thread behavior, work items may not
  * be executed strictly in order.
@@ -411,17 +562,57 @@ threadpool_queue_work_priority(threadpool_t *pool,
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thread = NULL;
+  int i;
   ent->on_pool = pool;
   ent->pending = 1;
   ent->priority = prio;
-
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
-
-  tor_cond_signal_one(&pool->condition);
-
-  tor_mutex_release(&pool->lock);
+  ent->generation = pool->generation;
+
+  if (atomic_counter_get(&pool->n_waiting) > 0) {
+    /* Somebody is waiting for work: give it to them directly. */
+    for (i = 0; i < pool->n_threads; ++i) {
+      workerthread_t *t =
+        pool->threads[(pool->next_thread + i) % pool->n_threads];
+      tor_mutex_acquire(&t->lock);
+      if (t->waiting) {
+        worker_thread_clear_waiting(t);
+        thread = t;
+        break;
+      }
+      tor_mutex_release(&t->lock);
+    }
+  }
+  if (thread == NULL) {
+    /* Everybody is busy: take turns. */
+    thread = pool->threads[pool->next_thread];
+    tor_mutex_acquire(&thread->lock);
+  }
+  pool->next_thread = (thread->index + 1) % pool->n_threads;
+
+  ent->on_thread = thread;
+  atomic_counter_add(&pool->n_pending[prio], 1);
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  tor_cond_signal_one(&thread->condition);
+  tor_mutex_release(&thread->lock);
+
+  if (atomic_counter_get(&pool->n_waiting) > 0) {
+    /* A thread started waiting while we were picking one.  Make sure it
+     * wakes up to steal this work if its owner is busy. */
+    for (i = 0; i < pool->n_threads; ++i) {
+      workerthread_t *t = pool->threads[i];
+      if (t == thread)
+        continue;
+      tor_mutex_acquire(&t->lock);
+      if (t->waiting) {
+        t->kicked = 1;
+        tor_cond_signal_one(&t->condition);
+        tor_mutex_release(&t->lock);
+        break;
+      }
+      tor_mutex_release(&t->lock);
+    }
+  }
 
   return ent;
 }
@@ -481,10 +672,16 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_fn = fn;
   ++pool->generation;
 
-  tor_cond_signal_all(&pool->condition);
-
   tor_mutex_release(&pool->lock);
 
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thread = pool->threads[i];
+    tor_mutex_acquire(&thread->lock);
+    thread->update_pending = 1;
+    tor_cond_signal_one(&thread->condition);
+    tor_mutex_release(&thread->lock);
+  }
+
   if (old_args) {
     for (i = 0; i < n_threads; ++i) {
       if (old_args[i] && old_args_free_fn)
@@ -507,12 +704,17 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Launch threads until we have <b>n</b>.  Call this only once per pool:
+ * the threads look at each others' queues, so the set of threads must not
+ * change once they are running. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
+  int i;
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
+  if (BUG(pool->n_threads))
+    return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
@@ -545,6 +747,11 @@ threadpool_start_threads(threadpool_t *pool, int n)
   }
   tor_mutex_release(&pool->lock);
 
+  for (i = 0; i < pool->n_threads; ++i) {
+    if (workerthread_start(pool->threads[i]) < 0)
+      return -1; // LCOV_EXCL_LINE
+  }
+
   return 0;
 }
 
@@ -563,13 +770,12 @@ threadpool_new(int n_threads,
                void *arg)
 {
   threadpool_t *pool;
+  unsigned i;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
+  atomic_counter_init(&pool->n_waiting);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i)
+    atomic_counter_init(&pool->n_pending[i]);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -579,7 +785,6 @@ threadpool_new(int n_threads,
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
     tor_mutex_uninit(&pool->lock);
     threadpool_free(pool);
     return NULL;
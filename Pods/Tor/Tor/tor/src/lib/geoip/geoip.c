@@ -13,14 +13,18 @@
  * statistical functions, which collect statistics about different kinds of
  * per-country usage.
  *
- * The geoip lookup tables are implemented as sorted lists of disjoint address
- * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * The geoip lookup tables are implemented as geoip_table_t: flat arrays of
+ * the address runs that map to each country, indexed by the top bits of the
+ * address.  Countries are numbered by their position in a list of singleton
+ * geoip_country_t objects, which are also indexed by their names in a
+ * hashtable.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
  * function.  For more information on the file format they read, see that
  * function.  See the scripts and the README file in src/config for more
- * information about how those files are generated.
+ * information about how those files are generated.  Since parsing those
+ * files is slow, geoip_load_file_cached() can also save the tables it
+ * builds in a cache file, and map that file on later runs instead.
  *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
@@ -29,6 +33,7 @@
 
 #define GEOIP_PRIVATE
 #include "lib/geoip/geoip.h"
+#include "lib/arch/bytes.h"
 #include "lib/container/map.h"
 #include "lib/container/order.h"
 #include "lib/container/smartlist.h"
@@ -36,6 +41,8 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -46,23 +53,127 @@
 #include "lib/string/util_string.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 static void init_geoip_countries(void);
 
-/** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country. */
-typedef struct geoip_ipv4_entry_t {
-  uint32_t ip_low; /**< The lowest IP in the range, in host order */
-  uint32_t ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv4_entry_t;
+/** How many of the top bits of an address pick its bucket in a
+ * geoip_table_t? */
+#define GEOIP_BUCKET_BITS 16
+/** How many buckets does a geoip_table_t have? */
+#define GEOIP_N_BUCKETS (1u << GEOIP_BUCKET_BITS)
+/** Largest number of runs we accept in a geoip_table_t.  Real databases
+ * have well under a million. */
+#define GEOIP_MAX_RUNS (1u << 26)
+
+/** An IPv4 or IPv6 address as two host-order halves.  IPv4 addresses use
+ * only the low 32 bits of <b>lo</b>. */
+typedef struct geoip_addr_t {
+  uint64_t hi;
+  uint64_t lo;
+} geoip_addr_t;
+
+/** An entry from a GeoIP file: maps a range of addresses to a country. */
+typedef struct geoip_range_t {
+  geoip_addr_t low; /**< The lowest address in the range */
+  geoip_addr_t high; /**< The highest address in the range */
+  country_t country; /**< An index into geoip_countries */
+} geoip_range_t;
 
-/** An entry from the GeoIP IPv6 file: maps an IPv6 range to a country. */
-typedef struct geoip_ipv6_entry_t {
-  struct in6_addr ip_low; /**< The lowest IP in the range, in host order */
-  struct in6_addr ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv6_entry_t;
+/**
+ * The header of a geoip_table_t's storage, and of a GeoIP cache file.
+ *
+ * After the header come, each starting at a multiple of 8 bytes: the
+ * two-letter code of each country the table uses; the bucket array; the
+ * start of each run (for IPv6, all the high halves, then all the low
+ * halves); and the country of each run.  See geoip_table_layout().
+ *
+ * Cache files are only meant to be read on the host that wrote them, so
+ * everything is in host byte order.
+ */
+typedef struct geoip_cache_header_t {
+  /** GEOIP_CACHE_MAGIC. */
+  char magic[8];
+  /** GEOIP_CACHE_BYTE_ORDER, as this host stores it. */
+  uint32_t byte_order;
+  /** 4 or 6. */
+  uint32_t family;
+  /** Number of runs in the table. */
+  uint32_t n_runs;
+  /** Number of country codes in the table. */
+  uint32_t n_countries;
+  /** SHA1 digest of the GeoIP file this table was built from. */
+  char digest[DIGEST_LEN];
+  uint32_t reserved;
+} geoip_cache_header_t;
+
+/** Value of geoip_cache_header_t.magic. */
+#define GEOIP_CACHE_MAGIC "TorGeo1\n"
+/** Value of geoip_cache_header_t.byte_order. */
+#define GEOIP_CACHE_BYTE_ORDER 0x01020304u
+
+/** Offsets of the arrays in a geoip_table_t's storage. */
+typedef struct geoip_layout_t {
+  size_t countries;
+  size_t bucket;
+  size_t start_hi;
+  size_t start_lo;
+  size_t run_country;
+  size_t total;
+} geoip_layout_t;
+
+/**
+ * A GeoIP database for one address family, in the form we look addresses
+ * up in.
+ *
+ * The table cuts the address space into "runs": maximal stretches of
+ * addresses that all map to the same country, including stretches of
+ * addresses that the GeoIP file did not mention.  The first run starts at
+ * address 0, and each run ends just before the next one starts, so the run
+ * holding an address is the last one that starts at or below it.  To keep
+ * the binary search for that run short, bucket[k] is the run holding the
+ * first address whose top GEOIP_BUCKET_BITS bits are k: an address in
+ * bucket k lies in one of the runs from bucket[k] to bucket[k+1].  Most
+ * buckets hold only a handful of runs, and many lie entirely in one run.
+ *
+ * All of the arrays live in a single block, laid out as described for
+ * geoip_cache_header_t, so that the block can be written out as a cache
+ * file and later used straight from a memory mapping of that file.
+ */
+typedef struct geoip_table_t {
+  /** AF_INET or AF_INET6. */
+  sa_family_t family;
+  /** Number of runs; 0 if the arrays have not been built. */
+  uint32_t n_runs;
+  /** GEOIP_N_BUCKETS+1 run indices. */
+  const uint32_t *bucket;
+  /** For IPv4, the first address of each run; for IPv6, the high half of
+   * the first address of each run. */
+  const void *start_hi;
+  /** For IPv6, the low half of the first address of each run. */
+  const uint64_t *start_lo;
+  /** The country of each run, as an index into <b>country_map</b>. */
+  const uint16_t *run_country;
+  /** Map from the table's country numbers to indices into
+   * geoip_countries. */
+  country_t *country_map;
+  /** The block holding the arrays, if it is on the heap. */
+  char *mem;
+  /** Size of <b>mem</b>. */
+  size_t mem_len;
+  /** The mapped cache file holding the arrays, if there is one. */
+  tor_mmap_t *mapping;
+  /** Ranges added since the arrays were last built. */
+  geoip_range_t *pending;
+  /** Number of entries in <b>pending</b>. */
+  int n_pending;
+  /** Number of entries <b>pending</b> has room for. */
+  int pending_alloc;
+} geoip_table_t;
 
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
@@ -70,12 +181,10 @@ static smartlist_t *geoip_countries = NULL;
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** List of all known geoip_ipv4_entry_t sorted
- * by their respective ip_low values. */
-static smartlist_t *geoip_ipv4_entries = NULL;
-/** List of all known geoip_ipv6_entry_t, sorted by their respective
- * ip_low values. */
-static smartlist_t *geoip_ipv6_entries = NULL;
+/** The IPv4 GeoIP database, or NULL if none is loaded. */
+static geoip_table_t *geoip_ipv4_table = NULL;
+/** The IPv6 GeoIP database, or NULL if none is loaded. */
+static geoip_table_t *geoip_ipv6_table = NULL;
 
 /** SHA1 digest of the IPv4 GeoIP file to include in extra-info
  * descriptors. */
@@ -111,20 +220,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index of the 2-letter country code <b>country</b> in
+ * geoip_countries, adding it if it is not there yet. */
+static country_t
+geoip_intern_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -141,22 +244,440 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return (country_t)idx;
+}
+
+/** Return -1, 0, or 1 as <b>a</b> is below, equal to, or above <b>b</b>. */
+static inline int
+geoip_addr_compare(const geoip_addr_t *a, const geoip_addr_t *b)
+{
+  if (a->hi != b->hi)
+    return a->hi < b->hi ? -1 : 1;
+  if (a->lo != b->lo)
+    return a->lo < b->lo ? -1 : 1;
+  return 0;
+}
+
+/** Set <b>out</b> to the geoip_addr_t form of <b>addr</b>. */
+static void
+geoip_addr_from_tor_addr(geoip_addr_t *out, const tor_addr_t *addr)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    out->hi = 0;
+    out->lo = tor_addr_to_ipv4h(addr);
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    out->hi = tor_ntohll(get_uint64(a));
+    out->lo = tor_ntohll(get_uint64(a + 8));
+  }
+}
+
+/** Return a newly allocated, empty GeoIP table for <b>family</b>. */
+static geoip_table_t *
+geoip_table_new(sa_family_t family)
+{
+  geoip_table_t *t = tor_malloc_zero(sizeof(geoip_table_t));
+  t->family = family;
+  return t;
+}
+
+/** Release the built arrays of <b>t</b>, if it has any. */
+static void
+geoip_table_clear_runs(geoip_table_t *t)
+{
+  tor_free(t->mem);
+  t->mem_len = 0;
+  if (t->mapping) {
+    tor_munmap_file(t->mapping);
+    t->mapping = NULL;
+  }
+  tor_free(t->country_map);
+  t->n_runs = 0;
+  t->bucket = NULL;
+  t->start_hi = NULL;
+  t->start_lo = NULL;
+  t->run_country = NULL;
+}
+
+/** Release all storage held by <b>t</b>. */
+static void
+geoip_table_free_(geoip_table_t *t)
+{
+  if (!t)
+    return;
+  geoip_table_clear_runs(t);
+  tor_free(t->pending);
+  tor_free(t);
+}
+#define geoip_table_free(t) \
+  FREE_AND_NULL(geoip_table_t, geoip_table_free_, (t))
+
+/** Add a range from <b>low</b> to <b>high</b> in <b>country</b> to the
+ * ranges waiting to be built into <b>t</b>. */
+static void
+geoip_table_add_pending(geoip_table_t *t, const geoip_addr_t *low,
+                        const geoip_addr_t *high, country_t country)
+{
+  geoip_range_t *r;
+  if (t->n_pending == t->pending_alloc) {
+    t->pending_alloc = t->pending_alloc ? t->pending_alloc * 2 : 64;
+    t->pending = tor_reallocarray(t->pending, t->pending_alloc,
+                                  sizeof(geoip_range_t));
+  }
+  r = &t->pending[t->n_pending++];
+  r->low = *low;
+  r->high = *high;
+  r->country = country;
+}
 
-  if (tor_addr_family(low) == AF_INET) {
-    geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
-    ent->ip_low = tor_addr_to_ipv4h(low);
-    ent->ip_high = tor_addr_to_ipv4h(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv4_entries, ent);
-  } else if (tor_addr_family(low) == AF_INET6) {
-    geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
-    ent->ip_low = *tor_addr_to_in6_assert(low);
-    ent->ip_high = *tor_addr_to_in6_assert(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv6_entries, ent);
+/** Set *<b>out</b> to the first address of run <b>i</b> in <b>t</b>. */
+static inline void
+geoip_table_get_start(const geoip_table_t *t, uint32_t i, geoip_addr_t *out)
+{
+  if (t->family == AF_INET) {
+    out->hi = 0;
+    out->lo = ((const uint32_t *)t->start_hi)[i];
+  } else {
+    out->hi = ((const uint64_t *)t->start_hi)[i];
+    out->lo = t->start_lo[i];
   }
 }
 
+/** Turn the built arrays of <b>t</b> back into pending ranges, so that
+ * more ranges can be added to it. */
+static void
+geoip_table_thaw(geoip_table_t *t)
+{
+  uint32_t i;
+  for (i = 0; i < t->n_runs; ++i) {
+    geoip_addr_t low, high;
+    country_t country = t->country_map[t->run_country[i]];
+    if (country == 0)
+      continue;
+    geoip_table_get_start(t, i, &low);
+    if (i + 1 < t->n_runs) {
+      geoip_table_get_start(t, i + 1, &high);
+      if (high.lo-- == 0)
+        --high.hi;
+    } else {
+      high.hi = t->family == AF_INET ? 0 : UINT64_MAX;
+      high.lo = t->family == AF_INET ? UINT32_MAX : UINT64_MAX;
+    }
+    geoip_table_add_pending(t, &low, &high, country);
+  }
+  geoip_table_clear_runs(t);
+}
+
+/** Compute the layout of the storage for a table for <b>family</b> with
+ * <b>n_runs</b> runs and <b>n_countries</b> countries. */
+static void
+geoip_table_layout(sa_family_t family, uint32_t n_runs,
+                   uint32_t n_countries, geoip_layout_t *out)
+{
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+  size_t off = sizeof(geoip_cache_header_t);
+  out->countries = off;
+  off = ALIGN8(off + 2 * (size_t)n_countries);
+  out->bucket = off;
+  off = ALIGN8(off + sizeof(uint32_t) * (GEOIP_N_BUCKETS + 1));
+  out->start_hi = off;
+  if (family == AF_INET) {
+    off = ALIGN8(off + sizeof(uint32_t) * (size_t)n_runs);
+    out->start_lo = off;
+  } else {
+    off += sizeof(uint64_t) * (size_t)n_runs;
+    out->start_lo = off;
+    off += sizeof(uint64_t) * (size_t)n_runs;
+  }
+  out->run_country = off;
+  off = ALIGN8(off + sizeof(uint16_t) * (size_t)n_runs);
+  out->total = off;
+#undef ALIGN8
+}
+
+/** Point the arrays of <b>t</b> into <b>mem</b>, a block laid out as in
+ * <b>lay</b> whose header has already been checked.  If <b>check</b> is
+ * true, make sure that the arrays are well-formed first, and fail if they
+ * are not.  Return 0 on success and -1 on failure. */
+static int
+geoip_table_attach(geoip_table_t *t, const char *mem,
+                   const geoip_layout_t *lay, int check)
+{
+  const geoip_cache_header_t *hdr = (const geoip_cache_header_t *)mem;
+  const uint32_t n_runs = hdr->n_runs;
+  const uint32_t n_countries = hdr->n_countries;
+  const char *codes = mem + lay->countries;
+  const uint32_t *bucket = (const uint32_t *)(mem + lay->bucket);
+  const uint16_t *run_country = (const uint16_t *)(mem + lay->run_country);
+  uint32_t i;
+
+  t->n_runs = n_runs;
+  t->bucket = bucket;
+  t->start_hi = mem + lay->start_hi;
+  t->start_lo = (const uint64_t *)(mem + lay->start_lo);
+  t->run_country = run_country;
+
+  if (check) {
+    geoip_addr_t prev, cur;
+    if (bucket[0] != 0 || bucket[GEOIP_N_BUCKETS] != n_runs - 1)
+      goto bad;
+    for (i = 0; i < GEOIP_N_BUCKETS; ++i) {
+      if (bucket[i] > bucket[i+1])
+        goto bad;
+    }
+    geoip_table_get_start(t, 0, &prev);
+    if (prev.hi || prev.lo)
+      goto bad;
+    for (i = 0; i < n_runs; ++i) {
+      if (run_country[i] >= n_countries)
+        goto bad;
+      if (i == 0)
+        continue;
+      geoip_table_get_start(t, i, &cur);
+      if (geoip_addr_compare(&prev, &cur) >= 0)
+        goto bad;
+      prev = cur;
+    }
+    if (codes[0] != '?' || codes[1] != '?')
+      goto bad;
+    for (i = 0; i < 2 * n_countries; ++i) {
+      if (!TOR_ISALNUM(codes[i]) && codes[i] != '?')
+        goto bad;
+    }
+  }
+
+  t->country_map = tor_calloc(n_countries, sizeof(country_t));
+  for (i = 0; i < n_countries; ++i) {
+    char cc[3];
+    memcpy(cc, codes + 2*i, 2);
+    cc[2] = '\0';
+    t->country_map[i] = geoip_intern_country(cc);
+  }
+  return 0;
+
+ bad:
+  t->n_runs = 0;
+  t->bucket = NULL;
+  t->start_hi = NULL;
+  t->start_lo = NULL;
+  t->run_country = NULL;
+  return -1;
+}
+
+/** Sorting helper: compare two geoip_range_t by their lowest address. */
+static int
+geoip_compare_ranges_(const void *a_, const void *b_)
+{
+  const geoip_range_t *a = a_, *b = b_;
+  return geoip_addr_compare(&a->low, &b->low);
+}
+
+/** Append a run starting at <b>start</b> in <b>country</b> to the
+ * <b>*n</b> runs in <b>starts</b> and <b>countries</b>, merging it with
+ * the previous run where possible. */
+static void
+geoip_add_run(geoip_addr_t *starts, country_t *countries, uint32_t *n,
+              const geoip_addr_t *start, country_t country)
+{
+  if (*n && !geoip_addr_compare(&starts[*n - 1], start)) {
+    /* The previous run is empty; replace it. */
+    --*n;
+  }
+  if (*n && countries[*n - 1] == country)
+    return;
+  starts[*n] = *start;
+  countries[*n] = country;
+  ++*n;
+}
+
+/** Build the arrays of <b>t</b> from its existing runs, if any, and its
+ * pending ranges.  Where ranges overlap, the one that starts first wins. */
+static void
+geoip_table_build(geoip_table_t *t)
+{
+  geoip_addr_t *starts, next = { 0, 0 }, top;
+  country_t *countries;
+  uint32_t i, n = 0, n_countries;
+  uint32_t *bucket;
+  uint16_t *run_country;
+  geoip_cache_header_t *hdr;
+  geoip_layout_t lay;
+  int done = 0;
+  char *mem;
+
+  if (t->n_runs)
+    geoip_table_thaw(t);
+
+  qsort(t->pending, t->n_pending, sizeof(geoip_range_t),
+        geoip_compare_ranges_);
+  starts = tor_calloc(2 * (size_t)t->n_pending + 1, sizeof(geoip_addr_t));
+  countries = tor_calloc(2 * (size_t)t->n_pending + 1, sizeof(country_t));
+  top.hi = t->family == AF_INET ? 0 : UINT64_MAX;
+  top.lo = t->family == AF_INET ? UINT32_MAX : UINT64_MAX;
+
+  geoip_add_run(starts, countries, &n, &next, 0);
+  for (i = 0; i < (uint32_t)t->n_pending && !done; ++i) {
+    const geoip_range_t *r = &t->pending[i];
+    if (geoip_addr_compare(&r->high, &next) < 0)
+      continue; /* Wholly covered by earlier ranges. */
+    if (geoip_addr_compare(&r->low, &next) > 0) {
+      geoip_add_run(starts, countries, &n, &next, 0);
+      geoip_add_run(starts, countries, &n, &r->low, r->country);
+    } else {
+      geoip_add_run(starts, countries, &n, &next, r->country);
+    }
+    if (!geoip_addr_compare(&r->high, &top)) {
+      done = 1;
+    } else {
+      next = r->high;
+      if (++next.lo == 0)
+        ++next.hi;
+    }
+  }
+  if (!done)
+    geoip_add_run(starts, countries, &n, &next, 0);
+  tor_free(t->pending);
+  t->n_pending = t->pending_alloc = 0;
+
+  /* Every country we know about gets a slot, so that the table's country
+   * numbers are the same as their indices in geoip_countries. */
+  n_countries = smartlist_len(geoip_countries);
+  geoip_table_layout(t->family, n, n_countries, &lay);
+  mem = tor_malloc_zero(lay.total);
+  hdr = (geoip_cache_header_t *)mem;
+  memcpy(hdr->magic, GEOIP_CACHE_MAGIC, sizeof(hdr->magic));
+  hdr->byte_order = GEOIP_CACHE_BYTE_ORDER;
+  hdr->family = t->family == AF_INET ? 4 : 6;
+  hdr->n_runs = n;
+  hdr->n_countries = n_countries;
+  SMARTLIST_FOREACH(geoip_countries, const geoip_country_t *, c,
+                    memcpy(mem + lay.countries + 2*c_sl_idx,
+                           c->countrycode, 2));
+  run_country = (uint16_t *)(mem + lay.run_country);
+  for (i = 0; i < n; ++i) {
+    if (t->family == AF_INET) {
+      ((uint32_t *)(mem + lay.start_hi))[i] = (uint32_t)starts[i].lo;
+    } else {
+      ((uint64_t *)(mem + lay.start_hi))[i] = starts[i].hi;
+      ((uint64_t *)(mem + lay.start_lo))[i] = starts[i].lo;
+    }
+    run_country[i] = (uint16_t)countries[i];
+  }
+  bucket = (uint32_t *)(mem + lay.bucket);
+  {
+    const int shift = (t->family == AF_INET ? 32 : 64) - GEOIP_BUCKET_BITS;
+    uint32_t k, j = 0;
+    for (k = 0; k < GEOIP_N_BUCKETS; ++k) {
+      /* The first address in bucket k. */
+      geoip_addr_t first = { 0, 0 };
+      if (t->family == AF_INET)
+        first.lo = ((uint64_t)k) << shift;
+      else
+        first.hi = ((uint64_t)k) << shift;
+      while (j + 1 < n && geoip_addr_compare(&starts[j+1], &first) <= 0)
+        ++j;
+      bucket[k] = j;
+    }
+    bucket[GEOIP_N_BUCKETS] = n - 1;
+  }
+  tor_free(starts);
+  tor_free(countries);
+
+  t->mem = mem;
+  t->mem_len = lay.total;
+  geoip_table_attach(t, mem, &lay, 0);
+}
+
+/** Try to replace the contents of <b>t</b> with the GeoIP cache file at
+ * <b>fname</b>.  Only use it if it was built from a GeoIP file whose
+ * digest is <b>digest</b>.  Return 0 on success and -1 if there is no
+ * usable cache. */
+static int
+geoip_table_load_cache(geoip_table_t *t, const char *fname,
+                       const char *digest)
+{
+  tor_mmap_t *m;
+  const geoip_cache_header_t *hdr;
+  geoip_layout_t lay;
+
+  m = tor_mmap_file(fname);
+  if (!m)
+    return -1;
+  if (m->size < sizeof(geoip_cache_header_t))
+    goto stale;
+  hdr = (const geoip_cache_header_t *)m->data;
+  if (fast_memneq(hdr->magic, GEOIP_CACHE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->byte_order != GEOIP_CACHE_BYTE_ORDER ||
+      hdr->family != (t->family == AF_INET ? 4u : 6u) ||
+      fast_memneq(hdr->digest, digest, DIGEST_LEN) ||
+      hdr->n_runs == 0 || hdr->n_runs > GEOIP_MAX_RUNS ||
+      hdr->n_countries == 0 || hdr->n_countries > COUNTRY_MAX)
+    goto stale;
+  geoip_table_layout(t->family, hdr->n_runs, hdr->n_countries, &lay);
+  if (m->size != lay.total)
+    goto stale;
+
+  geoip_table_clear_runs(t);
+  tor_free(t->pending);
+  t->n_pending = t->pending_alloc = 0;
+  if (geoip_table_attach(t, m->data, &lay, 1) < 0) {
+    log_warn(LD_GENERAL, "GEOIP cache file %s is corrupt; ignoring it.",
+             fname);
+    tor_munmap_file(m);
+    return -1;
+  }
+  t->mapping = m;
+  return 0;
+
+ stale:
+  tor_munmap_file(m);
+  return -1;
+}
+
+/** Write the arrays of <b>t</b>, which we built from a GeoIP file whose
+ * digest is <b>digest</b>, to the GeoIP cache file at <b>fname</b>. */
+static void
+geoip_table_save_cache(geoip_table_t *t, const char *fname,
+                       const char *digest)
+{
+  geoip_cache_header_t *hdr = (geoip_cache_header_t *)t->mem;
+  tor_assert(t->mem);
+  memcpy(hdr->digest, digest, DIGEST_LEN);
+  if (write_bytes_to_file(fname, t->mem, t->mem_len, 1) < 0) {
+    log_info(LD_GENERAL, "Unable to write GEOIP cache file %s.", fname);
+  }
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  geoip_table_t *t;
+  geoip_addr_t low_addr, high_addr;
+  country_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_intern_country(country);
+
+  if (tor_addr_family(low) == AF_INET)
+    t = geoip_ipv4_table;
+  else if (tor_addr_family(low) == AF_INET6)
+    t = geoip_ipv6_table;
+  else
+    return;
+  if (t->n_runs)
+    geoip_table_thaw(t);
+  geoip_addr_from_tor_addr(&low_addr, low);
+  geoip_addr_from_tor_addr(&high_addr, high);
+  geoip_table_add_pending(t, &low_addr, &high_addr, idx);
+}
+
 /** Add an entry to the GeoIP table indicated by <b>family</b>,
  * parsing it from <b>line</b>. The format is as for geoip_load_file(). */
 STATIC int
@@ -169,16 +690,15 @@ geoip_parse_entry(const char *line, sa_family_t family)
   if (!geoip_countries)
     init_geoip_countries();
   if (family == AF_INET) {
-    if (!geoip_ipv4_entries)
-      geoip_ipv4_entries = smartlist_new();
+    if (!geoip_ipv4_table)
+      geoip_ipv4_table = geoip_table_new(AF_INET);
   } else if (family == AF_INET6) {
-    if (!geoip_ipv6_entries)
-      geoip_ipv6_entries = smartlist_new();
+    if (!geoip_ipv6_table)
+      geoip_ipv6_table = geoip_table_new(AF_INET6);
   } else {
     log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
   }
-
   while (TOR_ISSPACE(*line))
     ++line;
   if (*line == '#')
@@ -226,64 +746,6 @@ geoip_parse_entry(const char *line, sa_family_t family)
   return -1;
 }
 
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_entries_(const void **_a, const void **_b)
-{
-  const geoip_ipv4_entry_t *a = *_a, *b = *_b;
-  if (a->ip_low < b->ip_low)
-    return -1;
-  else if (a->ip_low > b->ip_low)
-    return 1;
-  else
-    return 0;
-}
-
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_entries_(const void **_a, const void **_b)
-{
-  const geoip_ipv6_entry_t *a = *_a, *b = *_b;
-  return fast_memcmp(a->ip_low.s6_addr, b->ip_low.s6_addr,
-                     sizeof(struct in6_addr));
-}
-
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
-
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
-    return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
-}
-
 /** Set up a new list of geoip countries with no countries (yet) set in it,
  * except for the unknown country.
  */
@@ -323,12 +785,27 @@ init_geoip_countries(void)
 int
 geoip_load_file(sa_family_t family, const char *filename, int severity)
 {
-  FILE *f;
-  crypto_digest_t *geoip_digest_env = NULL;
+  return geoip_load_file_cached(family, filename, NULL, severity);
+}
+
+/** As geoip_load_file(), but if <b>cache_fname</b> is set, keep a binary
+ * copy of the database we build in the file <b>cache_fname</b>, and use
+ * that copy instead of parsing the GeoIP file whenever the GeoIP file has
+ * not changed since we made it. */
+int
+geoip_load_file_cached(sa_family_t family, const char *filename,
+                       const char *cache_fname, int severity)
+{
+  char *contents;
+  const char *cp;
+  struct stat st;
+  char digest[DIGEST_LEN];
+  geoip_table_t **tp;
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
-  if (!(f = tor_fopen_cloexec(filename, "r"))) {
+  contents = read_file_to_str(filename, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if (!contents) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.",
            filename);
     return -1;
@@ -336,47 +813,42 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   if (!geoip_countries)
     init_geoip_countries();
 
-  if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
-    geoip_ipv4_entries = smartlist_new();
-  } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
-    geoip_ipv6_entries = smartlist_new();
+  /* Remember file digests so that we can include it in our extra-info
+   * descriptors. */
+  crypto_digest(digest, contents, (size_t)st.st_size);
+  memcpy(family == AF_INET ? geoip_digest : geoip6_digest, digest,
+         DIGEST_LEN);
+
+  tp = (family == AF_INET) ? &geoip_ipv4_table : &geoip_ipv6_table;
+  geoip_table_free(*tp);
+  *tp = geoip_table_new(family);
+
+  if (cache_fname && geoip_table_load_cache(*tp, cache_fname, digest) == 0) {
+    log_notice(LD_GENERAL, "Loaded GEOIP %s file %s from cache %s.",
+               (family == AF_INET) ? "IPv4" : "IPv6", filename, cache_fname);
+    tor_free(contents);
+    return 0;
   }
-  geoip_digest_env = crypto_digest_new();
 
   log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
              (family == AF_INET) ? "IPv4" : "IPv6", filename);
-  while (!feof(f)) {
+  for (cp = contents; *cp; ) {
     char buf[512];
-    if (fgets(buf, (int)sizeof(buf), f) == NULL)
-      break;
-    crypto_digest_add_bytes(geoip_digest_env, buf, strlen(buf));
+    const char *eol = strchr(cp, '\n');
+    size_t len = eol ? (size_t)(eol - cp) + 1 : strlen(cp);
+    size_t n = MIN(len, sizeof(buf) - 1);
+    memcpy(buf, cp, n);
+    buf[n] = '\0';
     /* FFFF track full country name. */
     geoip_parse_entry(buf, family);
+    cp += len;
   }
   /*XXXX abort and return -1 if no entries/illformed?*/
-  fclose(f);
+  tor_free(contents);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
-  if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
-  } else {
-    /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
-  }
-  crypto_digest_free(geoip_digest_env);
+  geoip_table_build(*tp);
+  if (cache_fname)
+    geoip_table_save_cache(*tp, cache_fname, digest);
 
   return 0;
 }
@@ -390,12 +862,26 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
 STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  geoip_table_t *t = geoip_ipv4_table;
+  const uint32_t *start;
+  uint32_t lo, hi, b;
+
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  if (t->n_pending || !t->n_runs)
+    geoip_table_build(t);
+  start = t->start_hi;
+  b = ipaddr >> (32 - GEOIP_BUCKET_BITS);
+  lo = t->bucket[b];
+  hi = t->bucket[b + 1];
+  while (lo < hi) {
+    uint32_t mid = hi - (hi - lo) / 2;
+    if (start[mid] <= ipaddr)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return t->country_map[t->run_country[lo]];
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -406,13 +892,30 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 STATIC int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
+  geoip_table_t *t = geoip_ipv6_table;
+  const uint64_t *start_hi;
+  uint64_t a_hi, a_lo;
+  uint32_t lo, hi, b;
 
-  if (!geoip_ipv6_entries)
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  if (t->n_pending || !t->n_runs)
+    geoip_table_build(t);
+  start_hi = t->start_hi;
+  a_hi = tor_ntohll(get_uint64(addr->s6_addr));
+  a_lo = tor_ntohll(get_uint64(addr->s6_addr + 8));
+  b = (uint32_t)(a_hi >> (64 - GEOIP_BUCKET_BITS));
+  lo = t->bucket[b];
+  hi = t->bucket[b + 1];
+  while (lo < hi) {
+    uint32_t mid = hi - (hi - lo) / 2;
+    if (start_hi[mid] < a_hi ||
+        (start_hi[mid] == a_hi && t->start_lo[mid] <= a_lo))
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return t->country_map[t->run_country[lo]];
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -461,9 +964,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_table != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_table != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -489,20 +992,10 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_table_free(geoip_ipv4_table);
+  geoip_table_free(geoip_ipv6_table);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
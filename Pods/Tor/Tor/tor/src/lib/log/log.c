@@ -33,6 +33,7 @@
 #define LOG_PRIVATE
 #include "lib/log/log.h"
 #include "lib/log/log_sys.h"
+#include "lib/log/log_ring.h"
 #include "lib/version/git_revision.h"
 #include "lib/log/ratelim.h"
 #include "lib/lock/compat_mutex.h"
@@ -164,6 +165,20 @@ static size_t pending_startup_messages_len;
  * configured. */
 static int queue_startup_messages = 1;
 
+/** If asynchronous logging is on, the ring that takes messages for
+ * file-descriptor logs, to be written by some other thread.  Protected by
+ * log_mutex, except that consumers drain it without holding the lock. */
+static log_ring_t *async_ring = NULL;
+
+/** Function to call after we add a message to async_ring. */
+static log_async_wakeup_fn async_wakeup = NULL;
+
+/** How many messages have we dropped because async_ring was full? */
+static uint64_t async_n_dropped = 0;
+
+/** How many of those dropped messages haven't we reported yet? */
+static uint64_t async_n_unreported = 0;
+
 /** True iff __PRETTY_FUNCTION__ includes parenthesized arguments. */
 static int pretty_fn_has_parens = 0;
 
@@ -471,6 +486,35 @@ logfile_wants_message(const logfile_t *lf, int severity,
   return 1;
 }
 
+/** Hand the <b>msg_len</b>-byte message in <b>buf</b> for <b>lf</b> to the
+ * asynchronous log writer.  If we dropped any messages since the last one
+ * that got through, say so first.  Return 0 on success, and -1 if there was
+ * no room.  The caller must hold log_mutex. */
+static int
+logfile_deliver_async(const logfile_t *lf, const char *buf, size_t msg_len)
+{
+  if (async_n_unreported) {
+    char note[256];
+    /* Once the writer has fallen behind, give it a chance to catch up before
+     * we queue anything else: otherwise we would fill the ring with notes
+     * about single dropped messages. */
+    if (log_ring_used(async_ring) > LOG_RING_DEFAULT_SIZE / 2)
+      return -1;
+    size_t n = log_prefix_(note, sizeof(note), LOG_NOTICE);
+    tor_snprintf(note+n, sizeof(note)-n,
+                 "Log writer fell behind; dropped %"PRIu64" messages.\n",
+                 async_n_unreported);
+    if (log_ring_add(async_ring, lf->fd, note, strlen(note)) < 0)
+      return -1;
+    async_n_unreported = 0;
+  }
+  if (log_ring_add(async_ring, lf->fd, buf, msg_len) < 0)
+    return -1;
+  if (async_wakeup)
+    async_wakeup();
+  return 0;
+}
+
 /** Send a message to <b>lf</b>.  The full message, with time prefix and
  * severity, is in <b>buf</b>.  The message itself is in
  * <b>msg_after_prefix</b>.  If <b>callbacks_deferred</b> points to true, then
@@ -518,6 +562,17 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
       lf->callback(severity, domain, msg_after_prefix);
     }
   } else {
+    if (async_ring) {
+      if (logfile_deliver_async(lf, buf, msg_len) == 0)
+        return;
+      /* The writer has fallen behind.  Drop debug and info messages rather
+       * than wait for it; anything more severe, we write ourselves. */
+      if (severity > LOG_NOTICE) {
+        ++async_n_dropped;
+        ++async_n_unreported;
+        return;
+      }
+    }
     if (write_all_to_fd_minimal(lf->fd, buf, msg_len) < 0) { /* error */
       /* don't log the error! mark this log entry to be blown away, and
        * continue. */
@@ -790,6 +845,9 @@ logs_free_all(void)
 void
 logs_flush_sigsafe(void)
 {
+  /* Write out whatever the asynchronous writer hasn't gotten to yet. */
+  if (async_ring)
+    log_ring_drain_sigsafe(async_ring);
   /* If we don't have fsync() in unistd.h, we can't flush the logs. */
 #ifdef HAVE_FSYNC
   logfile_t *victim, *next;
@@ -850,6 +908,9 @@ static void
 close_log(logfile_t *victim)
 {
   if (victim->needs_close) {
+    /* Don't close the fd under any messages still waiting for it. */
+    if (async_ring)
+      log_ring_drain(async_ring);
     close_log_sigsafe(victim);
   } else if (victim->is_syslog) {
 #ifdef HAVE_SYSLOG_H
@@ -969,6 +1030,80 @@ logs_set_pending_callback_callback(pending_callback_callback cb)
   pending_cb_cb = cb;
 }
 
+/**
+ * Turn asynchronous logging on or off, depending on <b>enabled</b>.
+ *
+ * While it is on, messages for file and stream logs go into a bounded ring
+ * instead of being written by the thread that logs them, and <b>wakeup</b>
+ * (if not NULL) is called after each one.  Someone else must then call
+ * logs_async_drain() to write them, typically from a dedicated thread after
+ * <b>wakeup</b> says there is work.  If the ring is full, we drop debug and
+ * info messages, and write anything more severe ourselves.
+ *
+ * Turning asynchronous logging off writes out anything still queued.  Only
+ * do so once nothing else will call logs_async_drain().
+ *
+ * Like the pending-callback callback, <b>wakeup</b> can be invoked from any
+ * thread, is called with the log lock held, and must not log.
+ *
+ * Return 0 on success, and -1 if this platform can't log asynchronously.
+ */
+int
+logs_set_async(int enabled, log_async_wakeup_fn wakeup)
+{
+  int r = 0;
+  LOCK_LOGS();
+  if (enabled) {
+    if (!async_ring)
+      async_ring = log_ring_new(LOG_RING_DEFAULT_SIZE);
+    if (async_ring)
+      async_wakeup = wakeup;
+    else
+      r = -1;
+  } else if (async_ring) {
+    log_ring_drain(async_ring);
+    log_ring_free(async_ring);
+    async_wakeup = NULL;
+  }
+  UNLOCK_LOGS();
+  return r;
+}
+
+/**
+ * Write out every message waiting for the asynchronous log writer, and
+ * return how many we wrote.  Doesn't take the log lock.  Only call this while
+ * asynchronous logging is on.
+ */
+int
+logs_async_drain(void)
+{
+  raw_assert(async_ring);
+  return log_ring_drain(async_ring);
+}
+
+/**
+ * Return true iff no messages are waiting for the asynchronous log writer.
+ */
+int
+logs_async_is_idle(void)
+{
+  return !async_ring || log_ring_is_empty(async_ring);
+}
+
+/**
+ * Return the number of messages that we have dropped because the
+ * asynchronous log writer couldn't keep up.
+ */
+uint64_t
+logs_get_n_async_dropped(void)
+{
+  uint64_t n;
+  LOCK_LOGS();
+  n = async_n_dropped;
+  UNLOCK_LOGS();
+  return n;
+}
+
 /**
  * Add a log handler to send messages in <b>severity</b>
  * to the function <b>cb</b>.
@@ -1456,6 +1591,8 @@ void
 truncate_logs(void)
 {
   logfile_t *lf;
+  if (async_ring)
+    log_ring_drain(async_ring);
   for (lf = logfiles; lf; lf = lf->next) {
     if (lf->fd >= 0) {
       tor_ftruncate(lf->fd);
@@ -178,6 +178,11 @@ int add_syslog_log(const log_severity_list_t *severity,
 int add_callback_log(const log_severity_list_t *severity, log_callback cb);
 typedef void (*pending_callback_callback)(void);
 void logs_set_pending_callback_callback(pending_callback_callback cb);
+typedef void (*log_async_wakeup_fn)(void);
+int logs_set_async(int enabled, log_async_wakeup_fn wakeup);
+int logs_async_drain(void);
+int logs_async_is_idle(void);
+uint64_t logs_get_n_async_dropped(void);
 void logs_set_domain_logging(int enabled);
 int get_min_log_level(void);
 void switch_logs_debug(void);
@@ -0,0 +1,292 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file log_ring.c
+ * \brief A lock-free ring of log messages for a dedicated writer thread.
+ *
+ * When asynchronous logging is on, log.c copies each message bound for a
+ * file descriptor into a log_ring_t instead of calling write() itself.  Every
+ * producer already holds log_mutex, and consumers take the ring's drain lock,
+ * so a ring only ever has one producer and one consumer at a time.  That lets
+ * the two ends share it without any lock between them: the producer
+ * publishes records by advancing <b>head</b>, and the consumer gives space
+ * back by advancing <b>tail</b>.  The producer never waits: when the ring is
+ * full, log_ring_add() fails and the caller decides what to do.
+ *
+ * Each record is a log_ring_hdr_t followed by the message, padded to a
+ * multiple of the header size.  Records never wrap around the end of the
+ * buffer: when one doesn't fit, we fill the rest of the buffer with a padding
+ * record and start again from the beginning.
+ *
+ * Nothing here may log.
+ **/
+
+#include "orconfig.h"
+#include <string.h>
+
+#include "lib/log/log_ring.h"
+#include "lib/err/torerr.h"
+#include "lib/fdio/fdio.h"
+#include "lib/lock/compat_mutex.h"
+#include "lib/malloc/malloc.h"
+
+#if defined(HAVE_STDATOMIC_H) && defined(STDATOMIC_WORKS)
+#define LOG_RING_SUPPORTED
+#include <stdatomic.h>
+#endif
+
+#ifdef LOG_RING_SUPPORTED
+
+/** Header in front of every record in a log_ring_t. */
+typedef struct log_ring_hdr_t {
+  /** Length of the message after this header, not counting padding. */
+  uint32_t len;
+  /** File descriptor to write the message to, or -1 for padding. */
+  int32_t fd;
+} log_ring_hdr_t;
+
+/** Round <b>n</b> up to a multiple of the record header size. */
+#define LOG_RING_PAD(n) \
+  (((n) + sizeof(log_ring_hdr_t) - 1) & ~(sizeof(log_ring_hdr_t) - 1))
+
+/** Largest number of bytes that log_ring_drain() passes to one write();
+ * also the longest message that we accept. */
+#define LOG_RING_BATCH_SIZE (64*1024)
+
+struct log_ring_t {
+  /** Size of <b>buf</b>; a power of two. */
+  size_t size;
+  /** Messages waiting to be written. */
+  char *buf;
+  /** Position just after the last record that the producer has published.
+   * Positions count bytes since the ring was created, and wrap around; the
+   * matching offset in <b>buf</b> is pos & (size-1). */
+  atomic_size_t head;
+  /** Position of the first record that no consumer has taken yet. */
+  atomic_size_t tail;
+  /** Held by whichever thread is draining the ring. */
+  tor_mutex_t drain_lock;
+  /** Messages to one file descriptor that log_ring_drain() is collecting
+   * for a single write().  Protected by drain_lock. */
+  char batch[LOG_RING_BATCH_SIZE];
+};
+
+/** Return a new empty ring holding <b>size</b> bytes of records, or NULL if
+ * this platform can't support one.  <b>size</b> must be a power of two. */
+log_ring_t *
+log_ring_new(size_t size)
+{
+  raw_assert(size >= 2*LOG_RING_BATCH_SIZE);
+  raw_assert((size & (size - 1)) == 0);
+
+  log_ring_t *ring = tor_malloc_zero(sizeof(log_ring_t));
+  ring->size = size;
+  ring->buf = tor_malloc(size);
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  tor_mutex_init_nonrecursive(&ring->drain_lock);
+  return ring;
+}
+
+/** Release all storage held by <b>ring</b>.  Any messages still in it are
+ * lost: drain it first. */
+void
+log_ring_free_(log_ring_t *ring)
+{
+  if (!ring)
+    return;
+  tor_mutex_uninit(&ring->drain_lock);
+  tor_free(ring->buf);
+  tor_free(ring);
+}
+
+/** Append the <b>len</b>-byte message at <b>msg</b>, to be written to
+ * <b>fd</b>, to <b>ring</b>.  Return 0 on success, and -1 if there is no room
+ * for it.  The caller must hold log_mutex.  Never blocks. */
+int
+log_ring_add(log_ring_t *ring, int fd, const char *msg, size_t len)
+{
+  const size_t mask = ring->size - 1;
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  const size_t need = sizeof(log_ring_hdr_t) + LOG_RING_PAD(len);
+  const size_t to_end = ring->size - (head & mask);
+  const size_t skip = (need > to_end) ? to_end : 0;
+  log_ring_hdr_t hdr;
+  size_t pos = head;
+
+  raw_assert(fd >= 0);
+  if (len > LOG_RING_BATCH_SIZE || skip + need > ring->size - (head - tail))
+    return -1;
+
+  if (skip) {
+    /* to_end is a nonzero multiple of the header size, so it always has room
+     * for the padding record's header. */
+    hdr.len = (uint32_t)(skip - sizeof(hdr));
+    hdr.fd = -1;
+    memcpy(ring->buf + (pos & mask), &hdr, sizeof(hdr));
+    pos += skip;
+  }
+  hdr.len = (uint32_t)len;
+  hdr.fd = fd;
+  memcpy(ring->buf + (pos & mask), &hdr, sizeof(hdr));
+  memcpy(ring->buf + (pos & mask) + sizeof(hdr), msg, len);
+  pos += need;
+
+  /* Sequentially consistent, so that a consumer about to go to sleep either
+   * sees this record in log_ring_is_empty(), or is seen to be asleep by the
+   * wakeup function that our caller runs next. */
+  atomic_store(&ring->head, pos);
+  return 0;
+}
+
+/** Return true iff every message added to <b>ring</b> has been taken by a
+ * consumer. */
+int
+log_ring_is_empty(const log_ring_t *ring)
+{
+  return atomic_load(&ring->head) ==
+    atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/** Return the number of bytes of <b>ring</b> that hold records no consumer
+ * has taken yet. */
+size_t
+log_ring_used(const log_ring_t *ring)
+{
+  return atomic_load_explicit(&ring->head, memory_order_relaxed) -
+    atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/** Write <b>len</b> bytes at <b>buf</b> to <b>fd</b>.  There is nobody to
+ * tell if this fails: the next message will just try again. */
+static void
+log_ring_write(int fd, const char *buf, size_t len)
+{
+  (void)write_all_to_fd_minimal(fd, buf, len);
+}
+
+/** Write every message in <b>ring</b> to its file descriptor, combining
+ * consecutive messages to the same descriptor into one write().  Keep going
+ * until the ring is empty, and return the number of messages written.  Safe
+ * to call from any thread, but not from a signal handler. */
+int
+log_ring_drain(log_ring_t *ring)
+{
+  const size_t mask = ring->size - 1;
+  size_t head, tail, batch_len = 0;
+  int batch_fd = -1, n = 0;
+
+  tor_mutex_acquire(&ring->drain_lock);
+  tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (tail !=
+         (head = atomic_load_explicit(&ring->head, memory_order_acquire))) {
+    while (tail != head) {
+      const char *rec = ring->buf + (tail & mask);
+      log_ring_hdr_t hdr;
+      memcpy(&hdr, rec, sizeof(hdr));
+      if (hdr.fd >= 0) {
+        if (batch_len && (hdr.fd != batch_fd ||
+                          batch_len + hdr.len > LOG_RING_BATCH_SIZE)) {
+          log_ring_write(batch_fd, ring->batch, batch_len);
+          batch_len = 0;
+        }
+        memcpy(ring->batch + batch_len, rec + sizeof(hdr), hdr.len);
+        batch_len += hdr.len;
+        batch_fd = hdr.fd;
+        ++n;
+      }
+      tail += sizeof(hdr) + LOG_RING_PAD(hdr.len);
+    }
+    /* Everything up to here is copied out: let the producer reuse the space
+     * while we wait for the disk. */
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    if (batch_len) {
+      log_ring_write(batch_fd, ring->batch, batch_len);
+      batch_len = 0;
+    }
+  }
+  tor_mutex_release(&ring->drain_lock);
+
+  return n;
+}
+
+/** Write every message in <b>ring</b> to its file descriptor, without
+ * locking or batching.  This function is safe to call from a signal handler.
+ * If another thread is draining the ring at the same time, some messages may
+ * be written twice: we only do this when we are about to crash. */
+void
+log_ring_drain_sigsafe(log_ring_t *ring)
+{
+  const size_t mask = ring->size - 1;
+  size_t tail = atomic_load(&ring->tail);
+  const size_t head = atomic_load(&ring->head);
+
+  while (tail != head) {
+    const char *rec = ring->buf + (tail & mask);
+    log_ring_hdr_t hdr;
+    memcpy(&hdr, rec, sizeof(hdr));
+    if (hdr.fd >= 0)
+      log_ring_write(hdr.fd, rec + sizeof(hdr), hdr.len);
+    tail += sizeof(hdr) + LOG_RING_PAD(hdr.len);
+  }
+  atomic_store(&ring->tail, tail);
+}
+
+#else /* !defined(LOG_RING_SUPPORTED) */
+
+/* Without working atomics, we can't share a ring between threads without a
+ * lock; asynchronous logging is unavailable. */
+
+log_ring_t *
+log_ring_new(size_t size)
+{
+  (void)size;
+  return NULL;
+}
+
+void
+log_ring_free_(log_ring_t *ring)
+{
+  (void)ring;
+}
+
+int
+log_ring_add(log_ring_t *ring, int fd, const char *msg, size_t len)
+{
+  (void)ring;
+  (void)fd;
+  (void)msg;
+  (void)len;
+  return -1;
+}
+
+int
+log_ring_is_empty(const log_ring_t *ring)
+{
+  (void)ring;
+  return 1;
+}
+
+size_t
+log_ring_used(const log_ring_t *ring)
+{
+  (void)ring;
+  return 0;
+}
+
+int
+log_ring_drain(log_ring_t *ring)
+{
+  (void)ring;
+  return 0;
+}
+
+void
+log_ring_drain_sigsafe(log_ring_t *ring)
+{
+  (void)ring;
+}
+
+#endif /* defined(LOG_RING_SUPPORTED) */
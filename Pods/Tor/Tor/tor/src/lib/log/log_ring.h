@@ -0,0 +1,34 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file log_ring.h
+ * \brief Header for log_ring.c
+ **/
+
+#ifndef TOR_LOG_RING_H
+#define TOR_LOG_RING_H
+
+#include <stddef.h>
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+
+/** A bounded ring of log messages waiting to be written to their file
+ * descriptors by another thread. */
+typedef struct log_ring_t log_ring_t;
+
+/** Default size of a log_ring_t, in bytes. */
+#define LOG_RING_DEFAULT_SIZE (1<<20)
+
+log_ring_t *log_ring_new(size_t size);
+void log_ring_free_(log_ring_t *ring);
+#define log_ring_free(ring) \
+  FREE_AND_NULL(log_ring_t, log_ring_free_, (ring))
+
+int log_ring_add(log_ring_t *ring, int fd, const char *msg, size_t len);
+int log_ring_is_empty(const log_ring_t *ring);
+size_t log_ring_used(const log_ring_t *ring);
+int log_ring_drain(log_ring_t *ring);
+void log_ring_drain_sigsafe(log_ring_t *ring);
+
+#endif /* !defined(TOR_LOG_RING_H) */
@@ -538,7 +538,9 @@ tor_addr_to_PTR_name(char *out, size_t outlen,
  *  If 'flags & TAPMP_EXTENDED_STAR' and 'flags & TAPMP_STAR_IPV6_ONLY' are
  *  both true, then the wildcard address '*' yields an IPv6 wildcard.
  *
- * TAPMP_STAR_IPV4_ONLY and TAPMP_STAR_IPV6_ONLY are mutually exclusive. */
+ * TAPMP_STAR_IPV4_ONLY and TAPMP_STAR_IPV6_ONLY are mutually exclusive.
+ *
+ * This function is reentrant, and may be called from any thread. */
 int
 tor_addr_parse_mask_ports(const char *s,
                           unsigned flags,
@@ -547,6 +549,7 @@ tor_addr_parse_mask_ports(const char *s,
                           uint16_t *port_min_out, uint16_t *port_max_out)
 {
   char *base = NULL, *address, *mask = NULL, *port = NULL, *rbracket = NULL;
+  char *esc = NULL;
   char *endptr;
   int any_flag=0, v4map=0;
   sa_family_t family;
@@ -565,7 +568,8 @@ tor_addr_parse_mask_ports(const char *s,
 #define MAX_ADDRESS_LENGTH (TOR_ADDR_BUF_LEN+2+(1+INET_NTOA_BUF_LEN)+12+1)
 
   if (strlen(s) > MAX_ADDRESS_LENGTH) {
-    log_warn(LD_GENERAL, "Impossibly long IP %s; rejecting", escaped(s));
+    esc = esc_for_log(s);
+    log_warn(LD_GENERAL, "Impossibly long IP %s; rejecting", esc);
     goto err;
   }
   base = tor_strdup(s);
@@ -641,8 +645,9 @@ tor_addr_parse_mask_ports(const char *s,
     family = AF_INET;
     tor_addr_from_in(addr_out, &in_tmp);
   } else {
+    esc = esc_for_log(address);
     log_warn(LD_GENERAL, "Malformed IP %s in address pattern; rejecting.",
-             escaped(address));
+             esc);
     goto err;
   }
 
@@ -667,15 +672,17 @@ tor_addr_parse_mask_ports(const char *s,
         if (tor_inet_pton(AF_INET, mask, &v4mask) > 0) {
           bits = addr_mask_get_bits(ntohl(v4mask.s_addr));
           if (bits < 0) {
+            esc = esc_for_log(mask);
             log_warn(LD_GENERAL,
                      "IPv4-style mask %s is not a prefix address; rejecting.",
-                     escaped(mask));
+                     esc);
             goto err;
           }
         } else { /* Not IPv4; we don't do address-style IPv6 masks. */
+          esc = esc_for_log(s);
           log_warn(LD_GENERAL,
                    "Malformed mask on address range %s; rejecting.",
-                   escaped(s));
+                   esc);
           goto err;
         }
       }
@@ -705,8 +712,9 @@ tor_addr_parse_mask_ports(const char *s,
     *maskbits_out = (maskbits_t) bits;
   } else {
     if (mask) {
+      esc = esc_for_log(s);
       log_warn(LD_GENERAL,
-               "Unexpected mask in address %s; rejecting", escaped(s));
+               "Unexpected mask in address %s; rejecting", esc);
       goto err;
     }
   }
@@ -728,8 +736,9 @@ tor_addr_parse_mask_ports(const char *s,
     }
   } else {
     if (port) {
+      esc = esc_for_log(s);
       log_warn(LD_GENERAL,
-               "Unexpected ports in address %s; rejecting", escaped(s));
+               "Unexpected ports in address %s; rejecting", esc);
       goto err;
     }
   }
@@ -737,6 +746,7 @@ tor_addr_parse_mask_ports(const char *s,
   tor_free(base);
   return tor_addr_family(addr_out);
  err:
+  tor_free(esc);
   tor_free(base);
   return -1;
 }
@@ -2033,9 +2043,12 @@ parse_port_range(const char *port, uint16_t *port_min_out,
 
   return 0;
  malformed_port:
-  log_warn(LD_GENERAL,
-           "Malformed port %s on address range; rejecting.",
-           escaped(port));
+  {
+    char *esc = esc_for_log(port);
+    log_warn(LD_GENERAL,
+             "Malformed port %s on address range; rejecting.", esc);
+    tor_free(esc);
+  }
   return -1;
 }
 
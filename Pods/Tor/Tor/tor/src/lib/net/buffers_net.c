@@ -25,6 +25,26 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+/** Defined if we can use readv() and writev() to move data between a buffer
+ * and a socket or pipe several chunks at a time. */
+#define USE_BUF_IOVECS
+#endif
+
+/** Largest number of chunks that we flush with a single call to writev().
+ * POSIX guarantees that IOV_MAX is at least this large. */
+#define BUF_MAX_IOVECS 16
+
+/** Number of read and write system calls we have made on buffers. */
+static uint64_t n_read_syscalls = 0;
+static uint64_t n_write_syscalls = 0;
+/** Number of bytes that those system calls have read or written. */
+static uint64_t n_bytes_read = 0;
+static uint64_t n_bytes_written = 0;
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -52,6 +72,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
   else
     read_result = read(fd, CHUNK_WRITE_PTR(chunk), at_most);
+  ++n_read_syscalls;
 
   if (read_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -74,12 +95,77 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   } else { /* actually got bytes. */
     buf->datalen += read_result;
     chunk->datalen += read_result;
+    n_bytes_read += read_result;
+    log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+              (int)buf->datalen);
+    tor_assert(read_result <= BUF_MAX_LEN);
+    return (int)read_result;
+  }
+}
+
+#ifdef USE_BUF_IOVECS
+/** As read_to_chunk(), but read up to <b>at_most</b> bytes into the
+ * remaining space of the tail chunk of <b>buf</b> and into a new chunk after
+ * it, using a single call to readv().  The caller must make sure that the
+ * tail chunk has less than <b>at_most</b> bytes of space left. */
+static int
+read_to_chunks_iov(buf_t *buf, tor_socket_t fd, size_t at_most,
+                   int *reached_eof, int *error)
+{
+  struct iovec iov[2];
+  chunk_t *old_tail = buf->tail, *new_tail;
+  size_t cap = CHUNK_REMAINING_CAPACITY(old_tail);
+  ssize_t read_result;
+  int e = 0;
+
+  tor_assert(cap < at_most);
+
+  new_tail = buf_add_chunk_with_capacity(buf, at_most - cap, 1);
+  iov[0].iov_base = CHUNK_WRITE_PTR(old_tail);
+  iov[0].iov_len = cap;
+  iov[1].iov_base = CHUNK_WRITE_PTR(new_tail);
+  iov[1].iov_len = at_most - cap;
+  if (iov[1].iov_len > new_tail->memlen)
+    iov[1].iov_len = new_tail->memlen;
+
+  read_result = readv(fd, iov, 2);
+  /* Save the error before buf_free_empty_tail_chunk() can clobber it. */
+  if (read_result < 0)
+    e = tor_socket_errno(fd);
+  ++n_read_syscalls;
+
+  if (read_result > (ssize_t)cap) {
+    old_tail->datalen += cap;
+    new_tail->datalen += read_result - cap;
+  } else {
+    /* We didn't need the new chunk after all; don't leave it empty on the
+     * buffer, since then we would never fill the rest of the old one. */
+    buf_free_empty_tail_chunk(buf, old_tail);
+    if (read_result > 0)
+      old_tail->datalen += read_result;
+  }
+
+  if (read_result < 0) {
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    buf->datalen += read_result;
+    n_bytes_read += read_result;
     log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
               (int)buf->datalen);
     tor_assert(read_result <= BUF_MAX_LEN);
     return (int)read_result;
   }
 }
+#endif /* defined(USE_BUF_IOVECS) */
 
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
@@ -111,6 +197,22 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
+#ifdef USE_BUF_IOVECS
+    if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN &&
+        CHUNK_REMAINING_CAPACITY(buf->tail) < readlen) {
+      /* Fill the tail chunk and a new one with a single system call. */
+      r = read_to_chunks_iov(buf, fd, readlen, reached_eof, socket_error);
+      check();
+      if (r < 0)
+        return r; /* Error */
+      tor_assert(total_read+r <= BUF_MAX_LEN);
+      total_read += r;
+      if ((size_t)r < readlen) { /* eof, block, or no more to read. */
+        break;
+      }
+      continue;
+    }
+#endif /* defined(USE_BUF_IOVECS) */
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
       if (readlen > chunk->memlen)
@@ -153,6 +255,7 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     write_result = tor_socket_send(fd, chunk->data, sz, 0);
   else
     write_result = write(fd, chunk->data, sz);
+  ++n_write_syscalls;
 
   if (write_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -168,11 +271,63 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     return 0;
   } else {
     buf_drain(buf, write_result);
+    n_bytes_written += write_result;
     tor_assert(write_result <= BUF_MAX_LEN);
     return (int)write_result;
   }
 }
 
+#ifdef USE_BUF_IOVECS
+/** Helper for buf_flush_to_socket(): try to write <b>sz</b> bytes from the
+ * first few chunks of <b>buf</b> onto file descriptor <b>fd</b>, with a
+ * single call to writev().  Set *<b>attempted_out</b> to the number of bytes
+ * we tried to write.  Return the number of bytes written on success, 0 on
+ * blocking, -1 on failure.
+ */
+static int
+flush_chunks_iov(tor_socket_t fd, buf_t *buf, size_t sz,
+                 size_t *attempted_out)
+{
+  struct iovec iov[BUF_MAX_IOVECS];
+  int n_iov = 0;
+  size_t total = 0;
+  ssize_t write_result;
+  chunk_t *chunk;
+
+  for (chunk = buf->head; chunk && n_iov < BUF_MAX_IOVECS && total < sz;
+       chunk = chunk->next) {
+    size_t len = chunk->datalen;
+    if (len > sz - total)
+      len = sz - total;
+    if (len == 0)
+      continue;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    total += len;
+  }
+  *attempted_out = total;
+
+  write_result = writev(fd, iov, n_iov);
+  ++n_write_syscalls;
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(fd);
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"write() would block, returning.");
+    return 0;
+  } else {
+    buf_drain(buf, write_result);
+    n_bytes_written += write_result;
+    tor_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_BUF_IOVECS) */
+
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, and remove the written bytes
  * from the buffer.  Return the number of bytes written on success,
@@ -196,6 +351,20 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef USE_BUF_IOVECS
+    if (buf->head->datalen < sz && buf->head->next) {
+      /* The data we want spans several chunks: write them all at once. */
+      r = flush_chunks_iov(fd, buf, sz, &flushlen0);
+      check();
+      if (r < 0)
+        return r;
+      flushed += r;
+      sz -= r;
+      if (r == 0 || (size_t)r < flushlen0) /* can't flush any more now. */
+        break;
+      continue;
+    }
+#endif /* defined(USE_BUF_IOVECS) */
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
@@ -214,6 +383,22 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   return (int)flushed;
 }
 
+/** Set *<b>n_read_calls_out</b> and *<b>n_write_calls_out</b> to the number
+ * of system calls we have made to read data into buffers and to write data
+ * from them, and *<b>n_read_bytes_out</b> and *<b>n_written_bytes_out</b> to
+ * the number of bytes that those calls have moved. */
+void
+buf_net_get_syscall_stats(uint64_t *n_read_calls_out,
+                          uint64_t *n_read_bytes_out,
+                          uint64_t *n_write_calls_out,
+                          uint64_t *n_written_bytes_out)
+{
+  *n_read_calls_out = n_read_syscalls;
+  *n_read_bytes_out = n_bytes_read;
+  *n_write_calls_out = n_write_syscalls;
+  *n_written_bytes_out = n_bytes_written;
+}
+
 /** Write data from <b>buf</b> to the socket <b>s</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
  * the number of bytes actually written, and remove the written bytes
@@ -14,6 +14,7 @@
 #define TOR_BUFFERS_NET_H
 
 #include <stddef.h>
+#include "lib/cc/torint.h"
 #include "lib/net/socket.h"
 
 struct buf_t;
@@ -29,4 +30,9 @@ int buf_read_from_pipe(struct buf_t *buf, int fd, size_t at_most,
 
 int buf_flush_to_pipe(struct buf_t *buf, int fd, size_t sz);
 
+void buf_net_get_syscall_stats(uint64_t *n_read_calls_out,
+                               uint64_t *n_read_bytes_out,
+                               uint64_t *n_write_calls_out,
+                               uint64_t *n_written_bytes_out);
+
 #endif /* !defined(TOR_BUFFERS_NET_H) */
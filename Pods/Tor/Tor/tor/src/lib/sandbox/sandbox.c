@@ -243,6 +243,13 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(prlimit64),
 #endif
     SCMP_SYS(read),
+    SCMP_SYS(readv),
+#ifdef __NR_io_uring_enter
+    /* Libevent's io_uring backend restricts its ring to poll requests before
+     * we install the filter, and we never allow io_uring_setup or
+     * io_uring_register, so this can't be used for anything else. */
+    SCMP_SYS(io_uring_enter),
+#endif
     SCMP_SYS(rt_sigreturn),
 #ifdef __NR_rseq
     SCMP_SYS(rseq),
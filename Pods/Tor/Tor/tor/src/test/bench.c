@@ -10,12 +10,19 @@
 
 #include "orconfig.h"
 
+#define CONTROL_EVENTS_PRIVATE
+
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/crypto/relay_crypto.h"
 
 #include "lib/intmath/weakrng.h"
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
 #include <openssl/evp.h>
@@ -24,25 +31,57 @@
 #include <openssl/obj_mac.h>
 #endif /* defined(ENABLE_OPENSSL) */
 
+#include "core/or/channel.h"
 #include "core/or/circuitlist.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/relay.h"
 #include "app/config/config.h"
+#include "app/main/log_writer.h"
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto_format.h"
+#include "lib/crypt_ops/crypto_rsa.h"
 #include "feature/dircommon/consdiff.h"
 #include "lib/compress/compress.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/time/compat_time.h"
 
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/origin_circuit_st.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "feature/control/control.h"
+#include "feature/control/control_connection_st.h"
+#include "feature/control/control_events.h"
+#include "feature/dircache/dirserv.h"
+#include "feature/dircommon/dir_connection_st.h"
+#include "feature/dircommon/directory.h"
 #include "feature/dirparse/microdesc_parse.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/signing.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/networkstatus_st.h"
 #include "feature/nodelist/microdesc.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/hs_common/replaycache.h"
+#include "feature/nodelist/routerstatus_st.h"
+#include "lib/geoip/geoip.h"
+#include "lib/fs/dir.h"
+#include "lib/fs/files.h"
+#include "lib/container/order.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -426,6 +465,126 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+/** A chained hash table laid out the way digestmap_t was before it moved to
+ * open addressing: one heap-allocated node per entry, hanging off a table of
+ * bucket pointers.  Used by bench_dmap() for comparison. */
+typedef struct chained_dmap_ent_t {
+  HT_ENTRY(chained_dmap_ent_t) node;
+  void *val;
+  char key[DIGEST_LEN];
+} chained_dmap_ent_t;
+
+static inline unsigned
+chained_dmap_ent_hash(const chained_dmap_ent_t *ent)
+{
+  return (unsigned) siphash24g(ent->key, DIGEST_LEN);
+}
+
+static inline int
+chained_dmap_ent_eq(const chained_dmap_ent_t *a, const chained_dmap_ent_t *b)
+{
+  return tor_memeq(a->key, b->key, DIGEST_LEN);
+}
+
+static HT_HEAD(chained_dmap, chained_dmap_ent_t) chained_dmap =
+  HT_INITIALIZER();
+HT_PROTOTYPE(chained_dmap, chained_dmap_ent_t, node, chained_dmap_ent_hash,
+             chained_dmap_ent_eq);
+HT_GENERATE2(chained_dmap, chained_dmap_ent_t, node, chained_dmap_ent_hash,
+             chained_dmap_ent_eq, 0.6, tor_reallocarray_, tor_free_);
+
+/** Compare digestmap_t against the chained table above when each holds
+ * <b>elts</b> random digests: report insertion and lookup times, and how
+ * much memory each uses per entry. */
+static void
+bench_dmap_vs_chained(int elts)
+{
+  char *keys = tor_malloc((size_t)elts * 2 * DIGEST_LEN);
+  char *misses = keys + (size_t)elts * DIGEST_LEN;
+  const int rounds = MAX(1, 2000000 / elts);
+  chained_dmap_ent_t search, **ents, *ent;
+  uint64_t start, end;
+  size_t chained_bytes, flat_bytes;
+  digestmap_t *dm = NULL;
+  int i, r, n = 0;
+
+  crypto_rand(keys, (size_t)elts * 2 * DIGEST_LEN);
+  ents = tor_calloc(elts, sizeof(chained_dmap_ent_t *));
+  printf("With %d entries:\n", elts);
+
+  reset_perftime();
+  start = perftime();
+  for (r = 0; r < rounds; ++r) {
+    digestmap_free(dm, NULL);
+    dm = digestmap_new();
+    for (i = 0; i < elts; ++i)
+      digestmap_set(dm, keys + i * DIGEST_LEN, (void*)1);
+  }
+  end = perftime();
+  printf("  open addressing insert: %.2f ns per element\n",
+         NANOCOUNT(start, end, rounds * elts));
+
+  start = perftime();
+  for (r = 0; r < rounds; ++r) {
+    if (r) {
+      HT_CLEAR(chained_dmap, &chained_dmap);
+      for (i = 0; i < elts; ++i)
+        tor_free(ents[i]);
+    }
+    for (i = 0; i < elts; ++i) {
+      ents[i] = tor_malloc_zero(sizeof(chained_dmap_ent_t));
+      memcpy(ents[i]->key, keys + i * DIGEST_LEN, DIGEST_LEN);
+      ents[i]->val = (void*)1;
+      HT_INSERT(chained_dmap, &chained_dmap, ents[i]);
+    }
+  }
+  end = perftime();
+  printf("  chained insert:         %.2f ns per element\n",
+         NANOCOUNT(start, end, rounds * elts));
+
+  start = perftime();
+  for (r = 0; r < rounds; ++r) {
+    for (i = 0; i < elts; ++i) {
+      n += digestmap_get(dm, keys + i * DIGEST_LEN) != NULL;
+      n += digestmap_get(dm, misses + i * DIGEST_LEN) != NULL;
+    }
+  }
+  end = perftime();
+  printf("  open addressing lookup: %.2f ns per element\n",
+         NANOCOUNT(start, end, rounds * elts * 2));
+
+  start = perftime();
+  for (r = 0; r < rounds; ++r) {
+    for (i = 0; i < elts; ++i) {
+      memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+      ent = HT_FIND(chained_dmap, &chained_dmap, &search);
+      n += ent != NULL;
+      memcpy(search.key, misses + i * DIGEST_LEN, DIGEST_LEN);
+      ent = HT_FIND(chained_dmap, &chained_dmap, &search);
+      n += ent != NULL;
+    }
+  }
+  end = perftime();
+  printf("  chained lookup:         %.2f ns per element\n",
+         NANOCOUNT(start, end, rounds * elts * 2));
+
+  /* The chained figure leaves out the allocator's own per-node overhead. */
+  flat_bytes = digestmap_mem_usage(dm);
+  chained_bytes = HT_MEM_USAGE(&chained_dmap) +
+    (size_t)elts * sizeof(chained_dmap_ent_t);
+  printf("  open addressing: %.1f bytes per entry; "
+         "chained: %.1f bytes per entry\n",
+         flat_bytes / (double)elts, chained_bytes / (double)elts);
+  printf("  Hits == %d\n", n);
+
+  HT_CLEAR(chained_dmap, &chained_dmap);
+  for (i = 0; i < elts; ++i)
+    tor_free(ents[i]);
+  tor_free(ents);
+  digestmap_free(dm, NULL);
+  tor_free(keys);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -495,6 +654,9 @@ bench_dmap(void)
   printf("False positive rate on digestset: %.2f%%\n",
          (fp/(double)fpostests)*100);
 
+  bench_dmap_vs_chained(elts);
+  bench_dmap_vs_chained(200000);
+
   digestmap_free(dm, NULL);
   digestset_free(ds);
   SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
@@ -617,6 +779,472 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+static void
+bench_cell_batch(void)
+{
+  const int iters = 1<<16;
+  const int max_batch = 64;
+  int i, j, batch;
+
+  /* benchmarks for batched cell crypto at relay. */
+  or_circuit_t *or_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  cell_t **cells = tor_calloc(max_batch, sizeof(cell_t *));
+  uint64_t start, end;
+
+  for (j = 0; j < max_batch; ++j) {
+    cells[j] = tor_malloc(sizeof(cell_t));
+    crypto_rand((char*)cells[j]->payload, sizeof(cells[j]->payload));
+  }
+
+  /* Mock-up or_circuit_t */
+  or_circ->base_.magic = OR_CIRCUIT_MAGIC;
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+
+  /* Initialize crypto */
+  char key1[CIPHER_KEY_LEN], key2[CIPHER_KEY_LEN];
+  crypto_rand(key1, sizeof(key1));
+  crypto_rand(key2, sizeof(key2));
+  or_circ->crypto.f_crypto = crypto_cipher_new(key1);
+  or_circ->crypto.b_crypto = crypto_cipher_new(key2);
+  or_circ->crypto.f_digest = crypto_digest_new();
+  or_circ->crypto.b_digest = crypto_digest_new();
+
+  reset_perftime();
+
+  for (batch = 1; batch <= max_batch; batch *= 2) {
+    start = perftime();
+    for (i = 0; i < iters; i += batch) {
+      relay_decrypt_cells(TO_CIRCUIT(or_circ), cells, batch,
+                          CELL_DIRECTION_OUT);
+      for (j = 0; j < batch; ++j) {
+        relay_cell_is_recognized(TO_CIRCUIT(or_circ), cells[j],
+                                 CELL_DIRECTION_OUT);
+      }
+    }
+    end = perftime();
+    printf("Outbound batch of %2d: %.2f ns per cell (%.0f cells/sec).\n",
+           batch, NANOCOUNT(start,end,iters),
+           1e9 / NANOCOUNT(start,end,iters));
+  }
+
+  for (batch = 1; batch <= max_batch; batch *= 2) {
+    start = perftime();
+    for (i = 0; i < iters; i += batch) {
+      relay_decrypt_cells(TO_CIRCUIT(or_circ), cells, batch,
+                          CELL_DIRECTION_IN);
+    }
+    end = perftime();
+    printf(" Inbound batch of %2d: %.2f ns per cell (%.0f cells/sec).\n",
+           batch, NANOCOUNT(start,end,iters),
+           1e9 / NANOCOUNT(start,end,iters));
+  }
+
+  relay_crypto_clear(&or_circ->crypto);
+  tor_free(or_circ);
+  for (j = 0; j < max_batch; ++j)
+    tor_free(cells[j]);
+  tor_free(cells);
+}
+
+/** Remove the first cell from <b>queue</b> and free it, the way a channel
+ * does once it has written the cell. */
+static inline void
+bench_cell_queue_pop_and_free(cell_queue_t *queue)
+{
+  packed_cell_t *pc = TOR_SIMPLEQ_FIRST(&queue->head);
+  TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
+  --queue->n;
+  packed_cell_free(pc);
+}
+
+static void
+bench_cell_queue(void)
+{
+  const int iters = 1<<20;
+  const int n_cells = 1000000;
+  const int n_queues = 1024;
+  const int depth = 64;
+  cell_queue_t *queues = tor_calloc(n_queues, sizeof(cell_queue_t));
+  cell_t *cell = tor_malloc_zero(sizeof(cell_t));
+  uint64_t start, end;
+  size_t alloc;
+  int i;
+
+  crypto_rand((char*)cell->payload, sizeof(cell->payload));
+  for (i = 0; i < n_queues; ++i)
+    cell_queue_init(&queues[i]);
+
+  reset_perftime();
+
+  /* Steady state: one queue that never gets longer than <b>depth</b>. */
+  for (i = 0; i < depth; ++i)
+    cell_queue_append_packed_copy(NULL, &queues[0], 0, cell, 1, 0);
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    cell_queue_append_packed_copy(NULL, &queues[0], 0, cell, 1, 0);
+    bench_cell_queue_pop_and_free(&queues[0]);
+  }
+  end = perftime();
+  printf("Enqueue+dequeue at depth %d: %.2f ns per cell\n",
+         depth, NANOCOUNT(start, end, iters));
+  cell_queue_clear(&queues[0]);
+
+  /* Fill up lots of queues, then drain them. */
+  start = perftime();
+  for (i = 0; i < n_cells; ++i) {
+    cell_queue_append_packed_copy(NULL, &queues[i % n_queues], 0, cell, 1, 0);
+  }
+  end = perftime();
+  alloc = cell_queues_get_total_allocation();
+  printf("Enqueue %d cells on %d queues: %.2f ns per cell\n",
+         n_cells, n_queues, NANOCOUNT(start, end, n_cells));
+  printf("Memory for %d queued cells: %"TOR_PRIuSZ" bytes "
+         "(%.1f bytes per cell)\n", n_cells,
+         alloc, ((double)alloc) / n_cells);
+
+  start = perftime();
+  for (i = 0; i < n_cells; ++i) {
+    bench_cell_queue_pop_and_free(&queues[i % n_queues]);
+  }
+  end = perftime();
+  printf("Dequeue %d cells from %d queues: %.2f ns per cell\n",
+         n_cells, n_queues, NANOCOUNT(start, end, n_cells));
+  printf("Idle cell pool memory after draining: %"TOR_PRIuSZ" bytes\n",
+         cell_pool_get_idle_allocation());
+
+  cell_pool_release_idle();
+  tor_free(queues);
+  tor_free(cell);
+}
+
+static void
+bench_cmux_ewma(void)
+{
+  const int n_circs = 10000;
+  const int iters = 1<<20;
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuit_t *circs = tor_calloc(n_circs, sizeof(circuit_t));
+  destroy_cell_queue_t *destroy_queue;
+  uint64_t start, end;
+  int i;
+
+  cmux_ewma_set_options(NULL, NULL);
+  circuitmux_set_policy(cmux, &ewma_policy);
+
+  /* Give every circuit more cells than we'll ever send, and a random amount
+   * of recent traffic so that they don't all start with the same count. */
+  chan->global_identifier = 1;
+  for (i = 0; i < n_circs; ++i) {
+    circs[i].n_chan = chan;
+    circs[i].n_circ_id = i + 1;
+    circuitmux_attach_circuit(cmux, &circs[i], CELL_DIRECTION_OUT);
+    circuitmux_set_num_cells(cmux, &circs[i], 1u<<30);
+    circuitmux_notify_xmit_cells(cmux, &circs[i],
+                                 1 + crypto_rand_int(1000));
+  }
+  tor_assert(circuitmux_num_active_circuits(cmux) == (unsigned) n_circs);
+
+  reset_perftime();
+
+  /* What the channel does for every cell it flushes. */
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    circuit_t *circ = circuitmux_get_first_active_circuit(cmux,
+                                                          &destroy_queue);
+    circuitmux_notify_xmit_cells(cmux, circ, 1);
+  }
+  end = perftime();
+  printf("Pick and update the next of %d active circuits: %.2f ns\n",
+         n_circs, NANOCOUNT(start, end, iters));
+
+  for (i = 0; i < n_circs; ++i)
+    circuitmux_detach_circuit(cmux, &circs[i]);
+  circuitmux_free(cmux);
+  tor_free(circs);
+  tor_free(chan);
+}
+
+/** A batch of cells on one mock circuit, for bench_cell_threads. */
+typedef struct bench_crypt_job_t {
+  crypto_cipher_t *cipher;
+  cell_t **cells;
+  int n_cells;
+} bench_crypt_job_t;
+
+/** How many bench_crypt_job_t replies we have received so far. */
+static int bench_crypt_n_replies = 0;
+
+static void *
+bench_crypt_state_new(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(1);
+}
+
+static void
+bench_crypt_state_free(void *state)
+{
+  tor_free(state);
+}
+
+static workqueue_reply_t
+bench_crypt_threadfn(void *state, void *arg)
+{
+  bench_crypt_job_t *job = arg;
+  (void)state;
+  relay_crypt_payloads(job->cipher, job->cells, job->n_cells);
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_crypt_replyfn(void *arg)
+{
+  (void)arg;
+  ++bench_crypt_n_replies;
+}
+
+static void
+bench_cell_threads(void)
+{
+  const int n_circs = 64;
+  const int batch = 16;
+  const int rounds = 1<<8;
+  const int thread_counts[] = { 1, 2, 4, 8 };
+  bench_crypt_job_t *jobs = tor_calloc(n_circs, sizeof(bench_crypt_job_t));
+  unsigned t;
+  int i, j, round;
+  uint64_t start, end;
+
+  /* Each mock circuit gets its own cipher and batch of cells, and has at
+   * most one batch on the threadpool at a time, as with OffloadRelayCrypto.
+   */
+  for (i = 0; i < n_circs; ++i) {
+    char key[CIPHER_KEY_LEN];
+    crypto_rand(key, sizeof(key));
+    jobs[i].cipher = crypto_cipher_new(key);
+    jobs[i].n_cells = batch;
+    jobs[i].cells = tor_calloc(batch, sizeof(cell_t *));
+    for (j = 0; j < batch; ++j) {
+      jobs[i].cells[j] = tor_malloc(sizeof(cell_t));
+      crypto_rand((char*)jobs[i].cells[j]->payload, CELL_PAYLOAD_SIZE);
+    }
+  }
+
+  reset_perftime();
+
+  for (t = 0; t < ARRAY_LENGTH(thread_counts); ++t) {
+    replyqueue_t *rq = replyqueue_new(0);
+    threadpool_t *tp = threadpool_new(thread_counts[t], rq,
+                                      bench_crypt_state_new,
+                                      bench_crypt_state_free, NULL);
+    tor_assert(tp);
+
+    start = perftime();
+    for (round = 0; round < rounds; ++round) {
+      bench_crypt_n_replies = 0;
+      for (i = 0; i < n_circs; ++i) {
+        threadpool_queue_work_priority(tp, WQ_PRI_HIGH,
+                                       bench_crypt_threadfn,
+                                       bench_crypt_replyfn, &jobs[i]);
+      }
+      while (bench_crypt_n_replies < n_circs)
+        replyqueue_process(rq);
+    }
+    end = perftime();
+
+    printf("%d worker thread(s): %.2f ns per cell (%.0f cells/sec).\n",
+           thread_counts[t],
+           NANOCOUNT(start, end, rounds * n_circs * batch),
+           1e9 / NANOCOUNT(start, end, rounds * n_circs * batch));
+    /* We can't stop the worker threads, so we leave this pool's threads
+     * idle rather than freeing it out from under them. */
+  }
+
+  for (i = 0; i < n_circs; ++i) {
+    crypto_cipher_free(jobs[i].cipher);
+    for (j = 0; j < batch; ++j)
+      tor_free(jobs[i].cells[j]);
+    tor_free(jobs[i].cells);
+  }
+  tor_free(jobs);
+}
+
+/** An empty piece of work for bench_workqueue, and how long it took to get
+ * a reply for it. */
+typedef struct bench_wq_item_t {
+  monotime_t queued_at;
+  int64_t latency_usec;
+} bench_wq_item_t;
+
+/** How many bench_wq_item_t replies we have received so far. */
+static int bench_wq_n_replies = 0;
+
+static workqueue_reply_t
+bench_wq_threadfn(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_wq_replyfn(void *arg)
+{
+  bench_wq_item_t *item = arg;
+  monotime_t now;
+  monotime_get(&now);
+  item->latency_usec = monotime_diff_usec(&item->queued_at, &now);
+  ++bench_wq_n_replies;
+}
+
+/** Measure enqueue-to-reply latency for trivial work items, when the main
+ * thread keeps every worker thread busy. */
+static void
+bench_workqueue(void)
+{
+  const int n_items = 1<<10;
+  const int rounds = 1<<6;
+  const int thread_counts[] = { 1, 2, 4, 8 };
+  bench_wq_item_t *items = tor_calloc(n_items, sizeof(bench_wq_item_t));
+  unsigned t;
+  int i, round;
+
+  for (t = 0; t < ARRAY_LENGTH(thread_counts); ++t) {
+    replyqueue_t *rq = replyqueue_new(0);
+    threadpool_t *tp = threadpool_new(thread_counts[t], rq,
+                                      bench_crypt_state_new,
+                                      bench_crypt_state_free, NULL);
+    int64_t total = 0, max = 0, elapsed;
+    monotime_t start, end;
+    tor_assert(tp);
+
+    monotime_get(&start);
+    for (round = 0; round < rounds; ++round) {
+      bench_wq_n_replies = 0;
+      for (i = 0; i < n_items; ++i) {
+        monotime_get(&items[i].queued_at);
+        threadpool_queue_work_priority(tp, WQ_PRI_HIGH,
+                                       bench_wq_threadfn,
+                                       bench_wq_replyfn, &items[i]);
+      }
+      while (bench_wq_n_replies < n_items)
+        replyqueue_process(rq);
+      for (i = 0; i < n_items; ++i) {
+        total += items[i].latency_usec;
+        if (items[i].latency_usec > max)
+          max = items[i].latency_usec;
+      }
+    }
+    monotime_get(&end);
+    elapsed = monotime_diff_usec(&start, &end);
+
+    printf("%d worker thread(s): %.2f usec mean latency, %"PRId64" usec "
+           "max; %.2f usec per item.\n",
+           thread_counts[t],
+           ((double)total) / (rounds * n_items), max,
+           ((double)elapsed) / (rounds * n_items));
+    /* As in bench_cell_threads, we leave this pool's threads idle. */
+  }
+
+  tor_free(items);
+}
+
+/** A batch of ntor server handshakes for bench_onion_ntor_batch. */
+typedef struct bench_ntor_batch_t {
+  const uint8_t *onionskin;
+  const di_digest256_map_t *keymap;
+  const uint8_t *nodeid;
+  int n;
+} bench_ntor_batch_t;
+
+/** How many handshakes we have gotten replies for so far. */
+static int bench_ntor_n_done = 0;
+
+static workqueue_reply_t
+bench_ntor_batch_threadfn(void *state, void *arg)
+{
+  bench_ntor_batch_t *batch = arg;
+  int i;
+  (void)state;
+  for (i = 0; i < batch->n; ++i) {
+    uint8_t reply[NTOR_REPLY_LEN];
+    uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
+    onion_skin_ntor_server_handshake(batch->onionskin, batch->keymap, NULL,
+                                     batch->nodeid, reply,
+                                     key_out, sizeof(key_out));
+  }
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_ntor_batch_replyfn(void *arg)
+{
+  bench_ntor_batch_t *batch = arg;
+  bench_ntor_n_done += batch->n;
+  tor_free(batch);
+}
+
+/** Measure how many ntor server handshakes per second the cpuworker
+ * threadpool gets through when it handles them one per work item, and when
+ * it handles them in batches. */
+static void
+bench_onion_ntor_batch(void)
+{
+  const int n_handshakes = 1<<12;
+  const int batch_sizes[] = { 1, 4, 16 };
+  const int n_threads = 4;
+  curve25519_keypair_t keypair;
+  uint8_t os[NTOR_ONIONSKIN_LEN];
+  uint8_t nodeid[DIGEST_LEN];
+  ntor_handshake_state_t *state = NULL;
+  di_digest256_map_t *keymap = NULL;
+  replyqueue_t *rq;
+  threadpool_t *tp;
+  unsigned b;
+  int i;
+
+  curve25519_secret_key_generate(&keypair.seckey, 0);
+  curve25519_public_key_generate(&keypair.pubkey, &keypair.seckey);
+  dimap_add_entry(&keymap, keypair.pubkey.public_key, &keypair);
+  crypto_rand((char *)nodeid, sizeof(nodeid));
+  onion_skin_ntor_create(nodeid, &keypair.pubkey, &state, os);
+
+  rq = replyqueue_new(0);
+  tp = threadpool_new(n_threads, rq,
+                      bench_crypt_state_new, bench_crypt_state_free, NULL);
+  tor_assert(tp);
+
+  for (b = 0; b < ARRAY_LENGTH(batch_sizes); ++b) {
+    monotime_t start, end;
+    int64_t usec;
+
+    monotime_get(&start);
+    bench_ntor_n_done = 0;
+    for (i = 0; i < n_handshakes; i += batch_sizes[b]) {
+      bench_ntor_batch_t *batch = tor_malloc_zero(sizeof(*batch));
+      batch->onionskin = os;
+      batch->keymap = keymap;
+      batch->nodeid = nodeid;
+      batch->n = MIN(batch_sizes[b], n_handshakes - i);
+      threadpool_queue_work_priority(tp, WQ_PRI_HIGH,
+                                     bench_ntor_batch_threadfn,
+                                     bench_ntor_batch_replyfn, batch);
+    }
+    while (bench_ntor_n_done < n_handshakes)
+      replyqueue_process(rq);
+    monotime_get(&end);
+
+    usec = monotime_diff_usec(&start, &end);
+    printf("%d thread(s), batches of %2d: %.0f handshakes/sec.\n",
+           n_threads, batch_sizes[b], n_handshakes * 1e6 / usec);
+  }
+
+  /* As in bench_cell_threads, we leave the pool's threads idle. */
+  ntor_handshake_state_free(state);
+  dimap_free(keymap, NULL);
+}
+
 static void
 bench_dh(void)
 {
@@ -704,6 +1332,177 @@ bench_ecdh_p224(void)
 }
 #endif /* defined(ENABLE_OPENSSL) */
 
+/** Return a newly allocated networkstatus document of type <b>type</b>
+ * (a vote or a consensus) listing <b>n</b> synthetic relays, and signed by
+ * <b>sign_key</b>.  A vote also carries a key certificate binding
+ * <b>sign_key</b> to <b>id_key</b>, since we check vote signatures while
+ * parsing. */
+static char *
+bench_ns_make(networkstatus_type_t type, int n,
+              crypto_pk_t *id_key, crypto_pk_t *sign_key)
+{
+  const int is_vote = (type == NS_TYPE_VOTE);
+  smartlist_t *chunks = smartlist_new();
+  char id_hex[HEX_DIGEST_LEN+1], sk_hex[HEX_DIGEST_LEN+1];
+  char va[ISO_TIME_LEN+1], fu[ISO_TIME_LEN+1], vu[ISO_TIME_LEN+1];
+  char id_digest[DIGEST_LEN];
+  char *id_pem = NULL, *sk_pem = NULL, *doc, *sig;
+  size_t pem_len;
+  common_digests_t digests;
+  time_t now = time(NULL);
+  int i;
+
+  crypto_pk_get_fingerprint(id_key, id_hex, 0);
+  crypto_pk_get_fingerprint(sign_key, sk_hex, 0);
+  crypto_pk_get_digest(id_key, id_digest);
+  crypto_pk_write_public_key_to_string(id_key, &id_pem, &pem_len);
+  crypto_pk_write_public_key_to_string(sign_key, &sk_pem, &pem_len);
+  format_iso_time(va, now);
+  format_iso_time(fu, now + 3600);
+  format_iso_time(vu, now + 3*3600);
+
+  smartlist_add_asprintf(chunks,
+         "network-status-version 3\n"
+         "vote-status %s\n"
+         "%s\n"
+         "%s%s%s"
+         "valid-after %s\n"
+         "fresh-until %s\n"
+         "valid-until %s\n"
+         "voting-delay 300 300\n"
+         "client-versions 0.4.7.16,0.4.8.9,0.4.8.10\n"
+         "server-versions 0.4.7.16,0.4.8.9,0.4.8.10\n"
+         "known-flags Authority BadExit Exit Fast Guard HSDir MiddleOnly "
+         "Running Stable StaleDesc Sybil V2Dir Valid\n"
+         "params CircuitPriorityHalflifeMsec=30000 bwweightscale=10000 "
+         "cc_alg=2 circwindow=1000\n"
+         "dir-source bench %s 192.0.2.1 192.0.2.1 80 443\n"
+         "contact bench@example.com\n",
+         is_vote ? "vote" : "consensus",
+         is_vote ? "consensus-methods 28 29 30 31 32 33" :
+                   "consensus-method 32",
+         is_vote ? "published " : "", is_vote ? va : "",
+         is_vote ? "\n" : "",
+         va, fu, vu, id_hex);
+
+  if (is_vote) {
+    char *cert;
+    char digest[DIGEST_LEN];
+    char *crosscert = router_get_dirobj_signature(id_digest, DIGEST_LEN,
+                                                  sign_key);
+    tor_asprintf(&cert,
+                 "dir-key-certificate-version 3\n"
+                 "fingerprint %s\n"
+                 "dir-key-published %s\n"
+                 "dir-key-expires %s\n"
+                 "dir-identity-key\n%s"
+                 "dir-signing-key\n%s"
+                 "dir-key-crosscert\n%s"
+                 "dir-key-certification\n",
+                 id_hex, va, vu, id_pem, sk_pem, crosscert);
+    crypto_digest(digest, cert, strlen(cert));
+    smartlist_add(chunks, cert);
+    smartlist_add(chunks, router_get_dirobj_signature(digest, DIGEST_LEN,
+                                                      id_key));
+    tor_free(crosscert);
+  } else {
+    char vote_digest[DIGEST_LEN];
+    crypto_rand(vote_digest, sizeof(vote_digest));
+    smartlist_add_asprintf(chunks, "vote-digest %s\n",
+                           hex_str(vote_digest, DIGEST_LEN));
+  }
+
+  /* Entries must be sorted by identity digest, so we put the index of each
+   * relay at the front of its identity. */
+  for (i = 0; i < n; ++i) {
+    char id[DIGEST_LEN], d[DIGEST_LEN];
+    char id64[BASE64_DIGEST_LEN+1], d64[BASE64_DIGEST_LEN+1];
+    set_uint32(id, htonl(i));
+    crypto_rand(id + 4, sizeof(id) - 4);
+    crypto_rand(d, sizeof(d));
+    digest_to_base64(id64, id);
+    digest_to_base64(d64, d);
+    smartlist_add_asprintf(chunks,
+           "r relay%d %s %s %s 10.%d.%d.%d 9001 0\n"
+           "%s"
+           "s Fast Guard%s Running Stable V2Dir Valid\n"
+           "v Tor 0.4.8.10\n"
+           "pr Conflux=1 Cons=1-2 Desc=1-2 DirCache=2 FlowCtrl=1-2 HSDir=2 "
+           "HSIntro=4-5 HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 "
+           "Padding=2 Relay=1-4\n",
+           i, id64, d64, va, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff,
+           (i & 1) ? "a [2001:db8::1]:9001\n" : "",
+           (i % 3) ? "" : " Exit");
+    if (is_vote) {
+      ed25519_public_key_t ed;
+      char ed64[ED25519_BASE64_LEN+1], m64[BASE64_DIGEST256_LEN+1];
+      char m[DIGEST256_LEN];
+      crypto_rand((char *)ed.pubkey, sizeof(ed.pubkey));
+      crypto_rand(m, sizeof(m));
+      ed25519_public_to_base64(ed64, &ed);
+      digest256_to_base64(m64, m);
+      smartlist_add_asprintf(chunks,
+           "w Bandwidth=%d Measured=%d\n"
+           "p %s\n"
+           "id ed25519 %s\n"
+           "m 28,29,30,31,32,33 sha256=%s\n",
+           1000 + i, 900 + i,
+           (i % 3) ? "reject 1-65535" : "accept 80,443,8080",
+           ed64, m64);
+    } else {
+      smartlist_add_asprintf(chunks,
+           "w Bandwidth=%d\n"
+           "p %s\n",
+           900 + i, (i % 3) ? "reject 1-65535" : "accept 80,443,8080");
+    }
+  }
+  smartlist_add_asprintf(chunks,
+                         "directory-footer\n"
+                         "directory-signature %s %s\n", id_hex, sk_hex);
+
+  doc = smartlist_join_strings(chunks, "", 0, NULL);
+  router_get_networkstatus_v3_hashes(doc, strlen(doc), &digests);
+  sig = router_get_dirobj_signature(digests.d[DIGEST_SHA1], DIGEST_LEN,
+                                    sign_key);
+  smartlist_clear(chunks);
+  smartlist_add(chunks, doc);
+  smartlist_add(chunks, sig);
+  doc = smartlist_join_strings(chunks, "", 0, NULL);
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(id_pem);
+  tor_free(sk_pem);
+  return doc;
+}
+
+/** Parse the networkstatus document <b>doc</b> of type <b>type</b>
+ * <b>iters</b> times, and report the throughput. */
+static void
+bench_ns_parse(const char *what, const char *doc, networkstatus_type_t type,
+               int n_relays, int iters)
+{
+  uint64_t start, end;
+  size_t len = strlen(doc);
+  int i;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(doc, len, NULL, type);
+    if (!ns) {
+      printf("Couldn't parse %s!\n", what);
+      return;
+    }
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("%s parse, %d relays (%.2f MB): %.2f msec, %.2f MB/sec\n",
+         what, n_relays, len / 1e6, NANOCOUNT(start, end, iters) / 1e6,
+         len * 1e3 / NANOCOUNT(start, end, iters));
+}
+
 static void
 bench_md_parse(void)
 {
@@ -737,6 +1536,874 @@ bench_md_parse(void)
 
   end = perftime();
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
+
+  {
+    /* About as many relays as a current consensus lists. */
+    const int N_RELAYS = 7000;
+    crypto_pk_t *id_key = crypto_pk_new(), *sign_key = crypto_pk_new();
+    char *doc;
+    crypto_pk_generate_key(id_key);
+    crypto_pk_generate_key(sign_key);
+
+    doc = bench_ns_make(NS_TYPE_CONSENSUS, N_RELAYS, id_key, sign_key);
+    bench_ns_parse("Consensus", doc, NS_TYPE_CONSENSUS, N_RELAYS, 10);
+    tor_free(doc);
+    doc = bench_ns_make(NS_TYPE_VOTE, N_RELAYS, id_key, sign_key);
+    bench_ns_parse("Vote", doc, NS_TYPE_VOTE, N_RELAYS, 10);
+    tor_free(doc);
+
+    crypto_pk_free(id_key);
+    crypto_pk_free(sign_key);
+  }
+}
+
+/** Parse a consensus and a vote of about the current size, first on the
+ * main thread alone and then with help from the cpuworker threads. */
+static void
+bench_ns_parse_threads(void)
+{
+  const int N_RELAYS = 7000;
+  tor_libevent_cfg_t cfg;
+  crypto_pk_t *id_key = crypto_pk_new(), *sign_key = crypto_pk_new();
+  char *consensus, *vote;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  crypto_pk_generate_key(id_key);
+  crypto_pk_generate_key(sign_key);
+  consensus = bench_ns_make(NS_TYPE_CONSENSUS, N_RELAYS, id_key, sign_key);
+  vote = bench_ns_make(NS_TYPE_VOTE, N_RELAYS, id_key, sign_key);
+
+  printf("Main thread only:\n");
+  bench_ns_parse("Consensus", consensus, NS_TYPE_CONSENSUS, N_RELAYS, 10);
+  bench_ns_parse("Vote", vote, NS_TYPE_VOTE, N_RELAYS, 10);
+
+  cpuworker_init();
+  printf("With %u cpuworker threads on %d CPUs:\n",
+         cpuworker_get_n_threads(), get_num_cpus(get_options()));
+  bench_ns_parse("Consensus", consensus, NS_TYPE_CONSENSUS, N_RELAYS, 10);
+  bench_ns_parse("Vote", vote, NS_TYPE_VOTE, N_RELAYS, 10);
+
+  tor_free(consensus);
+  tor_free(vote);
+  crypto_pk_free(id_key);
+  crypto_pk_free(sign_key);
+}
+
+/** Write a synthetic GeoIP file for <b>family</b> with <b>n</b> ranges to
+ * <b>fname</b>, roughly the size of the ones we ship. */
+static void
+bench_geoip_write_file(sa_family_t family, const char *fname, int n)
+{
+  smartlist_t *lines = smartlist_new();
+  char *s;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    char cc0 = 'A' + (i % 26), cc1 = 'A' + ((i / 26) % 10);
+    if (family == AF_INET) {
+      uint32_t low = (uint32_t)(((uint64_t)i << 32) / n);
+      uint32_t high = low + (uint32_t)crypto_rand_int(20000);
+      smartlist_add_asprintf(lines, "%u,%u,%c%c\n", low, high, cc0, cc1);
+    } else {
+      unsigned g0 = 0x2001 + (i >> 12), g1 = (i & 0xfff) << 4;
+      smartlist_add_asprintf(lines,
+                     "%x:%x::,%x:%x:ffff:ffff:ffff:ffff:ffff:ffff,%c%c\n",
+                     g0, g1, g0, g1, cc0, cc1);
+    }
+  }
+  s = smartlist_join_strings(lines, "", 0, NULL);
+  if (write_str_to_file(fname, s, 0) < 0)
+    printf("Couldn't write %s\n", fname);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(s);
+}
+
+static void
+bench_geoip(void)
+{
+  const int N_LOOKUPS = 1000000;
+  const char *tmpdir = getenv("TMPDIR");
+  char *fname = NULL, *fname6 = NULL, *cache = NULL, *cache6 = NULL;
+  tor_addr_t *addrs = NULL;
+  uint64_t start, end;
+  uint32_t suffix = crypto_rand_u32();
+  int i, sum = 0;
+
+  if (!tmpdir)
+    tmpdir = "/tmp";
+  tor_asprintf(&fname, "%s/tor-bench-geoip-%08x", tmpdir, suffix);
+  tor_asprintf(&fname6, "%s/tor-bench-geoip6-%08x", tmpdir, suffix);
+  tor_asprintf(&cache, "%s/tor-bench-cached-geoip-%08x", tmpdir, suffix);
+  tor_asprintf(&cache6, "%s/tor-bench-cached-geoip6-%08x", tmpdir, suffix);
+  bench_geoip_write_file(AF_INET, fname, 200000);
+  bench_geoip_write_file(AF_INET6, fname6, 60000);
+
+  reset_perftime();
+  start = perftime();
+  geoip_load_file(AF_INET, fname, LOG_WARN);
+  geoip_load_file(AF_INET6, fname6, LOG_WARN);
+  end = perftime();
+  printf("GeoIP load from text: %.2f msec\n", NANOCOUNT(start, end, 1e6));
+
+  /* The first cached load parses the files and writes the caches. */
+  geoip_load_file_cached(AF_INET, fname, cache, LOG_WARN);
+  geoip_load_file_cached(AF_INET6, fname6, cache6, LOG_WARN);
+  start = perftime();
+  geoip_load_file_cached(AF_INET, fname, cache, LOG_WARN);
+  geoip_load_file_cached(AF_INET6, fname6, cache6, LOG_WARN);
+  end = perftime();
+  printf("GeoIP load from cache: %.2f msec\n", NANOCOUNT(start, end, 1e6));
+
+  addrs = tor_calloc(N_LOOKUPS, sizeof(tor_addr_t));
+  for (i = 0; i < N_LOOKUPS; ++i) {
+    if (i & 1) {
+      uint8_t bytes[16];
+      crypto_rand((char *)bytes, sizeof(bytes));
+      bytes[0] = 0x20;
+      bytes[1] = 0x01;
+      tor_addr_from_ipv6_bytes(&addrs[i], bytes);
+    } else {
+      tor_addr_from_ipv4h(&addrs[i], crypto_rand_u32());
+    }
+  }
+  start = perftime();
+  for (i = 0; i < N_LOOKUPS; ++i)
+    sum += geoip_get_country_by_addr(&addrs[i]);
+  end = perftime();
+  printf("GeoIP lookup: %.2f ns per address, %.1fM lookups/sec "
+         "(sum %d)\n",
+         NANOCOUNT(start, end, N_LOOKUPS),
+         N_LOOKUPS / NANOCOUNT(start, end, 1e3), sum);
+
+  geoip_free_all();
+  tor_unlink(fname);
+  tor_unlink(fname6);
+  tor_unlink(cache);
+  tor_unlink(cache6);
+  tor_free(fname);
+  tor_free(fname6);
+  tor_free(cache);
+  tor_free(cache6);
+  tor_free(addrs);
+}
+
+/** Load the microdescriptor cache from disk, and look up each of the
+ * <b>n</b> digests in <b>digests</b> as nodelist_set_consensus() would.
+ * Return the CPU time taken, in nsec. */
+static uint64_t
+bench_md_cache_load_once(const char *digests, int n)
+{
+  uint64_t start, end;
+  int i, found = 0;
+
+  microdesc_free_all();
+  start = perftime();
+  microdesc_cache_t *cache = get_microdesc_cache();
+  for (i = 0; i < n; ++i) {
+    if (microdesc_cache_lookup_by_digest256(cache, digests + i*DIGEST256_LEN))
+      ++found;
+  }
+  end = perftime();
+  if (found != n)
+    printf("Only found %d/%d microdescriptors!\n", found, n);
+  return end - start;
+}
+
+/** Return a newly allocated string holding <b>n</b> synthetic
+ * microdescriptors, each one preceded by an @last-listed annotation if
+ * <b>annotate</b> is true.  Set *<b>digests_out</b> to a newly allocated
+ * array of their <b>n</b> SHA256 digests. */
+static char *
+bench_md_make(int n, int annotate, char **digests_out)
+{
+  smartlist_t *chunks = smartlist_new();
+  crypto_pk_t *onion_key = crypto_pk_new();
+  char listed[ISO_TIME_LEN+1];
+  char *pem = NULL, *contents, *digests;
+  size_t pem_len;
+  int i;
+
+  /* The microdescriptors can share an onion key; everything else
+   * differs. */
+  crypto_pk_generate_key(onion_key);
+  crypto_pk_write_public_key_to_string(onion_key, &pem, &pem_len);
+  format_iso_time(listed, time(NULL));
+  digests = tor_malloc(n * DIGEST256_LEN);
+  for (i = 0; i < n; ++i) {
+    curve25519_public_key_t ntor;
+    ed25519_public_key_t ed;
+    char ntor_b64[CURVE25519_BASE64_PADDED_LEN+1];
+    char ed_b64[ED25519_BASE64_LEN+1];
+    char fam1[DIGEST_LEN], fam2[DIGEST_LEN];
+    char *body;
+    crypto_rand((char *)ntor.public_key, sizeof(ntor.public_key));
+    crypto_rand((char *)ed.pubkey, sizeof(ed.pubkey));
+    crypto_rand(fam1, sizeof(fam1));
+    crypto_rand(fam2, sizeof(fam2));
+    curve25519_public_to_base64(ntor_b64, &ntor, true);
+    ed25519_public_to_base64(ed_b64, &ed);
+    tor_asprintf(&body,
+                 "onion-key\n%s"
+                 "ntor-onion-key %s\n"
+                 "family $%s $%s\n"
+                 "p accept 53,80,443,%d-%d\n"
+                 "id ed25519 %s\n",
+                 pem, ntor_b64, hex_str(fam1, DIGEST_LEN),
+                 hex_str(fam2, DIGEST_LEN), 1024 + i, 2048 + i, ed_b64);
+    crypto_digest256(digests + i*DIGEST256_LEN, body, strlen(body),
+                     DIGEST_SHA256);
+    if (annotate)
+      smartlist_add_asprintf(chunks, "@last-listed %s\n%s", listed, body);
+    else
+      smartlist_add_strdup(chunks, body);
+    tor_free(body);
+  }
+  contents = smartlist_join_strings(chunks, "", 0, NULL);
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  crypto_pk_free(onion_key);
+  tor_free(pem);
+  *digests_out = digests;
+  return contents;
+}
+
+static void
+bench_md_cache_startup(void)
+{
+  const int N = 7000;
+  or_options_t *options = get_options_mutable();
+  const char *tmpdir = getenv("TMPDIR");
+  char *dir = NULL, *fname = NULL, *contents = NULL;
+  char *digests = NULL;
+  char *saved_cachedir = options->CacheDirectory;
+  uint64_t t_parse, t_index;
+
+  if (!tmpdir)
+    tmpdir = "/tmp";
+  tor_asprintf(&dir, "%s/tor-bench-md-%08x", tmpdir, crypto_rand_u32());
+  if (check_private_dir(dir, CPD_CREATE, NULL) < 0) {
+    printf("Couldn't create %s\n", dir);
+    goto done;
+  }
+  options->CacheDirectory = dir;
+
+  /* A consensus worth of microdescriptors. */
+  contents = bench_md_make(N, 1, &digests);
+  fname = get_cachedir_fname("cached-microdescs");
+  write_str_to_file(fname, contents, 1);
+  tor_free(fname);
+
+  reset_perftime();
+  /* The first load parses the cache file, and writes the index. */
+  t_parse = bench_md_cache_load_once(digests, N);
+  t_index = bench_md_cache_load_once(digests, N);
+  printf("Microdesc cache startup, %d microdescs: "
+         "%.2f msec parsing, %.2f msec from index\n",
+         N, NANOCOUNT(0, t_parse, 1e6), NANOCOUNT(0, t_index, 1e6));
+
+  microdesc_free_all();
+  fname = get_cachedir_fname("cached-microdescs");
+  tor_unlink(fname);
+  tor_free(fname);
+  fname = get_cachedir_fname("cached-microdescs.new");
+  tor_unlink(fname);
+  tor_free(fname);
+  fname = get_cachedir_fname("cached-microdescs.idx");
+  tor_unlink(fname);
+  tor_free(fname);
+  rmdir(dir);
+
+ done:
+  options->CacheDirectory = saved_cachedir;
+  tor_free(dir);
+  tor_free(contents);
+  tor_free(digests);
+}
+
+static void
+bench_node_select(void)
+{
+  const int N = 7000, N_CHOICES = 20000;
+  node_t *nodes = tor_calloc(N, sizeof(node_t));
+  routerstatus_t *rs = tor_calloc(N, sizeof(routerstatus_t));
+  double *weights = tor_calloc(N, sizeof(double));
+  smartlist_t *sl = smartlist_new();
+  weighted_alias_table_t *table;
+  uint64_t start, end;
+  int i, sum = 0;
+
+  /* A consensus worth of relays, as compute_weighted_bandwidths() sees them
+   * when there are no bandwidth weights in the consensus. */
+  for (i = 0; i < N; ++i) {
+    crypto_rand(rs[i].identity_digest, DIGEST_LEN);
+    memcpy(nodes[i].identity, rs[i].identity_digest, DIGEST_LEN);
+    rs[i].is_valid = rs[i].is_flagged_running = 1;
+    rs[i].is_possible_guard = (i % 3) == 0;
+    rs[i].is_exit = (i % 4) == 0;
+    rs[i].has_bandwidth = 1;
+    rs[i].bandwidth_kb = 100 + crypto_rand_int(50000);
+    nodes[i].rs = &rs[i];
+    nodes[i].is_valid = nodes[i].is_running = 1;
+    nodes[i].is_possible_guard = rs[i].is_possible_guard;
+    nodes[i].is_exit = rs[i].is_exit;
+    weights[i] = rs[i].bandwidth_kb;
+    smartlist_add(sl, &nodes[i]);
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < N_CHOICES; ++i)
+    sum += node_sl_choose_by_bandwidth(sl, WEIGHT_FOR_MID) != NULL;
+  end = perftime();
+  printf("Weighted choice from %d nodes, scanning: %.2f usec per choice\n",
+         N, NANOCOUNT(start, end, N_CHOICES) / 1e3);
+
+  start = perftime();
+  table = weighted_alias_table_new(weights, N);
+  end = perftime();
+  printf("Building an alias table for %d nodes: %.2f usec\n",
+         N, NANOCOUNT(start, end, 1) / 1e3);
+
+  start = perftime();
+  for (i = 0; i < N_CHOICES; ++i)
+    sum += smartlist_get(sl, weighted_alias_table_choose(table)) != NULL;
+  end = perftime();
+  printf("Weighted choice from %d nodes, alias table: %.2f usec per choice "
+         "(%d)\n", N, NANOCOUNT(start, end, N_CHOICES) / 1e3, sum);
+
+  weighted_alias_table_free(table);
+  smartlist_free(sl);
+  tor_free(nodes);
+  tor_free(rs);
+  tor_free(weights);
+}
+
+/** Simulate an INTRODUCE2 flood against a service's replay cache: as many
+ * distinct encrypted sections as we can feed it for a few seconds, with a
+ * replay mixed in now and then.  The horizon is short so that the cache
+ * ages out and scrubs entries while we run. */
+static void
+bench_replaycache(void)
+{
+  const int SECONDS = 5, REPLAY_EVERY = 1000;
+  replaycache_t *rc = replaycache_new(2, 1);
+  uint8_t cell[256], replay[256];
+  uint64_t start, end;
+  uint32_t n = 0;
+  int hits = 0;
+  time_t stop;
+
+  crypto_rand((char *)cell, sizeof(cell));
+  memcpy(replay, cell, sizeof(replay));
+
+  reset_perftime();
+  start = perftime();
+  stop = time(NULL) + SECONDS;
+  while (time(NULL) < stop) {
+    int i;
+    for (i = 0; i < REPLAY_EVERY; ++i) {
+      /* Cheap, distinct contents: the cache hashes them anyway. */
+      set_uint32(cell, n++);
+      hits += replaycache_add_and_test(rc, cell, sizeof(cell));
+    }
+    hits += replaycache_add_and_test(rc, replay, sizeof(replay));
+  }
+  end = perftime();
+
+  printf("Replay cache flood: %.2f nsec per cell, %u cells, "
+         "%d replays caught\n",
+         NANOCOUNT(start, end, n + n / REPLAY_EVERY), n, hits);
+
+  replaycache_free(rc);
+}
+
+/** Log <b>n</b> debug-level messages, and report how fast the calling thread
+ * got through them and how long each call took. */
+static void
+bench_log_async_impl(const char *what, int n)
+{
+  uint32_t *nsec = tor_calloc(n, sizeof(uint32_t));
+  const uint64_t dropped = logs_get_n_async_dropped();
+  monotime_t start, end, flushed, t0, t1;
+  int i;
+
+  monotime_get(&start);
+  for (i = 0; i < n; ++i) {
+    monotime_get(&t0);
+    log_debug(LD_GENERAL, "Benchmark message %d, long enough to look like "
+              "a real debug message from circuit %u.", i, (unsigned)i * 7);
+    monotime_get(&t1);
+    nsec[i] = (uint32_t)MIN(monotime_diff_nsec(&t0, &t1), UINT32_MAX);
+  }
+  monotime_get(&end);
+  /* Help the writer finish, so we can tell when everything is written. */
+  if (!logs_async_is_idle())
+    logs_async_drain();
+  monotime_get(&flushed);
+
+  printf("%-13s %8.0f msgs/sec (%8.0f msgs/sec written); per call: "
+         "p50 %5u nsec, p99 %6u nsec, max %8u nsec; %"PRIu64" dropped\n",
+         what, n * 1e6 / monotime_diff_usec(&start, &end),
+         n * 1e6 / monotime_diff_usec(&start, &flushed),
+         find_nth_uint32(nsec, n, n / 2),
+         find_nth_uint32(nsec, n, (n * 99) / 100),
+         find_nth_uint32(nsec, n, n - 1),
+         logs_get_n_async_dropped() - dropped);
+  tor_free(nsec);
+}
+
+/** Compare writing a debug-level log file from the logging thread with
+ * handing the writes to the asynchronous log writer. */
+static void
+bench_log_async(void)
+{
+  const int N = 200000;
+  const char *tmpdir = getenv("TMPDIR");
+  log_severity_list_t everything;
+  char *fname = NULL;
+
+  if (!tmpdir)
+    tmpdir = "/tmp";
+  tor_asprintf(&fname, "%s/tor-bench-log-%08x", tmpdir, crypto_rand_u32());
+  set_log_severity_config(LOG_DEBUG, LOG_ERR, &everything);
+
+  /* Existing logs become temporary, so that rollback_log_changes() puts
+   * them back and closes ours. */
+  mark_logs_temp();
+  if (add_file_log(&everything, fname,
+                   tor_open_cloexec(fname, O_WRONLY|O_CREAT|O_TRUNC,
+                                    0644)) < 0) {
+    printf("Couldn't open %s\n", fname);
+    goto done;
+  }
+
+  bench_log_async_impl("Synchronous:", N);
+  if (log_writer_start() < 0) {
+    printf("Asynchronous logging isn't supported here.\n");
+  } else {
+    bench_log_async_impl("Asynchronous:", N);
+    log_writer_stop();
+  }
+  rollback_log_changes();
+
+ done:
+  tor_unlink(fname);
+  tor_free(fname);
+}
+
+/** One compression of a consensus for bench_consensus_compress. */
+typedef struct bench_compress_job_t {
+  const char *doc;
+  size_t len;
+  compress_method_t method;
+  int n_threads;
+  size_t out_len;
+} bench_compress_job_t;
+
+/** How many bench_compress_job_t replies we have received so far. */
+static int bench_compress_n_done = 0;
+
+static workqueue_reply_t
+bench_compress_threadfn(void *state, void *arg)
+{
+  bench_compress_job_t *job = arg;
+  char *out = NULL;
+  (void)state;
+  if (tor_compress_parallel(&out, &job->out_len, job->doc, job->len,
+                            job->method, job->n_threads) < 0)
+    job->out_len = 0;
+  tor_free(out);
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_compress_replyfn(void *arg)
+{
+  (void)arg;
+  ++bench_compress_n_done;
+}
+
+/** Compress every job in <b>jobs</b>, either one after another on this
+ * thread, or each in its own work item on <b>tp</b>; return the wall-clock
+ * time that took in msec. */
+static double
+bench_consensus_compress_all(threadpool_t *tp, replyqueue_t *rq,
+                             bench_compress_job_t *jobs, int n_jobs)
+{
+  monotime_t start, end;
+  int i;
+
+  monotime_get(&start);
+  if (tp) {
+    bench_compress_n_done = 0;
+    for (i = 0; i < n_jobs; ++i) {
+      threadpool_queue_work_priority(tp, WQ_PRI_LOW,
+                                     bench_compress_threadfn,
+                                     bench_compress_replyfn, &jobs[i]);
+    }
+    while (bench_compress_n_done < n_jobs)
+      replyqueue_process(rq);
+  } else {
+    for (i = 0; i < n_jobs; ++i)
+      bench_compress_threadfn(NULL, &jobs[i]);
+  }
+  monotime_get(&end);
+
+  return monotime_diff_usec(&start, &end) / 1e3;
+}
+
+/** Measure the wall-clock time to compress a consensus of about the current
+ * size with each method, and with every method the way consdiffmgr does
+ * it: formerly in one job, now in one job per method. */
+static void
+bench_consensus_compress(void)
+{
+  const compress_method_t all_methods[] = {
+    ZLIB_METHOD, LZMA_METHOD, ZSTD_METHOD
+  };
+  const int thread_counts[] = { 1, 2, 4 };
+  crypto_pk_t *id_key = crypto_pk_new(), *sign_key = crypto_pk_new();
+  bench_compress_job_t jobs[ARRAY_LENGTH(all_methods)];
+  replyqueue_t *rq;
+  threadpool_t *tp;
+  char *doc;
+  size_t len;
+  int n_jobs = 0;
+  unsigned i, t;
+
+  crypto_pk_generate_key(id_key);
+  crypto_pk_generate_key(sign_key);
+  doc = bench_ns_make(NS_TYPE_CONSENSUS, 7000, id_key, sign_key);
+  len = strlen(doc);
+  printf("Consensus of %.2f MB:\n", len / 1e6);
+
+  memset(jobs, 0, sizeof(jobs));
+  for (i = 0; i < ARRAY_LENGTH(all_methods); ++i) {
+    if (!tor_compress_supports_method(all_methods[i]))
+      continue;
+    jobs[n_jobs].doc = doc;
+    jobs[n_jobs].len = len;
+    jobs[n_jobs].method = all_methods[i];
+    jobs[n_jobs].n_threads = 1;
+    ++n_jobs;
+  }
+
+  for (i = 0; i < (unsigned)n_jobs; ++i) {
+    for (t = 0; t < ARRAY_LENGTH(thread_counts); ++t) {
+      /* Only zstd can split one input between threads. */
+      if (thread_counts[t] > 1 && jobs[i].method != ZSTD_METHOD)
+        continue;
+      jobs[i].n_threads = thread_counts[t];
+      double msec = bench_consensus_compress_all(NULL, NULL, &jobs[i], 1);
+      printf("  %-12s %d thread(s): %7.1f msec, %.1f%% of input\n",
+             compression_method_get_name(jobs[i].method),
+             thread_counts[t], msec, jobs[i].out_len * 100.0 / len);
+    }
+    jobs[i].n_threads = 1;
+  }
+
+  rq = replyqueue_new(0);
+  tp = threadpool_new(n_jobs, rq,
+                      bench_crypt_state_new, bench_crypt_state_free, NULL);
+  tor_assert(tp);
+  printf("  All methods, one after another: %7.1f msec\n",
+         bench_consensus_compress_all(NULL, NULL, jobs, n_jobs));
+  printf("  All methods, one job each:      %7.1f msec\n",
+         bench_consensus_compress_all(tp, rq, jobs, n_jobs));
+  for (i = 0; i < (unsigned)n_jobs; ++i)
+    jobs[i].n_threads = 4;
+  printf("  ... and zstd with 4 threads:    %7.1f msec\n",
+         bench_consensus_compress_all(tp, rq, jobs, n_jobs));
+  /* As in bench_workqueue, we leave this pool's threads idle. */
+
+  crypto_pk_free(id_key);
+  crypto_pk_free(sign_key);
+  tor_free(doc);
+}
+
+#ifdef HAVE_MODULE_DIRCACHE
+/** Return a new directory connection that is about to answer a request. */
+static dir_connection_t *
+bench_dir_conn_new(void)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  TO_CONN(conn)->state = DIR_CONN_STATE_SERVER_WRITING;
+  conn->spool = smartlist_new();
+  return conn;
+}
+
+/** Send everything spooled on <b>conns</b>, a little from each connection
+ * in turn, as the main loop would if all their sockets stayed writable.
+ * Return the number of bytes sent. */
+static uint64_t
+bench_dir_spool_drain(smartlist_t *conns)
+{
+  uint64_t total = 0;
+  int busy;
+  do {
+    busy = 0;
+    SMARTLIST_FOREACH_BEGIN(conns, dir_connection_t *, conn) {
+      buf_t *outbuf = TO_CONN(conn)->outbuf;
+      if (conn->spool) {
+        connection_dirserv_flushed_some(conn);
+        busy = 1;
+      }
+      total += buf_datalen(outbuf);
+      buf_drain(outbuf, buf_datalen(outbuf));
+    } SMARTLIST_FOREACH_END(conn);
+  } while (busy);
+  return total;
+}
+
+/** Serve <b>n_conns</b> concurrent requests for microdescriptors.  There
+ * are <b>n_batches</b> different requests, each for <b>batch_len</b>
+ * microdescriptors from <b>digests</b>.  Compress each answer with
+ * <b>method</b>, on its own connection, or once per batch if
+ * <b>shared</b>. */
+static void
+bench_dir_spool_md(const char *digests, int n_conns, int n_batches,
+                   int batch_len, compress_method_t method, int shared)
+{
+  smartlist_t *conns = smartlist_new();
+  uint64_t start, end, total;
+  int i, j;
+
+  start = perftime();
+  for (i = 0; i < n_conns; ++i) {
+    dir_connection_t *conn = bench_dir_conn_new();
+    const char *batch = digests + (i % n_batches) * batch_len * DIGEST256_LEN;
+    for (j = 0; j < batch_len; ++j) {
+      smartlist_add(conn->spool,
+                    spooled_resource_new(DIR_SPOOL_MICRODESC,
+                                         (const uint8_t *)batch +
+                                           j * DIGEST256_LEN,
+                                         DIGEST256_LEN));
+    }
+    if (!shared || !dirserv_spool_use_shared_blob(conn, method,
+                                                  LOW_COMPRESSION))
+      conn->compress_state = tor_compress_new(1, method, LOW_COMPRESSION);
+    smartlist_add(conns, conn);
+  }
+  total = bench_dir_spool_drain(conns);
+  end = perftime();
+
+  printf("  %-10s %-8s %4d requests: %7.2f usec/request, %.1f MB sent\n",
+         compression_method_get_name(method),
+         shared ? "shared" : "per-conn", n_conns,
+         MICROCOUNT(start, end, n_conns), total / 1e6);
+
+  SMARTLIST_FOREACH(conns, dir_connection_t *, conn, {
+    dir_conn_clear_spool(conn);
+    connection_free_(TO_CONN(conn));
+  });
+  smartlist_free(conns);
+  dirserv_free_all();
+}
+
+/** Serve <b>n_conns</b> concurrent requests for the consensus that we hold
+ * precompressed. */
+static void
+bench_dir_spool_consensus(int n_conns)
+{
+  smartlist_t *conns = smartlist_new();
+  uint64_t start, end, total;
+  int i;
+
+  start = perftime();
+  for (i = 0; i < n_conns; ++i) {
+    dir_connection_t *conn = bench_dir_conn_new();
+    smartlist_add(conn->spool,
+                  spooled_resource_new(DIR_SPOOL_NETWORKSTATUS, NULL, 0));
+    smartlist_add(conns, conn);
+  }
+  total = bench_dir_spool_drain(conns);
+  end = perftime();
+
+  printf("  consensus %4d requests: %7.2f usec/request, %.1f MB/sec\n",
+         n_conns, MICROCOUNT(start, end, n_conns),
+         total * 1e3 / NANOCOUNT(start, end, 1));
+
+  SMARTLIST_FOREACH(conns, dir_connection_t *, conn,
+                    connection_free_(TO_CONN(conn)));
+  smartlist_free(conns);
+}
+
+/** Measure how fast a directory cache serves many concurrent requests,
+ * both for the consensus and for batches of microdescriptors. */
+static void
+bench_dir_spool(void)
+{
+  const int N_MDS = 7000, BATCH_LEN = 96, N_BATCHES = 8;
+  const compress_method_t methods[] = { ZLIB_METHOD, ZSTD_METHOD };
+  crypto_pk_t *id_key = crypto_pk_new(), *sign_key = crypto_pk_new();
+  char *doc, *mds, *digests = NULL;
+  common_digests_t doc_digests;
+  uint8_t sha3[DIGEST256_LEN];
+  smartlist_t *added;
+  int n_conns;
+  unsigned i;
+
+  reset_perftime();
+
+  crypto_pk_generate_key(id_key);
+  crypto_pk_generate_key(sign_key);
+  doc = bench_ns_make(NS_TYPE_CONSENSUS, 7000, id_key, sign_key);
+  memset(&doc_digests, 0, sizeof(doc_digests));
+  memset(sha3, 0, sizeof(sha3));
+  dirserv_set_cached_consensus_networkstatus(doc, strlen(doc), "ns",
+                                             &doc_digests, sha3,
+                                             time(NULL));
+  for (n_conns = 1; n_conns <= 64; n_conns *= 4)
+    bench_dir_spool_consensus(n_conns);
+  dirserv_free_all();
+
+  mds = bench_md_make(N_MDS, 0, &digests);
+  added = microdescs_add_to_cache(get_microdesc_cache(), mds, NULL,
+                                  SAVED_NOWHERE, 1, time(NULL), NULL);
+  if (smartlist_len(added) != N_MDS)
+    printf("Only added %d/%d microdescriptors!\n", smartlist_len(added),
+           N_MDS);
+  for (i = 0; i < ARRAY_LENGTH(methods); ++i) {
+    if (!tor_compress_supports_method(methods[i]))
+      continue;
+    for (n_conns = N_BATCHES; n_conns <= 512; n_conns *= 8) {
+      bench_dir_spool_md(digests, n_conns, N_BATCHES, BATCH_LEN,
+                         methods[i], 0);
+      bench_dir_spool_md(digests, n_conns, N_BATCHES, BATCH_LEN,
+                         methods[i], 1);
+    }
+  }
+
+  smartlist_free(added);
+  microdesc_free_all();
+  crypto_pk_free(id_key);
+  crypto_pk_free(sign_key);
+  tor_free(doc);
+  tor_free(mds);
+  tor_free(digests);
+}
+#endif /* defined(HAVE_MODULE_DIRCACHE) */
+
+/** Parse the CIRC_BW events in the <b>len</b> bytes at <b>s</b> the way a
+ * controller would, and return the total bytes read that they report. */
+static uint64_t
+bench_control_events_parse(const char *s, size_t len, int binary)
+{
+  const char *end = s + len;
+  uint64_t total = 0;
+
+  while (s < end) {
+    const char *eol = tor_memstr(s, end - s, "\r\n");
+    unsigned id, n_read, n_written, n, body_len;
+    char tbuf[ISO_TIME_USEC_LEN+1];
+    if (!eol)
+      break;
+    if (binary) {
+      if (tor_sscanf(s, "650 BINARY_EVENTS %u %u\r\n", &n, &body_len) != 2)
+        break;
+      for (s = eol + 2; n--; s += CONTROL_RECORD_HEADER_LEN+CIRC_BW_RECORD_LEN)
+        total += ntohl(get_uint32(s + CONTROL_RECORD_HEADER_LEN + 12));
+      continue;
+    }
+    if (tor_sscanf(s, "650 CIRC_BW ID=%u READ=%u WRITTEN=%u TIME=%26s ",
+                   &id, &n_read, &n_written, tbuf) != 4)
+      break;
+    total += n_read;
+    s = eol + 2;
+  }
+  return total;
+}
+
+/** Report how long it takes to produce, deliver, and parse one CIRC_BW
+ * event for each circuit in <b>circs</b>, <b>n_rounds</b> times, sent to
+ * <b>conn</b> as text lines or as binary records. */
+static void
+bench_control_events_impl(control_connection_t *conn,
+                          smartlist_t *circs, int n_rounds, int binary)
+{
+  const int n_events = smartlist_len(circs) * n_rounds;
+  uint64_t start, end, produce_nsec = 0, parse_nsec = 0, total = 0;
+  size_t n_bytes = 0;
+  int i;
+
+  conn->binary_events = binary;
+  control_update_global_event_mask();
+
+  reset_perftime();
+  for (i = 0; i < n_rounds; ++i) {
+    size_t len;
+    char *s;
+
+    SMARTLIST_FOREACH(circs, origin_circuit_t *, circ, {
+      circ->n_read_circ_bw = 498 * (1 + (circ_sl_idx & 7));
+      circ->n_written_circ_bw = 498;
+    });
+    start = perftime();
+    control_event_circ_bandwidth_used();
+    tor_libevent_run_event_loop(tor_libevent_get_base(), 1);
+    end = perftime();
+    produce_nsec += end - start;
+
+    s = buf_extract(conn->base_.outbuf, &len);
+    buf_drain(conn->base_.outbuf, len);
+    start = perftime();
+    total += bench_control_events_parse(s, len, binary);
+    end = perftime();
+    parse_nsec += end - start;
+    n_bytes += len;
+    tor_free(s);
+  }
+
+  printf("%-7s produce+deliver %6.1f nsec/event (%9.0f events/sec); "
+         "parse %6.1f nsec/event; %5.1f bytes/event; %"PRIu64" bytes read\n",
+         binary ? "Binary:" : "Text:",
+         NANOCOUNT(0, produce_nsec, n_events),
+         n_events * 1e9 / produce_nsec,
+         NANOCOUNT(0, parse_nsec, n_events),
+         (double)n_bytes / n_events, total);
+}
+
+/** Compare sending CIRC_BW events to a controller as text lines with
+ * sending them as batched binary records. */
+static void
+bench_control_events(void)
+{
+  const int N_CIRCS = 1000, N_ROUNDS = 50;
+  smartlist_t *circs = smartlist_new();
+  control_connection_t *conn;
+  int i;
+
+  if (!tor_libevent_is_initialized()) {
+    tor_libevent_cfg_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+  tor_init_connection_lists();
+  control_initialize_event_queue();
+
+  /* A controller that nothing reads from: we take its output straight from
+   * the outbuf. */
+  conn = control_connection_new(AF_INET);
+  conn->base_.state = CONTROL_CONN_STATE_OPEN;
+  conn->event_mask = EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED);
+  conn->base_.conn_array_index = smartlist_len(get_connection_array());
+  smartlist_add(get_connection_array(), conn);
+
+  for (i = 0; i < N_CIRCS; ++i)
+    smartlist_add(circs, origin_circuit_new());
+
+  bench_control_events_impl(conn, circs, N_ROUNDS, 0);
+  bench_control_events_impl(conn, circs, N_ROUNDS, 1);
+
+  smartlist_remove(get_connection_array(), conn);
+  conn->base_.conn_array_index = -1;
+  connection_free_(TO_CONN(conn));
+  control_update_global_event_mask();
+  smartlist_free(circs);
+  circuit_free_all();
 }
 
 typedef void (*bench_fn)(void);
@@ -756,11 +2423,17 @@ static struct benchmark_t benchmarks[] = {
   ENT(aes),
   ENT(onion_TAP),
   ENT(onion_ntor),
+  ENT(onion_ntor_batch),
   ENT(ed25519),
   ENT(rand),
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_batch),
+  ENT(cell_queue),
+  ENT(cmux_ewma),
+  ENT(cell_threads),
+  ENT(workqueue),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -769,6 +2442,17 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(ns_parse_threads),
+  ENT(md_cache_startup),
+  ENT(geoip),
+  ENT(node_select),
+  ENT(replaycache),
+  ENT(consensus_compress),
+  ENT(log_async),
+#ifdef HAVE_MODULE_DIRCACHE
+  ENT(dir_spool),
+#endif
+  ENT(control_events),
   {NULL,NULL,0}
 };
 
@@ -9,6 +9,8 @@
 #include "lib/buf/buffers.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/socketpair.h"
 #include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "core/proto/proto_http.h"
@@ -498,6 +500,72 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc(16384);
+  buf_t *buf1 = NULL, *buf2 = NULL;
+  int i;
+
+  (void)arg;
+
+  crypto_rand(junk, 16384);
+  buf_clear_freelists();
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  buf1 = buf_new();
+  tt_assert(buf1);
+  for (i = 0; i < 4; ++i)
+    buf_add(buf1, junk, 4000);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* Draining a chunk puts it on the freelist. */
+  buf_drain(buf1, 4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 12288);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4096);
+
+  /* ... and the next chunk of the same size comes back off it. */
+  buf2 = buf_new();
+  tt_assert(buf2);
+  buf_add(buf2, junk, 4000);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* Chunks of another size don't use that freelist. */
+  buf_clear(buf1);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 12288);
+  buf_add(buf1, junk, 16000);
+  tt_int_op(buf_allocation(buf1), OP_EQ, 16384);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 12288);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384 + 4096);
+
+  /* The freelists never hold more than their cap. */
+  for (i = 0; i < 4000; ++i)
+    buf_add(buf2, junk, 4000);
+  buf_free(buf2);
+  buf2 = NULL;
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 16384);
+  tt_int_op(buf_get_freelist_allocation(), OP_GT, 12288);
+  tt_int_op(buf_get_freelist_allocation(), OP_LE, 8*1024*1024);
+
+  /* Clearing the freelists gives everything back. */
+  {
+    size_t on_freelist = buf_get_freelist_allocation();
+    tt_int_op(buf_clear_freelists(), OP_EQ, on_freelist);
+  }
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+  buf_free(buf1);
+  buf1 = NULL;
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf1);
+  buf_free(buf2);
+  tor_free(junk);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -768,6 +836,69 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+/* Flush a buffer made of many small chunks to a socket and read it back,
+ * making sure that we move several chunks per system call when we can. */
+static void
+test_buffers_socket_iov(void *arg)
+{
+  buf_t *out = NULL, *in = NULL;
+  tor_socket_t fds[2] = {TOR_INVALID_SOCKET, TOR_INVALID_SOCKET};
+  char data[4000], got[4000];
+  uint64_t reads0, read_bytes0, writes0, written_bytes0;
+  uint64_t reads1, read_bytes1, writes1, written_bytes1;
+  chunk_t *chunk;
+  int i, r, n_chunks = 0, eof = 0, err = 0;
+  (void)arg;
+
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[1]));
+
+  crypto_rand(data, sizeof(data));
+  out = buf_new_with_capacity(100);
+  in = buf_new_with_capacity(100);
+  for (i = 0; i < 40; ++i)
+    buf_add(out, data + i*100, 100);
+  for (chunk = out->head; chunk; chunk = chunk->next)
+    ++n_chunks;
+  tt_int_op(n_chunks, OP_GT, 16);
+
+  buf_net_get_syscall_stats(&reads0, &read_bytes0,
+                            &writes0, &written_bytes0);
+
+  r = buf_flush_to_socket(out, fds[0], buf_datalen(out));
+  tt_int_op(r, OP_EQ, sizeof(data));
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+
+  /* Leave a little room on the tail chunk, so that the read spans it and a
+   * new chunk. */
+  buf_add(in, data, 150);
+  r = buf_read_from_socket(in, fds[1], sizeof(data), &eof, &err);
+  tt_int_op(r, OP_EQ, sizeof(data));
+  tt_int_op(eof, OP_EQ, 0);
+  tt_int_op(buf_datalen(in), OP_EQ, sizeof(data) + 150);
+  buf_drain(in, 150);
+  buf_get_bytes(in, got, sizeof(got));
+  tt_mem_op(got, OP_EQ, data, sizeof(data));
+
+  buf_net_get_syscall_stats(&reads1, &read_bytes1,
+                            &writes1, &written_bytes1);
+  tt_u64_op(written_bytes1 - written_bytes0, OP_EQ, sizeof(data));
+  tt_u64_op(read_bytes1 - read_bytes0, OP_EQ, sizeof(data));
+#if defined(HAVE_SYS_UIO_H) && !defined(_WIN32)
+  /* We write up to 16 chunks per call to writev(); we fill the rest of the
+   * tail chunk and a new one with a single call to readv(). */
+  tt_u64_op(writes1 - writes0, OP_EQ, (n_chunks + 15) / 16);
+  tt_u64_op(reads1 - reads0, OP_EQ, 1);
+#endif
+
+ done:
+  buf_free(out);
+  buf_free(in);
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -866,10 +997,12 @@ struct testcase_t buffer_tests[] = {
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
+  { "socket_iov", test_buffers_socket_iov, TT_FORK, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
 
   { "compress/zlib", test_buffers_compress, TT_FORK,
@@ -139,9 +139,74 @@ test_circuit_n_cells(void *arg)
   circuit_free_(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cell_pool(void *arg)
+{
+  packed_cell_t *cells[200];
+  cell_queue_t cq;
+  size_t idle;
+  int i;
+  (void)arg;
+
+  memset(cells, 0, sizeof(cells));
+  cell_queue_init(&cq);
+  tt_int_op(cell_pool_release_idle(), OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+  for (i = 0; i < 200; ++i) {
+    cells[i] = packed_cell_new();
+    tt_assert(cells[i]);
+    tt_assert(fast_mem_is_zero(cells[i]->body, sizeof(cells[i]->body)));
+    tt_uint_op(cells[i]->inserted_timestamp, OP_EQ, 0);
+  }
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            200 * packed_cell_mem_cost());
+  /* Cells allocated in a row come out of the same slab. */
+  tt_ptr_op(cells[1], OP_EQ, cells[0] + 1);
+  /* The free cells in the last, partly used slab count as idle memory, but
+   * there's no unused slab for the pool to release. */
+  idle = cell_pool_get_idle_allocation();
+  tt_uint_op(idle, OP_GT, 0);
+  tt_int_op(cell_pool_release_idle(), OP_EQ, 0);
+  tt_int_op(cell_pool_get_idle_allocation(), OP_EQ, idle);
+
+  /* Freeing a cell and allocating another reuses its storage. */
+  packed_cell_free(cells[100]);
+  cells[100] = packed_cell_new();
+  tt_ptr_op(cells[100], OP_EQ, cells[99] + 1);
+
+  /* Queues hand back the same cells. */
+  for (i = 0; i < 200; ++i)
+    cell_queue_append(&cq, cells[i]);
+  for (i = 0; i < 100; ++i) {
+    tt_ptr_op(cell_queue_pop(&cq), OP_EQ, cells[i]);
+    packed_cell_free(cells[i]);
+  }
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            100 * packed_cell_mem_cost());
+  /* Every freed cell is still held by the pool. */
+  tt_uint_op(cell_pool_get_idle_allocation(), OP_GE,
+             idle + 100 * packed_cell_mem_cost());
+  memset(cells, 0, sizeof(cells));
+
+  /* Once every cell is gone, the slabs are idle and can be released. */
+  cell_queue_clear(&cq);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+  idle = cell_pool_get_idle_allocation();
+  tt_uint_op(idle, OP_GE, 200 * packed_cell_mem_cost());
+  tt_int_op(cell_pool_release_idle(), OP_EQ, idle);
+  tt_int_op(cell_pool_get_idle_allocation(), OP_EQ, 0);
+
+ done:
+  for (i = 0; i < 200; ++i)
+    packed_cell_free(cells[i]);
+  cell_queue_clear(&cq);
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "pool", test_cell_pool, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
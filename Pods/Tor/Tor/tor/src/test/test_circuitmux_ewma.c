@@ -109,13 +109,13 @@ test_cmux_ewma_notify_circ(void *arg)
   /* We should have an active circuit in the queue so its EWMA value can be
    * tracked. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_int_op(smartlist_len(ewma_pol_data->active_circuit_pqueue), OP_EQ, 1);
+  tt_int_op(ewma_pol_data->active_circuit_pqueue.n, OP_EQ, 1);
   tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
 
   ewma_policy.notify_circ_inactive(&cmux, pol_data, &circ, circ_data);
   /* Should be removed from the active queue. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_int_op(smartlist_len(ewma_pol_data->active_circuit_pqueue), OP_EQ, 0);
+  tt_int_op(ewma_pol_data->active_circuit_pqueue.n, OP_EQ, 0);
   tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
 
  done:
@@ -178,13 +178,124 @@ test_cmux_ewma_policy_data(void *arg)
 
   /* Test EWMA object. */
   ewma_pol_data = TO_EWMA_POL_DATA(pol_data);
-  tt_assert(ewma_pol_data->active_circuit_pqueue);
+  tt_int_op(ewma_pol_data->active_circuit_pqueue.n, OP_EQ, 0);
   tt_uint_op(ewma_pol_data->active_circuit_pqueue_last_recalibrated, OP_NE, 0);
 
  done:
   ewma_policy.free_cmux_data(&cmux, pol_data);
 }
 
+/** Check that the active circuit queue of <b>pol</b> is in heap order and
+ * that every entry knows its position. */
+static int
+pqueue_is_ok(const ewma_policy_data_t *pol)
+{
+  const ewma_pqueue_t *pq = &pol->active_circuit_pqueue;
+  for (int i = 0; i < pq->n; ++i) {
+    if (pq->ents[i]->heap_index != i)
+      return 0;
+    if (i > 0 && pq->counts[(i - 1) / 4] > pq->counts[i])
+      return 0;
+  }
+  return 1;
+}
+
+static void
+test_cmux_ewma_pqueue_order(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  ewma_policy_data_t *pol;
+  const int n_circs = 200;
+  circuit_t *circs = NULL;
+  circuitmux_policy_circ_data_t **circ_data = NULL;
+  ewma_policy_circ_data_t *ewma_data;
+  double prev, scaled;
+  int i, n_active;
+
+  (void) arg;
+
+  pol_data = ewma_policy.alloc_cmux_data(&cmux);
+  tt_assert(pol_data);
+  pol = TO_EWMA_POL_DATA(pol_data);
+  circs = tor_calloc(n_circs, sizeof(circuit_t));
+  circ_data = tor_calloc(n_circs, sizeof(*circ_data));
+
+  /* Activate circuits with scrambled cell counts. */
+  for (i = 0; i < n_circs; ++i) {
+    circ_data[i] = ewma_policy.alloc_circ_data(&cmux, pol_data, &circs[i],
+                                               CELL_DIRECTION_OUT, 1);
+    ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    tt_assert(ewma_data);
+    ewma_data->cell_ewma.cell_count = (double) ((i * 7919) % 1009);
+    ewma_data->cell_ewma.last_adjusted_tick =
+      pol->active_circuit_pqueue_last_recalibrated;
+    ewma_policy.notify_circ_active(&cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  tt_int_op(pol->active_circuit_pqueue.n, OP_EQ, n_circs);
+  tt_assert(pqueue_is_ok(pol));
+
+  /* Remove every third circuit from the middle of the queue. */
+  n_active = n_circs;
+  for (i = 0; i < n_circs; i += 3) {
+    ewma_policy.notify_circ_inactive(&cmux, pol_data, &circs[i],
+                                     circ_data[i]);
+    ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    tt_assert(ewma_data);
+    tt_int_op(ewma_data->cell_ewma.heap_index, OP_EQ, -1);
+    /* No tick has passed, so the count comes back unscaled. */
+    tt_uint_op(ewma_data->cell_ewma.last_adjusted_tick, OP_EQ,
+               pol->active_circuit_pqueue_last_recalibrated);
+    tt_int_op((int) ewma_data->cell_ewma.cell_count, OP_EQ,
+              (i * 7919) % 1009);
+    --n_active;
+    tt_assert(pqueue_is_ok(pol));
+  }
+  tt_int_op(pol->active_circuit_pqueue.n, OP_EQ, n_active);
+
+  /* Go back one tick: sending on the head rescales every active count, so
+   * the largest count must shrink. */
+  pol->active_circuit_pqueue_last_recalibrated -= 1;
+  prev = 0;
+  for (i = 0; i < pol->active_circuit_pqueue.n; ++i)
+    prev = MAX(prev, pol->active_circuit_pqueue.counts[i]);
+  {
+    circuit_t *head = ewma_policy.pick_active_circuit(&cmux, pol_data);
+    tt_assert(head);
+    i = (int) (head - circs);
+    ewma_policy.notify_xmit_cells(&cmux, pol_data, head, circ_data[i], 1);
+  }
+  tt_assert(pqueue_is_ok(pol));
+  scaled = 0;
+  for (i = 0; i < pol->active_circuit_pqueue.n; ++i)
+    scaled = MAX(scaled, pol->active_circuit_pqueue.counts[i]);
+  tt_double_op(scaled, OP_LT, prev);
+
+  /* Drain the queue: circuits come out lowest count first. */
+  prev = -1.0;
+  while (pol->active_circuit_pqueue.n > 0) {
+    circuit_t *head = ewma_policy.pick_active_circuit(&cmux, pol_data);
+    tt_assert(head);
+    i = (int) (head - circs);
+    ewma_data = TO_EWMA_POL_CIRC_DATA(circ_data[i]);
+    tt_assert(ewma_data);
+    ewma_policy.notify_circ_inactive(&cmux, pol_data, head, circ_data[i]);
+    tt_double_op(ewma_data->cell_ewma.cell_count, OP_GE, prev);
+    prev = ewma_data->cell_ewma.cell_count;
+    tt_assert(pqueue_is_ok(pol));
+  }
+  tt_ptr_op(ewma_policy.pick_active_circuit(&cmux, pol_data), OP_EQ, NULL);
+
+ done:
+  if (circ_data) {
+    for (i = 0; i < n_circs; ++i)
+      ewma_policy.free_circ_data(&cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  tor_free(circ_data);
+  tor_free(circs);
+  ewma_policy.free_cmux_data(&cmux, pol_data);
+}
+
 static void *
 cmux_ewma_setup_test(const struct testcase_t *tc)
 {
@@ -223,6 +334,7 @@ struct testcase_t circuitmux_ewma_tests[] = {
   TEST_CMUX_EWMA(policy_circ_data),
   TEST_CMUX_EWMA(notify_circ),
   TEST_CMUX_EWMA(xmit_cell),
+  TEST_CMUX_EWMA(pqueue_order),
 
   END_OF_TESTCASES
 };
@@ -971,6 +971,73 @@ test_container_strmap(void *arg)
   tor_free(v105);
 }
 
+/** Run unit tests for digestmap_t growth, removal, and tombstone reuse. */
+static void
+test_container_digestmap_churn(void *arg)
+{
+  digestmap_t *map = digestmap_new();
+  const int n = 2000;
+  char *keys = tor_malloc(n * DIGEST_LEN);
+  int i, n_seen = 0;
+  size_t mem;
+
+  (void)arg;
+  crypto_rand(keys, n * DIGEST_LEN);
+  digestmap_assert_ok(map);
+
+  /* Grow the table a few times. */
+  for (i = 0; i < n; ++i) {
+    tt_ptr_op(digestmap_set(map, keys + i*DIGEST_LEN, keys + i*DIGEST_LEN),
+              OP_EQ, NULL);
+  }
+  tt_int_op(digestmap_size(map), OP_EQ, n);
+  digestmap_assert_ok(map);
+  mem = digestmap_mem_usage(map);
+  tt_u64_op(mem, OP_GE, n * (DIGEST_LEN + sizeof(void *)));
+
+  /* Remove every other entry while iterating; every entry must be visited
+   * exactly once even though removal happens under the iterator. */
+  DIGESTMAP_FOREACH_MODIFY(map, k, char *, v) {
+    tt_ptr_op(k, OP_NE, v);
+    tt_mem_op(k, OP_EQ, v, DIGEST_LEN);
+    if (((v - keys) / DIGEST_LEN) % 2)
+      MAP_DEL_CURRENT(k);
+    ++n_seen;
+  } DIGESTMAP_FOREACH_END;
+  tt_int_op(n_seen, OP_EQ, n);
+  tt_int_op(digestmap_size(map), OP_EQ, n / 2);
+  digestmap_assert_ok(map);
+
+  for (i = 0; i < n; ++i) {
+    tt_ptr_op(digestmap_get(map, keys + i*DIGEST_LEN), OP_EQ,
+              (i % 2) ? NULL : keys + i*DIGEST_LEN);
+  }
+
+  /* Reinsert the removed entries: this fills the slots they left behind,
+   * so the table shouldn't need to get any bigger. */
+  for (i = 1; i < n; i += 2) {
+    tt_ptr_op(digestmap_set(map, keys + i*DIGEST_LEN, keys + i*DIGEST_LEN),
+              OP_EQ, NULL);
+  }
+  tt_int_op(digestmap_size(map), OP_EQ, n);
+  tt_u64_op(digestmap_mem_usage(map), OP_EQ, mem);
+  digestmap_assert_ok(map);
+
+  /* Remove and reinsert over and over again. */
+  for (i = 0; i < 20 * n; ++i) {
+    const char *k = keys + (i % n)*DIGEST_LEN;
+    tt_ptr_op(digestmap_remove(map, k), OP_EQ, k);
+    tt_ptr_op(digestmap_remove(map, k), OP_EQ, NULL);
+    tt_ptr_op(digestmap_set(map, k, (void*)k), OP_EQ, NULL);
+  }
+  tt_int_op(digestmap_size(map), OP_EQ, n);
+  digestmap_assert_ok(map);
+
+ done:
+  digestmap_free(map, NULL);
+  tor_free(keys);
+}
+
 static void
 test_container_smartlist_remove(void *arg)
 {
@@ -1380,6 +1447,7 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(bitarray),
   CONTAINER_LEGACY(digestset),
   CONTAINER_LEGACY(strmap),
+  CONTAINER(digestmap_churn, 0),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   CONTAINER(di_map, 0),
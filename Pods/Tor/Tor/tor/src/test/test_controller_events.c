@@ -21,6 +21,7 @@
 #include "test/test_helpers.h"
 #include "test/log_test_helpers.h"
 
+#include "core/or/edge_connection_st.h"
 #include "core/or/entry_connection_st.h"
 #include "core/or/or_circuit_st.h"
 #include "core/or/origin_circuit_st.h"
@@ -436,6 +437,152 @@ test_cntev_signal(void *arg)
   UNMOCK(queue_control_event_string);
 }
 
+static smartlist_t *saved_records = NULL;
+
+static void
+mock_queue_control_event_record(uint16_t event, const uint8_t *body,
+                                size_t body_len)
+{
+  char *hex = tor_malloc(body_len*2 + 1);
+  base16_encode(hex, body_len*2 + 1, (const char *)body, body_len);
+  smartlist_add_asprintf(saved_records, "%x:%s", event, hex);
+  tor_free(hex);
+}
+
+/* Test that bandwidth events are formatted as text, as binary records, or
+ * both, depending on what controllers want. */
+static void
+test_cntev_binary_events(void *arg)
+{
+  origin_circuit_t *ocirc = NULL;
+  edge_connection_t *edge_conn = NULL;
+  const char *rec;
+  (void)arg;
+
+  MOCK(queue_control_event_string, mock_queue_control_event_string);
+  MOCK(queue_control_event_record, mock_queue_control_event_record);
+  saved_records = smartlist_new();
+
+  /* Only text controllers want BW: no records. */
+  control_testing_set_global_event_mask(EVENT_MASK_(EVENT_BANDWIDTH_USED));
+  control_event_bandwidth_used(1000, 2000);
+  tt_str_op(saved_event_str, OP_EQ, "650 BW 1000 2000\r\n");
+  tt_int_op(smartlist_len(saved_records), OP_EQ, 0);
+
+  /* Only binary controllers want BW: no text. */
+  tor_free(saved_event_str);
+  control_testing_set_global_binary_event_mask(
+                                         EVENT_MASK_(EVENT_BANDWIDTH_USED),
+                                         EVENT_MASK_(EVENT_BANDWIDTH_USED));
+  control_event_bandwidth_used(1000, 0x01020304);
+  tt_ptr_op(saved_event_str, OP_EQ, NULL);
+  tt_int_op(smartlist_len(saved_records), OP_EQ, 1);
+  tt_str_op(smartlist_get(saved_records, 0), OP_EQ, "4:000003E801020304");
+
+  /* Both kinds of controller want BW. */
+  control_testing_set_global_binary_event_mask(
+                                         EVENT_MASK_(EVENT_BANDWIDTH_USED), 0);
+  control_event_bandwidth_used(1, 2);
+  tt_str_op(saved_event_str, OP_EQ, "650 BW 1 2\r\n");
+  tt_int_op(smartlist_len(saved_records), OP_EQ, 2);
+  tt_str_op(smartlist_get(saved_records, 1), OP_EQ, "4:0000000100000002");
+
+  /* CIRC_BW, binary only.  Skip the timestamp at the start. */
+  tor_free(saved_event_str);
+  control_testing_set_global_event_mask(
+                                    EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED));
+  control_testing_set_global_binary_event_mask(
+                                    EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED),
+                                    EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED));
+  ocirc = tor_malloc_zero(sizeof(origin_circuit_t));
+  ocirc->base_.magic = ORIGIN_CIRCUIT_MAGIC;
+  ocirc->global_identifier = 7;
+  ocirc->n_read_circ_bw = 509;
+  ocirc->n_written_circ_bw = 1018;
+  ocirc->n_delivered_read_circ_bw = 498;
+  ocirc->n_overhead_read_circ_bw = 11;
+  ocirc->n_delivered_written_circ_bw = 996;
+  ocirc->n_overhead_written_circ_bw = 22;
+  control_event_circ_bandwidth_used_for_circ(ocirc);
+  tt_ptr_op(saved_event_str, OP_EQ, NULL);
+  tt_int_op(smartlist_len(saved_records), OP_EQ, 3);
+  rec = smartlist_get(saved_records, 2);
+  tt_int_op(strlen(rec), OP_EQ, 3 + CIRC_BW_RECORD_LEN*2);
+  tt_str_op(rec + 3 + 16, OP_EQ,
+            "00000007" "000001FD" "000003FA" "000001F2"
+            "0000000B" "000003E4" "00000016" "00000000");
+  tt_int_op(ocirc->n_read_circ_bw, OP_EQ, 0);
+  tt_int_op(ocirc->n_overhead_written_circ_bw, OP_EQ, 0);
+
+  /* STREAM_BW, binary only. */
+  control_testing_set_global_event_mask(
+                                    EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED));
+  control_testing_set_global_binary_event_mask(
+                                    EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED),
+                                    EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED));
+  edge_conn = tor_malloc_zero(sizeof(edge_connection_t));
+  edge_conn->base_.global_identifier = UINT64_C(0x100000002);
+  edge_conn->n_read = 3;
+  edge_conn->n_written = 4;
+  control_event_stream_bandwidth(edge_conn);
+  tt_ptr_op(saved_event_str, OP_EQ, NULL);
+  tt_int_op(smartlist_len(saved_records), OP_EQ, 4);
+  rec = smartlist_get(saved_records, 3);
+  tt_int_op(strlen(rec), OP_EQ, 3 + STREAM_BW_RECORD_LEN*2);
+  tt_str_op(rec + 3 + 16, OP_EQ, "0000000100000002" "00000003" "00000004");
+  tt_int_op(edge_conn->n_read, OP_EQ, 0);
+
+ done:
+  tor_free(saved_event_str);
+  tor_free(ocirc);
+  tor_free(edge_conn);
+  SMARTLIST_FOREACH(saved_records, char *, cp, tor_free(cp));
+  smartlist_free(saved_records);
+  control_testing_set_global_binary_event_mask(0, 0);
+  UNMOCK(queue_control_event_string);
+  UNMOCK(queue_control_event_record);
+}
+
+/* Test picking out the binary records that a controller wants. */
+static void
+test_cntev_records_filter(void *arg)
+{
+  /* BW, CONN_BW (with a body longer than we know about), BW. */
+  static const char records[] =
+    "\x00\x04\x00\x08" "AAAAAAAA"
+    "\x00\x1a\x00\x18" "BBBBBBBBBBBBBBBBBBBBBBBB"
+    "\x00\x04\x00\x08" "CCCCCCCC";
+  const size_t records_len = sizeof(records) - 1;
+  char *out = NULL;
+  size_t len;
+  int n;
+  (void)arg;
+
+  out = control_records_filter(records, records_len,
+                               EVENT_MASK_(EVENT_BANDWIDTH_USED), &len, &n);
+  tt_int_op(n, OP_EQ, 2);
+  tt_int_op(len, OP_EQ, 24);
+  tt_mem_op(out, OP_EQ, "\x00\x04\x00\x08" "AAAAAAAA"
+            "\x00\x04\x00\x08" "CCCCCCCC", 24);
+  tor_free(out);
+
+  out = control_records_filter(records, records_len,
+                               EVENT_MASK_(EVENT_CONN_BW), &len, &n);
+  tt_int_op(n, OP_EQ, 1);
+  tt_int_op(len, OP_EQ, 28);
+  tt_mem_op(out, OP_EQ, records + 12, 28);
+  tor_free(out);
+
+  out = control_records_filter(records, records_len,
+                               EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED),
+                               &len, &n);
+  tt_int_op(n, OP_EQ, 0);
+  tt_int_op(len, OP_EQ, 0);
+
+ done:
+  tor_free(out);
+}
+
 static void
 test_cntev_log_fmt(void *arg)
 {
@@ -745,6 +892,8 @@ struct testcase_t controller_event_tests[] = {
   TEST(event_mask, TT_FORK),
   TEST(format_stream, TT_FORK),
   TEST(signal, TT_FORK),
+  TEST(binary_events, TT_FORK),
+  TEST(records_filter, 0),
   TEST(log_fmt, 0),
   T_PUBSUB(dirboot_defer_desc, TT_FORK),
   T_PUBSUB(dirboot_defer_orconn, TT_FORK),
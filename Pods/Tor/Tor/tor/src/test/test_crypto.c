@@ -3169,6 +3169,135 @@ test_crypto_ed25519_validation(void *arg)
  done: ;
 }
 
+/** Test that batch verification agrees with checking each signature on its
+ * own, including for malformed signatures. */
+static void
+test_crypto_ed25519_batch(void *arg)
+{
+  (void) arg;
+  ed25519_keypair_t kp[4];
+  ed25519_checkable_t ch[100];
+  uint8_t msgs[100][32];
+  int okay[100];
+  int i, n_bad = 0;
+
+  for (i = 0; i < 4; ++i)
+    tt_int_op(0, OP_EQ, ed25519_keypair_generate(&kp[i], 0));
+
+  for (i = 0; i < 100; ++i) {
+    crypto_rand((char *)msgs[i], sizeof(msgs[i]));
+    tt_int_op(0, OP_EQ, ed25519_sign(&ch[i].signature, msgs[i],
+                                     sizeof(msgs[i]), &kp[i % 4]));
+    ch[i].pubkey = &kp[i % 4].pubkey;
+    ch[i].msg = msgs[i];
+    ch[i].len = sizeof(msgs[i]);
+  }
+  /* A flipped bit in S, a truncated message, the wrong key, a high bit set
+   * in S, and an R whose y coordinate is not reduced. */
+  ch[3].signature.sig[40] ^= 4;
+  ch[17].len--;
+  ch[50].pubkey = &kp[1].pubkey;
+  ch[71].signature.sig[63] |= 0x40;
+  memset(ch[99].signature.sig, 0xff, 31);
+  ch[99].signature.sig[31] = 0x7f;
+
+  tt_int_op(-5, OP_EQ, ed25519_checksig_batch(okay, ch, 100));
+  for (i = 0; i < 100; ++i) {
+    int single = ed25519_checksig(&ch[i].signature, ch[i].msg, ch[i].len,
+                                  ch[i].pubkey) == 0;
+    tt_int_op(okay[i], OP_EQ, single);
+    n_bad += !single;
+  }
+  tt_int_op(n_bad, OP_EQ, 5);
+
+  /* Each prefix counts only the bad signatures inside it. */
+  for (i = 1; i <= 100; i += 11) {
+    tt_int_op(ed25519_checksig_batch(NULL, ch, i), OP_EQ,
+              -((i > 3) + (i > 17) + (i > 50) + (i > 71) + (i > 99)));
+  }
+
+ done:
+  ;
+}
+
+/** Test batch verification on signatures from a public key with a torsion
+ * component.  A random linear combination of signature equations can't tell
+ * whether their torsion terms cancel: it fails on signatures that the
+ * single-signature check accepts (bug 40078), and can pass signatures that
+ * the single-signature check rejects.  The batch result must agree with the
+ * single check every time. */
+static void
+test_crypto_ed25519_batch_torsion(void *arg)
+{
+  (void) arg;
+  /* Generated with slow_ed25519.py: the public key is aB + T, where T has
+   * order 8, and each R is rB + jT.  In the first four, j is chosen so that
+   * the torsion terms cancel in SB = R + hA, and the single check accepts
+   * them.  In the last four, 4T is left over, and the single check rejects
+   * them, but a batch whose coefficients sum to an even number would not
+   * notice. */
+  const char pubkey_hex[] =
+    "a8d7b6b0e678c3f5287aa84579852887c77eae35bd3078164d077dd3cc316650";
+  const char *sig_hex[] = {
+    "052b84dcd4384773ee389083ccc899362d58d16214987bb3e48e0ef54ff50ce4"
+    "cbddc86227be68f13c342869b1687bc4b1c9147a19156a50b8617b4f164ea50a",
+    "12cfbab8172dad158d7561c6600f6341c7a4b20af7757e69de39cf0fb24917dd"
+    "b4a99c9d444e0617e5ad34771d3eb975dad818279ac9cf3de34f54177eddad0a",
+    "c664e47fde7d6988f1f67dcfca06196e021849ebd4b7ea8b9fb24637e2087fb5"
+    "cb80c4da714f2b55a0682e95df8a2570abaf874260a8f185e63caaa601607d00",
+    "38ae4a8378908db221259f7a124da653367ca54c614e9419de66b1acad23b8b2"
+    "c4da982c090c4f1bbd793f9fcbe1fb910885c97162119753aa0a1975d759c404",
+    "a97089d4d75332ea8a90c057149822adb4a201eaa725813e52921161ff28366a"
+    "a4202c460c19880de104f54d4ea6feada2accdf2ab2aa3de4272233145535e0b",
+    "14acef66c137189bb6eac4e8357f63811a7b547767fb1580030f4df834d0ceef"
+    "6357d417cf5c373355df909476bea32194d24fd4f227b520bddfcf3756da5a05",
+    "2a8894c8be5e9b2b75f35135e3f40437f632391892a347d49f6d47a6067dda76"
+    "4ab26400d019fc4032a3a04b0678370c611609304a954e86d8d8196de9711809",
+    "10b3ea96447b30860087f98a60817cc3189886f8429aecbdee7247778c181c11"
+    "d4d14cd5354fb7a77a5e67016f38b0a53c4dc6eeb257b66fda2db40db159cd01",
+  };
+  ed25519_public_key_t pubkey;
+  ed25519_checkable_t ch[8];
+  char msgs[8][32];
+  int single[8], okay[8];
+  int i, j;
+
+  tt_int_op(sizeof(pubkey.pubkey), OP_EQ,
+            base16_decode((char *)pubkey.pubkey, sizeof(pubkey.pubkey),
+                          pubkey_hex, strlen(pubkey_hex)));
+  tt_int_op(ed25519_validate_pubkey(&pubkey), OP_EQ, -1);
+
+  for (i = 0; i < 8; ++i) {
+    if (i < 4)
+      tor_snprintf(msgs[i], sizeof(msgs[i]), "Bug 40078, signature %d", i);
+    else
+      tor_snprintf(msgs[i], sizeof(msgs[i]), "Torsion mismatch %d", i - 4);
+    tt_int_op(ED25519_SIG_LEN, OP_EQ,
+              base16_decode((char *)ch[i].signature.sig, ED25519_SIG_LEN,
+                            sig_hex[i], strlen(sig_hex[i])));
+    ch[i].pubkey = &pubkey;
+    ch[i].msg = (const uint8_t *)msgs[i];
+    ch[i].len = strlen(msgs[i]);
+    single[i] = ed25519_checksig(&ch[i].signature, ch[i].msg,
+                                 ch[i].len, &pubkey) == 0;
+    tt_int_op(single[i], OP_EQ, i < 4);
+  }
+
+  /* The random coefficients differ every time; try enough of them that a
+   * batch which can accept the last four would have done so. */
+  for (i = 0; i < 32; ++i) {
+    memset(okay, 0xff, sizeof(okay));
+    tt_int_op(0, OP_EQ, ed25519_checksig_batch(okay, ch, 4));
+    tt_int_op(-4, OP_EQ, ed25519_checksig_batch(okay + 4, ch + 4, 4));
+    tt_int_op(-4, OP_EQ, ed25519_checksig_batch(NULL, ch, 8));
+    for (j = 0; j < 8; ++j)
+      tt_int_op(okay[j], OP_EQ, single[j]);
+  }
+
+ done:
+  ;
+}
+
 static void
 test_crypto_failure_modes(void *arg)
 {
@@ -3254,6 +3383,8 @@ struct testcase_t crypto_tests[] = {
   ED25519_TEST(blinding_fail, 0),
   ED25519_TEST(testvectors, 0),
   ED25519_TEST(validation, 0),
+  ED25519_TEST(batch, 0),
+  ED25519_TEST(batch_torsion, 0),
   { "ed25519_storage", test_crypto_ed25519_storage, 0, NULL, NULL },
   { "siphash", test_crypto_siphash, 0, NULL, NULL },
   { "blake2b", test_crypto_blake2b, 0, NULL, NULL },
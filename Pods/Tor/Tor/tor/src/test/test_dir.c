@@ -28,6 +28,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/relay.h"
 #include "core/or/protover.h"
 #include "core/or/versions.h"
@@ -71,6 +72,7 @@
 #include "lib/crypt_ops/crypto_format.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
 #include "lib/osinfo/uname.h"
 #include "test/log_test_helpers.h"
@@ -3800,6 +3802,190 @@ test_dir_v3_networkstatus(void *arg)
                        test_routerstatus_for_v3ns);
 }
 
+/** Work queued by mock_ns_parse_queue_work(), as fake_work_queue_ent_t. */
+static smartlist_t *ns_parse_queued_work = NULL;
+/** If true, mock_ns_parse_queue_work() runs work as soon as it is queued,
+ * as if a cpuworker picked it up at once. */
+static int ns_parse_run_work_now = 0;
+typedef struct ns_parse_work_t {
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} ns_parse_work_t;
+
+static unsigned int
+mock_cpuworker_get_n_threads_3(void)
+{
+  return 3;
+}
+
+static workqueue_entry_t *
+mock_ns_parse_queue_work(workqueue_priority_t prio,
+                         workqueue_reply_t (*fn)(void *, void *),
+                         void (*reply_fn)(void *),
+                         void *arg)
+{
+  (void) prio;
+  ns_parse_work_t *work = tor_malloc_zero(sizeof(*work));
+  work->fn = fn;
+  work->reply_fn = reply_fn;
+  work->arg = arg;
+  if (!ns_parse_queued_work)
+    ns_parse_queued_work = smartlist_new();
+  smartlist_add(ns_parse_queued_work, work);
+  if (ns_parse_run_work_now)
+    tt_int_op(fn(NULL, arg), OP_EQ, WQ_RPL_REPLY);
+ done:
+  return (workqueue_entry_t *)work;
+}
+
+/** Run (unless already run) and reply to everything in
+ * ns_parse_queued_work.  Return how many work entries there were. */
+static int
+ns_parse_finish_queued_work(void)
+{
+  int n = 0;
+  if (!ns_parse_queued_work)
+    return 0;
+  SMARTLIST_FOREACH_BEGIN(ns_parse_queued_work, ns_parse_work_t *, work) {
+    if (!ns_parse_run_work_now)
+      tt_int_op(work->fn(NULL, work->arg), OP_EQ, WQ_RPL_REPLY);
+    work->reply_fn(work->arg);
+    tor_free(work);
+    ++n;
+  } SMARTLIST_FOREACH_END(work);
+ done:
+  smartlist_free(ns_parse_queued_work);
+  return n;
+}
+
+/** Check that the vote_routerstatus_t entries of <b>a</b> and <b>b</b>
+ * are the same. */
+static void
+ns_parse_check_same_entries(const networkstatus_t *a, const networkstatus_t *b)
+{
+  tt_assert(a);
+  tt_assert(b);
+  tt_int_op(smartlist_len(a->routerstatus_list), OP_EQ,
+            smartlist_len(b->routerstatus_list));
+  tt_int_op(a->has_measured_bws, OP_EQ, b->has_measured_bws);
+  for (int i = 0; i < smartlist_len(a->routerstatus_list); ++i) {
+    const vote_routerstatus_t *va = smartlist_get(a->routerstatus_list, i);
+    const vote_routerstatus_t *vb = smartlist_get(b->routerstatus_list, i);
+    tt_str_op(va->status.nickname, OP_EQ, vb->status.nickname);
+    tt_mem_op(va->status.identity_digest, OP_EQ, vb->status.identity_digest,
+              DIGEST_LEN);
+    tt_mem_op(va->status.descriptor_digest, OP_EQ,
+              vb->status.descriptor_digest, DIGEST256_LEN);
+    tt_assert(tor_addr_eq(&va->status.ipv4_addr, &vb->status.ipv4_addr));
+    tt_assert(tor_addr_eq(&va->status.ipv6_addr, &vb->status.ipv6_addr));
+    tt_int_op(va->status.ipv4_orport, OP_EQ, vb->status.ipv4_orport);
+    tt_int_op(va->status.ipv6_orport, OP_EQ, vb->status.ipv6_orport);
+    tt_u64_op(va->flags, OP_EQ, vb->flags);
+    tt_int_op(va->published_on, OP_EQ, vb->published_on);
+    tt_str_op(va->version, OP_EQ, vb->version);
+    tt_str_op(va->protocols, OP_EQ, vb->protocols);
+    tt_int_op(va->status.bandwidth_kb, OP_EQ, vb->status.bandwidth_kb);
+    tt_int_op(va->measured_bw_kb, OP_EQ, vb->measured_bw_kb);
+    tt_mem_op(&va->status.pv, OP_EQ, &vb->status.pv,
+              sizeof(protover_summary_flags_t));
+  }
+ done:
+  ;
+}
+
+/** Make sure that parsing a vote's routerstatus entries on the cpuworkers
+ * gives exactly what parsing them on the main thread does. */
+static void
+test_dir_ns_parse_parallel(void *arg)
+{
+  authority_cert_t *cert1=NULL, *cert2=NULL, *cert3=NULL;
+  crypto_pk_t *sign_skey_1=NULL, *sign_skey_2=NULL, *sign_skey_3=NULL;
+  networkstatus_t *vote=NULL, *v1=NULL, *serial=NULL, *parallel=NULL;
+  char *v_text=NULL, *cp;
+  size_t v_len;
+  int n_vrs;
+  time_t now = time(NULL);
+  const size_t orig_min_len = ns_parse_parallel_min_len;
+  const size_t orig_chunk_len = ns_parse_min_chunk_len;
+  (void)arg;
+
+  get_options_mutable()->NumCPUs = 4;
+  MOCK(cpuworker_get_n_threads, mock_cpuworker_get_n_threads_3);
+  MOCK(cpuworker_queue_work, mock_ns_parse_queue_work);
+
+  tt_assert(!dir_common_authority_pk_init(&cert1, &cert2, &cert3,
+                                          &sign_skey_1, &sign_skey_2,
+                                          &sign_skey_3));
+  tt_assert(!dir_common_construct_vote_1(&vote, cert1, sign_skey_1,
+                                         &dir_common_gen_routerstatus_for_v3ns,
+                                         &v1, &n_vrs, now, 1));
+  tt_int_op(n_vrs, OP_EQ, 4);
+  v_text = format_networkstatus_vote(sign_skey_1, vote);
+  tt_assert(v_text);
+  v_len = strlen(v_text);
+
+  /* A small vote gets parsed on the main thread alone. */
+  serial = networkstatus_parse_vote_from_string(v_text, v_len, NULL,
+                                                NS_TYPE_VOTE);
+  tt_assert(serial);
+  tt_int_op(ns_parse_finish_queued_work(), OP_EQ, 0);
+  tt_int_op(smartlist_len(serial->routerstatus_list), OP_EQ, 4);
+
+  /* Split the same vote into one-entry chunks. Helpers that start late find
+   * the main thread has done all the work. */
+  ns_parse_parallel_min_len = 0;
+  ns_parse_min_chunk_len = 1;
+  parallel = networkstatus_parse_vote_from_string(v_text, v_len, NULL,
+                                                  NS_TYPE_VOTE);
+  tt_int_op(ns_parse_finish_queued_work(), OP_EQ, 3);
+  ns_parse_check_same_entries(serial, parallel);
+  networkstatus_vote_free(parallel);
+
+  /* Helpers that start at once do all the work instead. */
+  ns_parse_run_work_now = 1;
+  parallel = networkstatus_parse_vote_from_string(v_text, v_len, NULL,
+                                                  NS_TYPE_VOTE);
+  tt_int_op(ns_parse_finish_queued_work(), OP_EQ, 3);
+  ns_parse_check_same_entries(serial, parallel);
+  networkstatus_vote_free(parallel);
+
+  /* A malformed entry in a later chunk still sinks the whole vote. */
+  cp = strstr(v_text, "\nr ");
+  tt_assert(cp);
+  cp = strstr(cp + 1, "\nr ");
+  tt_assert(cp);
+  cp = strstr(cp + 1, "\nr ");
+  tt_assert(cp);
+  cp[3] = '!'; /* not a legal nickname */
+  setup_full_capture_of_logs(LOG_WARN);
+  parallel = networkstatus_parse_vote_from_string(v_text, v_len, NULL,
+                                                  NS_TYPE_VOTE);
+  tt_ptr_op(parallel, OP_EQ, NULL);
+  expect_log_msg_containing("Invalid nickname");
+  teardown_capture_of_logs();
+  tt_int_op(ns_parse_finish_queued_work(), OP_EQ, 3);
+
+ done:
+  teardown_capture_of_logs();
+  ns_parse_parallel_min_len = orig_min_len;
+  ns_parse_min_chunk_len = orig_chunk_len;
+  ns_parse_run_work_now = 0;
+  UNMOCK(cpuworker_get_n_threads);
+  UNMOCK(cpuworker_queue_work);
+  tor_free(v_text);
+  networkstatus_vote_free(vote);
+  networkstatus_vote_free(v1);
+  networkstatus_vote_free(serial);
+  networkstatus_vote_free(parallel);
+  authority_cert_free(cert1);
+  authority_cert_free(cert2);
+  authority_cert_free(cert3);
+  crypto_pk_free(sign_skey_1);
+  crypto_pk_free(sign_skey_2);
+  crypto_pk_free(sign_skey_3);
+}
+
 static void
 test_dir_scale_bw(void *testdata)
 {
@@ -3946,6 +4132,94 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_random_weighted_alias(void *testdata)
+{
+  int histogram[10];
+  double vals[10] = {3,1,2,4,6,0,7,5,8,9}, total = 0;
+  weighted_alias_table_t *table = NULL;
+  int i, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  /* Same ten-element array as test_dir_random_weighted(): the alias table
+   * should choose with the same frequencies. */
+  memset(histogram,0,sizeof(histogram));
+  for (i=0; i<10; ++i)
+    total += vals[i];
+  table = weighted_alias_table_new(vals, 10);
+  tt_int_op(table->n, OP_EQ, 10);
+  for (i=0; i<n; ++i) {
+    choice = weighted_alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+  weighted_alias_table_free(table);
+
+  max_sq_error = 0;
+  for (i=0; i<10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* A singleton is always chosen. */
+  table = weighted_alias_table_new(vals, 1);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(weighted_alias_table_choose(table), OP_EQ, 0);
+  weighted_alias_table_free(table);
+
+  /* One heavy element among many light ones never hands its share to a
+   * zero-weight element. */
+  {
+    double skewed[1000];
+    for (i = 0; i < 1000; ++i)
+      skewed[i] = (i % 2) ? 1.0 : 0.0;
+    skewed[500] = 1e6;
+    table = weighted_alias_table_new(skewed, 1000);
+    for (i = 0; i < n; ++i) {
+      choice = weighted_alias_table_choose(table);
+      tt_assert(choice == 500 || (choice % 2) == 1);
+    }
+    weighted_alias_table_free(table);
+  }
+
+  /* An array of zeros: choose uniformly. */
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < 5; ++i)
+    vals[i] = 0;
+  table = weighted_alias_table_new(vals, 5);
+  for (i = 0; i < n; ++i) {
+    choice = weighted_alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 5);
+    histogram[choice]++;
+  }
+  max_sq_error = 0;
+  for (i=0; i<5; ++i) {
+    int expected = n/5;
+    double frac_diff = 0, sq;
+    frac_diff = (histogram[i] - expected) / ((double)expected);
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+ done:
+  weighted_alias_table_free(table);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -7242,7 +7516,9 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(param_voting),
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
+  DIR(ns_parse_parallel, TT_FORK),
   DIR(random_weighted, 0),
+  DIR(random_weighted_alias, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
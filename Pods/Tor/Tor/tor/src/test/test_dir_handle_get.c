@@ -9,6 +9,7 @@
 #define CONFIG_PRIVATE
 #define RENDCACHE_PRIVATE
 #define DIRCACHE_PRIVATE
+#define DIRSERV_PRIVATE
 
 #include "core/or/or.h"
 #include "app/config/config.h"
@@ -328,6 +329,15 @@ static const char microdesc[] =
   "-----END RSA PUBLIC KEY-----\n"
   "ntor-onion-key QlrOXAa8j3LD31LESsPm/lIKFBwevk2oXdqJcd9SEUc=\n";
 
+static const char microdesc2[] =
+  "onion-key\n"
+  "-----BEGIN RSA PUBLIC KEY-----\n"
+  "MIGJAoGBAMjlHH/daN43cSVRaHBwgUfnszzAhg98EvivJ9Qxfv51mvQUxPjQ07es\n"
+  "gV/3n8fyh3Kqr/ehi9jxkdgSRfSnmF7giaHL1SLZ29kA7KtST+pBvmTpDtHa3ykX\n"
+  "Xorc7hJvIyTZoc1HU+5XSynj3gsBE5IGK1ZRzrNS688LnuZMVp1tAgMBAAE=\n"
+  "-----END RSA PUBLIC KEY-----\n"
+  "ntor-onion-key G1mMKXc4OJkfFeLTSLJvtRhpeAFEY6XejizqLVSdZnU=\n";
+
 static void
 test_dir_handle_get_micro_d(void *data)
 {
@@ -442,6 +452,119 @@ test_dir_handle_get_micro_d_server_busy(void *data)
     microdesc_free_all();
 }
 
+static void
+test_dir_handle_get_micro_d_shared(void *data)
+{
+  dir_connection_t *conn1 = NULL, *conn2 = NULL;
+  microdesc_cache_t *mc = NULL ;
+  smartlist_t *list = NULL, *list2 = NULL;
+  char digest[DIGEST256_LEN], digest2[DIGEST256_LEN];
+  char digest_base64[128], digest2_base64[128];
+  char path[256];
+  char *header1 = NULL, *header2 = NULL;
+  char *body1 = NULL, *body2 = NULL;
+  char *uncompressed = NULL;
+  size_t body1_used = 0, body2_used = 0, uncompressed_len = 0;
+  (void) data;
+
+  MOCK(get_options, mock_get_options);
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+
+  /* SETUP */
+  init_mock_options();
+
+  /* Add microdesc to cache */
+  crypto_digest256(digest, microdesc, strlen(microdesc), DIGEST_SHA256);
+  base64_encode_nopad(digest_base64, sizeof(digest_base64),
+                      (uint8_t *) digest, DIGEST256_LEN);
+
+  mc = get_microdesc_cache();
+  list = microdescs_add_to_cache(mc, microdesc, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(list));
+
+  /* Ask for it compressed, twice. */
+  tor_snprintf(path, sizeof(path), MICRODESC_GET("%s.z"), digest_base64);
+  conn1 = new_dir_conn();
+  tt_int_op(directory_handle_command_get(conn1, path, NULL, 0), OP_EQ, 0);
+  tt_int_op(spool_blob_cache_get_n_entries(), OP_EQ, 1);
+  conn2 = new_dir_conn();
+  tt_int_op(directory_handle_command_get(conn2, path, NULL, 0), OP_EQ, 0);
+  tt_int_op(spool_blob_cache_get_n_entries(), OP_EQ, 1);
+
+  fetch_from_buf_http(TO_CONN(conn1)->outbuf, &header1, MAX_HEADERS_SIZE,
+                      &body1, &body1_used, 4096, 0);
+  fetch_from_buf_http(TO_CONN(conn2)->outbuf, &header2, MAX_HEADERS_SIZE,
+                      &body2, &body2_used, 4096, 0);
+  tt_assert(header1);
+  tt_assert(body1);
+  tt_assert(strstr(header1, "Content-Encoding: deflate\r\n"));
+  tt_str_op(header1, OP_EQ, header2);
+
+  /* Both connections got the same compressed bytes, made once. */
+  tt_size_op(body1_used, OP_EQ, spool_blob_cache_get_total_len());
+  tt_mem_op(body1, OP_EQ, body2, body1_used);
+  tt_int_op(body1_used, OP_EQ, body2_used);
+  tt_int_op(0, OP_EQ, tor_uncompress(&uncompressed, &uncompressed_len,
+                                     body1, body1_used, ZLIB_METHOD, 1,
+                                     LOG_WARN));
+  tt_str_op(uncompressed, OP_EQ, microdesc);
+
+  connection_free_minimal(TO_CONN(conn1));
+  connection_free_minimal(TO_CONN(conn2));
+  conn1 = conn2 = NULL;
+  tor_free(header1);
+  tor_free(header2);
+  tor_free(body1);
+  tor_free(body2);
+
+  /* Asking for the same two microdescs in either order shares one blob. */
+  crypto_digest256(digest2, microdesc2, strlen(microdesc2), DIGEST_SHA256);
+  base64_encode_nopad(digest2_base64, sizeof(digest2_base64),
+                      (uint8_t *) digest2, DIGEST256_LEN);
+  list2 = microdescs_add_to_cache(mc, microdesc2, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(list2));
+
+  tor_snprintf(path, sizeof(path), MICRODESC_GET("%s-%s.z"),
+               digest_base64, digest2_base64);
+  conn1 = new_dir_conn();
+  tt_int_op(directory_handle_command_get(conn1, path, NULL, 0), OP_EQ, 0);
+  tt_int_op(spool_blob_cache_get_n_entries(), OP_EQ, 2);
+  tor_snprintf(path, sizeof(path), MICRODESC_GET("%s-%s.z"),
+               digest2_base64, digest_base64);
+  conn2 = new_dir_conn();
+  tt_int_op(directory_handle_command_get(conn2, path, NULL, 0), OP_EQ, 0);
+  tt_int_op(spool_blob_cache_get_n_entries(), OP_EQ, 2);
+
+  fetch_from_buf_http(TO_CONN(conn1)->outbuf, &header1, MAX_HEADERS_SIZE,
+                      &body1, &body1_used, 4096, 0);
+  fetch_from_buf_http(TO_CONN(conn2)->outbuf, &header2, MAX_HEADERS_SIZE,
+                      &body2, &body2_used, 4096, 0);
+  tt_assert(body1);
+  tt_int_op(body1_used, OP_EQ, body2_used);
+  tt_mem_op(body1, OP_EQ, body2, body1_used);
+
+  done:
+    UNMOCK(get_options);
+    UNMOCK(connection_write_to_buf_impl_);
+
+    or_options_free(mock_options); mock_options = NULL;
+    if (conn1)
+      connection_free_minimal(TO_CONN(conn1));
+    if (conn2)
+      connection_free_minimal(TO_CONN(conn2));
+    tor_free(header1);
+    tor_free(header2);
+    tor_free(body1);
+    tor_free(body2);
+    tor_free(uncompressed);
+    smartlist_free(list);
+    smartlist_free(list2);
+    microdesc_free_all();
+    dirserv_free_all();
+}
+
 #define BRIDGES_PATH "/tor/networkstatus-bridges"
 static void
 test_dir_handle_get_networkstatus_bridges_not_found_without_auth(void *data)
@@ -2744,6 +2867,7 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(micro_d_not_found, 0),
   DIR_HANDLE_CMD(micro_d_server_busy, 0),
   DIR_HANDLE_CMD(micro_d, 0),
+  DIR_HANDLE_CMD(micro_d_shared, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_without_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_wrong_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges, 0),
@@ -803,6 +803,119 @@ test_dns_impl_cache_miss(void *arg)
   return;
 }
 
+/* Given a hot cached answer that is about to expire, we want
+ * dns_resolve_impl() to keep answering from it while it launches a single
+ * refresh, and the answer to that refresh to replace the cached one in
+ * place.
+ */
+static int n_prefetch_launches = 0;
+
+static int
+dns_impl_cache_prefetch_launch_resolve(cached_resolve_t *resolve)
+{
+  last_launched_resolve = resolve;
+  resolve->res_status_ipv4 = RES_STATUS_INFLIGHT;
+  ++n_prefetch_launches;
+
+  return 0;
+}
+
+static void
+test_dns_impl_cache_prefetch(void *arg)
+{
+  int retval;
+  int made_pending = 0;
+  time_t now = time(NULL);
+  tor_addr_t answer;
+  dns_cache_stats_t stats;
+
+  edge_connection_t *exitconn = create_valid_exitconn();
+  or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
+
+  cached_resolve_t *resolve_out = NULL;
+
+  cached_resolve_t *cache_entry = tor_malloc_zero(sizeof(cached_resolve_t));
+  cache_entry->magic = CACHED_RESOLVE_MAGIC;
+  cache_entry->state = CACHE_STATE_CACHED;
+  cache_entry->minheap_idx = -1;
+  cache_entry->res_status_ipv4 = RES_STATUS_DONE_OK;
+  cache_entry->result_ipv4.addr_ipv4 = 0x01020304;
+  cache_entry->lifetime = 800;
+  cache_entry->expire = now + 60;
+  cache_entry->n_hits = DNS_PREFETCH_MIN_HITS - 2;
+
+  (void)arg;
+
+  TO_CONN(exitconn)->address = tor_strdup("torproject.org");
+
+  strlcpy(cache_entry->address, TO_CONN(exitconn)->address,
+          sizeof(cache_entry->address));
+
+  MOCK(router_my_exit_policy_is_reject_star,
+       dns_impl_cache_hit_cached_router_my_exit_policy_is_reject_star);
+  MOCK(set_exitconn_info_from_resolve,
+       dns_impl_cache_hit_cached_set_exitconn_info_from_resolve);
+  MOCK(launch_resolve,
+       dns_impl_cache_prefetch_launch_resolve);
+
+  dns_init();
+
+  dns_insert_cache_entry(cache_entry);
+
+  /* Not hot enough yet. */
+  retval = dns_resolve_impl(exitconn, 1, on_circ, NULL, &made_pending,
+                            &resolve_out);
+  tt_int_op(retval,OP_EQ,0);
+  tt_int_op(n_prefetch_launches,OP_EQ,0);
+  tt_ptr_op(cache_entry->refresh,OP_EQ,NULL);
+
+  /* Now it is: we answer from the cache and launch a refresh. */
+  retval = dns_resolve_impl(exitconn, 1, on_circ, NULL, &made_pending,
+                            &resolve_out);
+  tt_int_op(retval,OP_EQ,0);
+  tt_int_op(made_pending,OP_EQ,0);
+  tt_assert(resolve_out == cache_entry);
+  tt_int_op(n_prefetch_launches,OP_EQ,1);
+  tt_assert(cache_entry->refresh);
+  tt_assert(last_launched_resolve == cache_entry->refresh);
+  tt_str_op(cache_entry->refresh->address,OP_EQ,cache_entry->address);
+
+  /* Only one refresh at a time. */
+  retval = dns_resolve_impl(exitconn, 1, on_circ, NULL, &made_pending,
+                            &resolve_out);
+  tt_int_op(retval,OP_EQ,0);
+  tt_int_op(n_prefetch_launches,OP_EQ,1);
+
+  /* The refresh's answer replaces the cached one. */
+  tor_addr_from_ipv4h(&answer, 0x05060708);
+  dns_found_answer(cache_entry->address, DNS_IPv4_A, DNS_ERR_NONE,
+                   &answer, NULL, 3600);
+  tt_assert(dns_get_cache_entry(cache_entry) == cache_entry);
+  tt_ptr_op(cache_entry->refresh,OP_EQ,NULL);
+  tt_int_op(cache_entry->state,OP_EQ,CACHE_STATE_CACHED);
+  tt_int_op(cache_entry->res_status_ipv4,OP_EQ,RES_STATUS_DONE_OK);
+  tt_uint_op(cache_entry->result_ipv4.addr_ipv4,OP_EQ,0x05060708);
+  tt_uint_op(cache_entry->lifetime,OP_EQ,3600);
+  tt_int_op(cache_entry->expire,OP_GE,now + 3600);
+  tt_uint_op(cache_entry->n_hits,OP_EQ,0);
+
+  dns_get_cache_stats(&stats);
+  tt_u64_op(stats.n_hits,OP_EQ,3);
+  tt_u64_op(stats.n_prefetches,OP_EQ,1);
+  tt_u64_op(stats.n_answers,OP_EQ,1);
+  tt_u64_op(stats.n_entries,OP_EQ,1);
+
+  done:
+  UNMOCK(router_my_exit_policy_is_reject_star);
+  UNMOCK(set_exitconn_info_from_resolve);
+  UNMOCK(launch_resolve);
+  dns_free_all();
+  tor_free(on_circ);
+  tor_free(TO_CONN(exitconn)->address);
+  tor_free(exitconn);
+  return;
+}
+
 struct testcase_t dns_tests[] = {
 #ifdef HAVE_EVDNS_BASE_GET_NAMESERVER_ADDR
    { "configure_ns_fallback", test_dns_configure_ns_fallback,
@@ -821,5 +934,7 @@ struct testcase_t dns_tests[] = {
    { "impl_cache_hit_cached", test_dns_impl_cache_hit_cached,
      TT_FORK, NULL, NULL },
    { "impl_cache_miss", test_dns_impl_cache_miss, TT_FORK, NULL, NULL },
+   { "impl_cache_prefetch", test_dns_impl_cache_prefetch,
+     TT_FORK, NULL, NULL },
    END_OF_TESTCASES
 };
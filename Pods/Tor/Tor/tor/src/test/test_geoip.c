@@ -13,6 +13,11 @@
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
 #include "test/test.h"
+#include "test/log_test_helpers.h"
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
   /* Record odd numbered fake-IPs using ipv6, even numbered fake-IPs
    * using ipv4.  Since our fake geoip database is the same between
@@ -564,6 +569,118 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+static void
+test_geoip_load_file_cached(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip_cached_src"));
+  char *cache_fname = tor_strdup(get_fname("cached-geoip"));
+  char *cache = NULL;
+  char *dhex = NULL;
+  size_t cache_len;
+  struct stat st;
+
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, GEOIP_CONTENT, 1));
+
+  /* The first load parses the file and writes the cache. */
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ,
+            geoip_load_file_cached(AF_INET, fname, cache_fname, LOG_WARN));
+  expect_log_msg_containing("Parsing GEOIP IPv4 file");
+  teardown_capture_of_logs();
+  tt_int_op(FN_FILE, OP_EQ, file_status(cache_fname));
+  int country = geoip_get_country_by_ipv4(0x08080808);
+  tt_int_op(country, OP_GE, 1);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "US");
+  dhex = tor_strdup(geoip_db_digest(AF_INET));
+
+  /* The second load uses the cache, and gives the same answers. */
+  geoip_free_all();
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ,
+            geoip_load_file_cached(AF_INET, fname, cache_fname, LOG_WARN));
+  expect_log_msg_containing("from cache");
+  teardown_capture_of_logs();
+  country = geoip_get_country_by_ipv4(0x08080808);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "US");
+  tt_str_op(geoip_get_country_name(geoip_get_country_by_ipv4(135195000)),
+            OP_EQ, "MX");
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0x01020304));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0xffffffff));
+  tt_str_op(dhex, OP_EQ, geoip_db_digest(AF_INET));
+
+  /* A damaged cache gets ignored, and the file gets parsed again. */
+  cache = read_file_to_str(cache_fname, RFTS_BIN, &st);
+  tt_assert(cache);
+  cache_len = (size_t)st.st_size;
+  tt_int_op(cache_len, OP_GT, 48);
+  cache[48] = 'x';
+  tt_int_op(0, OP_EQ, write_bytes_to_file(cache_fname, cache, cache_len, 1));
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ,
+            geoip_load_file_cached(AF_INET, fname, cache_fname, LOG_WARN));
+  expect_log_msg_containing("is corrupt");
+  expect_log_msg_containing("Parsing GEOIP IPv4 file");
+  teardown_capture_of_logs();
+  country = geoip_get_country_by_ipv4(0x08080808);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "US");
+
+  /* A changed file makes the cache stale. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, "134744064,134744319,DE\n",
+                                        1));
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ,
+            geoip_load_file_cached(AF_INET, fname, cache_fname, LOG_WARN));
+  expect_log_msg_containing("Parsing GEOIP IPv4 file");
+  teardown_capture_of_logs();
+  country = geoip_get_country_by_ipv4(0x08080808);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "DE");
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0x08080908));
+
+ done:
+  teardown_capture_of_logs();
+  tor_free(fname);
+  tor_free(cache_fname);
+  tor_free(cache);
+  tor_free(dhex);
+}
+
+static void
+test_geoip_overlapping_ranges(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip_overlap"));
+  const char CONTENT[] =
+    "100,199,AA\n"
+    "150,249,BB\n"
+    "300,399,CC\n"
+    "400,499,CC\n"
+    "320,329,DD\n";
+
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, CONTENT, 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname, LOG_WARN));
+
+#define CHECK_CC(addr, cc) \
+  tt_str_op(geoip_get_country_name(geoip_get_country_by_ipv4(addr)), \
+            OP_EQ, (cc))
+  CHECK_CC(0, "??");
+  CHECK_CC(99, "??");
+  CHECK_CC(100, "AA");
+  /* Where two ranges overlap, the one that starts first wins. */
+  CHECK_CC(199, "AA");
+  CHECK_CC(200, "BB");
+  CHECK_CC(249, "BB");
+  CHECK_CC(250, "??");
+  CHECK_CC(325, "CC");
+  CHECK_CC(450, "CC");
+  CHECK_CC(500, "??");
+  CHECK_CC(0xffffffff, "??");
+#undef CHECK_CC
+
+ done:
+  tor_free(fname);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +692,9 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "load_file_cached", test_geoip_load_file_cached, TT_FORK, NULL, NULL },
+  { "overlapping_ranges", test_geoip_overlapping_ranges, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
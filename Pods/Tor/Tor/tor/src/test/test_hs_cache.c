@@ -279,6 +279,79 @@ test_clean_oom_as_dir(void *arg)
   tor_free(desc2_str);
 }
 
+static void
+test_evict_order_as_dir(void *arg)
+{
+  int ret;
+  size_t removed;
+  char *desc_str[3] = { NULL, NULL, NULL };
+  hs_descriptor_t *desc[3] = { NULL, NULL, NULL };
+  ed25519_keypair_t signing_kp;
+  hs_cache_dir_stats_t stats;
+
+  (void) arg;
+
+  init_test();
+
+  for (int i = 0; i < 3; ++i) {
+    ret = ed25519_keypair_generate(&signing_kp, 0);
+    tt_int_op(ret, OP_EQ, 0);
+    desc[i] = hs_helper_build_hs_desc_with_ip(&signing_kp);
+    tt_assert(desc[i]);
+    ret = hs_desc_encode_descriptor(desc[i], &signing_kp, NULL, &desc_str[i]);
+    tt_int_op(ret, OP_EQ, 0);
+    ret = hs_cache_store_as_dir(desc_str[i]);
+    tt_int_op(ret, OP_EQ, 0);
+  }
+
+  hs_cache_get_dir_stats(&stats);
+  tt_size_op(stats.n_entries, OP_EQ, 3);
+  tt_size_op(stats.n_bytes, OP_EQ, hs_cache_get_total_allocation());
+
+  /* The oldest one gets downloaded, so it should be evicted last. */
+  dir_set_downloaded(&desc[0]->plaintext_data.blinded_pubkey, 1);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[0]), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+
+  /* Then the never downloaded ones go, oldest first. */
+  removed = hs_cache_handle_oom(1);
+  tt_size_op(removed, OP_GT, 0);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[1]), NULL);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[2]), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+  removed = hs_cache_handle_oom(1);
+  tt_size_op(removed, OP_GT, 0);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[2]), NULL);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[0]), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+
+  hs_cache_get_dir_stats(&stats);
+  tt_u64_op(stats.n_hits, OP_EQ, 3);
+  tt_u64_op(stats.n_misses, OP_EQ, 2);
+  tt_u64_op(stats.n_evicted_oom, OP_EQ, 2);
+  tt_size_op(stats.n_entries, OP_EQ, 1);
+
+  /* Expiry uses the lifetime of the descriptor. */
+  ret = (int) cache_clean_v3_as_dir(time(NULL) + 60, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = (int) cache_clean_v3_as_dir(
+              time(NULL) + desc[0]->plaintext_data.lifetime_sec + 1, 0);
+  tt_int_op(ret, OP_GT, 0);
+  hs_cache_get_dir_stats(&stats);
+  tt_u64_op(stats.n_expired, OP_EQ, 1);
+  tt_size_op(stats.n_entries, OP_EQ, 0);
+  tt_size_op(stats.n_bytes, OP_EQ, 0);
+  tt_size_op(hs_cache_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  for (int i = 0; i < 3; ++i) {
+    hs_descriptor_free(desc[i]);
+    tor_free(desc_str[i]);
+  }
+}
+
 /* Test helper: Fetch an HS descriptor from an HSDir (for the hidden service
    with <b>blinded_key</b>. Return the received descriptor string. */
 static char *
@@ -762,6 +835,8 @@ struct testcase_t hs_cache[] = {
     NULL, NULL },
   { "clean_oom_as_dir", test_clean_oom_as_dir, TT_FORK,
     NULL, NULL },
+  { "evict_order_as_dir", test_evict_order_as_dir, TT_FORK,
+    NULL, NULL },
   { "hsdir_revision_counter_check", test_hsdir_revision_counter_check, TT_FORK,
     NULL, NULL },
   { "upload_and_download_hs_desc", test_upload_and_download_hs_desc, TT_FORK,
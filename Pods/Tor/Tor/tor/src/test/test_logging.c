@@ -181,9 +181,104 @@ test_ratelim(void *arg)
   tor_free(msg);
 }
 
+static int async_n_wakeups = 0;
+static void
+async_wakeup_cb(void)
+{
+  ++async_n_wakeups;
+}
+
+static void
+test_async(void *arg)
+{
+  const char *fn = get_fname("async_log");
+  char *content = NULL;
+  const char *cp;
+  log_severity_list_t everything;
+  int i;
+  (void)arg;
+
+  set_log_severity_config(LOG_DEBUG, LOG_ERR, &everything);
+  init_logging(1);
+  open_and_add_file_log(&everything, fn, 0);
+  tt_int_op(logs_set_async(1, async_wakeup_cb), OP_EQ, 0);
+
+  /* Messages wait in the ring until somebody drains it. */
+  log_info(LD_GENERAL, "first message");
+  log_notice(LD_GENERAL, "second message");
+  tt_int_op(async_n_wakeups, OP_GE, 2);
+  tt_assert(! logs_async_is_idle());
+  content = read_file_to_str(fn, 0, NULL);
+  tt_ptr_op(strstr(content, "first message"), OP_EQ, NULL);
+  tor_free(content);
+
+  tt_int_op(logs_async_drain(), OP_GE, 2);
+  tt_assert(logs_async_is_idle());
+  content = read_file_to_str(fn, 0, NULL);
+  cp = strstr(content, "first message");
+  tt_assert(cp);
+  tt_assert(strstr(cp, "second message"));
+  tor_free(content);
+
+  /* Overflow the ring: debug messages get dropped, but warnings don't. */
+  for (i = 0; i < 20000; ++i) {
+    log_debug(LD_GENERAL, "filler %d: %0200d", i, i);
+  }
+  tt_u64_op(logs_get_n_async_dropped(), OP_GT, 0);
+  log_warn(LD_GENERAL, "too important to drop");
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(strstr(content, "too important to drop"));
+  tor_free(content);
+
+  /* Once there's room, we say how many we dropped. */
+  tt_int_op(logs_async_drain(), OP_GT, 0);
+  log_info(LD_GENERAL, "caught up");
+  tt_int_op(logs_set_async(0, NULL), OP_EQ, 0);
+  content = read_file_to_str(fn, 0, NULL);
+  cp = strstr(content, "Log writer fell behind; dropped ");
+  tt_assert(cp);
+  tt_assert(strstr(cp, "caught up"));
+
+  /* And with asynchronous logging off, we write right away. */
+  log_info(LD_GENERAL, "synchronous again");
+  tor_free(content);
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(strstr(content, "synchronous again"));
+
+ done:
+  logs_set_async(0, NULL);
+  tor_free(content);
+}
+
+static void
+test_async_sigsafe(void *arg)
+{
+  const char *fn = get_fname("async_sigsafe_log");
+  char *content = NULL;
+  log_severity_list_t everything;
+  (void)arg;
+
+  set_log_severity_config(LOG_DEBUG, LOG_ERR, &everything);
+  init_logging(1);
+  open_and_add_file_log(&everything, fn, 0);
+  tt_int_op(logs_set_async(1, NULL), OP_EQ, 0);
+
+  /* If we're about to die, nobody is going to drain the ring for us. */
+  log_info(LD_GENERAL, "famous last words");
+  logs_flush_sigsafe();
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(strstr(content, "famous last words"));
+  tt_assert(logs_async_is_idle());
+
+ done:
+  tor_free(content);
+}
+
 struct testcase_t logging_tests[] = {
   { "sigsafe_err_fds", test_get_sigsafe_err_fds, TT_FORK, NULL, NULL },
   { "sigsafe_err", test_sigsafe_err, TT_FORK, NULL, NULL },
   { "ratelim", test_ratelim, 0, NULL, NULL },
+  { "async", test_async, TT_FORK, NULL, NULL },
+  { "async_sigsafe", test_async_sigsafe, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
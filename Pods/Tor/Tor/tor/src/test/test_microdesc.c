@@ -6,6 +6,7 @@
 
 #define DIRVOTE_PRIVATE
 #include "app/config/config.h"
+#include "core/or/policies.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/dirparse/routerparse.h"
@@ -264,6 +265,144 @@ test_md_cache(void *data)
   tor_free(encoded_family);
 }
 
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL, *parsed = NULL;
+  microdesc_t *md1, *md3, *md3_parsed;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  char *fn = NULL, *idx_fn = NULL, *s = NULL;
+  char *encoded_family = NULL;
+  time_t now = time(NULL);
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test_idx"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+  tor_asprintf(&idx_fn, "%s"PATH_SEPARATOR"cached-microdescs.idx",
+               options->CacheDirectory);
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  /* Rebuilding the cache writes an index next to it. */
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, now - 15*24*60*60, NULL);
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tt_int_op(FN_FILE, OP_EQ, file_status(idx_fn));
+
+  /* On reload, we use the index, and build microdescs from it that match
+   * the ones we would have parsed. */
+  microdesc_free_all();
+  setup_capture_of_logs(LOG_INFO);
+  mc = get_microdesc_cache();
+  expect_log_msg_containing("Using index of 3 microdescriptors");
+  teardown_capture_of_logs();
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  tt_ptr_op(md3, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d3));
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md3->last_listed, OP_EQ, now - 15*24*60*60);
+  tt_mem_op(md3->body, OP_EQ, test_md3_noannotation,
+            strlen(test_md3_noannotation));
+  parsed = microdescs_parse_from_string(md3->body, md3->body + md3->bodylen,
+                                        0, SAVED_NOWHERE, NULL);
+  tt_int_op(smartlist_len(parsed), OP_EQ, 1);
+  md3_parsed = smartlist_get(parsed, 0);
+  tt_mem_op(md3->digest, OP_EQ, md3_parsed->digest, DIGEST256_LEN);
+  tt_int_op(md3->onion_pkey_len, OP_EQ, md3_parsed->onion_pkey_len);
+  tt_mem_op(md3->onion_pkey, OP_EQ, md3_parsed->onion_pkey,
+            md3->onion_pkey_len);
+  tt_assert(md3->onion_curve25519_pkey);
+  tt_mem_op(md3->onion_curve25519_pkey, OP_EQ,
+            md3_parsed->onion_curve25519_pkey,
+            sizeof(curve25519_public_key_t));
+  tt_ptr_op(md3->ed25519_identity_pkey, OP_EQ, NULL);
+  encoded_family = nodefamily_format(md3->family);
+  tt_str_op(encoded_family, OP_EQ, "nodex nodey nodez");
+  tor_free(encoded_family);
+  tt_assert(md3->exit_policy);
+  s = write_short_policy(md3->exit_policy);
+  tt_str_op(s, OP_EQ, "accept 1-700,800-1000");
+  tor_free(s);
+  tt_ptr_op(md3->ipv6_exit_policy, OP_EQ, NULL);
+  tt_int_op(md3->policy_is_reject_star, OP_EQ,
+            md3_parsed->policy_is_reject_star);
+
+  /* Cleaning drops old microdescs that we never built from the index. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  microdesc_cache_clean(mc, now - 7*24*60*60, 1/*force*/);
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d3));
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  tt_assert(md1);
+  tt_mem_op(md1->body, OP_EQ, test_md1, strlen(test_md1));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+
+  /* A rebuild writes a new index that matches the new cache file. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  microdesc_free_all();
+  setup_capture_of_logs(LOG_INFO);
+  mc = get_microdesc_cache();
+  expect_log_msg_containing("Using index of 2 microdescriptors");
+  teardown_capture_of_logs();
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d3));
+
+  /* If the cache file changes under the index, we parse it instead, and
+   * write a new index. */
+  microdesc_free_all();
+  tt_int_op(0, OP_EQ, write_str_to_file(fn, test_md1, 1));
+  setup_capture_of_logs(LOG_INFO);
+  mc = get_microdesc_cache();
+  expect_no_log_msg_containing("Using index");
+  expect_log_msg_containing("Found 1 descriptors");
+  teardown_capture_of_logs();
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d2));
+  microdesc_free_all();
+  setup_capture_of_logs(LOG_INFO);
+  mc = get_microdesc_cache();
+  expect_log_msg_containing("Using index of 1 microdescriptors");
+  teardown_capture_of_logs();
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+
+ done:
+  teardown_capture_of_logs();
+  if (options)
+    tor_free(options->CacheDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  if (parsed)
+    SMARTLIST_FOREACH(parsed, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(parsed);
+  tor_free(fn);
+  tor_free(idx_fn);
+  tor_free(s);
+  tor_free(encoded_family);
+}
+
 static const char truncated_md[] =
   "@last-listed 2013-08-08 19:02:59\n"
   "onion-key\n"
@@ -923,6 +1062,7 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "parse_id_ed25519", test_md_parse_id_ed25519, 0, NULL, NULL },
@@ -20,6 +20,8 @@
 
 #include "core/or/extend_info_st.h"
 #include "feature/dirauth/dirvote.h"
+#include "feature/dirauth/shared_random.h"
+#include "feature/hs/hsdir_index_st.h"
 #include "feature/nodelist/fmt_routerstatus.h"
 #include "feature/nodelist/microdesc_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -241,6 +243,109 @@ test_nodelist_ed_id(void *arg)
 #undef N_NODES
 }
 
+/** Test that nodelist_set_consensus() only recomputes the hsdir indexes and
+ * countries of the nodes whose inputs to them changed. */
+static void
+test_nodelist_incremental_update(void *arg)
+{
+#define N_NODES 3
+  routerstatus_t *rs[N_NODES];
+  routerinfo_t *ri[N_NODES];
+  node_t *node[N_NODES];
+  hsdir_index_t old_index[N_NODES];
+  networkstatus_t *ns;
+  sr_srv_t srv;
+  time_t now = approx_time();
+  int i;
+  (void)arg;
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->valid_after = now - 60;
+  ns->fresh_until = now + 3600;
+  ns->valid_until = now + 3 * 3600;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  for (i = 0; i < N_NODES; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(*rs[i]));
+    ri[i] = tor_malloc_zero(sizeof(*ri[i]));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    rs[i]->pv.supports_v3_hsdir = 1;
+    tor_addr_from_ipv4h(&rs[i]->ipv4_addr, 0x01020300 + i);
+    memcpy(ri[i]->cache_info.identity_digest, rs[i]->identity_digest,
+           DIGEST_LEN);
+    tor_addr_copy(&ri[i]->ipv4_addr, &rs[i]->ipv4_addr);
+    ri[i]->cache_info.signing_key_cert = tor_malloc_zero(sizeof(tor_cert_t));
+    crypto_rand((char *) &ri[i]->cache_info.signing_key_cert->signing_key,
+                sizeof(ed25519_public_key_t));
+    smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+
+  /* First consensus: no identity keys yet, so there are no hsdir indexes to
+   * build, but every node needs a country. */
+  nodelist_set_consensus(ns);
+  tt_int_op(nodelist_last_update_stats.n_listed, OP_EQ, N_NODES);
+  tt_int_op(nodelist_last_update_stats.n_hsdir_index_built, OP_EQ, 0);
+  tt_int_op(nodelist_last_update_stats.n_country_set, OP_EQ, N_NODES);
+  tt_int_op(nodelist_last_update_stats.n_touched, OP_EQ, N_NODES);
+
+  /* The descriptors bring in the identity keys and the indexes. */
+  for (i = 0; i < N_NODES; ++i) {
+    node[i] = nodelist_set_routerinfo(ri[i], NULL);
+    tt_assert(node[i]);
+    tt_assert(!fast_mem_is_zero((char *) node[i]->hsdir_index.fetch,
+                                DIGEST256_LEN));
+    memcpy(&old_index[i], &node[i]->hsdir_index, sizeof(hsdir_index_t));
+  }
+
+  /* Same consensus again, with one relay at a new address: only that relay
+   * needs its country looked up, and no indexes get rebuilt. */
+  tor_addr_from_ipv4h(&rs[1]->ipv4_addr, 0x05060708);
+  nodelist_set_consensus(ns);
+  tt_int_op(nodelist_last_update_stats.n_hsdir_index_built, OP_EQ, 0);
+  tt_int_op(nodelist_last_update_stats.n_country_set, OP_EQ, 1);
+  tt_int_op(nodelist_last_update_stats.n_touched, OP_EQ, 1);
+  for (i = 0; i < N_NODES; ++i) {
+    tt_mem_op(&old_index[i], OP_EQ, &node[i]->hsdir_index,
+              sizeof(hsdir_index_t));
+  }
+
+  /* A new shared random value changes the indexes of every node. */
+  memset(&srv, 0, sizeof(srv));
+  memset(srv.value, 'A', sizeof(srv.value));
+  ns->sr_info.previous_srv = &srv;
+  nodelist_set_consensus(ns);
+  tt_int_op(nodelist_last_update_stats.n_hsdir_index_built, OP_EQ, N_NODES);
+  tt_int_op(nodelist_last_update_stats.n_country_set, OP_EQ, 0);
+  tt_int_op(nodelist_last_update_stats.n_touched, OP_EQ, N_NODES);
+  for (i = 0; i < N_NODES; ++i) {
+    tt_mem_op(&old_index[i], OP_NE, &node[i]->hsdir_index,
+              sizeof(hsdir_index_t));
+    /* They match the indexes we would have built from scratch. */
+    memcpy(&old_index[i], &node[i]->hsdir_index, sizeof(hsdir_index_t));
+    memset(&node[i]->hsdir_index, 0, sizeof(hsdir_index_t));
+    node[i]->hsdir_index_gen = 0;
+    node_set_hsdir_index(node[i], ns);
+    tt_mem_op(&old_index[i], OP_EQ, &node[i]->hsdir_index,
+              sizeof(hsdir_index_t));
+  }
+
+ done:
+  ns->sr_info.previous_srv = NULL;
+  nodelist_free_all();
+  for (i = 0; i < N_NODES; ++i) {
+    tor_free(ri[i]->cache_info.signing_key_cert);
+    tor_free(ri[i]);
+  }
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+#undef N_NODES
+}
+
 static void
 test_nodelist_nodefamily(void *arg)
 {
@@ -1426,6 +1531,7 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(incremental_update, TT_FORK),
   NODE(nodefamily, TT_FORK),
   NODE(nodefamily_parse_err, TT_FORK),
   NODE(nodefamily_lookup, TT_FORK),
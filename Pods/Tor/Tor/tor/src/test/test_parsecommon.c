@@ -610,6 +610,66 @@ test_parsecommon_get_next_token_err_bad_base64(void *arg)
   return;
 }
 
+static void
+test_parsecommon_get_next_token_long_args(void *arg)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  directory_token_t *token;
+  (void)arg;
+
+  token_rule_t table[] = {
+          T0N("p", K_P, CONCAT_ARGS, NO_OBJ),
+          T0N("pr", K_PROTO, ARGS, NO_OBJ),
+          T0N("known-flags-that-are-long", K_KNOWN_FLAGS, ARGS, NO_OBJ),
+          END_OF_TABLE,
+  };
+
+  /* Arguments long enough to cross several 16-byte blocks, separated by
+   * runs of mixed whitespace, and a comment that ends the argument list. */
+  const char *str =
+          "pr Cons=1-2 Desc=1-2\tDirCache=2   FlowCtrl=1-2 HSDir=2 "
+          "HSIntro=4-5 HSRend=1-2\n"
+          "known-flags-that-are-long Authority BadExit Exit "
+          "Fast#Guard HSDir # Running Stable\n"
+          "p accept 80,443\n"
+          "known-flags-that-are-long\n";
+
+  int retval = tokenize_string(area, str, str + strlen(str),
+                               tokens, table, 0);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_int_op(smartlist_len(tokens), OP_EQ, 4);
+
+  token = smartlist_get(tokens, 0);
+  tt_int_op(token->tp, OP_EQ, K_PROTO);
+  tt_int_op(token->n_args, OP_EQ, 7);
+  tt_str_op(token->args[0], OP_EQ, "Cons=1-2");
+  tt_str_op(token->args[2], OP_EQ, "DirCache=2");
+  tt_str_op(token->args[3], OP_EQ, "FlowCtrl=1-2");
+  tt_str_op(token->args[6], OP_EQ, "HSRend=1-2");
+
+  token = smartlist_get(tokens, 1);
+  tt_int_op(token->tp, OP_EQ, K_KNOWN_FLAGS);
+  tt_int_op(token->n_args, OP_EQ, 6);
+  tt_str_op(token->args[3], OP_EQ, "Fast");
+  tt_str_op(token->args[4], OP_EQ, "Guard");
+  tt_str_op(token->args[5], OP_EQ, "HSDir");
+
+  token = smartlist_get(tokens, 2);
+  tt_int_op(token->tp, OP_EQ, K_P);
+  tt_int_op(token->n_args, OP_EQ, 1);
+  tt_str_op(token->args[0], OP_EQ, "accept 80,443");
+
+  token = smartlist_get(tokens, 3);
+  tt_int_op(token->tp, OP_EQ, K_KNOWN_FLAGS);
+  tt_int_op(token->n_args, OP_EQ, 0);
+
+ done:
+  memarea_drop_all(area);
+  smartlist_free(tokens);
+  return;
+}
+
 #define PARSECOMMON_TEST(name) \
   { #name, test_parsecommon_ ## name, 0, NULL, NULL }
 
@@ -624,6 +684,7 @@ struct testcase_t parsecommon_tests[] = {
   PARSECOMMON_TEST(tokenize_string_no_annotations),
   PARSECOMMON_TEST(get_next_token_success),
   PARSECOMMON_TEST(get_next_token_concat_args),
+  PARSECOMMON_TEST(get_next_token_long_args),
   PARSECOMMON_TEST(get_next_token_parse_keys),
   PARSECOMMON_TEST(get_next_token_object),
   PARSECOMMON_TEST(get_next_token_err_too_many_args),
@@ -2,12 +2,17 @@
 /* See LICENSE for licensing information */
 
 #define CIRCUITBUILD_PRIVATE
+#define CIRCUITLIST_PRIVATE
 #define RELAY_PRIVATE
 #define BWHIST_PRIVATE
 #include "core/or/or.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/circuitlist.h"
 #include "core/or/channeltls.h"
+#include "core/or/command.h"
+#include "core/or/connection_or.h"
+#include "core/crypto/relay_crypto.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "feature/stats/bwhist.h"
 #include "core/or/relay.h"
 #include "lib/container/order.h"
@@ -374,11 +379,96 @@ test_find_addr_to_publish(void *arg)
   or_options_free(options);
 }
 
+/* Relay cells that arrive on a middle hop's p_chan are held by the command
+ * layer, decrypted as a batch, and come out on n_chan just as if each one
+ * had been decrypted on its own. */
+static void
+test_relay_receive_batched_cells(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL, *ref_circ = NULL;
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  cell_t cells[26], expected[26];
+  packed_cell_t packed, *pc = NULL;
+  const int n_cells = (int)ARRAY_LENGTH(cells);
+  int i;
+
+  (void)arg;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+
+  /* Give the circuit keys we know, and decrypt the same cells one at a time
+   * on a second circuit with the same keys. */
+  crypto_rand(keys, sizeof(keys));
+  relay_crypto_clear(&orcirc->crypto);
+  tt_int_op(0, OP_EQ, relay_crypto_init(&orcirc->crypto, keys, sizeof(keys),
+                                        0, 0));
+  ref_circ = or_circuit_new(0, NULL);
+  tt_int_op(0, OP_EQ, relay_crypto_init(&ref_circ->crypto, keys,
+                                        sizeof(keys), 0, 0));
+  for (i = 0; i < n_cells; ++i) {
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+    crypto_rand((char *)&cells[i], sizeof(cells[i]));
+    cells[i].command = CELL_RELAY;
+    cells[i].circ_id = orcirc->p_circ_id;
+    memcpy(&expected[i], &cells[i], sizeof(cells[i]));
+    tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(ref_circ), &expected[i],
+                                           CELL_DIRECTION_OUT, &layer_hint,
+                                           &recognized));
+    expected[i].circ_id = orcirc->base_.n_circ_id;
+  }
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  MOCK(assert_circuit_ok,
+       assert_circuit_ok_mock);
+
+  /* Nothing comes out until the cells are flushed... */
+  for (i = 0; i < 10; ++i)
+    command_process_cell(pchan, &cells[i]);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 0);
+  command_flush_relay_cells();
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, 10);
+
+  /* ...or until a whole batch is waiting. */
+  for (i = 10; i < n_cells; ++i)
+    command_process_cell(pchan, &cells[i]);
+  tt_int_op(orcirc->base_.n_chan_cells.n, OP_EQ, n_cells);
+
+  for (i = 0; i < n_cells; ++i) {
+    pc = cell_queue_pop(&orcirc->base_.n_chan_cells);
+    tt_assert(pc);
+    cell_pack(&packed, &expected[i], nchan->wide_circ_ids);
+    tt_mem_op(pc->body, OP_EQ, packed.body,
+              get_cell_network_size(nchan->wide_circ_ids));
+    packed_cell_free(pc);
+  }
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  UNMOCK(assert_circuit_ok);
+  packed_cell_free(pc);
+  if (orcirc)
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+  circuit_free_(TO_CIRCUIT(ref_circ));
+  free_fake_orcirc(orcirc);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
   { "close_circ_rephist", test_relay_close_circuit,
     TT_FORK, NULL, NULL },
+  { "receive_batched_cells", test_relay_receive_batched_cells,
+    TT_FORK, NULL, NULL },
   { "suggested_address", test_suggested_address,
     TT_FORK, NULL, NULL },
   { "find_addr_to_publish", test_find_addr_to_publish,
@@ -181,12 +181,83 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+/* As test_relaycrypt_outbound, but decrypt the cells in batches at each
+ * hop, and make sure we get the same results. */
+static void
+test_relaycrypt_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig[20];
+  cell_t encrypted[20];
+  cell_t *cells[20];
+  int i, j;
+
+  for (i = 0; i < 20; ++i) {
+    crypto_rand((char *)&orig[i], sizeof(orig[i]));
+
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+
+    memcpy(&encrypted[i], &orig[i], sizeof(orig[i]));
+    cells[i] = &encrypted[i];
+
+    /* Encrypt the cell to the last hop */
+    relay_encrypt_cell_outbound(&encrypted[i], cs->origin_circ,
+                                cs->origin_circ->cpath->prev);
+  }
+
+  for (j = 0; j < 3; ++j) {
+    tt_int_op(0, OP_EQ, relay_decrypt_cells(TO_CIRCUIT(cs->or_circ[j]),
+                                            cells, 20, CELL_DIRECTION_OUT));
+    for (i = 0; i < 20; ++i) {
+      int recognized = relay_cell_is_recognized(TO_CIRCUIT(cs->or_circ[j]),
+                                                cells[i],
+                                                CELL_DIRECTION_OUT);
+      tt_int_op(recognized, OP_EQ, j == 2);
+    }
+  }
+
+  for (i = 0; i < 20; ++i)
+    tt_mem_op(orig[i].payload, OP_EQ, encrypted[i].payload,
+              CELL_PAYLOAD_SIZE);
+
+  /* Now send them back from the last hop. */
+  for (i = 0; i < 20; ++i)
+    relay_encrypt_cell_inbound(&encrypted[i], cs->or_circ[2]);
+  for (j = 1; j >= 0; --j) {
+    tt_int_op(0, OP_EQ, relay_decrypt_cells(TO_CIRCUIT(cs->or_circ[j]),
+                                            cells, 20, CELL_DIRECTION_IN));
+  }
+  for (i = 0; i < 20; ++i) {
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+    int r = relay_decrypt_cell(TO_CIRCUIT(cs->origin_circ),
+                               &encrypted[i],
+                               CELL_DIRECTION_IN,
+                               &layer_hint, &recognized);
+    tt_int_op(r, OP_EQ, 0);
+    tt_int_op(recognized, OP_EQ, 1);
+    tt_ptr_op(layer_hint, OP_EQ, cs->origin_circ->cpath->prev);
+    tt_mem_op(orig[i].payload, OP_EQ, encrypted[i].payload,
+              CELL_PAYLOAD_SIZE);
+  }
+
+ done:
+  ;
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(batch),
   END_OF_TESTCASES
 };
 
@@ -277,7 +277,55 @@ test_replaycache_scrub(void *arg)
   /* Make sure we hit the aging-out case too */
   replaycache_scrub_if_needed_internal(1500, r);
   /* Assert that we aged it */
-  tt_int_op(digest256map_size(r->digests_seen),OP_EQ, 0);
+  tt_int_op(replaycache_n_entries(r),OP_EQ, 0);
+
+ done:
+  if (r) replaycache_free(r);
+
+  return;
+}
+
+static void
+test_replaycache_buckets(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result, i;
+  char buf[32];
+
+  (void)arg;
+  r = replaycache_new(600, 300);
+  tt_ptr_op(r, OP_NE, NULL);
+
+  /* Enough entries to make the first bucket's Bloom filter grow */
+  for (i = 0; i < 1000; ++i) {
+    tor_snprintf(buf, sizeof(buf), "cell %d", i);
+    result = replaycache_add_and_test_internal(1000, r, buf, strlen(buf),
+                                               NULL);
+    tt_int_op(result,OP_EQ, 0);
+  }
+  for (i = 0; i < 1000; ++i) {
+    tor_snprintf(buf, sizeof(buf), "cell %d", i);
+    result = replaycache_add_and_test_internal(1100, r, buf, strlen(buf),
+                                               NULL);
+    tt_int_op(result,OP_EQ, 1);
+  }
+  tt_int_op(replaycache_n_entries(r),OP_EQ, 1000);
+
+  /* Keep one entry fresh while the others age out */
+  result = replaycache_add_and_test_internal(1500, r, "cell 7", 6, NULL);
+  tt_int_op(result,OP_EQ, 1);
+  result = replaycache_add_and_test_internal(1800, r, "cell 7", 6, NULL);
+  tt_int_op(result,OP_EQ, 1);
+  result = replaycache_add_and_test_internal(1800, r, "cell 8", 6, NULL);
+  tt_int_op(result,OP_EQ, 0);
+
+  /* The first bucket is gone, and with it all the stale entries */
+  replaycache_scrub_if_needed_internal(2200, r);
+  tt_int_op(replaycache_n_entries(r),OP_EQ, 3);
+  result = replaycache_add_and_test_internal(2200, r, "cell 7", 6, NULL);
+  tt_int_op(result,OP_EQ, 1);
+  result = replaycache_add_and_test_internal(2200, r, "cell 9", 6, NULL);
+  tt_int_op(result,OP_EQ, 0);
 
  done:
   if (r) replaycache_free(r);
@@ -384,6 +432,7 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(elapsed),
   REPLAYCACHE_LEGACY(noexpire),
   REPLAYCACHE_LEGACY(scrub),
+  REPLAYCACHE_LEGACY(buckets),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
   END_OF_TESTCASES
@@ -2926,6 +2926,55 @@ test_util_decompress_dos(void *arg)
   ;
 }
 
+static void
+test_util_compress_parallel(void *arg)
+{
+  const char *methodname = arg;
+  char *input = NULL, *result = NULL, *result2 = NULL;
+  size_t szr = 0, szr2 = 0;
+  const size_t big = 3*1024*1024;
+  size_t pos = 0;
+  int r, n_threads;
+  tt_assert(methodname);
+
+  compress_method_t method = compression_method_get_by_name(methodname);
+  tt_int_op(method, OP_NE, UNKNOWN_METHOD);
+  if (! tor_compress_supports_method(method)) {
+    tt_skip();
+  }
+
+  /* Something shaped like a consensus: compressible, but not too much. */
+  input = tor_malloc(big);
+  while (pos + 64 < big) {
+    char rnd[20], hex[HEX_DIGEST_LEN+1];
+    crypto_rand(rnd, sizeof(rnd));
+    base16_encode(hex, sizeof(hex), rnd, sizeof(rnd));
+    pos += tor_snprintf(input+pos, big-pos, "r relay%u %s\ns Fast Valid\n",
+                        (unsigned)pos, hex);
+  }
+
+  for (n_threads = 1; n_threads <= 4; n_threads *= 2) {
+    r = tor_compress_parallel(&result, &szr, input, pos, method, n_threads);
+    tt_int_op(r, OP_EQ, 0);
+    tt_ptr_op(result, OP_NE, NULL);
+    tt_int_op(detect_compression_method(result, szr), OP_EQ, method);
+
+    /* Whatever we did, it has to look like one ordinary compressed
+     * document. */
+    r = tor_uncompress(&result2, &szr2, result, szr, method, 1, LOG_INFO);
+    tt_int_op(r, OP_EQ, 0);
+    tt_int_op(szr2, OP_EQ, pos);
+    tt_mem_op(result2, OP_EQ, input, pos);
+    tor_free(result);
+    tor_free(result2);
+  }
+
+ done:
+  tor_free(input);
+  tor_free(result);
+  tor_free(result2);
+}
+
 static void
 test_util_gzip_compression_bomb(void *arg)
 {
@@ -6939,6 +6988,11 @@ test_util_map_anon_nofork(void *arg)
     &compress_setup,                                                    \
     (char*)(identifier) }
 
+#define COMPRESS_PARALLEL(name, identifier)                             \
+  { ("compress_parallel/" #name), test_util_compress_parallel, 0,       \
+    &compress_setup,                                                    \
+    (char*)(identifier) }
+
 #ifdef _WIN32
 #define UTIL_TEST_WIN_ONLY(n, f) UTIL_TEST(n, (f))
 #else
@@ -6987,6 +7041,9 @@ struct testcase_t util_tests[] = {
   COMPRESS_DOS(lzma, "x-tor-lzma"),
   COMPRESS_DOS(zstd, "x-zstd"),
   COMPRESS_DOS(zstd_nostatic, "x-zstd:nostatic"),
+  COMPRESS_PARALLEL(zlib, "deflate"),
+  COMPRESS_PARALLEL(lzma, "x-tor-lzma"),
+  COMPRESS_PARALLEL(zstd, "x-zstd"),
   UTIL_TEST(gzip_compression_bomb, TT_FORK),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
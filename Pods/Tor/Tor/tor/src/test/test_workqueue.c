@@ -13,6 +13,7 @@
 #include "lib/evloop/compat_libevent.h"
 #include "lib/intmath/weakrng.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/time/compat_time.h"
 
 #include <stdio.h>
 
@@ -25,6 +26,11 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_latency = 0;
+
+/** If opt_latency is set, the enqueue-to-reply latency of each item, in
+ * microseconds, indexed by serial. */
+static int64_t *latencies = NULL;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -42,12 +48,14 @@ typedef struct state_t {
 
 typedef struct rsa_work_t {
   int serial;
+  monotime_t queued_at;
   uint8_t msg[128];
   uint8_t msglen;
 } rsa_work_t;
 
 typedef struct ecdh_work_t {
   int serial;
+  monotime_t queued_at;
   union {
     curve25519_public_key_t pk;
     uint8_t msg[32];
@@ -178,6 +186,14 @@ handle_reply(void *arg)
   bitarray_set(received,rw->serial);
 #endif
 
+  if (opt_latency) {
+    /* Same naughty cast, but only looking at serial and queued_at. */
+    rsa_work_t *lw = arg;
+    monotime_t now;
+    monotime_get(&now);
+    latencies[lw->serial] = monotime_diff_usec(&lw->queued_at, &now);
+  }
+
   tor_free(arg);
   ++n_received;
 }
@@ -203,6 +219,7 @@ add_work(threadpool_t *tp)
     crypto_rand((char*)w->msg, 20);
     w->msglen = 20;
     ++rsa_sent;
+    monotime_get(&w->queued_at);
     return threadpool_queue_work_priority(tp,
                                           WQ_PRI_MED,
                                           workqueue_do_rsa, handle_reply, w);
@@ -212,6 +229,7 @@ add_work(threadpool_t *tp)
     /* Not strictly right, but this is just for benchmarks. */
     crypto_rand((char*)w->u.pk.public_key, 32);
     ++ecdh_sent;
+    monotime_get(&w->queued_at);
     return threadpool_queue_work(tp, workqueue_do_ecdh, handle_reply, w);
   }
 }
@@ -316,6 +334,40 @@ replysock_readable_cb(threadpool_t *tp)
   }
 }
 
+static int
+compare_int64_(const void *a, const void *b)
+{
+  const int64_t *x = a, *y = b;
+  if (*x < *y)
+    return -1;
+  else if (*x > *y)
+    return 1;
+  return 0;
+}
+
+/** Print the mean, 99th percentile, and maximum enqueue-to-reply latency of
+ * the items that were not cancelled. */
+static void
+report_latencies(void)
+{
+  int i, n = 0;
+  int64_t total = 0;
+
+  for (i = 0; i < n_sent; ++i) {
+    if (latencies[i] >= 0) {
+      latencies[n++] = latencies[i];
+      total += latencies[i];
+    }
+  }
+  if (n == 0)
+    return;
+  qsort(latencies, n, sizeof(int64_t), compare_int64_);
+  printf("Latency over %d items: mean %.1f usec, p99 %"PRId64" usec, "
+         "max %"PRId64" usec\n",
+         n, ((double)total) / n, latencies[(n * 99) / 100],
+         latencies[n - 1]);
+}
+
 static void
 help(void)
 {
@@ -329,6 +381,7 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -l            Report enqueue-to-reply latency\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -357,6 +410,8 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-l")) {
+      opt_latency = 1;
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -410,6 +465,13 @@ main(int argc, char **argv)
 
   crypto_seed_weak_rng(&weak_rng);
 
+  monotime_init();
+  if (opt_latency) {
+    latencies = tor_calloc(opt_n_items, sizeof(int64_t));
+    for (i = 0; i < opt_n_items; ++i)
+      latencies[i] = -1;
+  }
+
   memset(&evcfg, 0, sizeof(evcfg));
   tor_libevent_initialize(&evcfg);
 
@@ -449,6 +511,8 @@ main(int argc, char **argv)
     puts("Accepted work after shutdown\n");
     puts("FAIL");
   } else {
+    if (opt_latency)
+      report_latencies();
     puts("OK");
     return 0;
   }
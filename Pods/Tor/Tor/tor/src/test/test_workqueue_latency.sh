@@ -0,0 +1,3 @@
+#!/bin/sh
+
+"${builddir:-.}/src/test/test_workqueue" -l -R 0 -I 4000 -L 1000